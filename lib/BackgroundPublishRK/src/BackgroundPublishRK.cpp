@@ -7,6 +7,8 @@
 
 #include "BackgroundPublishRK.h"
 
+#include <vector>
+
 BackgroundPublishRK *BackgroundPublishRK::_instance;
 
 BackgroundPublishRK::BackgroundPublishRK() {
@@ -24,12 +26,54 @@ BackgroundPublishRK &BackgroundPublishRK::instance() {
     return *_instance;
 }
 
+BackgroundPublishRK &BackgroundPublishRK::withNumSlots(size_t numSlots) {
+    if (!thread) {
+        this->numSlots = (numSlots < 1) ? 1 : numSlots;
+    }
+    return *this;
+}
+
+size_t BackgroundPublishRK::getNumBusySlots() {
+    size_t result = 0;
+
+    if (thread) {
+        WITH_LOCK(*this) {
+            for(size_t ii = 0; ii < numSlots; ii++) {
+                if (slots[ii].state != BACKGROUND_PUBLISH_IDLE) {
+                    result++;
+                }
+            }
+        }
+    }
+    return result;
+}
+
+uint32_t BackgroundPublishRK::getWakeupsPerHour() const {
+    system_tick_t elapsed = millis() - startMs;
+    if (elapsed == 0) {
+        return 0;
+    }
+    return (uint32_t)((uint64_t)numWakeups * 3600000 / elapsed);
+}
+
 void BackgroundPublishRK::start()
 {
     if(!thread)
     {
         os_mutex_create(&mutex);
 
+        // The semaphore is never deleted because a publish started before stop() may still
+        // complete and give it afterwards. That just causes one extra wakeup.
+        if(!wakeSemaphore)
+        {
+            os_semaphore_create(&wakeSemaphore, 1, 0);
+        }
+        numWakeups = 0;
+        startMs = millis();
+
+        state = BACKGROUND_PUBLISH_IDLE;
+        slots = new BackgroundPublishSlot[numSlots];
+
         // use OS_THREAD_PRIORITY_DEFAULT so that application, system, and
         // background publish thread will all run at the same priority and
         // be able to preempt each other
@@ -44,26 +88,31 @@ void BackgroundPublishRK::stop()
     if(thread)
     {
         state = BACKGROUND_PUBLISH_STOP;
+        wake();
         thread->dispose();
         delete thread;
         thread = NULL;
+
+        delete[] slots;
+        slots = NULL;
     }
 }
 
 void BackgroundPublishRK::thread_f()
 {
+    // Publishes started and not yet completed, in the order they were started
+    std::vector<std::pair<BackgroundPublishSlot *, particle::Future<bool>>> inFlight;
+    inFlight.reserve(numSlots);
+
     while(true)
     {
-        while(state == BACKGROUND_PUBLISH_IDLE)
-        {
-            // yield to rest of system while we wait
-            // a condition variable would be ideal but doesn't look like
-            // std::condition_variable is supported
-            delay(1);
-        }
-
         if(state == BACKGROUND_PUBLISH_STOP)
         {
+            // Complete anything outstanding so callers are not left waiting
+            for(auto it = inFlight.begin(); it != inFlight.end(); it++)
+            {
+                completeSlot(it->first, it->second.isDone() && it->second.isSucceeded());
+            }
             return;
         }
 
@@ -72,81 +121,158 @@ void BackgroundPublishRK::thread_f()
         // additional synchronization around a publish request and acts as a
         // memory barrier around publish arguments to ensure all updates
         // are complete
-        lock();
-        unlock();
-
-        // kick off the publish
-        // WITH_ACK does not work as expected from a background thread
-        // use the Future<bool> object directly as its default wait
-        // (used by WITH_ACK) short-circuits when not called from the
-        // main application thread
-        auto ok = Particle.publish(event_name, event_data, event_flags);
-
-        // then wait for publish to complete
-        while(!ok.isDone() && state != BACKGROUND_PUBLISH_STOP)
+        BackgroundPublishSlot *slot;
+        WITH_LOCK(*this)
         {
-            // yield to rest of system while we wait
-            delay(1);
+            slot = getNextRequestedSlot();
+            if(slot)
+            {
+                slot->state = BACKGROUND_PUBLISH_IN_FLIGHT;
+            }
         }
 
-        if(completed_cb)
+        if(slot)
         {
-            completed_cb(ok.isSucceeded(),
-                event_name,
-                event_data,
-                event_context);
+            // kick off the publish
+            // WITH_ACK does not work as expected from a background thread
+            // use the Future<bool> object directly as its default wait
+            // (used by WITH_ACK) short-circuits when not called from the
+            // main application thread
+            particle::Future<bool> future = Particle.publish(slot->event_name, slot->event_data, slot->event_flags);
+
+            // wake this thread when the publish completes. These are called from the system
+            // thread, or immediately if the publish has already completed.
+            os_semaphore_t sem = wakeSemaphore;
+            future.onSuccess([sem](bool) { os_semaphore_give(sem, false); });
+            future.onError([sem](const particle::Error &) { os_semaphore_give(sem, false); });
+
+            inFlight.push_back(std::make_pair(slot, future));
+
+            // start any other requests before waiting
+            continue;
         }
 
-        WITH_LOCK(*this)
+        // deliver callbacks for completed publishes in completion order; publishes that
+        // completed since the last check are delivered in the order they were started
+        bool completed = false;
+        for(auto it = inFlight.begin(); it != inFlight.end(); )
         {
-            if(state == BACKGROUND_PUBLISH_STOP)
+            if(it->second.isDone())
+            {
+                completeSlot(it->first, it->second.isSucceeded());
+                it = inFlight.erase(it);
+                completed = true;
+            }
+            else
             {
-                return;
+                it++;
             }
-            event_context = NULL;
-            completed_cb = NULL;
-            state = BACKGROUND_PUBLISH_IDLE;
+        }
+
+        if(!completed)
+        {
+            // block until publish() is called, a publish completes, or stop() is called
+            os_semaphore_take(wakeSemaphore, CONCURRENT_WAIT_FOREVER, false);
+            numWakeups++;
         }
     }
 }
 
-bool BackgroundPublishRK::publish(const char *name, const char *data, PublishFlags flags, PublishCompletedCallback cb, const void *context)
+BackgroundPublishSlot *BackgroundPublishRK::getNextRequestedSlot()
 {
-    // protect against separate threads trying to publish at the same time
-    WITH_LOCK(*this)
+    BackgroundPublishSlot *result = NULL;
 
-    // check currently in idle state and ready to accept publish request
-    if(!thread || state != BACKGROUND_PUBLISH_IDLE)
+    for(size_t ii = 0; ii < numSlots; ii++)
     {
-        return false;
+        if(slots[ii].state == BACKGROUND_PUBLISH_REQUESTED &&
+            (!result || (int32_t)(slots[ii].seq - result->seq) < 0))
+        {
+            result = &slots[ii];
+        }
     }
+    return result;
+}
 
-    // event name is required to publish
-    // all other arguments may be be left out or defaulted
-    if(!name)
+void BackgroundPublishRK::wake()
+{
+    // binary semaphore: giving it when it's already available fails, which is fine
+    os_semaphore_give(wakeSemaphore, false);
+}
+
+void BackgroundPublishRK::completeSlot(BackgroundPublishSlot *slot, bool succeeded)
+{
+    if(slot->completed_cb)
     {
-        return false;
+        slot->completed_cb(succeeded,
+            slot->event_name,
+            slot->event_data,
+            slot->event_context);
     }
 
-    // have the lock and thread is currently idle
-    // safe to prepare publish request
-    strncpy(event_name, name, sizeof(event_name));
-    event_name[sizeof(event_name)-1] = '\0'; // ensure null termination
+    WITH_LOCK(*this)
+    {
+        slot->event_context = NULL;
+        slot->completed_cb = NULL;
+        slot->state = BACKGROUND_PUBLISH_IDLE;
+    }
+}
 
-    if(data)
+bool BackgroundPublishRK::publish(const char *name, const char *data, PublishFlags flags, PublishCompletedCallback cb, const void *context)
+{
+    // event name is required to publish
+    // all other arguments may be be left out or defaulted
+    if(!thread || !name)
     {
-        strncpy(event_data, data, sizeof(event_data));
-        event_data[sizeof(event_data)-1] = '\0'; // ensure null termination
+        return false;
     }
-    else
+
+    // protect against separate threads trying to publish at the same time
+    WITH_LOCK(*this)
     {
-        event_data[0] = '\0'; // null terminate at start for no event data
+        // check the thread is running
+        if(state != BACKGROUND_PUBLISH_IDLE)
+        {
+            return false;
+        }
+
+        // find a free slot to accept the publish request
+        BackgroundPublishSlot *slot = NULL;
+        for(size_t ii = 0; ii < numSlots; ii++)
+        {
+            if(slots[ii].state == BACKGROUND_PUBLISH_IDLE)
+            {
+                slot = &slots[ii];
+                break;
+            }
+        }
+        if(!slot)
+        {
+            return false;
+        }
+
+        // have the lock and the slot is free
+        // safe to prepare publish request
+        strncpy(slot->event_name, name, sizeof(slot->event_name));
+        slot->event_name[sizeof(slot->event_name)-1] = '\0'; // ensure null termination
+
+        if(data)
+        {
+            strncpy(slot->event_data, data, sizeof(slot->event_data));
+            slot->event_data[sizeof(slot->event_data)-1] = '\0'; // ensure null termination
+        }
+        else
+        {
+            slot->event_data[0] = '\0'; // null terminate at start for no event data
+        }
+
+        slot->completed_cb = cb;
+        slot->event_context = context;
+        slot->event_flags = flags;
+        slot->seq = nextSeq++;
+        slot->state = BACKGROUND_PUBLISH_REQUESTED;
     }
 
-    completed_cb = cb;
-    event_context = context;
-    event_flags = flags;
-    state = BACKGROUND_PUBLISH_REQUESTED;
+    wake();
 
     return true;
 }
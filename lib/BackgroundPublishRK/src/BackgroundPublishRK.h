@@ -11,9 +11,10 @@
  * @brief Internal state of the publish thread
  */
 typedef enum {
-    BACKGROUND_PUBLISH_IDLE = 0,	//!< Not currently publishing
-    BACKGROUND_PUBLISH_REQUESTED,	//!< Publish started
+    BACKGROUND_PUBLISH_IDLE = 0,	//!< Not currently publishing (slot is free)
+    BACKGROUND_PUBLISH_REQUESTED,	//!< Publish requested, not yet started
     BACKGROUND_PUBLISH_STOP,		//!< Thread stopped (need to start again to publish)
+    BACKGROUND_PUBLISH_IN_FLIGHT,	//!< Publish started, waiting for it to complete
 } publish_thread_state_t;
 
 /**
@@ -35,6 +36,22 @@ typedef std::function<void(bool succeeded,
     const char *event_data,
     const void *event_context)> PublishCompletedCallback;
 
+/**
+ * @brief One outstanding publish request
+ */
+struct BackgroundPublishSlot {
+    volatile publish_thread_state_t state = BACKGROUND_PUBLISH_IDLE; //!< IDLE, REQUESTED, or IN_FLIGHT
+    uint32_t seq = 0;   //!< Order publish() was called in, used to start requests in order
+
+    // arguments for Particle.publish
+    char event_name[particle::protocol::MAX_EVENT_NAME_LENGTH+1];	//!< name passed to publish
+    char event_data[particle::protocol::MAX_EVENT_DATA_LENGTH+1];	//!< event data passed to publish (may be empty string)
+    PublishFlags event_flags; 	//!< event flags, typically PRIVATE, PRIVATE | WITH_ACK, or PRIVATE | NO_ACK.
+    // callback when publish completes
+    PublishCompletedCallback completed_cb = NULL; 	//!< Completion callback (optional)
+    const void *event_context = NULL; 		//!< Context passed to completion (optional)
+};
+
 /**
  * @brief Background publish class. You typically instantiate one of these as a global variable.
  */
@@ -51,6 +68,47 @@ public:
      */
     static BackgroundPublishRK &instance();
 
+    /**
+     * @brief Sets the number of publishes that can be outstanding at the same time (default: 1)
+     * 
+     * @param numSlots Number of request slots, at least 1. Each uses about 1.1 Kbytes of RAM.
+     * 
+     * Must be called before start(); it's ignored after the thread has started.
+     * 
+     * With more than one slot, publish() can be called again before the previous publish 
+     * completes. Ordering guarantees:
+     * 
+     * - Requests are passed to Particle.publish() in the order publish() was called.
+     * - Callbacks are called in the order the publishes complete, which is usually, but not
+     * necessarily, the order they were started. Callbacks for publishes that complete at the 
+     * same time are called in the order they were started.
+     * - Callbacks are called from the background publish thread, one at a time.
+     */
+    BackgroundPublishRK &withNumSlots(size_t numSlots);
+
+    /**
+     * @brief Gets the number of request slots
+     */
+    size_t getNumSlots() const { return numSlots; };
+
+    /**
+     * @brief Gets the number of slots with a publish requested or in progress
+     */
+    size_t getNumBusySlots();
+
+    /**
+     * @brief Gets the number of times the background thread has woken up since start()
+     * 
+     * The thread blocks until publish() is called, a publish completes, or stop() is called,
+     * so this is normally about two per event published.
+     */
+    uint32_t getNumWakeups() const { return numWakeups; };
+
+    /**
+     * @brief Gets the average number of background thread wakeups per hour since start()
+     */
+    uint32_t getWakeupsPerHour() const;
+
     /**
      * @brief Start the background publish thread. Required!
      *
@@ -86,6 +144,8 @@ public:
      *
      * @param context Optional parameter passed to the callback. You can store a C++ object
      * instance or a state structure pointer here.
+     * 
+     * @return false if the thread has not been started, name is NULL, or all slots are in use.
      */
     bool publish(const char *name,
         const char *data = NULL,
@@ -130,18 +190,32 @@ private:
     BackgroundPublishRK& operator=(const BackgroundPublishRK&) = delete;
 
 
+    /**
+     * @brief Gets the requested slot that publish() was called for first, or NULL if none
+     */
+    BackgroundPublishSlot *getNextRequestedSlot();
+
+    /**
+     * @brief Call the completion callback and free the slot
+     */
+    void completeSlot(BackgroundPublishSlot *slot, bool succeeded);
+
+    /**
+     * @brief Wakes the background thread. Can be called from any thread.
+     */
+    void wake();
+
     Thread *thread = NULL;		//!< Thread object pointer. Allocated during start()
     void thread_f();			//!< Thread function, passed to the Thread object
     os_mutex_t mutex;	//!< Mutex to protect access to class members from multiple threads
-    volatile publish_thread_state_t state = BACKGROUND_PUBLISH_IDLE; //!< Current state
-
-    // arguments for Particle.publish
-    char event_name[particle::protocol::MAX_EVENT_NAME_LENGTH+1];	//!< name passed to publish
-    char event_data[particle::protocol::MAX_EVENT_DATA_LENGTH+1];	//!< event data passed to publish (may be empty string)
-    PublishFlags event_flags; 	//!< event flags, typically PRIVATE, PRIVATE | WITH_ACK, or PRIVATE | NO_ACK.
-    // callback when publish completes
-    PublishCompletedCallback completed_cb = NULL; 	//!< Completion callback (optional)
-    const void *event_context = NULL; 		//!< Context passed to completion (optional)
+    volatile publish_thread_state_t state = BACKGROUND_PUBLISH_IDLE; //!< Thread state: IDLE (running) or STOP
+    os_semaphore_t wakeSemaphore = NULL; //!< Given to wake the thread. Created once and never deleted.
+    volatile uint32_t numWakeups = 0;   //!< Number of times the thread has woken since start()
+    system_tick_t startMs = 0;          //!< millis() value when start() was called
+
+    BackgroundPublishSlot *slots = NULL;    //!< Request slots, allocated during start()
+    size_t numSlots = 1;                    //!< Number of entries in slots
+    uint32_t nextSeq = 0;                   //!< Next BackgroundPublishSlot::seq value
 
     static BackgroundPublishRK *_instance; //!< Singleton instance of this class
 };
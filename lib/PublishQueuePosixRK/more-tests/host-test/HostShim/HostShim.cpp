@@ -0,0 +1,667 @@
+#include "Particle.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+
+//
+// Simulated clock and lockstep scheduler
+//
+// Background threads (BackgroundPublishRK) are real threads, but only one thread runs at a
+// time. A background thread runs until it calls delay(), which parks it until the simulated
+// clock reaches its wake time. The main thread advances the clock with HostSim::advance()
+// and waits for all woken threads to park again before continuing. This makes runs
+// deterministic and lets hours of simulated time pass in seconds.
+//
+namespace {
+
+struct Waiter {
+    uint32_t wakeAt;
+    bool forever;               //!< Only woken by os_semaphore_give()
+    void *semaphore;            //!< Semaphore being waited on, or NULL
+    bool signaled;              //!< Woken by os_semaphore_give() instead of the clock
+    bool parked;
+};
+
+struct Semaphore {
+    unsigned count;
+    unsigned max;
+};
+
+struct SimState {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::atomic<uint32_t> now{0};
+    int running = 0;                //!< Number of background threads not parked
+    std::vector<Waiter *> waiters;
+
+    bool connected = false;
+    std::vector<HostConnectivityChange> schedule;
+    size_t scheduleIndex = 0;       //!< Next entry in schedule to apply
+    uint32_t publishLatencyMs = 500;
+    uint32_t publishJitterMs = 0;
+    double publishLossRate = 0;
+    uint32_t publishTimeoutMs = 20000;
+    uint32_t publishFadeMs = 0;
+    uint32_t fadeUntil = 0;         //!< Publishes are lost until this time
+    bool inFade = false;
+    uint32_t randomState = 1;
+    int publishFailCount = 0;
+    bool timeValid = false;
+    time32_t timeBase = 0;          //!< Time.now() value when the simulated clock was 0
+    std::vector<HostPublishRecord> published;
+    std::vector<std::shared_ptr<particle::Future<bool>::State>> pendingPublishes;
+    std::vector<std::pair<system_event_t, SystemEventHandler>> handlers;
+    HostFsCounters fs;
+    bool fsFull = false;
+};
+
+// Intentionally never deleted: background threads may still be blocked on the
+// mutex and condition variable when the process exits.
+SimState &sim() {
+    static SimState *state = new SimState();
+    return *state;
+}
+
+thread_local bool isBackgroundThread = false;
+
+// xorshift32, so runs are the same on every computer
+uint32_t nextRandom(SimState &s) {
+    uint32_t x = s.randomState;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    s.randomState = x;
+    return x;
+}
+
+// True if a is before b, allowing for the clock wrapping
+bool isBefore(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+// Park the calling background thread until the waiter is woken. Call with s.mutex locked.
+void park(SimState &s, std::unique_lock<std::mutex> &lock, Waiter &waiter) {
+    waiter.parked = true;
+    s.waiters.push_back(&waiter);
+
+    s.running--;
+    s.cond.notify_all();
+    s.cond.wait(lock, [&waiter]() { return !waiter.parked; });
+}
+
+// Call the onSuccess or onError callbacks for a completed publish. Call without s.mutex locked.
+void notifyPublish(const std::shared_ptr<particle::Future<bool>::State> &state) {
+    std::vector<particle::Future<bool>::OnSuccessCallback> onSuccess;
+    std::vector<particle::Future<bool>::OnErrorCallback> onError;
+    onSuccess.swap(state->onSuccess);
+    onError.swap(state->onError);
+    state->notified = true;
+
+    if (state->succeeded) {
+        for(auto it = onSuccess.begin(); it != onSuccess.end(); it++) {
+            (*it)(true);
+        }
+    }
+    else {
+        for(auto it = onError.begin(); it != onError.end(); it++) {
+            (*it)(particle::Error());
+        }
+    }
+}
+
+}
+
+uint32_t millis() {
+    return sim().now;
+}
+
+void delay(unsigned long ms) {
+    if (!isBackgroundThread) {
+        // Delaying the main thread just lets simulated time pass
+        HostSim::advance(ms);
+        return;
+    }
+
+    SimState &s = sim();
+    std::unique_lock<std::mutex> lock(s.mutex);
+
+    Waiter waiter = {};
+    waiter.wakeAt = s.now + (ms ? ms : 1);
+    park(s, lock, waiter);
+}
+
+struct Thread::Data {
+    std::thread thread;
+    bool finished = false;
+};
+
+Thread::Thread(const char * /* name */, std::function<void(void)> function, os_thread_prio_t /* priority */, size_t /* stack_size */) : d(std::make_shared<Data>()) {
+    SimState &s = sim();
+    std::unique_lock<std::mutex> lock(s.mutex);
+
+    s.running++;
+
+    std::shared_ptr<Data> data = d;
+    d->thread = std::thread([data, function]() {
+        isBackgroundThread = true;
+        function();
+
+        SimState &s = sim();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        data->finished = true;
+        s.running--;
+        s.cond.notify_all();
+    });
+
+    // Let the thread run until it first parks
+    s.cond.wait(lock, [&s]() { return s.running == 0; });
+}
+
+Thread::~Thread() {
+    if (d->thread.joinable()) {
+        d->thread.detach();
+    }
+}
+
+void Thread::dispose() {
+    if (!d->thread.joinable()) {
+        return;
+    }
+    // Let the thread run until it notices it has been asked to stop
+    while(!d->finished) {
+        HostSim::advance(1);
+    }
+    d->thread.join();
+}
+
+// [static]
+void HostSim::advance(uint32_t ms) {
+    SimState &s = sim();
+
+    uint32_t target = s.now + ms;
+
+    while(isBefore(s.now, target)) {
+        std::unique_lock<std::mutex> lock(s.mutex);
+
+        // Skip to just before the next time something happens
+        uint32_t next = target;
+        for(auto it = s.waiters.begin(); it != s.waiters.end(); it++) {
+            if (!(*it)->forever && isBefore((*it)->wakeAt, next)) {
+                next = (*it)->wakeAt;
+            }
+        }
+        for(auto it = s.pendingPublishes.begin(); it != s.pendingPublishes.end(); it++) {
+            if (isBefore((*it)->doneAt, next)) {
+                next = (*it)->doneAt;
+            }
+        }
+        if (s.scheduleIndex < s.schedule.size() && isBefore(s.schedule[s.scheduleIndex].timeMs, next)) {
+            next = s.schedule[s.scheduleIndex].timeMs;
+        }
+        if (isBefore(s.now + 1, next)) {
+            s.now = next - 1;
+        }
+
+        s.now++;
+
+        std::vector<std::shared_ptr<particle::Future<bool>::State>> completed;
+        for(auto it = s.pendingPublishes.begin(); it != s.pendingPublishes.end(); ) {
+            if ((int32_t)(s.now - (*it)->doneAt) >= 0) {
+                completed.push_back(*it);
+                it = s.pendingPublishes.erase(it);
+            }
+            else {
+                it++;
+            }
+        }
+
+        for(auto it = s.waiters.begin(); it != s.waiters.end(); ) {
+            if (!(*it)->forever && (int32_t)(s.now - (*it)->wakeAt) >= 0) {
+                (*it)->parked = false;
+                s.running++;
+                it = s.waiters.erase(it);
+            }
+            else {
+                it++;
+            }
+        }
+
+        s.cond.notify_all();
+        s.cond.wait(lock, [&s]() { return s.running == 0; });
+        lock.unlock();
+
+        // Publish completion callbacks run on the main thread, as they would on the system thread
+        for(auto it = completed.begin(); it != completed.end(); it++) {
+            notifyPublish(*it);
+        }
+
+        while(s.scheduleIndex < s.schedule.size() && !isBefore(s.now, s.schedule[s.scheduleIndex].timeMs)) {
+            setConnected(s.schedule[s.scheduleIndex++].connected);
+        }
+    }
+}
+
+// [static]
+void HostSim::reset() {
+    SimState &s = sim();
+
+    s.connected = false;
+    s.schedule.clear();
+    s.scheduleIndex = 0;
+    s.publishLatencyMs = 500;
+    s.publishJitterMs = 0;
+    s.publishLossRate = 0;
+    s.publishTimeoutMs = 20000;
+    s.publishFadeMs = 0;
+    s.inFade = false;
+    s.randomState = 1;
+    s.publishFailCount = 0;
+    s.timeValid = false;
+    s.published.clear();
+    s.fs = HostFsCounters();
+    s.fsFull = false;
+}
+
+// [static]
+void HostSim::setConnected(bool value) {
+    SimState &s = sim();
+
+    if (s.connected && !value) {
+        fireSystemEvent(cloud_status, cloud_status_disconnecting);
+    }
+    s.connected = value;
+    if (value) {
+        fireSystemEvent(cloud_status, cloud_status_connected);
+    }
+}
+
+// [static]
+void HostSim::setConnectivitySchedule(const std::vector<HostConnectivityChange> &changes) {
+    SimState &s = sim();
+
+    s.schedule = changes;
+    s.scheduleIndex = 0;
+
+    // Apply changes that are already due
+    while(s.scheduleIndex < s.schedule.size() && !isBefore(s.now, s.schedule[s.scheduleIndex].timeMs)) {
+        setConnected(s.schedule[s.scheduleIndex++].connected);
+    }
+}
+
+// [static]
+std::vector<HostConnectivityChange> HostSim::periodicSchedule(uint32_t startMs, uint32_t periodMs, uint32_t onMs, uint32_t durationMs) {
+    std::vector<HostConnectivityChange> result;
+
+    for(uint32_t timeMs = startMs; isBefore(timeMs, startMs + durationMs); timeMs += periodMs) {
+        HostConnectivityChange change;
+        change.timeMs = timeMs;
+        change.connected = true;
+        result.push_back(change);
+
+        change.timeMs = timeMs + onMs;
+        change.connected = false;
+        result.push_back(change);
+    }
+    return result;
+}
+
+// [static]
+void HostSim::setPublishLatencyMs(uint32_t ms, uint32_t jitterMs) {
+    sim().publishLatencyMs = ms;
+    sim().publishJitterMs = (jitterMs < ms) ? jitterMs : ms;
+}
+
+// [static]
+void HostSim::setPublishLoss(double rate, uint32_t timeoutMs, uint32_t fadeMs) {
+    sim().publishLossRate = rate;
+    sim().publishTimeoutMs = timeoutMs;
+    sim().publishFadeMs = fadeMs;
+    sim().inFade = false;
+}
+
+// [static]
+void HostSim::setRandomSeed(uint32_t seed) {
+    sim().randomState = seed ? seed : 1;
+}
+
+// [static]
+void HostSim::setPublishFailCount(int count) {
+    sim().publishFailCount = count;
+}
+
+// [static]
+void HostSim::setFsFull(bool value) {
+    sim().fsFull = value;
+}
+
+// [static]
+void HostSim::setTime(time32_t unixTime) {
+    SimState &s = sim();
+    s.timeBase = unixTime - (time32_t)(s.now / 1000);
+    s.timeValid = true;
+}
+
+// [static]
+void HostSim::fireSystemEvent(uint64_t event, int param) {
+    for(auto it = sim().handlers.begin(); it != sim().handlers.end(); it++) {
+        if ((it->first & event) != 0) {
+            it->second(event, param);
+        }
+    }
+}
+
+// [static]
+const std::vector<HostPublishRecord> &HostSim::getPublished() {
+    return sim().published;
+}
+
+// [static]
+HostFsCounters &HostSim::fsCounters() {
+    return sim().fs;
+}
+
+//
+// System and Particle
+//
+SystemClass System;
+CloudClass Particle;
+TimeClass Time;
+
+time32_t TimeClass::now() {
+    return sim().timeBase + (time32_t)(sim().now / 1000);
+}
+
+bool TimeClass::isValid() {
+    return sim().timeValid;
+}
+
+bool SystemClass::on(system_event_t events, SystemEventHandler handler) {
+    for(auto it = sim().handlers.begin(); it != sim().handlers.end(); it++) {
+        if (it->first == events && it->second == handler) {
+            return true;
+        }
+    }
+    sim().handlers.push_back(std::make_pair(events, handler));
+    return true;
+}
+
+bool CloudClass::connected() {
+    return sim().connected;
+}
+
+particle::Future<bool> CloudClass::publish(const char *name, const char *data, PublishFlags /* flags */) {
+    SimState &s = sim();
+
+    std::shared_ptr<particle::Future<bool>::State> state = std::make_shared<particle::Future<bool>::State>();
+    uint32_t latencyMs = s.publishLatencyMs;
+    if (s.publishJitterMs) {
+        latencyMs = latencyMs - s.publishJitterMs + nextRandom(s) % (2 * s.publishJitterMs + 1);
+    }
+    state->doneAt = s.now + (latencyMs ? latencyMs : 1);
+    state->succeeded = s.connected;
+    if (s.publishFailCount > 0) {
+        s.publishFailCount--;
+        state->succeeded = false;
+    }
+    if (s.inFade && !isBefore(s.now, s.fadeUntil)) {
+        s.inFade = false;
+    }
+    if (s.inFade || (s.publishLossRate > 0 && (double)(nextRandom(s) % 1000000) < s.publishLossRate * 1000000)) {
+        state->doneAt = s.now + s.publishTimeoutMs;
+        state->succeeded = false;
+
+        if (!s.inFade && s.publishFadeMs) {
+            s.inFade = true;
+            s.fadeUntil = s.now + s.publishFadeMs;
+        }
+    }
+
+    HostPublishRecord rec;
+    rec.timeMs = s.now;
+    snprintf(rec.eventName, sizeof(rec.eventName), "%s", name);
+    snprintf(rec.eventData, sizeof(rec.eventData), "%s", data ? data : "");
+    rec.succeeded = state->succeeded;
+    s.published.push_back(rec);
+
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.pendingPublishes.push_back(state);
+    }
+
+    return particle::Future<bool>(state);
+}
+
+//
+// concurrent_hal
+//
+int os_mutex_create(os_mutex_t *mutex) {
+    *mutex = new std::mutex();
+    return 0;
+}
+
+int os_mutex_destroy(os_mutex_t mutex) {
+    delete static_cast<std::mutex *>(mutex);
+    return 0;
+}
+
+int os_mutex_lock(os_mutex_t mutex) {
+    static_cast<std::mutex *>(mutex)->lock();
+    return 0;
+}
+
+int os_mutex_trylock(os_mutex_t mutex) {
+    return static_cast<std::mutex *>(mutex)->try_lock() ? 0 : 1;
+}
+
+int os_mutex_unlock(os_mutex_t mutex) {
+    static_cast<std::mutex *>(mutex)->unlock();
+    return 0;
+}
+
+int os_mutex_recursive_create(os_mutex_recursive_t *mutex) {
+    *mutex = new std::recursive_mutex();
+    return 0;
+}
+
+int os_mutex_recursive_destroy(os_mutex_recursive_t mutex) {
+    delete static_cast<std::recursive_mutex *>(mutex);
+    return 0;
+}
+
+int os_mutex_recursive_lock(os_mutex_recursive_t mutex) {
+    static_cast<std::recursive_mutex *>(mutex)->lock();
+    return 0;
+}
+
+int os_mutex_recursive_trylock(os_mutex_recursive_t mutex) {
+    return static_cast<std::recursive_mutex *>(mutex)->try_lock() ? 0 : 1;
+}
+
+int os_mutex_recursive_unlock(os_mutex_recursive_t mutex) {
+    static_cast<std::recursive_mutex *>(mutex)->unlock();
+    return 0;
+}
+
+int os_semaphore_create(os_semaphore_t *semaphore, unsigned max, unsigned initial) {
+    Semaphore *sem = new Semaphore();
+    sem->count = initial;
+    sem->max = max;
+    *semaphore = sem;
+    return 0;
+}
+
+int os_semaphore_destroy(os_semaphore_t semaphore) {
+    delete static_cast<Semaphore *>(semaphore);
+    return 0;
+}
+
+int os_semaphore_take(os_semaphore_t semaphore, system_tick_t timeout, bool /* reserved */) {
+    Semaphore *sem = static_cast<Semaphore *>(semaphore);
+    SimState &s = sim();
+
+    if (!isBackgroundThread) {
+        // The main thread lets simulated time pass until the semaphore is given or it times out
+        for(system_tick_t elapsed = 0; ; elapsed++) {
+            {
+                std::lock_guard<std::mutex> lock(s.mutex);
+                if (sem->count > 0) {
+                    sem->count--;
+                    return 0;
+                }
+            }
+            if (elapsed >= timeout) {
+                return 1;
+            }
+            HostSim::advance(1);
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(s.mutex);
+    if (sem->count > 0) {
+        sem->count--;
+        return 0;
+    }
+    if (timeout == 0) {
+        return 1;
+    }
+
+    Waiter waiter = {};
+    waiter.forever = (timeout == CONCURRENT_WAIT_FOREVER);
+    waiter.wakeAt = s.now + timeout;
+    waiter.semaphore = sem;
+    park(s, lock, waiter);
+
+    return waiter.signaled ? 0 : 1;
+}
+
+int os_semaphore_give(os_semaphore_t semaphore, bool /* reserved */) {
+    Semaphore *sem = static_cast<Semaphore *>(semaphore);
+    SimState &s = sim();
+    std::unique_lock<std::mutex> lock(s.mutex);
+
+    for(auto it = s.waiters.begin(); it != s.waiters.end(); it++) {
+        if ((*it)->semaphore == sem) {
+            // Hand the semaphore directly to the waiting thread
+            (*it)->signaled = true;
+            (*it)->parked = false;
+            s.running++;
+            s.waiters.erase(it);
+            s.cond.notify_all();
+
+            if (!isBackgroundThread) {
+                // Stay in lockstep: let the woken thread run until it parks again
+                s.cond.wait(lock, [&s]() { return s.running == 0; });
+            }
+            return 0;
+        }
+    }
+
+    if (sem->count >= sem->max) {
+        return 1;
+    }
+    sem->count++;
+    return 0;
+}
+
+//
+// File system call counters. Link with:
+// -Wl,--wrap=open,--wrap=read,--wrap=write,--wrap=unlink,--wrap=mkdir,--wrap=rmdir,--wrap=opendir,--wrap=readdir
+//
+extern "C" {
+
+int __real_open(const char *path, int flags, ...);
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+int __real_unlink(const char *path);
+int __real_mkdir(const char *path, mode_t mode);
+int __real_rmdir(const char *path);
+DIR *__real_opendir(const char *path);
+struct dirent *__real_readdir(DIR *dir);
+
+int __wrap_open(const char *path, int flags, ...) {
+    // Device OS open() does not take a mode, and callers do not pass one
+    HostFsCounters &fs = sim().fs;
+    fs.opens++;
+    if ((flags & O_CREAT) != 0 && access(path, F_OK) != 0) {
+        fs.creates++;
+    }
+    return __real_open(path, flags, 0666);
+}
+
+ssize_t __wrap_read(int fd, void *buf, size_t count) {
+    sim().fs.reads++;
+    return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count) {
+    HostFsCounters &fs = sim().fs;
+    fs.writes++;
+    if (sim().fsFull) {
+        errno = ENOSPC;
+        return -1;
+    }
+    fs.bytesWritten += count;
+    return __real_write(fd, buf, count);
+}
+
+int __wrap_unlink(const char *path) {
+    sim().fs.unlinks++;
+    return __real_unlink(path);
+}
+
+int __wrap_mkdir(const char *path, mode_t mode) {
+    sim().fs.mkdirs++;
+    return __real_mkdir(path, mode);
+}
+
+int __wrap_rmdir(const char *path) {
+    sim().fs.mkdirs++;
+    return __real_rmdir(path);
+}
+
+DIR *__wrap_opendir(const char *path) {
+    sim().fs.dirScans++;
+    return __real_opendir(path);
+}
+
+struct dirent *__wrap_readdir(DIR *dir) {
+    sim().fs.dirEntries++;
+    return __real_readdir(dir);
+}
+
+}
+
+//
+// Same as UnitTestLib/helpers.cpp, except millis() above uses the simulated clock
+//
+extern "C"
+char *itoa(int value, char *str, int base) {
+    sprintf(str, (base == 16) ? "%x" : ((base == 8) ? "%o" : "%d"), value);
+    return str;
+}
+
+extern "C"
+char *utoa(unsigned int value, char *str, int base) {
+    sprintf(str, (base == 16) ? "%x" : ((base == 8) ? "%o" : "%u"), value);
+    return str;
+}
+
+extern "C"
+char *ltoa(unsigned long value, char *str, int base) {
+    sprintf(str, (base == 16) ? "%lx" : ((base == 8) ? "%lo" : "%ld"), value);
+    return str;
+}
+
+extern "C"
+char *ultoa(unsigned long value, char *str, int base) {
+    sprintf(str, (base == 16) ? "%lx" : ((base == 8) ? "%lo" : "%lu"), value);
+    return str;
+}
+
+extern "C"
+uint32_t HAL_RNG_GetRandomNumber(void) {
+    return (uint32_t) rand();
+}
+
+const Logger Log("app");
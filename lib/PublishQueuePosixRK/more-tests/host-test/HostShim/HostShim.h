@@ -0,0 +1,159 @@
+#ifndef __HOSTSHIM_H
+#define __HOSTSHIM_H
+
+// Controls for the host shim. Not part of Device OS; test code uses this to drive the
+// simulated clock and cloud connection and to read the file system counters.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+/**
+ * @brief Counters for file system calls made by the code under test
+ *
+ * Calls are counted by wrapping the libc symbols at link time (-Wl,--wrap=open, etc.)
+ * so the library source does not need to be modified.
+ */
+struct HostFsCounters {
+    size_t opens = 0;           //!< open() calls
+    size_t creates = 0;         //!< open() calls with O_CREAT that created a new file
+    size_t reads = 0;           //!< read() calls
+    size_t writes = 0;          //!< write() calls
+    size_t bytesWritten = 0;    //!< bytes passed to write()
+    size_t unlinks = 0;         //!< unlink() calls
+    size_t mkdirs = 0;          //!< mkdir() and rmdir() calls
+    size_t dirScans = 0;        //!< opendir() calls
+    size_t dirEntries = 0;      //!< readdir() calls
+
+    /**
+     * @brief Directory metadata mutations: file create, unlink, mkdir, rmdir
+     */
+    size_t dirMutations() const { return creates + unlinks + mkdirs; };
+
+    /**
+     * @brief Operations that program flash: creates, unlinks, writes, and directory changes
+     */
+    size_t flashOps() const { return creates + unlinks + mkdirs + writes; };
+};
+
+/**
+ * @brief An event received by the simulated cloud
+ */
+struct HostPublishRecord {
+    uint32_t timeMs;        //!< Simulated millis() value when the publish started
+    char eventName[65];     //!< Event name
+    char eventData[1025];   //!< Event data
+    bool succeeded;         //!< Whether the simulated publish succeeded
+};
+
+/**
+ * @brief A change in the simulated cloud connection at a point in simulated time
+ */
+struct HostConnectivityChange {
+    uint32_t timeMs;        //!< Simulated millis() value when the change happens
+    bool connected;         //!< Connection state from then on
+};
+
+class HostSim {
+public:
+    /**
+     * @brief Reset the simulated clock, cloud model, published event list, and counters
+     */
+    static void reset();
+
+    /**
+     * @brief Advance the simulated clock, letting background threads run at each millisecond
+     *
+     * Milliseconds where no background thread wakes up, no publish completes, and the connection
+     * schedule does not change are skipped over, so long idle periods take no time to simulate.
+     * 
+     * Only call this from the main (test) thread.
+     */
+    static void advance(uint32_t ms);
+
+    /**
+     * @brief Set the simulated cloud connection state
+     *
+     * Going from connected to disconnected fires the cloud_status_disconnecting event.
+     */
+    static void setConnected(bool value);
+
+    /**
+     * @brief Change the connection state at the given times as the clock advances
+     *
+     * @param changes Changes in time order. Replaces any previous schedule. reset() clears it.
+     */
+    static void setConnectivitySchedule(const std::vector<HostConnectivityChange> &changes);
+
+    /**
+     * @brief Build a schedule that connects for onMs at the start of every periodMs, for durationMs
+     *
+     * @param startMs Simulated time of the first connection
+     */
+    static std::vector<HostConnectivityChange> periodicSchedule(uint32_t startMs, uint32_t periodMs, uint32_t onMs, uint32_t durationMs);
+
+    /**
+     * @brief Set how long a simulated publish takes to complete
+     * 
+     * @param ms Time for the cloud to acknowledge the publish
+     * 
+     * @param jitterMs Each publish takes a random time from ms - jitterMs to ms + jitterMs
+     */
+    static void setPublishLatencyMs(uint32_t ms, uint32_t jitterMs = 0);
+
+    /**
+     * @brief Lose a fraction of publishes, even if connected
+     * 
+     * @param rate 0.0 (none, the default) to 1.0 (all)
+     * 
+     * @param timeoutMs A lost publish fails after this long, like a publish whose acknowledgement
+     * never arrives
+     * 
+     * @param fadeMs A lost publish starts a fade (a period of weak signal). Publishes started within 
+     * fadeMs of it are also lost. 0 (the default) means each publish is lost independently.
+     */
+    static void setPublishLoss(double rate, uint32_t timeoutMs = 20000, uint32_t fadeMs = 0);
+
+    /**
+     * @brief Seed the random number generator used for latency jitter and loss
+     * 
+     * reset() sets the seed to 1 so runs are repeatable.
+     */
+    static void setRandomSeed(uint32_t seed);
+
+    /**
+     * @brief Make the next count publishes fail, even if connected
+     */
+    static void setPublishFailCount(int count);
+
+    /**
+     * @brief Make every write() fail with ENOSPC, like a full file system. reset() clears it.
+     */
+    static void setFsFull(bool value);
+
+    /**
+     * @brief Set the simulated real-time clock, making Time.isValid() true
+     * 
+     * @param unixTime Time.now() value at the current simulated millis(). It advances with the
+     * simulated clock. reset() makes the time invalid again.
+     */
+    static void setTime(time32_t unixTime);
+
+    /**
+     * @brief Fire a system event to registered System.on() handlers
+     */
+    static void fireSystemEvent(uint64_t event, int param);
+
+    /**
+     * @brief All publishes received by the simulated cloud since reset()
+     */
+    static const std::vector<HostPublishRecord> &getPublished();
+
+    /**
+     * @brief File system call counters
+     */
+    static HostFsCounters &fsCounters();
+};
+
+#endif /* __HOSTSHIM_H */
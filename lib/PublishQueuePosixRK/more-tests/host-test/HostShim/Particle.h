@@ -0,0 +1,180 @@
+// Host (native gcc) stand-in for Particle.h used to run PublishQueuePosixRK, SequentialFileRK
+// and BackgroundPublishRK off-device. It extends the UnitTestLib shim from StorageHelperRK
+// with the threading, cloud, and system event APIs these libraries use.
+#ifndef __HOSTSHIM_PARTICLE_H
+#define __HOSTSHIM_PARTICLE_H
+
+#include "../../../../StorageHelperRK/automated-test/UnitTestLib/Particle.h"
+
+#include <dirent.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+// UnitTestLib defines WITH_LOCK as empty because it's single threaded. The host shim
+// runs BackgroundPublishRK on a real thread, so use the Device OS definition.
+#undef WITH_LOCK
+#undef TRY_LOCK
+#define WITH_LOCK(lock) for (std::unique_lock<typename std::remove_reference<decltype(lock)>::type> __with_lock((lock)); __with_lock; __with_lock.unlock())
+#define TRY_LOCK(lock) for (std::unique_lock<typename std::remove_reference<decltype(lock)>::type> __try_lock((lock), std::try_to_lock); __try_lock; __try_lock.unlock())
+
+//
+// concurrent_hal.h
+//
+typedef void *os_mutex_t;
+typedef void *os_mutex_recursive_t;
+typedef void *os_semaphore_t;
+typedef int os_thread_prio_t;
+
+const os_thread_prio_t OS_THREAD_PRIORITY_DEFAULT = 2;
+const system_tick_t CONCURRENT_WAIT_FOREVER = (system_tick_t)-1;
+
+int os_mutex_create(os_mutex_t *mutex);
+int os_mutex_destroy(os_mutex_t mutex);
+int os_mutex_lock(os_mutex_t mutex);
+int os_mutex_trylock(os_mutex_t mutex);
+int os_mutex_unlock(os_mutex_t mutex);
+
+int os_mutex_recursive_create(os_mutex_recursive_t *mutex);
+int os_mutex_recursive_destroy(os_mutex_recursive_t mutex);
+int os_mutex_recursive_lock(os_mutex_recursive_t mutex);
+int os_mutex_recursive_trylock(os_mutex_recursive_t mutex);
+int os_mutex_recursive_unlock(os_mutex_recursive_t mutex);
+
+// A background thread blocked in os_semaphore_take() is parked like delay(), and is woken by
+// os_semaphore_give() or the simulated clock reaching the timeout
+int os_semaphore_create(os_semaphore_t *semaphore, unsigned max, unsigned initial);
+int os_semaphore_destroy(os_semaphore_t semaphore);
+int os_semaphore_take(os_semaphore_t semaphore, system_tick_t timeout, bool reserved);
+int os_semaphore_give(os_semaphore_t semaphore, bool reserved);
+
+//
+// spark_wiring_thread.h
+//
+class Thread {
+public:
+    Thread(const char *name, std::function<void(void)> function, os_thread_prio_t priority = OS_THREAD_PRIORITY_DEFAULT, size_t stack_size = 0);
+    ~Thread();
+
+    void dispose();
+
+    struct Data;
+
+private:
+    std::shared_ptr<Data> d;
+};
+
+void delay(unsigned long ms);
+
+//
+// system_threading.h
+//
+namespace spark { namespace feature {
+    enum State {
+        DISABLED,
+        ENABLED
+    };
+}}
+
+inline spark::feature::State system_thread_get_state(void *) { return spark::feature::ENABLED; }
+
+//
+// system_event.h
+//
+typedef uint64_t system_event_t;
+
+enum SystemEvents {
+    cloud_status = 1 << 6,
+    reset = 1 << 10,
+    out_of_memory = 1 << 18,
+};
+
+enum SystemEventsParam {
+    cloud_status_disconnected = 0,
+    cloud_status_connecting = 1,
+    cloud_status_connected = 8,
+    cloud_status_disconnecting = 9,
+};
+
+typedef void (*SystemEventHandler)(system_event_t event, int param);
+
+class SystemClass {
+public:
+    bool on(system_event_t events, SystemEventHandler handler);
+};
+extern SystemClass System;
+
+//
+// spark_wiring_cloud.h
+//
+namespace particle {
+    class Error {
+    };
+
+    /**
+     * Stand-in for the Future<bool> returned by Particle.publish(). Completion is driven by the
+     * simulated clock in HostShim.cpp, which calls the onSuccess() and onError() callbacks from
+     * the main (test) thread, as the system thread would on a device.
+     */
+    template<typename T>
+    class Future {
+    public:
+        typedef std::function<void(const T &)> OnSuccessCallback;
+        typedef std::function<void(const Error &)> OnErrorCallback;
+
+        struct State {
+            system_tick_t doneAt = 0;
+            bool succeeded = false;
+            bool notified = false;      //!< Callbacks have been called
+            std::vector<OnSuccessCallback> onSuccess;
+            std::vector<OnErrorCallback> onError;
+        };
+
+        Future() : state(std::make_shared<State>()) {};
+        explicit Future(std::shared_ptr<State> state) : state(state) {};
+
+        bool isDone() const { return millis() >= state->doneAt; };
+        bool isSucceeded() const { return isDone() && state->succeeded; };
+
+        Future &onSuccess(OnSuccessCallback cb) {
+            if (state->notified) {
+                if (state->succeeded) {
+                    cb(true);
+                }
+            }
+            else {
+                state->onSuccess.push_back(cb);
+            }
+            return *this;
+        };
+
+        Future &onError(OnErrorCallback cb) {
+            if (state->notified) {
+                if (!state->succeeded) {
+                    cb(Error());
+                }
+            }
+            else {
+                state->onError.push_back(cb);
+            }
+            return *this;
+        };
+
+        std::shared_ptr<State> state;
+    };
+}
+
+class CloudClass {
+public:
+    bool connected();
+    particle::Future<bool> publish(const char *name, const char *data, PublishFlags flags = PublishFlags());
+};
+extern CloudClass Particle;
+
+#include "HostShim.h"
+
+#endif /* __HOSTSHIM_PARTICLE_H */
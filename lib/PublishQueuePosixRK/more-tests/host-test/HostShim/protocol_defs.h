@@ -0,0 +1,3 @@
+// Host shim: the protocol constants BackgroundPublishRK needs are in UnitTestLib's Particle.h
+#pragma once
+#include "Particle.h"
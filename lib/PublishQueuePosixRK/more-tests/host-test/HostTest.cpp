@@ -0,0 +1,2561 @@
+#include "Particle.h"
+#include "PublishQueuePosixRK.h"
+#include "BackgroundPublishRK.h"
+
+#include <cassert>
+#include <chrono>
+#include <fcntl.h>
+
+#include <sys/stat.h>
+
+// Set in main() to a tmpfs directory if available, so tests don't write to the disk
+const char *queueDirPath = "/tmp/pubqueue-hosttest";
+
+#define assertInt(msg, got, expected) _assertInt(msg, got, expected, __LINE__)
+void _assertInt(const char *msg, int got, int expected, int line) {
+	if (expected != got) {
+		printf("assertion failed %s line %d\n", msg, line);
+		printf("expected: %d\n", expected);
+		printf("     got: %d\n", got);
+		assert(false);
+	}
+}
+
+#define assertStr(msg, got, expected) _assertStr(msg, got, expected, __LINE__)
+void _assertStr(const char *msg, const char *got, const char *expected, int line) {
+	if (strcmp(expected, got) != 0) {
+		printf("assertion failed %s line %d\n", msg, line);
+		printf("expected: %s\n", expected);
+		printf("     got: %s\n", got);
+		assert(false);
+	}
+}
+
+/**
+ * @brief PublishQueuePosix is a singleton with a protected constructor. This makes it possible
+ * to create a fresh queue for each test.
+ */
+class TestQueue : public PublishQueuePosix {
+public:
+	TestQueue() {
+		withDirPath(queueDirPath);
+		_instance = this;
+	}
+	virtual ~TestQueue() {
+		// Stop the background publish thread so the next test can set the number of slots
+		BackgroundPublishRK::instance().stop();
+		_instance = NULL;
+	}
+
+	/**
+	 * @brief Run loop() for ms milliseconds of simulated time
+	 * 
+	 * @param stepMs Call loop() this often. The default of every millisecond is the most accurate.
+	 */
+	void run(uint32_t ms, uint32_t stepMs = 1) {
+		for(uint32_t ii = 0; ii < ms; ii += stepMs) {
+			loop();
+			HostSim::advance(stepMs);
+		}
+	}
+
+	/**
+	 * @brief Run loop() until the queue is empty and it's safe to sleep, or timeoutMs elapses
+	 *
+	 * @return the number of simulated milliseconds it took
+	 */
+	uint32_t runUntilEmpty(uint32_t timeoutMs) {
+		uint32_t start = millis();
+		while(millis() - start < timeoutMs) {
+			loop();
+			if (getNumEvents() == 0 && getCanSleep()) {
+				break;
+			}
+			HostSim::advance(1);
+		}
+		return millis() - start;
+	}
+};
+
+/**
+ * @brief Remove the queue directory and its contents from a previous run
+ */
+void cleanQueueDir() {
+	for(int priority = 0; priority < PUBLISHQUEUE_NUM_PRIORITIES; priority++) {
+		String path = queueDirPath;
+		if (priority > 0) {
+			path += String::format(".p%d", priority);
+		}
+		SequentialFile tmp;
+		tmp.withDirPath(path);
+		tmp.removeAll(true);
+	}
+}
+
+void publishCounter(TestQueue &q, int counter) {
+	char buf[256];
+	snprintf(buf, sizeof(buf), "{\"distance\":%d, \"battery\":87.50,\"key1\":\"Charging\", \"temp\":21.50, \"resets\":0, \"alerts\":0,\"connecttime\":12,\"timestamp\":1700000000000}", counter);
+	q.publish("Ubidots_Level_Hook_v1", buf, PRIVATE | WITH_ACK);
+}
+
+/**
+ * @brief Append the counter values in a publishCounter() event or batch of events to counters
+ *
+ * @return the number of events in data
+ */
+int getCounters(const char *data, std::vector<int> &counters) {
+	int count = 0;
+	for(const char *cp = strstr(data, "\"distance\":"); cp; cp = strstr(cp + 1, "\"distance\":")) {
+		counters.push_back(atoi(cp + 11));
+		count++;
+	}
+	return count;
+}
+
+void fileQueueTest() {
+	cleanQueueDir();
+	HostSim::reset();
+
+	TestQueue q;
+	q.setup();
+
+	// Offline, events go to the file queue
+	for(int ii = 0; ii < 5; ii++) {
+		publishCounter(q, ii);
+	}
+	assertInt("", (int)q.getNumEvents(), 5);
+
+	HostSim::setConnected(true);
+	q.runUntilEmpty(60000);
+	assertInt("", (int)q.getNumEvents(), 0);
+
+	const std::vector<HostPublishRecord> &published = HostSim::getPublished();
+	assertInt("", (int)published.size(), 5);
+	for(int ii = 0; ii < 5; ii++) {
+		char expected[16];
+		snprintf(expected, sizeof(expected), "%d", ii);
+		assertInt("", strncmp(published[ii].eventData + 12, expected, strlen(expected)), 0);
+	}
+}
+
+void logStoreTest() {
+	cleanQueueDir();
+	HostSim::reset();
+
+	{
+		TestQueue q;
+		q.withLogStore(4, 4096);
+		q.setup();
+
+		// Offline, events go to the log
+		for(int ii = 0; ii < 10; ii++) {
+			publishCounter(q, ii);
+		}
+		assertInt("", (int)q.getNumEvents(), 10);
+	}
+
+	// Simulate a reboot: the log is recovered from the cursor file and segments
+	TestQueue q;
+	q.withLogStore(4, 4096);
+	q.setup();
+	assertInt("", (int)q.getNumEvents(), 10);
+
+	HostSim::setConnected(true);
+	q.runUntilEmpty(120000);
+	assertInt("", (int)q.getNumEvents(), 0);
+
+	const std::vector<HostPublishRecord> &published = HostSim::getPublished();
+	assertInt("", (int)published.size(), 10);
+	for(int ii = 0; ii < 10; ii++) {
+		char expected[16];
+		snprintf(expected, sizeof(expected), "%d,", ii);
+		assertInt("", strncmp(published[ii].eventData + 12, expected, strlen(expected)), 0);
+	}
+
+}
+
+/**
+ * @brief Check the order and contents of a SequentialFile queue against expected, without removing anything
+ */
+void assertFileQueue(SequentialFile &sf, const std::vector<int> &expected, int line) {
+	_assertInt("queueLen", sf.getQueueLen(), (int)expected.size(), line);
+	for(size_t ii = 0; ii < expected.size(); ii++) {
+		_assertInt("fileNum", sf.getFileFromQueueAt(ii), expected[ii], line);
+	}
+	_assertInt("past end", sf.getFileFromQueueAt(expected.size()), 0, line);
+}
+
+void sequentialFileRangeTest() {
+	cleanQueueDir();
+	HostSim::reset();
+
+	SequentialFile::createDirIfNecessary(queueDirPath);
+	static const int fileNums[] = { 5, 3, 9, 4, 1 };
+	for(size_t ii = 0; ii < sizeof(fileNums) / sizeof(fileNums[0]); ii++) {
+		int fd = open(String::format("%s/%08d", queueDirPath, fileNums[ii]), O_RDWR | O_CREAT);
+		close(fd);
+	}
+
+	// Scanned in file number order, whatever the directory order
+	{
+		SequentialFile sf;
+		sf.withDirPath(queueDirPath);
+		sf.withManifest();
+		sf.scanDir();
+		assertFileQueue(sf, { 1, 3, 4, 5, 9 }, __LINE__);
+		assertInt("", (int)sf.getNumRanges(), 3);
+
+		// Out of order adds are inserted in order, joining ranges, and duplicates are ignored
+		sf.addFileToQueue(2);
+		sf.addFileToQueue(10);
+		sf.addFileToQueue(7);
+		sf.addFileToQueue(3);
+		assertFileQueue(sf, { 1, 2, 3, 4, 5, 7, 9, 10 }, __LINE__);
+		assertInt("", (int)sf.getNumRanges(), 3);
+		sf.addFileToQueue(8);
+		assertInt("", (int)sf.getNumRanges(), 2);
+
+		// Removing from the middle splits a range
+		assertInt("", sf.removeFileFromQueue(4), 1);
+		assertInt("", sf.removeFileFromQueue(4), 0);
+		assertInt("", sf.removeFileFromQueue(6), 0);
+		assertInt("", sf.removeFileFromQueue(10), 1);
+		assertFileQueue(sf, { 1, 2, 3, 5, 7, 8, 9 }, __LINE__);
+		assertInt("", (int)sf.getNumRanges(), 3);
+		sf.saveManifest();
+	}
+
+	// The manifest keeps the holes
+	{
+		SequentialFile sf;
+		sf.withDirPath(queueDirPath);
+		sf.withManifest();
+		sf.scanDir();
+		assertFileQueue(sf, { 1, 2, 3, 5, 7, 8, 9 }, __LINE__);
+
+		static const int expected[] = { 1, 2, 3, 5, 7, 8, 9 };
+		for(size_t ii = 0; ii < sizeof(expected) / sizeof(expected[0]); ii++) {
+			assertInt("", sf.getFileFromQueue(false), expected[ii]);
+			assertInt("", sf.getFileFromQueue(true), expected[ii]);
+		}
+		assertInt("", sf.getFileFromQueue(), 0);
+		assertInt("", (int)sf.getNumRanges(), 0);
+
+		// RAM does not grow with the number of queued files
+		for(int ii = 0; ii < 1000; ii++) {
+			sf.addFileToQueue(sf.reserveFile());
+		}
+		assertInt("", sf.getQueueLen(), 1000);
+		assertInt("", (int)sf.getNumRanges(), 1);
+		sf.removeAll(true);
+	}
+}
+
+/**
+ * @brief Create empty files for fileNums first to last with each of the extensions in the queue directory
+ */
+void createSidecarFiles(int first, int last, const char * const *exts, size_t numExts) {
+	SequentialFile::createDirIfNecessary(queueDirPath);
+	for(int fileNum = first; fileNum <= last; fileNum++) {
+		for(size_t ii = 0; ii < numExts; ii++) {
+			int fd = open(String::format("%s/%08d.%s", queueDirPath, fileNum, exts[ii]), O_RDWR | O_CREAT);
+			close(fd);
+		}
+	}
+}
+
+bool fileExists(const char *path) {
+	struct stat sb;
+	return stat(path, &sb) == 0;
+}
+
+void sequentialFileExtIndexTest() {
+	static const char * const exts[] = { "dat", "sha1" };
+
+	cleanQueueDir();
+	HostSim::reset();
+	createSidecarFiles(1, 10, exts, 2);
+
+	{
+		SequentialFile sf;
+		sf.withDirPath(queueDirPath);
+		sf.withFilenameExtension("dat");
+		sf.withManifest(true, 1);
+		sf.scanDir();
+		assertInt("", sf.getQueueLen(), 10);
+		assertInt("", sf.getExtIndexValid(), 1);
+
+		// All extensions are removed without reading the directory
+		HostSim::fsCounters() = HostFsCounters();
+		sf.getFileFromQueue();
+		sf.removeFileNum(1, true);
+		assertInt("", (int)HostSim::fsCounters().dirScans, 0);
+		assertInt("", (int)HostSim::fsCounters().unlinks, 2);
+		assertInt("", fileExists(sf.getPathForFileNum(1)), 0);
+		assertInt("", fileExists(sf.getPathForFileNum(1, "sha1")), 0);
+
+		// A sidecar created after scanDir() is recorded with addFileExtension()
+		int fileNum = sf.reserveFile();
+		int fd = open(sf.getPathForFileNum(fileNum), O_RDWR | O_CREAT);
+		close(fd);
+		fd = open(sf.getPathForFileNum(fileNum, "meta"), O_RDWR | O_CREAT);
+		close(fd);
+		sf.addFileExtension(fileNum, "meta");
+		sf.addFileToQueue(fileNum);
+		assertInt("", fileNum, 11);
+
+		// Getting a path for a file that is not created does not add it to the index
+		sf.getPathForFileNum(3, "tmp");
+
+		// Bulk removal, with a hole in the queue
+		sf.removeFileFromQueue(5);
+		HostSim::fsCounters() = HostFsCounters();
+		assertInt("", sf.removeRange(2, 6, true), 4);
+		assertInt("", (int)HostSim::fsCounters().dirScans, 0);
+		assertInt("", (int)HostSim::fsCounters().unlinks, 10);
+		assertInt("", (int)HostSim::fsCounters().writes, 1);
+		assertInt("", fileExists(sf.getPathForFileNum(5, "sha1")), 0);
+		assertInt("", sf.getFileFromQueue(false), 7);
+
+		assertInt("", sf.removeRange(10, 11, true), 2);
+		assertInt("", fileExists(sf.getPathForFileNum(11, "meta")), 0);
+
+		// Without allExtensions, only the queued files with the configured extension
+		assertInt("", sf.removeRange(7, 7, false), 1);
+		assertInt("", fileExists(sf.getPathForFileNum(7)), 0);
+		assertInt("", fileExists(sf.getPathForFileNum(7, "sha1")), 1);
+		assertInt("", sf.getQueueLen(), 2);
+	}
+
+	// Loaded from the manifest, the extensions are not known, so the directory is read
+	{
+		SequentialFile sf;
+		sf.withDirPath(queueDirPath);
+		sf.withFilenameExtension("dat");
+		sf.withManifest();
+		sf.scanDir();
+		assertInt("", sf.getQueueLen(), 2);
+		assertInt("", sf.getExtIndexValid(), 0);
+
+		HostSim::fsCounters() = HostFsCounters();
+		assertInt("", sf.removeRange(7, 9, true), 2);
+		assertInt("", (int)HostSim::fsCounters().dirScans, 1);
+		assertInt("", fileExists(sf.getPathForFileNum(7, "sha1")), 0);
+		assertInt("", fileExists(sf.getPathForFileNum(9, "sha1")), 0);
+		assertInt("", sf.getQueueLen(), 0);
+		sf.removeAll(true);
+	}
+}
+
+/**
+ * @brief Write fileNum's number as text to its slot and add it to the queue
+ */
+int writeSlotFileNum(SequentialFile &sf) {
+	int fileNum = sf.reserveFile();
+	String data = String::format("data%d", fileNum);
+	assertInt("", sf.writeSlot(fileNum, data.c_str(), data.length() + 1), 1);
+	sf.addFileToQueue(fileNum);
+	return fileNum;
+}
+
+String readSlotString(SequentialFile &sf, int fileNum) {
+	char buf[32] = {0};
+	size_t dataLen = 0;
+	int fd = sf.openSlot(fileNum, &dataLen);
+	if (fd < 0) {
+		return "";
+	}
+	assertInt("", dataLen < sizeof(buf), 1);
+	read(fd, buf, dataLen);
+	close(fd);
+	return buf;
+}
+
+void sequentialFileSlotTest() {
+	cleanQueueDir();
+	HostSim::reset();
+
+	{
+		SequentialFile sf;
+		sf.withDirPath(queueDirPath);
+		sf.withSlotRecycling(4);
+		sf.scanDir();
+		// The 4 slots and the marker that there are no older files to move into slots
+		assertInt("", (int)HostSim::fsCounters().creates, 5);
+		assertInt("", sf.getQueueLen(), 0);
+
+		for(int ii = 0; ii < 3; ii++) {
+			writeSlotFileNum(sf);
+		}
+		assertInt("", sf.getFileFromQueue(), 1);
+		sf.removeFileNum(1, false);
+		assertFileQueue(sf, {2, 3}, __LINE__);
+
+		// Once the slots exist, nothing is created or removed. 4 uses slot 0 and 5 reuses slot 1, which
+		// held 1. With all slots full, 6 reuses slot 2 and discards 2.
+		HostSim::fsCounters() = HostFsCounters();
+		for(int ii = 0; ii < 3; ii++) {
+			writeSlotFileNum(sf);
+		}
+		assertInt("", sf.getFileFromQueue(), 3);
+		sf.removeFileNum(3, false);
+		assertInt("", (int)HostSim::fsCounters().dirMutations(), 0);
+		assertInt("", (int)HostSim::fsCounters().dirScans, 0);
+		assertFileQueue(sf, {4, 5, 6}, __LINE__);
+		assertStr("", readSlotString(sf, 5), "data5");
+		assertInt("", sf.openSlot(2, NULL), -1);
+
+		// Removing a file number whose slot was reused leaves the newer one
+		sf.removeFileNum(2, false);
+		assertStr("", readSlotString(sf, 6), "data6");
+	}
+
+	// After a reboot the queue is in the same order, and file numbers continue from the newest.
+	// Older files were already moved into slots, so the directory is not read.
+	{
+		HostSim::fsCounters() = HostFsCounters();
+		SequentialFile sf;
+		sf.withDirPath(queueDirPath);
+		sf.withSlotRecycling(4);
+		sf.scanDir();
+		assertInt("", (int)HostSim::fsCounters().creates, 0);
+		assertInt("", (int)HostSim::fsCounters().dirScans, 0);
+		assertFileQueue(sf, {4, 5, 6}, __LINE__);
+		assertStr("", readSlotString(sf, 4), "data4");
+
+		assertInt("", sf.removeRange(4, 6, false), 3);
+		assertInt("", sf.getQueueLen(), 0);
+	}
+	{
+		SequentialFile sf;
+		sf.withDirPath(queueDirPath);
+		sf.withSlotRecycling(4);
+		sf.scanDir();
+		assertInt("", sf.getQueueLen(), 0);
+		assertInt("", writeSlotFileNum(sf), 7);
+		writeSlotFileNum(sf);
+		writeSlotFileNum(sf);
+	}
+
+	// A damaged slot header is treated as empty
+	{
+		int fd = open(String::format("%s/slot0000", queueDirPath), O_RDWR);
+		lseek(fd, 8, SEEK_SET);
+		write(fd, "\xff", 1);
+		close(fd);
+
+		SequentialFile sf;
+		sf.withDirPath(queueDirPath);
+		sf.withSlotRecycling(4);
+		sf.scanDir();
+		assertFileQueue(sf, {7, 9}, __LINE__);
+	}
+
+	// With more slots, queued file numbers are found in their old slots
+	{
+		SequentialFile sf;
+		sf.withDirPath(queueDirPath);
+		sf.withSlotRecycling(6);
+		sf.scanDir();
+		assertFileQueue(sf, {7, 9}, __LINE__);
+		assertStr("", readSlotString(sf, 9), "data9");
+		for(int ii = 0; ii < 6; ii++) {
+			writeSlotFileNum(sf);
+		}
+		assertFileQueue(sf, {10, 11, 12, 13, 14, 15}, __LINE__);
+		assertStr("", readSlotString(sf, 15), "data15");
+		sf.removeAll(true);
+	}
+
+	// Data that does not match its CRC, like a torn write over an older file number, is not read.
+	// A slot written before the data CRC was added is still read.
+	{
+		SequentialFile sf;
+		sf.withDirPath(queueDirPath);
+		sf.withSlotRecycling(4);
+		sf.scanDir();
+		assertInt("", writeSlotFileNum(sf), 1);
+		assertStr("", readSlotString(sf, 1), "data1");
+
+		int fd = open(String::format("%s/slot0001", queueDirPath), O_RDWR);
+		lseek(fd, sizeof(SequentialFileSlotHeader) + 1, SEEK_SET);
+		write(fd, "x", 1);
+		close(fd);
+		assertInt("", sf.openSlot(1, NULL), -1);
+
+		SequentialFileSlotHeader hdr = SequentialFileSlotHeader();
+		hdr.magic = SequentialFile::SLOT_MAGIC;
+		hdr.version = 1;
+		hdr.headerSize = sizeof(SequentialFileSlotHeader);
+		hdr.state = SequentialFile::SLOT_STATE_FULL;
+		hdr.fileNum = 2;
+		hdr.dataLen = 5;
+		hdr.crc = SequentialFile::crc32(&hdr, offsetof(SequentialFileSlotHeader, crc));
+		fd = open(String::format("%s/slot0002", queueDirPath), O_RDWR);
+		write(fd, &hdr, sizeof(hdr));
+		write(fd, "old2", 5);
+		close(fd);
+	}
+	{
+		SequentialFile sf;
+		sf.withDirPath(queueDirPath);
+		sf.withSlotRecycling(4);
+		sf.scanDir();
+		assertFileQueue(sf, {1, 2}, __LINE__);
+		assertInt("", sf.openSlot(1, NULL), -1);
+		assertStr("", readSlotString(sf, 2), "old2");
+		sf.removeAll(true);
+	}
+
+	// Writes that fail because the file system is full
+	int emptyFailedFileNum;
+	{
+		SequentialFile sf;
+		sf.withDirPath(queueDirPath);
+		sf.withSlotRecycling(4);
+		sf.scanDir();
+		emptyFailedFileNum = writeSlotFileNum(sf);
+
+		HostSim::setFsFull(true);
+		int fileNum = sf.reserveFile();
+		assertInt("", sf.writeSlot(fileNum, "data", 5), 0);
+		assertInt("", sf.openSlot(fileNum, NULL), -1);
+
+		assertInt("", sf.getFileFromQueue(), emptyFailedFileNum);
+		sf.removeFileNum(emptyFailedFileNum, false);
+		HostSim::setFsFull(false);
+	}
+	{
+		// The slot that could not be emptied is still full, so its file number is queued again
+		SequentialFile sf;
+		sf.withDirPath(queueDirPath);
+		sf.withSlotRecycling(4);
+		sf.scanDir();
+		assertFileQueue(sf, {emptyFailedFileNum}, __LINE__);
+		sf.removeAll(true);
+	}
+
+	// Files from before slot recycling was turned on are moved into slots
+	{
+		SequentialFile sf;
+		sf.withDirPath(queueDirPath);
+		sf.withFilenameExtension("dat");
+		sf.scanDir();
+		for(int ii = 0; ii < 3; ii++) {
+			int fileNum = sf.reserveFile();
+			int fd = open(sf.getPathForFileNum(fileNum), O_RDWR | O_CREAT);
+			String data = String::format("file%d", fileNum);
+			write(fd, data.c_str(), data.length() + 1);
+			close(fd);
+			sf.addFileToQueue(fileNum);
+		}
+	}
+	{
+		SequentialFile sf;
+		sf.withDirPath(queueDirPath);
+		sf.withFilenameExtension("dat");
+		sf.withSlotRecycling(4);
+		sf.scanDir();
+		assertFileQueue(sf, {1, 2, 3}, __LINE__);
+		assertStr("", readSlotString(sf, 1), "file1");
+		assertStr("", readSlotString(sf, 3), "file3");
+		assertInt("", fileExists(String::format("%s/00000001.dat", queueDirPath)), 0);
+	}
+
+	// Turning slot recycling off and on again moves the files written in between
+	{
+		SequentialFile sf;
+		sf.withDirPath(queueDirPath);
+		sf.withFilenameExtension("dat");
+		sf.scanDir();
+		int fd = open(sf.getPathForFileNum(sf.reserveFile()), O_RDWR | O_CREAT);
+		write(fd, "file4", 6);
+		close(fd);
+	}
+	{
+		SequentialFile sf;
+		sf.withDirPath(queueDirPath);
+		sf.withFilenameExtension("dat");
+		sf.withSlotRecycling(4);
+		sf.scanDir();
+		assertFileQueue(sf, {1, 2, 3, 4}, __LINE__);
+		assertStr("", readSlotString(sf, 4), "file4");
+		sf.removeAll(true);
+	}
+}
+
+void sequentialFilePathTest() {
+	char buf[SequentialFile::PATH_BUF_SIZE];
+
+	SequentialFile sf;
+	sf.withDirPath("/usr/pathtest/");
+	sf.withFilenameExtension("dat");
+
+	// The buffer versions match the String versions
+	assertInt("", sf.getNameForFileNum(12, NULL, buf, sizeof(buf)), 1);
+	assertStr("", buf, "00000012.dat");
+	assertStr("", buf, sf.getNameForFileNum(12));
+	assertInt("", sf.getPathForFileNum(12, "sha1", buf, sizeof(buf)), 1);
+	assertStr("", buf, "/usr/pathtest/00000012.sha1");
+	assertStr("", buf, sf.getPathForFileNum(12, "sha1"));
+	assertInt("", sf.getPathForFileNum(12, "", buf, sizeof(buf)), 1);
+	assertStr("", buf, "/usr/pathtest/00000012");
+
+	// Too small a buffer is truncated and null terminated
+	memset(buf, 'x', sizeof(buf));
+	assertInt("", sf.getPathForFileNum(12, NULL, buf, 18), 0);
+	assertStr("", buf, "/usr/pathtest/000");
+	assertInt("", sf.getNameForFileNum(12, NULL, buf, 12), 0);
+	assertStr("", buf, "00000012.da");
+
+	// A buffer of PATH_BUF_SIZE holds the longest directory path and filename
+	String longDir = "/";
+	while(longDir.length() < SEQUENTIALFILE_MAX_DIR_PATH) {
+		longDir += "d";
+	}
+	SequentialFile sf2;
+	sf2.withDirPath(longDir);
+	sf2.withPattern("%027d");
+	assertInt("", sf2.getPathForFileNum(1, "ext", buf, sizeof(buf)), 1);
+	assertInt("", (int)strlen(buf), (int)sizeof(buf) - 1);
+}
+
+/**
+ * @brief With withSlotRecycling(), events survive a reboot in order, and the oldest are discarded
+ * when the queue is full
+ */
+void slotRecyclingTest() {
+	cleanQueueDir();
+	HostSim::reset();
+
+	{
+		TestQueue q;
+		q.withSlotRecycling();
+		q.withFileQueueSize(5);
+		q.setup();
+		for(int ii = 0; ii < 10; ii++) {
+			publishCounter(q, ii);
+		}
+		assertInt("", (int)q.getNumEvents(), 5);
+	}
+
+	HostSim::fsCounters() = HostFsCounters();
+	TestQueue q;
+	q.withSlotRecycling();
+	q.withFileQueueSize(5);
+	q.setup();
+	assertInt("", (int)HostSim::fsCounters().creates, 0);
+	assertInt("", (int)q.getNumEvents(), 5);
+
+	HostSim::setConnected(true);
+	q.runUntilEmpty(60000);
+	assertInt("", (int)HostSim::fsCounters().dirMutations(), 0);
+
+	const std::vector<HostPublishRecord> &published = HostSim::getPublished();
+	assertInt("", (int)published.size(), 5);
+	for(int ii = 0; ii < 5; ii++) {
+		std::vector<int> counters;
+		getCounters(published[ii].eventData, counters);
+		assertInt("", counters[0], ii + 5);
+	}
+}
+
+void manifestTest() {
+	cleanQueueDir();
+	HostSim::reset();
+
+	{
+		TestQueue q;
+		q.withQueueManifest();
+		q.setup();
+		for(int ii = 0; ii < 10; ii++) {
+			publishCounter(q, ii);
+		}
+	}
+
+	// Simulate a reboot: the queue is loaded from the manifest without reading the directory
+	{
+		HostSim::fsCounters() = HostFsCounters();
+		TestQueue q;
+		q.withQueueManifest();
+		q.setup();
+		assertInt("", (int)HostSim::fsCounters().dirScans, 0);
+		assertInt("", (int)q.getNumEvents(), 10);
+
+		// An event file written while the manifest is not in use, like a reset right after 
+		// writing the file and before updating the manifest
+		TestQueue q2;
+		q2.setup();
+		publishCounter(q2, 10);
+	}
+	{
+		HostSim::fsCounters() = HostFsCounters();
+		TestQueue q;
+		q.withQueueManifest();
+		q.setup();
+		assertInt("", (int)HostSim::fsCounters().dirScans, 0);
+		assertInt("", (int)q.getNumEvents(), 11);
+	}
+
+	// A damaged manifest falls back to reading the directory
+	String manifestPath = String(queueDirPath) + "/manifest";
+	int fd = open(manifestPath, O_RDWR);
+	lseek(fd, 8, SEEK_SET);
+	write(fd, "\xff", 1);
+	close(fd);
+
+	HostSim::fsCounters() = HostFsCounters();
+	TestQueue q;
+	q.withQueueManifest();
+	q.setup();
+	assertInt("", (int)HostSim::fsCounters().dirScans > 0, 1);
+	assertInt("", (int)q.getNumEvents(), 11);
+
+	HostSim::setConnected(true);
+	q.runUntilEmpty(120000);
+
+	const std::vector<HostPublishRecord> &published = HostSim::getPublished();
+	assertInt("", (int)published.size(), 11);
+	for(int ii = 0; ii < 11; ii++) {
+		std::vector<int> counters;
+		getCounters(published[ii].eventData, counters);
+		assertInt("", counters[0], ii);
+	}
+}
+
+void manifestCheckpointTest() {
+	cleanQueueDir();
+	HostSim::reset();
+
+	{
+		TestQueue q;
+		q.withQueueManifest();
+		q.setup();
+		for(int ii = 0; ii < 10; ii++) {
+			publishCounter(q, ii);
+		}
+
+		// The manifest is only written at a checkpoint, not for each event
+		HostSim::fsCounters() = HostFsCounters();
+		publishCounter(q, 10);
+		assertInt("", (int)HostSim::fsCounters().writes, 1);
+		q.prepareForSleep();
+		assertInt("", (int)HostSim::fsCounters().writes, 2);
+		q.prepareForSleep();
+		assertInt("", (int)HostSim::fsCounters().writes, 2);
+
+		// Send the 11 events and 2 more, then queue one while offline, all after the checkpoint.
+		// The device then resets without saving the manifest.
+		HostSim::setConnected(true);
+		q.runUntilEmpty(120000);
+		publishCounter(q, 11);
+		publishCounter(q, 12);
+		q.runUntilEmpty(120000);
+		HostSim::setConnected(false);
+		publishCounter(q, 13);
+		assertInt("", (int)HostSim::getPublished().size(), 13);
+	}
+
+	// The sent events are dropped from the front and the one after the gap is found
+	{
+		HostSim::reset();
+		HostSim::fsCounters() = HostFsCounters();
+		TestQueue q;
+		q.withQueueManifest();
+		q.setup();
+		assertInt("", (int)HostSim::fsCounters().dirScans, 0);
+		assertInt("", (int)q.getNumEvents(), 1);
+
+		HostSim::setConnected(true);
+		q.runUntilEmpty(120000);
+
+		const std::vector<HostPublishRecord> &published = HostSim::getPublished();
+		assertInt("", (int)published.size(), 1);
+		std::vector<int> counters;
+		getCounters(published[0].eventData, counters);
+		assertInt("", counters[0], 13);
+		assertInt("", (int)q.getMetrics().numCorrupted, 0);
+	}
+}
+
+void logStoreWrapTest() {
+	cleanQueueDir();
+	HostSim::reset();
+
+	TestQueue q;
+	q.withLogStore(2, 1024);
+	q.setup();
+
+	// Each record is 211 bytes, so 4 fit in a 1024 byte segment. Moving back to the
+	// first segment discards the 4 events in it.
+	for(int ii = 0; ii < 12; ii++) {
+		publishCounter(q, 100 + ii);
+	}
+	assertInt("", (int)q.getNumEvents(), 8);
+
+	HostSim::setConnected(true);
+	q.runUntilEmpty(120000);
+	assertInt("", (int)HostSim::getPublished().size(), 8);
+	assertInt("", strncmp(HostSim::getPublished()[0].eventData + 12, "104,", 4), 0);
+	assertInt("", strncmp(HostSim::getPublished()[7].eventData + 12, "111,", 4), 0);
+}
+
+void logStoreRecoveryTest() {
+	char path[256];
+	snprintf(path, sizeof(path), "%s/cursor", queueDirPath);
+
+	for(int damage = 0; damage < 2; damage++) {
+		cleanQueueDir();
+		HostSim::reset();
+
+		{
+			TestQueue q;
+			q.withLogStore(2, 1024);
+			q.setup();
+
+			// 4 records per segment, so the queue wraps around into the first segment
+			for(int ii = 0; ii < 12; ii++) {
+				publishCounter(q, 100 + ii);
+			}
+			assertInt("", (int)q.getNumEvents(), 8);
+		}
+
+		if (damage) {
+			// Bad CRC
+			int fd = open(path, O_RDWR);
+			assertInt("", fd >= 0, true);
+			lseek(fd, 12, SEEK_SET);
+			write(fd, "xx", 2);
+			close(fd);
+		}
+		else {
+			unlink(path);
+		}
+
+		// The queue is rebuilt from the records in the segments
+		TestQueue q;
+		q.withLogStore(2, 1024);
+		q.setup();
+		assertInt("", (int)q.getNumEvents(), 8);
+
+		HostSim::setConnected(true);
+		q.runUntilEmpty(120000);
+		assertInt("", (int)HostSim::getPublished().size(), 8);
+		for(int ii = 0; ii < 8; ii++) {
+			char expected[16];
+			snprintf(expected, sizeof(expected), "%d,", 104 + ii);
+			assertInt("", strncmp(HostSim::getPublished()[ii].eventData + 12, expected, strlen(expected)), 0);
+		}
+	}
+}
+
+void logStoreFullTest() {
+	cleanQueueDir();
+	HostSim::reset();
+
+	{
+		TestQueue q;
+		q.withLogStore(4, 4096);
+		q.setup();
+
+		publishCounter(q, 1);
+
+		// Events that can't be written are lost, but must not leave a gap in the log
+		HostSim::setFsFull(true);
+		publishCounter(q, 2);
+		publishCounter(q, 3);
+		assertInt("", (int)q.getNumEvents(), 1);
+
+		HostSim::setFsFull(false);
+		publishCounter(q, 4);
+		assertInt("", (int)q.getNumEvents(), 2);
+	}
+
+	TestQueue q;
+	q.withLogStore(4, 4096);
+	q.setup();
+	assertInt("", (int)q.getNumEvents(), 2);
+
+	HostSim::setConnected(true);
+	q.runUntilEmpty(120000);
+	assertInt("", (int)HostSim::getPublished().size(), 2);
+	assertInt("", strncmp(HostSim::getPublished()[0].eventData + 12, "1,", 2), 0);
+	assertInt("", strncmp(HostSim::getPublished()[1].eventData + 12, "4,", 2), 0);
+}
+
+void batchFileQueueTest() {
+	cleanQueueDir();
+	HostSim::reset();
+
+	TestQueue q;
+	q.withMaxBatchSize(5);
+	q.setup();
+
+	for(int ii = 0; ii < 12; ii++) {
+		publishCounter(q, ii);
+	}
+	assertInt("", (int)q.getNumEvents(), 12);
+
+	// The first batch fails: none of the events in it are removed
+	HostSim::setPublishFailCount(1);
+	HostSim::setConnected(true);
+	while(HostSim::getPublished().empty()) {
+		q.run(1);
+	}
+	q.run(1000);
+	assertInt("", (int)HostSim::getPublished().size(), 1);
+	assertInt("", HostSim::getPublished()[0].succeeded, false);
+	assertInt("", (int)q.getNumEvents(), 12);
+
+	// Then batches of 5, 5, and 2 each retire all of their events
+	q.runUntilEmpty(120000);
+	assertInt("", (int)q.getNumEvents(), 0);
+
+	const std::vector<HostPublishRecord> &published = HostSim::getPublished();
+	assertInt("", (int)published.size(), 4);
+
+	std::vector<int> counters;
+	assertInt("", getCounters(published[0].eventData, counters), 5);
+	counters.clear();
+
+	const int expectedSize[3] = {5, 5, 2};
+	for(int ii = 0; ii < 3; ii++) {
+		assertInt("", published[ii + 1].succeeded, true);
+		assertInt("", published[ii + 1].eventData[0], '[');
+		assertInt("", getCounters(published[ii + 1].eventData, counters), expectedSize[ii]);
+	}
+	assertInt("", (int)counters.size(), 12);
+	for(int ii = 0; ii < 12; ii++) {
+		assertInt("", counters[ii], ii);
+	}
+}
+
+void batchRamQueueTest() {
+	cleanQueueDir();
+	HostSim::reset();
+
+	TestQueue q;
+	q.withRamQueueSize(10);
+	q.withMaxBatchSize(5);
+	q.setup();
+
+	HostSim::setConnected(true);
+	q.run(100);
+
+	// Connected, so these stay in the RAM queue
+	for(int ii = 0; ii < 3; ii++) {
+		publishCounter(q, ii);
+	}
+
+	// The batch is in flight: the events are counted, but not in the RAM queue
+	HostSim::setPublishFailCount(1);
+	while(HostSim::getPublished().empty()) {
+		q.run(1);
+	}
+	assertInt("", (int)q.getNumEvents(), 3);
+	std::vector<int> counters;
+	assertInt("", getCounters(HostSim::getPublished()[0].eventData, counters), 3);
+
+	// After the failure, the original events are put back and moved to files
+	q.run(1000);
+	assertInt("", (int)q.getNumEvents(), 3);
+
+	q.runUntilEmpty(120000);
+	const std::vector<HostPublishRecord> &published = HostSim::getPublished();
+	assertInt("", (int)published.size(), 2);
+	assertInt("", published[1].succeeded, true);
+	counters.clear();
+	assertInt("", getCounters(published[1].eventData, counters), 3);
+	for(int ii = 0; ii < 3; ii++) {
+		assertInt("", counters[ii], ii);
+	}
+}
+
+void batchLogStoreTest() {
+	cleanQueueDir();
+	HostSim::reset();
+
+	TestQueue q;
+	q.withLogStore(4, 4096);
+	q.withMaxBatchSize(10);
+	q.setup();
+
+	// A different event name ends a batch
+	for(int ii = 0; ii < 12; ii++) {
+		publishCounter(q, ii);
+	}
+	q.publish("status", "{\"a\":1}", PRIVATE);
+	publishCounter(q, 12);
+
+	HostSim::setConnected(true);
+	q.runUntilEmpty(120000);
+	assertInt("", (int)q.getNumEvents(), 0);
+
+	// Each event is 132 bytes, so only 7 fit in MAX_EVENT_DATA_LENGTH
+	const std::vector<HostPublishRecord> &published = HostSim::getPublished();
+	assertInt("", (int)published.size(), 4);
+
+	std::vector<int> counters;
+	assertInt("", getCounters(published[0].eventData, counters), 7);
+	assertInt("", getCounters(published[1].eventData, counters), 5);
+	assertStr("", published[2].eventName, "status");
+	assertStr("", published[2].eventData, "{\"a\":1}");
+	assertInt("", getCounters(published[3].eventData, counters), 1);
+	assertInt("", published[3].eventData[0], '{');
+	for(int ii = 0; ii < 13; ii++) {
+		assertInt("", counters[ii], ii);
+	}
+}
+
+/**
+ * @brief Check the counters of the successful publishes since HostSim::reset(), in the order received
+ */
+void assertSucceededCounters(const std::vector<int> &expected, int line) {
+	const std::vector<HostPublishRecord> &published = HostSim::getPublished();
+	std::vector<int> counters;
+	for(size_t ii = 0; ii < published.size(); ii++) {
+		if (published[ii].succeeded) {
+			getCounters(published[ii].eventData, counters);
+		}
+	}
+	if (counters != expected) {
+		printf("got:");
+		for(size_t ii = 0; ii < counters.size(); ii++) {
+			printf(" %d", counters[ii]);
+		}
+		printf("\n");
+	}
+	_assertInt("", counters == expected, true, line);
+}
+
+void pipelineTest() {
+	cleanQueueDir();
+	HostSim::reset();
+	HostSim::setPublishLatencyMs(3000);
+
+	{
+		TestQueue q;
+		q.withMaxInFlight(4);
+		q.setup();
+		assertInt("", (int)BackgroundPublishRK::instance().getNumSlots(), 4);
+
+		for(int ii = 0; ii < 12; ii++) {
+			publishCounter(q, ii);
+		}
+
+		// Publishes are started 1 second apart without waiting for the 3 second acknowledgement
+		HostSim::setConnected(true);
+		q.run(5500);
+		assertInt("", (int)BackgroundPublishRK::instance().getNumBusySlots(), 3);
+
+		q.runUntilEmpty(120000);
+
+		const std::vector<HostPublishRecord> &published = HostSim::getPublished();
+		assertInt("", (int)published.size(), 12);
+		std::vector<int> counters;
+		for(size_t ii = 0; ii < published.size(); ii++) {
+			getCounters(published[ii].eventData, counters);
+		}
+		for(int ii = 0; ii < 12; ii++) {
+			assertInt("", counters[ii], ii);
+		}
+	}
+
+	for(int useLog = 0; useLog < 2; useLog++) {
+		// A failure stops new publishes even while older ones are still waiting
+		cleanQueueDir();
+		HostSim::reset();
+		HostSim::setPublishLatencyMs(5000);
+
+		{
+			TestQueue q;
+			q.withMaxInFlight(4);
+			if (useLog) {
+				q.withLogStore(4, 4096);
+			}
+			q.setup();
+
+			for(int ii = 0; ii < 12; ii++) {
+				publishCounter(q, ii);
+			}
+			HostSim::setConnected(true);
+			while(HostSim::getPublished().size() < 1) {
+				q.run(1);
+			}
+			HostSim::setPublishLatencyMs(500);
+			HostSim::setPublishFailCount(1);
+			q.run(3000);
+			assertInt("", (int)HostSim::getPublished().size(), 2);
+			assertInt("", HostSim::getPublished()[1].succeeded, false);
+
+			q.runUntilEmpty(300000);
+			assertInt("", (int)q.getNumEvents(), 0);
+			assertSucceededCounters({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11}, __LINE__);
+		}
+
+		// When the oldest publish fails, the ones started after it that succeeded are not sent again
+		cleanQueueDir();
+		HostSim::reset();
+		HostSim::setPublishLatencyMs(5000);
+
+		{
+			TestQueue q;
+			q.withMaxInFlight(4);
+			if (useLog) {
+				q.withLogStore(4, 4096);
+			}
+			q.setup();
+
+			for(int ii = 0; ii < 12; ii++) {
+				publishCounter(q, ii);
+			}
+			HostSim::setPublishFailCount(1);
+			HostSim::setConnected(true);
+			while(HostSim::getPublished().size() < 1) {
+				q.run(1);
+			}
+			HostSim::setPublishLatencyMs(500);
+
+			q.runUntilEmpty(300000);
+			assertInt("", (int)q.getNumEvents(), 0);
+			assertSucceededCounters({1, 2, 3, 0, 4, 5, 6, 7, 8, 9, 10, 11}, __LINE__);
+		}
+	}
+
+	// Events from the RAM queue that succeeded after the oldest failed are in the latency histogram
+	cleanQueueDir();
+	HostSim::reset();
+	HostSim::setPublishLatencyMs(5000);
+
+	{
+		TestQueue q;
+		q.withMaxInFlight(4);
+		q.withRamQueueSize(10);
+		q.setup();
+		HostSim::setConnected(true);
+		q.run(100);
+
+		for(int ii = 0; ii < 4; ii++) {
+			publishCounter(q, ii);
+		}
+		HostSim::setPublishFailCount(1);
+		while(HostSim::getPublished().size() < 1) {
+			q.run(1);
+		}
+		HostSim::setPublishLatencyMs(500);
+
+		q.runUntilEmpty(300000);
+		assertSucceededCounters({1, 2, 3, 0}, __LINE__);
+
+		const PublishQueueMetrics &m = q.getMetrics();
+		int latencyTotal = 0;
+		for(size_t ii = 0; ii < PublishQueueMetrics::NUM_LATENCY_BUCKETS; ii++) {
+			latencyTotal += (int)m.latency[ii];
+		}
+		assertInt("", (int)m.numAcked, 4);
+		assertInt("", latencyTotal, 4);
+	}
+}
+
+void priorityTest() {
+	for(int useLog = 0; useLog < 2; useLog++) {
+		cleanQueueDir();
+		HostSim::reset();
+
+		TestQueue q;
+		q.withFileQueueSize(20);
+		q.withPriorityRule("Alert", 2);
+		if (useLog) {
+			q.withLogStore();
+		}
+		q.setup();
+		assertInt("", q.getPriorityForEvent("Alert_Hook"), 2);
+		assertInt("", q.getPriorityForEvent("Ubidots_Level_Hook_v1"), 0);
+
+		// Queued offline: routine events, then an alert by rule and a marker by explicit priority
+		for(int ii = 0; ii < 30; ii++) {
+			publishCounter(q, ii);
+		}
+		q.publish("Alert_Hook", "{\"alert\":1}", PRIVATE | WITH_ACK);
+		q.publishWithPriority(1, "Daily Cleanup", "Running", PRIVATE);
+
+		// The oldest routine events are discarded to make room
+		assertInt("", (int)q.getQueueDepth(2), 1);
+		assertInt("", (int)q.getQueueDepth(1), 1);
+		assertInt("", (int)q.getQueueDepth(0), 18);
+		assertInt("", (int)q.getNumEvicted(0), 12);
+		assertInt("", (int)q.getNumEvicted(1), 0);
+		assertInt("", (int)q.getNumEvicted(2), 0);
+
+		// Higher priorities are sent first after connecting
+		q.run(1000);
+		uint32_t connectTime = millis();
+		HostSim::setConnected(true);
+		q.runUntilEmpty(120000);
+
+		const std::vector<HostPublishRecord> &published = HostSim::getPublished();
+		assertInt("", (int)published.size(), 20);
+		assertStr("", published[0].eventName, "Alert_Hook");
+		assertInt("", published[0].timeMs - connectTime <= 3000, 1);
+		assertStr("", published[1].eventName, "Daily Cleanup");
+		for(int ii = 0; ii < 18; ii++) {
+			std::vector<int> counters;
+			assertInt("", getCounters(published[2 + ii].eventData, counters), 1);
+			assertInt("", counters[0], 12 + ii);
+		}
+
+		// Only higher priority events left, so they are discarded oldest first
+		HostSim::setConnected(false);
+		q.withFileQueueSize(2);
+		for(int ii = 0; ii < 3; ii++) {
+			q.publish("Alert_Hook", "{\"alert\":1}", PRIVATE | WITH_ACK);
+		}
+		assertInt("", (int)q.getQueueDepth(2), 2);
+		assertInt("", (int)q.getNumEvicted(2), 1);
+		q.clearQueues();
+	}
+}
+
+void burstDrainTest() {
+	cleanQueueDir();
+	HostSim::reset();
+	HostSim::setPublishLatencyMs(500);
+
+	TestQueue q;
+	q.withMaxInFlight(4);
+	q.setup();
+
+	for(int ii = 0; ii < 20; ii++) {
+		publishCounter(q, ii);
+	}
+	HostSim::setConnected(true);
+	q.run(10);
+	unsigned long estimateMs = q.startBurstDrain();
+	assertInt("", q.getBurstDrain(), 1);
+	uint32_t ms = q.runUntilEmpty(120000);
+	assertInt("", q.getBurstDrain(), 0);
+
+	// All sent in order, never more than PUBLISHQUEUE_BURST_SIZE in any second
+	const std::vector<HostPublishRecord> &published = HostSim::getPublished();
+	assertInt("", (int)published.size(), 20);
+	for(int ii = 0; ii < 20; ii++) {
+		std::vector<int> counters;
+		getCounters(published[ii].eventData, counters);
+		assertInt("", counters[0], ii);
+	}
+	assertInt("", published[PUBLISHQUEUE_BURST_SIZE - 1].timeMs - published[0].timeMs < 1000, 1);
+	for(size_t ii = PUBLISHQUEUE_BURST_SIZE; ii < published.size(); ii++) {
+		assertInt("", published[ii].timeMs - published[ii - PUBLISHQUEUE_BURST_SIZE].timeMs >= 1000, 1);
+	}
+
+	// The estimate is close
+	assertInt("", estimateMs > ms * 3 / 4 && estimateMs < ms * 5 / 4, 1);
+	assertInt("", (int)q.getTimeToEmptyMs(), 0);
+
+	// Burst drain mode does nothing when the queue is empty
+	q.startBurstDrain();
+	assertInt("", q.getBurstDrain(), 0);
+}
+
+void adaptiveRetryTest() {
+	cleanQueueDir();
+	HostSim::reset();
+	HostSim::setPublishLatencyMs(800);
+
+	TestQueue q;
+	q.withAdaptiveRetry(15000, 120000, 8000);
+	q.setup();
+	assertInt("", (int)q.getPublishGapMs(), 1000);
+	assertInt("", (int)q.getFailureWaitMs(), 15000);
+
+	HostSim::setConnected(true);
+	q.run(3000);
+
+	// A quick failure looks like throttling, so the gap between publishes is increased
+	HostSim::setPublishFailCount(1);
+	publishCounter(q, 0);
+	q.run(1000);
+	assertInt("", q.getPublishGapMs() >= 2000, 1);
+	q.runUntilEmpty(60000);
+
+	// Lost publishes time out; the wait after each failure doubles up to the limit
+	HostSim::setPublishLoss(1.0, 20000);
+	size_t firstAttempt = HostSim::getPublished().size();
+	publishCounter(q, 1);
+	q.run(460000, 10);
+	const std::vector<HostPublishRecord> &published = HostSim::getPublished();
+	assertInt("", (int)(published.size() - firstAttempt), 6);
+	const uint32_t expectedWaits[] = { 15000, 30000, 60000, 120000, 120000 };
+	for(size_t ii = 0; ii < 5; ii++) {
+		uint32_t waitMs = published[firstAttempt + ii + 1].timeMs - published[firstAttempt + ii].timeMs - 20000;
+		assertInt("", waitMs >= expectedWaits[ii] && waitMs < expectedWaits[ii] + 100, 1);
+	}
+	assertInt("", q.getFailureRate() > 400, 1);
+	assertInt("", q.getPublishGapMs() > 2000, 1);
+
+	// Recovers once publishes succeed
+	HostSim::setPublishLoss(0);
+	q.runUntilEmpty(300000);
+	assertInt("", (int)q.getFailureWaitMs(), 15000);
+	std::vector<int> counters;
+	getCounters(published.back().eventData, counters);
+	assertInt("", counters[0], 1);
+	for(int ii = 0; ii < 20; ii++) {
+		publishCounter(q, 2 + ii);
+	}
+	q.runUntilEmpty(300000);
+	assertInt("", q.getFailureRate() < 100, 1);
+	assertInt("", (int)q.getPublishGapMs() < 2000, 1);
+}
+
+void metricsTest() {
+	cleanQueueDir();
+	HostSim::reset();
+	HostSim::setPublishLatencyMs(500);
+
+	TestQueue q;
+	q.withFileQueueSize(4);
+	q.setup();
+
+	// Offline: 6 events, the oldest 2 are discarded, and the next one is damaged
+	for(int ii = 0; ii < 6; ii++) {
+		publishCounter(q, ii);
+	}
+	int fd = open(String(queueDirPath) + "/00000003", O_RDWR);
+	write(fd, "\xff", 1);
+	close(fd);
+
+	PublishQueueMetrics m = q.getMetrics();
+	assertInt("", (int)m.filesWritten, 6);
+	assertInt("", m.bytesWritten > 6 * 200, 1);
+	assertInt("", (int)m.numEvicted, 2);
+	assertInt("", (int)m.maxQueueDepth, 4);
+
+	q.run(20000);
+	HostSim::setConnected(true);
+	q.runUntilEmpty(120000);
+	assertInt("", (int)HostSim::getPublished().size(), 3);
+
+	m = q.getMetrics();
+	assertInt("", (int)m.numCorrupted, 1);
+	assertInt("", (int)m.numAcked, 3);
+	assertInt("", (int)m.numAttempts, 3);
+	assertInt("", (int)m.numFailures, 0);
+	// Waited 20 seconds offline, plus the time to send
+	assertInt("", (int)m.latency[2], 3);
+
+	// A failed publish is retried after waitAfterFailure (30 seconds)
+	q.resetMetrics();
+	HostSim::setPublishFailCount(1);
+	publishCounter(q, 6);
+	q.runUntilEmpty(120000);
+	m = q.getMetrics();
+	assertInt("", (int)m.numAcked, 1);
+	assertInt("", (int)m.numAttempts, 2);
+	assertInt("", (int)m.numFailures, 1);
+	assertInt("", (int)m.latency[3], 1);
+	assertInt("", (int)m.filesWritten, 1);
+
+	char buf[256];
+	q.formatMetrics(buf, sizeof(buf));
+	assertStr("", buf, String::format("{\"lat\":[0,0,0,1,0,0,0,0],\"ack\":1,\"att\":2,\"fail\":1,\"files\":1,\"bytes\":%u,\"evict\":0,\"bad\":0,\"sup\":0,\"exp\":0,\"max\":1}", (unsigned int)m.bytesWritten).c_str());
+
+	// Sent as a diagnostic event, then reset
+	q.withDiagnosticEvent("pubqDiag", 60000);
+	q.run(60000);
+	q.runUntilEmpty(120000);
+	const std::vector<HostPublishRecord> &published = HostSim::getPublished();
+	assertStr("", published.back().eventName, "pubqDiag");
+	assertStr("", published.back().eventData, buf);
+	assertInt("", (int)q.getMetrics().numAcked, 1);
+	q.withDiagnosticEvent(NULL);
+
+	// An event file that can't be written is not counted or queued, and is removed
+	HostSim::setConnected(false);
+	q.resetMetrics();
+	HostSim::setFsFull(true);
+	publishCounter(q, 8);
+	HostSim::setFsFull(false);
+	m = q.getMetrics();
+	assertInt("", (int)m.filesWritten, 0);
+	assertInt("", (int)m.bytesWritten, 0);
+	assertInt("", (int)q.getNumEvents(), 0);
+
+	SequentialFile sf;
+	sf.withDirPath(queueDirPath);
+	sf.scanDir();
+	assertInt("", sf.getQueueLen(), 0);
+}
+
+void groupCommitTest() {
+	for(int useLog = 0; useLog < 2; useLog++) {
+		cleanQueueDir();
+		HostSim::reset();
+
+		TestQueue q;
+		q.withGroupCommit(10, 60000);
+		if (useLog) {
+			q.withLogStore();
+		}
+		q.setup();
+		HostSim::fsCounters() = HostFsCounters();
+
+		// Held in RAM until there are 10 events
+		for(int ii = 0; ii < 9; ii++) {
+			publishCounter(q, ii);
+		}
+		assertInt("", (int)q.getNumEvents(), 9);
+		assertInt("", (int)HostSim::fsCounters().writes, 0);
+		publishCounter(q, 9);
+		size_t writes = HostSim::fsCounters().writes;
+		assertInt("", writes > 0, 1);
+
+		// Or until the oldest has waited maxAgeMs
+		publishCounter(q, 10);
+		q.run(59000);
+		assertInt("", (int)(HostSim::fsCounters().writes - writes), 0);
+		q.run(2000);
+		assertInt("", HostSim::fsCounters().writes > writes, 1);
+
+		// Written before a reset and before sleep
+		writes = HostSim::fsCounters().writes;
+		publishCounter(q, 11);
+		publishCounter(q, 12);
+		HostSim::fireSystemEvent(reset, 0);
+		assertInt("", HostSim::fsCounters().writes > writes, 1);
+
+		writes = HostSim::fsCounters().writes;
+		publishCounter(q, 13);
+		publishCounter(q, 14);
+		q.prepareForSleep();
+		assertInt("", HostSim::fsCounters().writes > writes, 1);
+
+		// None lost, in order
+		HostSim::setConnected(true);
+		q.runUntilEmpty(120000);
+		const std::vector<HostPublishRecord> &published = HostSim::getPublished();
+		assertInt("", (int)published.size(), 15);
+		for(int ii = 0; ii < 15; ii++) {
+			std::vector<int> counters;
+			assertInt("", getCounters(published[ii].eventData, counters), 1);
+			assertInt("", counters[0], ii);
+		}
+
+		// Held events are sent from RAM if the device connects first, without being written
+		HostSim::setConnected(false);
+		writes = HostSim::fsCounters().writes;
+		for(int ii = 15; ii < 18; ii++) {
+			publishCounter(q, ii);
+		}
+		HostSim::setConnected(true);
+		q.runUntilEmpty(120000);
+		assertInt("", (int)published.size(), 18);
+		assertInt("", (int)(HostSim::fsCounters().writes - writes), 0);
+	}
+}
+
+/**
+ * @brief Publish an event from a compactEncodingTest() case and record the expected name and data
+ */
+void publishCompact(TestQueue &q, const char *eventName, const char *eventData, std::vector<String> &expected) {
+	q.publish(eventName, eventData, PRIVATE | WITH_ACK);
+	expected.push_back(String(eventName) + "/" + eventData);
+}
+
+void compactEncodingTest() {
+	static const char * const cases[][2] = {
+		{ "status", "{\"temp\":-3.25,\"rssi\":-71,\"ver\":\"1.2.3\",\"dash\":\"-\",\"neg\":\"--5\",\"dot\":\".5\"}" },
+		{ "Cellular", "" },
+		{ "Cellular", "no numbers here" },
+		{ "status", "{\"big\":123456789012345678901234567890,\"zero\":0,\"v2\":1e-7}" },
+		{ "marker", "a\x01" "b" },
+		{ "x", "1-2-3" },
+	};
+	const int numCases = sizeof(cases) / sizeof(cases[0]);
+
+	for(int useLog = 0; useLog < 2; useLog++) {
+		cleanQueueDir();
+		HostSim::reset();
+
+		std::vector<String> expected;
+		String stringsPath = String(queueDirPath) + "/strings";
+		struct stat sb;
+
+		// Events queued with compact encoding off are still read after turning it on
+		{
+			TestQueue q;
+			q.withFileQueueSize(400);
+			if (useLog) {
+				q.withLogStore();
+			}
+			q.setup();
+			publishCounter(q, 0);
+			expected.push_back("");
+		}
+		{
+			TestQueue q;
+			q.withFileQueueSize(400).withCompactEncoding();
+			if (useLog) {
+				q.withLogStore();
+			}
+			q.setup();
+			for(int ii = 1; ii < 5; ii++) {
+				publishCounter(q, ii);
+				expected.push_back("");
+			}
+			for(int ii = 0; ii < numCases; ii++) {
+				publishCompact(q, cases[ii][0], cases[ii][1], expected);
+			}
+
+			// More names than fit in the string table are stored in the event
+			for(int ii = 0; ii < 300; ii++) {
+				char name[16], data[32];
+				snprintf(name, sizeof(name), "ev%d", ii);
+				snprintf(data, sizeof(data), "{\"n\":%d}", ii);
+				publishCompact(q, name, data, expected);
+			}
+			assertInt("", stat(stringsPath, &sb), 0);
+		}
+
+		// Reboot, reading the string table, and send everything
+		{
+			TestQueue q;
+			q.withFileQueueSize(400).withCompactEncoding();
+			if (useLog) {
+				q.withLogStore();
+			}
+			q.setup();
+			assertInt("", (int)q.getNumEvents(), (int)expected.size());
+
+			HostSim::setConnected(true);
+			q.runUntilEmpty((uint32_t)expected.size() * 5000);
+			const std::vector<HostPublishRecord> &published = HostSim::getPublished();
+			assertInt("", (int)published.size(), (int)expected.size());
+			for(size_t ii = 0; ii < expected.size(); ii++) {
+				if (expected[ii].length() == 0) {
+					std::vector<int> counters;
+					assertInt("", getCounters(published[ii].eventData, counters), 1);
+					assertInt("", counters[0], (int)ii);
+					assertStr("", published[ii].eventName, "Ubidots_Level_Hook_v1");
+				}
+				else {
+					String got = String(published[ii].eventName) + "/" + published[ii].eventData;
+					assertStr("", got.c_str(), expected[ii].c_str());
+				}
+			}
+
+			// Once nothing stored refers to the string table it's cleared, without a reboot
+			q.run(10);
+			assertInt("", stat(stringsPath, &sb), -1);
+
+			// So new names are added to the table again instead of being stored in each event
+			HostSim::setConnected(false);
+			publishCompact(q, "newName", "{\"n\":1}", expected);
+			assertInt("", stat(stringsPath, &sb), 0);
+			assertInt("", sb.st_size < 64, 1);
+
+			HostSim::setConnected(true);
+			q.runUntilEmpty(60000);
+			assertStr("", HostSim::getPublished().back().eventName, "newName");
+		}
+
+		// The string table is removed at boot when no stored event refers to it
+		TestQueue q;
+		q.withCompactEncoding();
+		if (useLog) {
+			q.withLogStore();
+		}
+		q.setup();
+		assertInt("", stat(stringsPath, &sb), -1);
+	}
+}
+
+/**
+ * @brief Encode one event with PublishQueueCodec directly
+ */
+bool codecEncode(PublishQueueCodec &codec, const char *eventName, const char *eventData, std::vector<uint8_t> &buf) {
+	std::vector<uint8_t> mem(sizeof(PublishQueueEvent) + strlen(eventData), 0);
+	PublishQueueEvent *event = (PublishQueueEvent *)&mem[0];
+	event->flags = PRIVATE | WITH_ACK;
+	strcpy(event->eventName, eventName);
+	strcpy(event->eventData, eventData);
+	return codec.encode(event, buf);
+}
+
+void codecStringTableTest() {
+	cleanQueueDir();
+	HostSim::reset();
+	SequentialFile::createDirIfNecessary(queueDirPath);
+
+	String stringsPath = String(queueDirPath) + "/strings";
+	PublishQueueCodec codec;
+	codec.withPath(stringsPath);
+	codec.load();
+
+	// One template and 252 names, leaving room for one more string
+	std::vector<uint8_t> buf;
+	for(int ii = 0; ii < (int)PublishQueueCodec::MAX_STRINGS - 2; ii++) {
+		char name[16], data[32];
+		snprintf(name, sizeof(name), "ev%d", ii);
+		snprintf(data, sizeof(data), "{\"n\":%d}", ii);
+		assertInt("", codecEncode(codec, name, data, buf), 1);
+	}
+	assertInt("", (int)codec.getNumStrings(), (int)PublishQueueCodec::MAX_STRINGS - 1);
+	struct stat sb;
+	stat(stringsPath, &sb);
+	off_t tableSize = sb.st_size;
+
+	// The new name would fit, but not the new template, which is so long inline that the event
+	// is stored unencoded. Neither is added to the table, so the last entry is not wasted.
+	String data;
+	for(int ii = 0; ii < 100; ii++) {
+		data += "0,";
+	}
+	HostSim::fsCounters() = HostFsCounters();
+	size_t bufSize = buf.size();
+	assertInt("", codecEncode(codec, "unencoded", data, buf), 0);
+	assertInt("", (int)buf.size(), (int)bufSize);
+	assertInt("", (int)codec.getNumStrings(), (int)PublishQueueCodec::MAX_STRINGS - 1);
+	assertInt("", (int)HostSim::fsCounters().writes, 0);
+	stat(stringsPath, &sb);
+	assertInt("", (int)sb.st_size, (int)tableSize);
+
+	// So it's still available for an event that's smaller encoded
+	assertInt("", codecEncode(codec, "encoded", "{\"n\":1}", buf), 1);
+	assertInt("", (int)codec.getNumStrings(), (int)PublishQueueCodec::MAX_STRINGS);
+
+	codec.clear();
+}
+
+void supersedeTest() {
+	for(int useLog = 0; useLog < 2; useLog++) {
+		cleanQueueDir();
+		HostSim::reset();
+
+		TestQueue q;
+		q.withRamQueueSize(10);
+		if (useLog) {
+			q.withLogStore();
+		}
+		q.setup();
+		HostSim::fsCounters() = HostFsCounters();
+
+		// Offline, superseding the oldest event in the file queue and one in the middle
+		q.publishWithSupersedeKey("status", "status", "s1", PRIVATE);
+		publishCounter(q, 0);
+		q.publishWithSupersedeKey("status", "status", "s2", PRIVATE);
+		publishCounter(q, 1);
+		q.publishWithSupersedeKey("statusLong", "status", "L1", PRIVATE);
+		q.publishWithSupersedeKey("status", "status", "s3", PRIVATE);
+		publishCounter(q, 2);
+		assertInt("", (int)q.getNumEvents(), 5);
+		assertInt("", (int)q.getMetrics().numSuperseded, 2);
+		assertInt("", (int)HostSim::fsCounters().dirScans, 0);
+
+		HostSim::setConnected(true);
+		q.runUntilEmpty(120000);
+		const std::vector<HostPublishRecord> &published = HostSim::getPublished();
+		static const char * const expected[] = { "0", "1", "L1", "s3", "2" };
+		assertInt("", (int)published.size(), 5);
+		for(int ii = 0; ii < 5; ii++) {
+			if (strcmp(published[ii].eventName, "status") == 0) {
+				assertStr("", published[ii].eventData, expected[ii]);
+			}
+			else {
+				std::vector<int> counters;
+				assertInt("", getCounters(published[ii].eventData, counters), 1);
+				assertInt("", counters[0], atoi(expected[ii]));
+			}
+		}
+		assertInt("", (int)q.getMetrics().numAcked, 5);
+
+		// Superseded in the RAM queue
+		q.setPausePublishing(true);
+		q.publishWithSupersedeKey("status", "status", "s4", PRIVATE);
+		q.publishWithSupersedeKey("status", "status", "s5", PRIVATE);
+		assertInt("", (int)q.getQueueDepth(0), 1);
+		q.setPausePublishing(false);
+		q.runUntilEmpty(120000);
+		assertInt("", (int)published.size(), 6);
+		assertStr("", published[5].eventData, "s5");
+
+		// An event that is already being sent is not removed
+		HostSim::setPublishLatencyMs(10000);
+		q.publishWithSupersedeKey("status", "status", "s6", PRIVATE);
+		q.run(3000);
+		q.publishWithSupersedeKey("status", "status", "s7", PRIVATE);
+		q.runUntilEmpty(120000);
+		assertInt("", (int)published.size(), 8);
+		assertStr("", published[6].eventData, "s6");
+		assertStr("", published[7].eventData, "s7");
+		assertInt("", (int)q.getMetrics().numSuperseded, 3);
+
+		// An event that is put back after a failed publish can still be superseded
+		HostSim::setPublishLatencyMs(0);
+		HostSim::setPublishFailCount(1);
+		q.publishWithSupersedeKey("status", "status", "s8", PRIVATE);
+		while(published.size() < 9) {
+			q.run(1);
+		}
+		q.run(1000);
+		q.publishWithSupersedeKey("status", "status", "s9", PRIVATE);
+		assertInt("", (int)q.getNumEvents(), 1);
+		q.runUntilEmpty(120000);
+		assertInt("", (int)published.size(), 10);
+		assertInt("", published[8].succeeded, false);
+		assertStr("", published[9].eventData, "s9");
+		assertInt("", (int)q.getMetrics().numSuperseded, 4);
+	}
+}
+
+void expiryTest() {
+	for(int mode = 0; mode < 4; mode++) {
+		bool useLog = (mode & 1) != 0;
+		bool compact = (mode & 2) != 0;
+
+		cleanQueueDir();
+		HostSim::reset();
+		HostSim::setTime(1700000000);
+
+		// Offline, expiring the oldest event in the file queue and one in the middle
+		{
+			TestQueue q;
+			q.withTtlRule("diag", 600);
+			q.withCompactEncoding(compact);
+			if (useLog) {
+				q.withLogStore();
+			}
+			q.setup();
+
+			q.publish("diag", "d1", PRIVATE);
+			publishCounter(q, 0);
+			q.publishWithTtl(1800, "diag", "d2", PRIVATE);
+			publishCounter(q, 1);
+			q.publish("diag", "d3", PRIVATE);
+			publishCounter(q, 2);
+			assertInt("", (int)q.getNumEvents(), 6);
+
+			q.run(599000, 1000);
+			assertInt("", (int)q.getNumEvents(), 6);
+			q.run(2000, 1000);
+			assertInt("", (int)q.getNumEvents(), 4);
+			assertInt("", (int)q.getMetrics().numExpired, 2);
+
+			// Expires while the device is off
+			q.publishWithTtl(60, "diag", "d4", PRIVATE);
+			assertInt("", (int)q.getNumEvents(), 5);
+		}
+		HostSim::advance(120000);
+
+		{
+			TestQueue q;
+			q.withTtlRule("diag", 600);
+			q.withCompactEncoding(compact);
+			if (useLog) {
+				q.withLogStore();
+			}
+			q.setup();
+
+			// An expired event in the middle of the log store is only skipped, so it's back after 
+			// a reset, but is still not sent
+			assertInt("", (int)q.getNumEvents(), useLog ? 6 : 5);
+
+			HostSim::setConnected(true);
+			q.runUntilEmpty(120000);
+			const std::vector<HostPublishRecord> &published = HostSim::getPublished();
+			static const char * const expected[] = { "0", "d2", "1", "2" };
+			assertInt("", (int)published.size(), 4);
+			for(int ii = 0; ii < 4; ii++) {
+				if (strcmp(published[ii].eventName, "diag") == 0) {
+					assertStr("", published[ii].eventData, expected[ii]);
+				}
+				else {
+					std::vector<int> counters;
+					assertInt("", getCounters(published[ii].eventData, counters), 1);
+					assertInt("", counters[0], atoi(expected[ii]));
+				}
+			}
+			assertInt("", (int)q.getMetrics().numExpired, useLog ? 2 : 1);
+
+			// Expires in the RAM queue
+			q.setPausePublishing(true);
+			q.publishWithTtl(30, "diag", "r1", PRIVATE);
+			q.publish("diag2", "r2", PRIVATE);
+			assertInt("", (int)q.getQueueDepth(0), 2);
+			q.run(31000, 1000);
+			assertInt("", (int)q.getQueueDepth(0), 1);
+			assertInt("", (int)q.getMetrics().numExpired, useLog ? 3 : 2);
+			q.setPausePublishing(false);
+			q.runUntilEmpty(120000);
+			assertInt("", (int)published.size(), 5);
+			assertStr("", published[4].eventData, "r2");
+
+			// An event that is put back after a failed publish still expires
+			HostSim::setPublishFailCount(1);
+			q.publishWithTtl(60, "diag", "f1", PRIVATE);
+			while(published.size() < 6) {
+				q.run(1);
+			}
+			HostSim::setConnected(false);
+			q.run(61000, 1000);
+			assertInt("", (int)q.getNumEvents(), 0);
+			assertInt("", (int)q.getMetrics().numExpired, useLog ? 4 : 3);
+			HostSim::setConnected(true);
+			q.runUntilEmpty(120000);
+			assertInt("", (int)published.size(), 6);
+			assertInt("", published[5].succeeded, false);
+		}
+
+		// Without the real time, events don't expire
+		HostSim::reset();
+		{
+			TestQueue q;
+			q.withTtlRule("diag", 600);
+			if (useLog) {
+				q.withLogStore();
+			}
+			q.setup();
+			q.publish("diag", "d5", PRIVATE);
+			q.run(700000, 1000);
+			HostSim::setConnected(true);
+			q.runUntilEmpty(120000);
+			assertInt("", (int)HostSim::getPublished().size(), 1);
+			assertInt("", (int)q.getMetrics().numExpired, 0);
+		}
+	}
+}
+
+void eventPoolTest() {
+	cleanQueueDir();
+	HostSim::reset();
+
+	PublishQueueEventPool &pool = PublishQueueEventPool::instance();
+	size_t heapFallbacks = pool.getHeapFallbacks();
+
+	TestQueue q;
+	q.withRamQueueSize(20);
+	q.setup();
+
+	HostSim::setConnected(true);
+	q.run(100);
+
+	// Each event is about 200 bytes. Once the 8 small slots are used, the larger slots 
+	// are used, then the heap.
+	for(int ii = 0; ii < 20; ii++) {
+		publishCounter(q, ii);
+	}
+	assertInt("", (int)pool.getInUse(0), PUBLISHQUEUE_POOL_SMALL_SLOTS);
+	assertInt("", (int)pool.getInUse(1), PUBLISHQUEUE_POOL_MEDIUM_SLOTS);
+	assertInt("", (int)pool.getInUse(2), PUBLISHQUEUE_POOL_LARGE_SLOTS);
+	assertInt("", (int)pool.getHighWater(0), PUBLISHQUEUE_POOL_SMALL_SLOTS);
+	int numHeap = 20 - PUBLISHQUEUE_POOL_SMALL_SLOTS - PUBLISHQUEUE_POOL_MEDIUM_SLOTS - PUBLISHQUEUE_POOL_LARGE_SLOTS;
+	assertInt("", (int)pool.getHeapInUse(), numHeap);
+	assertInt("", (int)(pool.getHeapFallbacks() - heapFallbacks), numHeap);
+
+	// Everything is returned to the pool or heap after sending
+	q.runUntilEmpty(120000);
+	assertInt("", (int)HostSim::getPublished().size(), 20);
+	for(size_t sizeClass = 0; sizeClass < PublishQueueEventPool::NUM_SIZE_CLASSES; sizeClass++) {
+		assertInt("", (int)pool.getInUse(sizeClass), 0);
+	}
+	assertInt("", (int)pool.getHeapInUse(), 0);
+	
+	// Freed slots are reused
+	publishCounter(q, 20);
+	assertInt("", (int)pool.getInUse(0), 1);
+	q.runUntilEmpty(120000);
+	assertInt("", (int)pool.getInUse(0), 0);
+}
+
+/**
+ * @brief Compare file system operations for one-file-per-event and the log store
+ *
+ * Events are queued while offline, then sent after connecting. This is the pattern
+ * for a site that is offline for several hours.
+ */
+void flashOpsBenchmark() {
+	const int numEvents = 100;
+
+	printf("\nflash operations per event (%d events queued offline, then sent)\n", numEvents);
+	printf("%-8s %8s %8s %8s %8s %8s %10s %10s\n", "layout", "creates", "unlinks", "writes", "bytes", "dirScans", "dirMutate", "flashOps");
+
+	const char *layouts[] = { "files", "manifest", "log" };
+
+	for(int layout = 0; layout < 3; layout++) {
+		cleanQueueDir();
+		HostSim::reset();
+
+		TestQueue q;
+		q.withFileQueueSize(numEvents);
+		if (layout == 1) {
+			q.withQueueManifest();
+		}
+		if (layout == 2) {
+			q.withLogStore();
+		}
+		q.setup();
+
+		HostSim::fsCounters() = HostFsCounters();
+
+		for(int ii = 0; ii < numEvents; ii++) {
+			publishCounter(q, ii);
+		}
+		HostSim::setConnected(true);
+		q.runUntilEmpty(numEvents * 5000);
+		assertInt("", (int)HostSim::getPublished().size(), numEvents);
+
+		const HostFsCounters &fs = HostSim::fsCounters();
+		printf("%-8s %8.2f %8.2f %8.2f %8.1f %8.2f %10.2f %10.2f\n", layouts[layout],
+			(double)fs.creates / numEvents, (double)fs.unlinks / numEvents, (double)fs.writes / numEvents,
+			(double)fs.bytesWritten / numEvents, (double)fs.dirScans / numEvents,
+			(double)fs.dirMutations() / numEvents, (double)fs.flashOps() / numEvents);
+	}
+}
+
+/**
+ * @brief Compare file system operations with and without withGroupCommit()
+ *
+ * One event per minute is queued while offline, then all are sent after connecting.
+ */
+void groupCommitBenchmark() {
+	const int numEvents = 100;
+
+	printf("\nflash operations per event with group commit (%d events, one per minute offline, then sent)\n", numEvents);
+	printf("%-8s %8s %8s %8s %8s %8s %10s\n", "layout", "group", "creates", "writes", "bytes", "dirMutate", "flashOps");
+
+	const char *layouts[] = { "files", "log" };
+
+	for(int layout = 0; layout < 2; layout++) {
+		for(int group = 0; group < 2; group++) {
+			cleanQueueDir();
+			HostSim::reset();
+
+			TestQueue q;
+			q.withFileQueueSize(numEvents);
+			if (layout == 1) {
+				q.withLogStore();
+			}
+			if (group) {
+				q.withGroupCommit(10, 15 * 60000);
+			}
+			q.setup();
+
+			HostSim::fsCounters() = HostFsCounters();
+
+			for(int ii = 0; ii < numEvents; ii++) {
+				publishCounter(q, ii);
+				q.run(1000);
+				HostSim::advance(59000);
+			}
+			q.prepareForSleep();
+			HostSim::setConnected(true);
+			q.runUntilEmpty(numEvents * 5000);
+			assertInt("", (int)HostSim::getPublished().size(), numEvents);
+
+			const HostFsCounters &fs = HostSim::fsCounters();
+			printf("%-8s %8s %8.2f %8.2f %8.1f %10.2f %10.2f\n", layouts[layout], group ? "10" : "off",
+				(double)fs.creates / numEvents, (double)fs.writes / numEvents,
+				(double)fs.bytesWritten / numEvents, (double)fs.dirMutations() / numEvents, 
+				(double)fs.flashOps() / numEvents);
+		}
+	}
+}
+
+/**
+ * @brief Compare bytes written and log store capacity with and without withCompactEncoding()
+ */
+void compactEncodingBenchmark() {
+	const int numEvents = 100;
+
+	printf("\ncompact encoding (%d events queued offline, then sent; capacity of withLogStore() defaults at one reading per 5 minutes)\n", numEvents);
+	printf("%-8s %8s %8s %8s %10s %10s %10s\n", "layout", "compact", "writes", "bytes", "flashOps", "capacity", "hours");
+
+	const char *layouts[] = { "files", "log" };
+
+	for(int layout = 0; layout < 2; layout++) {
+		for(int compact = 0; compact < 2; compact++) {
+			cleanQueueDir();
+			HostSim::reset();
+
+			size_t capacity = 0;
+			{
+				TestQueue q;
+				q.withFileQueueSize(numEvents).withCompactEncoding(compact != 0);
+				if (layout == 1) {
+					q.withLogStore();
+				}
+				q.setup();
+
+				HostSim::fsCounters() = HostFsCounters();
+
+				for(int ii = 0; ii < numEvents; ii++) {
+					publishCounter(q, ii);
+				}
+				HostSim::setConnected(true);
+				q.runUntilEmpty(numEvents * 5000);
+				assertInt("", (int)HostSim::getPublished().size(), numEvents);
+			}
+			HostFsCounters fs = HostSim::fsCounters();
+
+			if (layout == 1) {
+				// Queue offline until the oldest events are discarded to make room
+				HostSim::reset();
+				TestQueue q;
+				q.withFileQueueSize(100000).withCompactEncoding(compact != 0).withLogStore();
+				q.setup();
+				for(int ii = 0; ii < 20000 && q.getMetrics().numEvicted == 0; ii++) {
+					publishCounter(q, ii);
+					capacity = std::max(capacity, (size_t)q.getNumEvents());
+				}
+			}
+
+			printf("%-8s %8s %8.2f %8.1f %10.2f", layouts[layout], compact ? "on" : "off",
+				(double)fs.writes / numEvents, (double)fs.bytesWritten / numEvents, (double)fs.flashOps() / numEvents);
+			if (capacity) {
+				printf(" %10u %10.1f\n", (unsigned int)capacity, (double)capacity * 5 / 60);
+			}
+			else {
+				printf(" %10s %10s\n", "-", "-");
+			}
+		}
+	}
+}
+
+/**
+ * @brief Compare the backlog after an outage with and without publishWithSupersedeKey()
+ *
+ * Offline for 12 hours with a reading every 5 minutes and a status event every 15 minutes.
+ */
+void supersedeBenchmark() {
+	printf("\nbacklog after 12 hours offline (reading every 5 minutes, status every 15 minutes)\n");
+	printf("%-10s %8s %8s %10s %10s\n", "supersede", "queued", "sent", "dataBytes", "drainSec");
+
+	for(int supersede = 0; supersede < 2; supersede++) {
+		cleanQueueDir();
+		HostSim::reset();
+		HostSim::setPublishLatencyMs(800);
+
+		TestQueue q;
+		q.withFileQueueSize(400);
+		q.setup();
+
+		for(int ii = 0; ii < 144; ii++) {
+			publishCounter(q, ii);
+			if ((ii % 3) == 0) {
+				char data[128];
+				snprintf(data, sizeof(data), "Distance: %d, Sensor: Level, Battery: 87.50 and Charging", ii);
+				if (supersede) {
+					q.publishWithSupersedeKey("status", "status", data, PRIVATE);
+				}
+				else {
+					q.publish("status", data, PRIVATE);
+				}
+			}
+		}
+		size_t queued = q.getNumEvents();
+
+		HostSim::setConnected(true);
+		uint32_t drainMs = q.runUntilEmpty(3600000);
+
+		const std::vector<HostPublishRecord> &published = HostSim::getPublished();
+		size_t dataBytes = 0;
+		for(auto it = published.begin(); it != published.end(); it++) {
+			dataBytes += strlen(it->eventData);
+		}
+		printf("%-10s %8u %8u %10u %10.1f\n", supersede ? "on" : "off", (unsigned int)queued, (unsigned int)published.size(),
+			(unsigned int)dataBytes, (double)drainMs / 1000);
+	}
+}
+
+void expiryBenchmark() {
+	printf("\nbacklog after 24 hours offline (reading every 5 minutes, diagnostic event every hour)\n");
+	printf("%-10s %8s %8s %8s %10s %10s\n", "ttl", "queued", "sent", "expired", "dataBytes", "drainSec");
+
+	for(int useTtl = 0; useTtl < 2; useTtl++) {
+		cleanQueueDir();
+		HostSim::reset();
+		HostSim::setTime(1700000000);
+		HostSim::setPublishLatencyMs(800);
+
+		TestQueue q;
+		q.withFileQueueSize(400);
+		if (useTtl) {
+			q.withTtlRule("Cellular", 3600);
+		}
+		q.setup();
+
+		for(int ii = 0; ii < 288; ii++) {
+			publishCounter(q, ii);
+			if ((ii % 12) == 0) {
+				q.publish("Cellular", "{\"rssi\":-85,\"qual\":37,\"connectSec\":42,\"tower\":\"310-410-12345-678\",\"attempts\":3}", PRIVATE);
+			}
+			q.run(300000, 1000);
+		}
+		size_t queued = q.getNumEvents();
+
+		HostSim::setConnected(true);
+		uint32_t drainMs = q.runUntilEmpty(3600000);
+
+		const std::vector<HostPublishRecord> &published = HostSim::getPublished();
+		size_t dataBytes = 0;
+		for(auto it = published.begin(); it != published.end(); it++) {
+			dataBytes += strlen(it->eventData);
+		}
+		printf("%-10s %8u %8u %8u %10u %10.1f\n", useTtl ? "1 hour" : "none", (unsigned int)queued, (unsigned int)published.size(),
+			(unsigned int)q.getMetrics().numExpired, (unsigned int)dataBytes, (double)drainMs / 1000);
+	}
+}
+
+/**
+ * @brief Directory entries read and unlinks to remove files with a sidecar, by reading the directory and using the extension index
+ */
+void sidecarRemoveBenchmark() {
+	static const char * const exts[] = { "dat", "sha1" };
+
+	printf("\nremoving 10 file numbers with a .dat and .sha1 file each (per file number)\n");
+	printf("%-8s %-14s %10s %10s %10s\n", "queued", "method", "dirScans", "readdirs", "unlinks");
+
+	static const int queueLens[] = { 10, 100, 1000 };
+	for(size_t qq = 0; qq < sizeof(queueLens) / sizeof(queueLens[0]); qq++) {
+		for(int method = 0; method < 3; method++) {
+			cleanQueueDir();
+			HostSim::reset();
+			createSidecarFiles(1, queueLens[qq], exts, 2);
+
+			SequentialFile sf;
+			sf.withDirPath(queueDirPath);
+			sf.withFilenameExtension("dat");
+			if (method == 0) {
+				// Loaded from the manifest, so the extension index is not available
+				SequentialFile tmp;
+				tmp.withDirPath(queueDirPath);
+				tmp.withFilenameExtension("dat");
+				tmp.withManifest();
+				tmp.scanDir();
+				sf.withManifest();
+			}
+			sf.scanDir();
+
+			HostSim::fsCounters() = HostFsCounters();
+			if (method < 2) {
+				for(int ii = 0; ii < 10; ii++) {
+					sf.removeFileNum(sf.getFileFromQueue(), true);
+				}
+			}
+			else {
+				sf.removeRange(1, 10, true);
+			}
+			const HostFsCounters &c = HostSim::fsCounters();
+			static const char * const methods[] = { "scan", "index", "removeRange" };
+			printf("%-8d %-14s %10.2f %10.2f %10.2f\n", queueLens[qq], methods[method], (double)c.dirScans / 10, 
+				(double)c.dirEntries / 10, (double)c.unlinks / 10);
+			sf.removeAll(true);
+		}
+	}
+}
+
+/**
+ * @brief File system calls to queue an event offline and to send and remove it, with and without slot recycling
+ */
+void slotRecyclingBenchmark() {
+	const int numEvents = 100;
+
+	printf("\nfile system calls per event, with slot recycling (%d events queued offline, then sent)\n", numEvents);
+	printf("%-8s %-8s %8s %8s %8s %8s %8s %10s\n", "layout", "", "opens", "creates", "reads", "writes", "unlinks", "dirMutate");
+
+	const char *layouts[] = { "files", "manifest", "slots" };
+
+	for(int layout = 0; layout < 3; layout++) {
+		cleanQueueDir();
+		HostSim::reset();
+
+		TestQueue q;
+		q.withFileQueueSize(numEvents);
+		if (layout == 1) {
+			q.withQueueManifest();
+		}
+		if (layout == 2) {
+			q.withSlotRecycling();
+		}
+		q.setup();
+
+		// Steady state: the slots have been used once
+		for(int ii = 0; ii < numEvents; ii++) {
+			publishCounter(q, ii);
+		}
+		HostSim::setConnected(true);
+		q.runUntilEmpty(numEvents * 5000);
+		HostSim::setConnected(false);
+
+		for(int phase = 0; phase < 2; phase++) {
+			HostSim::fsCounters() = HostFsCounters();
+			if (phase == 0) {
+				for(int ii = 0; ii < numEvents; ii++) {
+					publishCounter(q, ii);
+				}
+			}
+			else {
+				HostSim::setConnected(true);
+				q.runUntilEmpty(numEvents * 5000);
+			}
+
+			const HostFsCounters &fs = HostSim::fsCounters();
+			printf("%-8s %-8s %8.2f %8.2f %8.2f %8.2f %8.2f %10.2f\n", layouts[layout], (phase == 0) ? "enqueue" : "dequeue",
+				(double)fs.opens / numEvents, (double)fs.creates / numEvents, (double)fs.reads / numEvents, 
+				(double)fs.writes / numEvents, (double)fs.unlinks / numEvents, (double)fs.dirMutations() / numEvents);
+		}
+		assertInt("", (int)HostSim::getPublished().size(), numEvents * 2);
+	}
+}
+
+/**
+ * @brief Time for setup() to load a queue of event files, reading the directory or using the manifest
+ */
+void bootTimeBenchmark() {
+	const int queueLens[] = { 0, 100, 1000 };
+	const int numRuns = 5;
+
+	printf("\nboot to ready with events queued in files (setup() time in microseconds on this computer)\n");
+	printf("%-8s %12s %10s %12s %12s\n", "events", "scan us", "scan fs", "manifest us", "manifest fs");
+
+	for(size_t ii = 0; ii < sizeof(queueLens) / sizeof(queueLens[0]); ii++) {
+		cleanQueueDir();
+		HostSim::reset();
+		{
+			TestQueue q;
+			q.withFileQueueSize(queueLens[ii]);
+			q.withQueueManifest();
+			q.setup();
+			for(int jj = 0; jj < queueLens[ii]; jj++) {
+				publishCounter(q, jj);
+			}
+		}
+
+		double micros[2];
+		size_t fsOps[2];
+		for(int useManifest = 0; useManifest < 2; useManifest++) {
+			// Best of several runs, to reduce noise from the host
+			micros[useManifest] = 0;
+			for(int run = 0; run < numRuns; run++) {
+				TestQueue q;
+				q.withFileQueueSize(queueLens[ii]);
+				q.withQueueManifest(useManifest != 0);
+
+				HostSim::fsCounters() = HostFsCounters();
+				auto start = std::chrono::steady_clock::now();
+				q.setup();
+				double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+				assertInt("", (int)q.getNumEvents(), queueLens[ii]);
+
+				if (run == 0 || us < micros[useManifest]) {
+					micros[useManifest] = us;
+				}
+				const HostFsCounters &fs = HostSim::fsCounters();
+				fsOps[useManifest] = fs.opens + fs.reads + fs.dirScans + fs.dirEntries;
+			}
+		}
+		printf("%-8d %12.0f %10u %12.0f %12u\n", queueLens[ii], 
+			micros[0], (unsigned int)fsOps[0], micros[1], (unsigned int)fsOps[1]);
+	}
+}
+
+/**
+ * @brief Time to send a queue of events for different publish latencies and numbers of publishes in flight
+ */
+void drainTimeBenchmark() {
+	const int numEvents = 50;
+	const uint32_t latencies[] = { 500, 3000 };
+	const size_t inFlights[] = { 1, 2, 4 };
+
+	printf("\ntime to send %d events queued offline (seconds)\n", numEvents);
+	printf("%-10s", "latency");
+	for(size_t jj = 0; jj < sizeof(inFlights) / sizeof(inFlights[0]); jj++) {
+		printf(" %9s%u", "inFlight=", (unsigned int)inFlights[jj]);
+	}
+	printf("\n");
+
+	for(size_t ii = 0; ii < sizeof(latencies) / sizeof(latencies[0]); ii++) {
+		double seconds[sizeof(inFlights) / sizeof(inFlights[0])];
+
+		for(size_t jj = 0; jj < sizeof(inFlights) / sizeof(inFlights[0]); jj++) {
+			cleanQueueDir();
+			HostSim::reset();
+			HostSim::setPublishLatencyMs(latencies[ii]);
+
+			TestQueue q;
+			q.withMaxInFlight(inFlights[jj]);
+			q.setup();
+
+			for(int kk = 0; kk < numEvents; kk++) {
+				publishCounter(q, kk);
+			}
+			HostSim::setConnected(true);
+			uint32_t ms = q.runUntilEmpty(numEvents * 10000);
+			assertInt("", (int)HostSim::getPublished().size(), numEvents);
+
+			seconds[jj] = (double)ms / 1000;
+		}
+
+		printf("%8lums", (unsigned long)latencies[ii]);
+		for(size_t jj = 0; jj < sizeof(inFlights) / sizeof(inFlights[0]); jj++) {
+			printf(" %10.1f", seconds[jj]);
+		}
+		printf("\n");
+	}
+}
+
+/**
+ * @brief Time from connecting until the queue is empty and it's safe to sleep, with and without burst drain
+ */
+void burstDrainBenchmark() {
+	const int queueLens[] = { 1, 5, 20 };
+	const uint32_t latencyMs = 500;
+
+	printf("\nawake time after connecting until safe to sleep (seconds, %lu ms publish latency, 1 in flight)\n", (unsigned long)latencyMs);
+	printf("%-8s %10s %10s %10s\n", "events", "normal", "burst", "estimate");
+
+	for(size_t ii = 0; ii < sizeof(queueLens) / sizeof(queueLens[0]); ii++) {
+		double seconds[2];
+		unsigned long estimateMs = 0;
+
+		for(int burst = 0; burst < 2; burst++) {
+			cleanQueueDir();
+			HostSim::reset();
+			HostSim::setPublishLatencyMs(latencyMs);
+
+			TestQueue q;
+			q.setup();
+
+			for(int kk = 0; kk < queueLens[ii]; kk++) {
+				publishCounter(q, kk);
+			}
+			HostSim::setConnected(true);
+			if (burst) {
+				estimateMs = q.startBurstDrain();
+			}
+			uint32_t ms = q.runUntilEmpty(queueLens[ii] * 10000);
+			assertInt("", (int)HostSim::getPublished().size(), queueLens[ii]);
+
+			seconds[burst] = (double)ms / 1000;
+		}
+		printf("%-8d %10.1f %10.1f %10.1f\n", queueLens[ii], seconds[0], seconds[1], (double)estimateMs / 1000);
+	}
+}
+
+/**
+ * @brief A day at a remote site: readings every 5 minutes, connected for 3 minutes each hour
+ * 
+ * Reports throughput, drain time, and flash operations with publish loss.
+ */
+void siteSimulationBenchmark() {
+	const uint32_t dayMs = 24 * 60 * 60000;
+	const uint32_t readingMs = 5 * 60000;
+	const uint32_t stepMs = 50;
+	const double lossRates[] = { 0.0, 0.1, 0.3 };
+	const char *layouts[] = { "files", "log" };
+
+	printf("\nsimulated day: reading every 5 min, connected 3 min every hour, 800+-400 ms latency, lost publishes time out after 20 s\n");
+	printf("%-8s %6s %9s %9s %9s %9s %9s %9s %10s\n", "layout", "loss", "readings", "sent", "missed", "att/evt", "drain s", "events/s", "flashOps");
+
+	for(int layout = 0; layout < 2; layout++) {
+		for(size_t ii = 0; ii < sizeof(lossRates) / sizeof(lossRates[0]); ii++) {
+			cleanQueueDir();
+			HostSim::reset();
+			HostSim::setPublishLatencyMs(800, 400);
+			HostSim::setPublishLoss(lossRates[ii]);
+
+			TestQueue q;
+			if (layout == 1) {
+				q.withLogStore();
+			}
+			q.setup();
+
+			HostSim::fsCounters() = HostFsCounters();
+			uint32_t start = millis();
+			HostSim::setConnectivitySchedule(HostSim::periodicSchedule(start + 30 * 60000, 60 * 60000, 3 * 60000, dayMs));
+
+			int numReadings = 0;
+			int missedWindows = 0;
+			uint32_t drainMs = 0;
+			bool wasConnected = false;
+			bool drained = false;
+			uint32_t connectedAt = 0;
+
+			while(millis() - start < dayMs) {
+				if ((millis() - start) % readingMs == 0) {
+					publishCounter(q, numReadings++);
+				}
+				q.run(stepMs, stepMs);
+
+				// Time from connecting until the queue is empty
+				bool connected = Particle.connected();
+				if (connected && !wasConnected) {
+					connectedAt = millis();
+					drained = false;
+				}
+				if (connected && !drained && q.getNumEvents() == 0 && q.getCanSleep()) {
+					drainMs += millis() - connectedAt;
+					drained = true;
+				}
+				if (!connected && wasConnected && !drained) {
+					missedWindows++;
+				}
+				wasConnected = connected;
+			}
+
+			int numSent = 0;
+			const std::vector<HostPublishRecord> &published = HostSim::getPublished();
+			for(auto it = published.begin(); it != published.end(); it++) {
+				if (it->succeeded) {
+					numSent++;
+				}
+			}
+			PublishQueueMetrics m = q.getMetrics();
+			int numWindows = 24 - missedWindows;
+
+			// Drain time and rate are only for windows where the queue was emptied
+			char drainStr[16] = "-", rateStr[16] = "-";
+			if (numWindows > 0 && drainMs > 0) {
+				snprintf(drainStr, sizeof(drainStr), "%.1f", (double)drainMs / numWindows / 1000);
+				snprintf(rateStr, sizeof(rateStr), "%.2f", (double)numSent * 1000 / drainMs);
+			}
+			printf("%-8s %5.0f%% %9d %9d %9d %9.2f %9s %9s %10.2f\n", layouts[layout], lossRates[ii] * 100,
+				numReadings, numSent, missedWindows, m.numAcked ? (double)m.numAttempts / m.numAcked : 0.0,
+				drainStr, rateStr, (double)HostSim::fsCounters().flashOps() / numReadings);
+			q.clearQueues();
+		}
+	}
+}
+
+/**
+ * @brief Attempts and connected time to send a backlog with fades in the cellular signal, with 
+ * fixed and adaptive retry timing
+ */
+void adaptiveRetryBenchmark() {
+	const int numEvents = 50;
+	const uint32_t fades[] = { 10000, 60000, 300000 };
+
+	printf("\nsending %d events with 5%% of publishes starting a signal fade, fixed vs adaptive retry\n", numEvents);
+	printf("%-8s %10s %10s %10s %12s\n", "fade", "retry", "att/evt", "drain s", "s/event");
+
+	for(size_t ii = 0; ii < sizeof(fades) / sizeof(fades[0]); ii++) {
+		for(int adaptive = 0; adaptive < 2; adaptive++) {
+			cleanQueueDir();
+			HostSim::reset();
+			HostSim::setPublishLatencyMs(800, 400);
+			HostSim::setPublishLoss(0.05, 20000, fades[ii]);
+
+			TestQueue q;
+			if (adaptive) {
+				q.withAdaptiveRetry();
+			}
+			q.setup();
+
+			for(int jj = 0; jj < numEvents; jj++) {
+				publishCounter(q, jj);
+			}
+			HostSim::setConnected(true);
+			uint32_t start = millis();
+			while(q.getNumEvents() != 0 && millis() - start < 4 * 3600000) {
+				q.run(10, 10);
+			}
+			assertInt("", (int)q.getNumEvents(), 0);
+
+			uint32_t ms = millis() - start;
+			PublishQueueMetrics m = q.getMetrics();
+			printf("%6lus %10s %10.2f %10.1f %12.2f\n", (unsigned long)fades[ii] / 1000, adaptive ? "adaptive" : "fixed", 
+				(double)m.numAttempts / m.numAcked, (double)ms / 1000, (double)ms / 1000 / numEvents);
+		}
+	}
+}
+
+void wakeupBenchmark() {
+	const int eventsPerHour[] = { 0, 60 };
+
+	printf("\nbackground publish thread wakeups per hour (polling every 1 ms was 3600000)\n");
+	printf("%16s %10s\n", "events/hour", "wakeups");
+
+	for(size_t ii = 0; ii < sizeof(eventsPerHour) / sizeof(eventsPerHour[0]); ii++) {
+		cleanQueueDir();
+		HostSim::reset();
+
+		TestQueue q;
+		q.setup();
+		HostSim::setConnected(true);
+
+		for(int jj = 0; jj < 60; jj++) {
+			if (jj < eventsPerHour[ii]) {
+				publishCounter(q, jj);
+			}
+			q.run(60000);
+		}
+		assertInt("", (int)HostSim::getPublished().size(), eventsPerHour[ii]);
+
+		// Woken once when the publish is requested and once when it completes
+		uint32_t wakeups = BackgroundPublishRK::instance().getWakeupsPerHour();
+		assertInt("", wakeups <= (uint32_t)eventsPerHour[ii] * 2, 1);
+
+		printf("%16d %10lu\n", eventsPerHour[ii], (unsigned long)wakeups);
+	}
+}
+
+int main() {
+	setvbuf(stdout, NULL, _IONBF, 0);
+	Logger::minLevel() = LOG_LEVEL_INFO;
+
+	struct stat sb;
+	if (stat("/dev/shm", &sb) == 0 && S_ISDIR(sb.st_mode)) {
+		queueDirPath = "/dev/shm/pubqueue-hosttest";
+	}
+
+	fileQueueTest();
+	logStoreTest();
+	logStoreWrapTest();
+	logStoreRecoveryTest();
+	logStoreFullTest();
+	sequentialFileRangeTest();
+	sequentialFileExtIndexTest();
+	sequentialFileSlotTest();
+	sequentialFilePathTest();
+	manifestTest();
+	manifestCheckpointTest();
+	slotRecyclingTest();
+	batchFileQueueTest();
+	batchRamQueueTest();
+	batchLogStoreTest();
+	eventPoolTest();
+	pipelineTest();
+	priorityTest();
+	groupCommitTest();
+	compactEncodingTest();
+	codecStringTableTest();
+	supersedeTest();
+	expiryTest();
+	burstDrainTest();
+	adaptiveRetryTest();
+	metricsTest();
+
+	flashOpsBenchmark();
+	groupCommitBenchmark();
+	compactEncodingBenchmark();
+	supersedeBenchmark();
+	expiryBenchmark();
+	drainTimeBenchmark();
+	burstDrainBenchmark();
+	siteSimulationBenchmark();
+	adaptiveRetryBenchmark();
+	wakeupBenchmark();
+	bootTimeBenchmark();
+	sidecarRemoveBenchmark();
+	slotRecyclingBenchmark();
+
+	// No events are leaked by any of the tests
+	PublishQueueEventPool::instance().logStats();
+	for(size_t sizeClass = 0; sizeClass < PublishQueueEventPool::NUM_SIZE_CLASSES; sizeClass++) {
+		assertInt("", (int)PublishQueueEventPool::instance().getInUse(sizeClass), 0);
+	}
+	assertInt("", (int)PublishQueueEventPool::instance().getHeapInUse(), 0);
+
+	printf("tests passed\n");
+	return 0;
+}
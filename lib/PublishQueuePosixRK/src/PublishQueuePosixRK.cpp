@@ -6,8 +6,14 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#include <algorithm>
+
 PublishQueuePosix *PublishQueuePosix::_instance;
 
+const unsigned long PublishQueueMetrics::latencyBucketMs[NUM_LATENCY_BUCKETS - 1] = { 
+    1000, 5000, 30000, 2 * 60000, 10 * 60000, 60 * 60000, 6 * 60 * 60000 
+};
+
 static Logger _log("app.pubq");
 
 
@@ -22,7 +28,7 @@ PublishQueuePosix &PublishQueuePosix::withRamQueueSize(size_t size) {
     ramQueueSize = size;
 
     if (stateHandler) {
-        _log.trace("withRamQueueSize(%u)", ramQueueSize);
+        _log.trace("withRamQueueSize(%u)", (unsigned int)ramQueueSize);
         checkQueueLimits();
     }
     return *this; 
@@ -33,12 +39,145 @@ PublishQueuePosix &PublishQueuePosix::withFileQueueSize(size_t size) {
     fileQueueSize = size; 
 
     if (stateHandler) {
-        _log.trace("withFileQueueSize(%u)", fileQueueSize);
+        _log.trace("withFileQueueSize(%u)", (unsigned int)fileQueueSize);
         checkQueueLimits();
     }
     return *this; 
 }
 
+PublishQueuePosix &PublishQueuePosix::withQueueManifest(bool value, size_t saveEvery) {
+    for(uint8_t priority = 0; priority < PUBLISHQUEUE_NUM_PRIORITIES; priority++) {
+        fileQueues[priority].withManifest(value, saveEvery);
+    }
+    return *this;
+}
+
+PublishQueuePosix &PublishQueuePosix::withPriorityRule(const char *eventNamePrefix, uint8_t priority) {
+    PublishQueuePriorityRule rule;
+    rule.eventNamePrefix = eventNamePrefix;
+    rule.priority = (priority < PUBLISHQUEUE_NUM_PRIORITIES) ? priority : (PUBLISHQUEUE_NUM_PRIORITIES - 1);
+    priorityRules.push_back(rule);
+    return *this;
+}
+
+uint8_t PublishQueuePosix::getPriorityForEvent(const char *eventName) const {
+    for(auto it = priorityRules.begin(); it != priorityRules.end(); it++) {
+        if (strncmp(eventName, it->eventNamePrefix.c_str(), it->eventNamePrefix.length()) == 0) {
+            return it->priority;
+        }
+    }
+    return 0;
+}
+
+PublishQueuePosix &PublishQueuePosix::withTtlRule(const char *eventNamePrefix, uint32_t ttl) {
+    PublishQueueTtlRule rule;
+    rule.eventNamePrefix = eventNamePrefix;
+    rule.ttl = ttl;
+    ttlRules.push_back(rule);
+    return *this;
+}
+
+uint32_t PublishQueuePosix::getTtlForEvent(const char *eventName) const {
+    for(auto it = ttlRules.begin(); it != ttlRules.end(); it++) {
+        if (strncmp(eventName, it->eventNamePrefix.c_str(), it->eventNamePrefix.length()) == 0) {
+            return it->ttl;
+        }
+    }
+    return 0;
+}
+
+size_t PublishQueuePosix::getQueueDepth(uint8_t priority) {
+    size_t result = 0;
+
+    if (priority < PUBLISHQUEUE_NUM_PRIORITIES) {
+        WITH_LOCK(*this) {
+            result = ramQueues[priority].size() + getFileQueueLen(priority);
+
+            for(size_t ii = 0; ii < inFlightCount; ii++) {
+                const PublishQueueInFlight &entry = getInFlight(ii);
+                if (entry.priority == priority && entry.fileNums.empty()) {
+                    // Events from the file queue are still in it, but RAM events are not
+                    result += entry.ramEvents.empty() ? 1 : entry.ramEvents.size();
+                }
+            }
+        }
+    }
+    return result;
+}
+
+size_t PublishQueuePosix::getNumEvicted(uint8_t priority) const {
+    if (priority >= PUBLISHQUEUE_NUM_PRIORITIES) {
+        return 0;
+    }
+    size_t result = numEvicted[priority];
+    if (priorityUsesLog(priority)) {
+        result += eventLog.getNumOverwritten();
+    }
+    return result;
+}
+
+PublishQueueMetrics PublishQueuePosix::getMetrics() const {
+    PublishQueueMetrics result = metrics;
+
+    size_t evicted = 0;
+    for(uint8_t priority = 0; priority < PUBLISHQUEUE_NUM_PRIORITIES; priority++) {
+        evicted += getNumEvicted(priority);
+    }
+    result.numEvicted = (uint32_t)(evicted - metricsEvictedBase);
+    result.numCorrupted += (uint32_t)(eventLog.getNumCorrupted() - metricsLogCorruptedBase);
+    result.bytesWritten += (uint32_t)(eventLog.getBytesWritten() - metricsLogBytesBase);
+
+    return result;
+}
+
+void PublishQueuePosix::resetMetrics() {
+    WITH_LOCK(*this) {
+        metrics = PublishQueueMetrics();
+        metricsEvictedBase = 0;
+        for(uint8_t priority = 0; priority < PUBLISHQUEUE_NUM_PRIORITIES; priority++) {
+            metricsEvictedBase += getNumEvicted(priority);
+        }
+        metricsLogCorruptedBase = eventLog.getNumCorrupted();
+        metricsLogBytesBase = eventLog.getBytesWritten();
+    }
+}
+
+size_t PublishQueuePosix::formatMetrics(char *buf, size_t bufSize) const {
+    PublishQueueMetrics m = getMetrics();
+
+    JSONBufferWriter writer(buf, bufSize - 1);
+    writer.beginObject();
+    writer.name("lat").beginArray();
+    for(size_t ii = 0; ii < PublishQueueMetrics::NUM_LATENCY_BUCKETS; ii++) {
+        writer.value((unsigned int)m.latency[ii]);
+    }
+    writer.endArray();
+    writer.name("ack").value((unsigned int)m.numAcked);
+    writer.name("att").value((unsigned int)m.numAttempts);
+    writer.name("fail").value((unsigned int)m.numFailures);
+    writer.name("files").value((unsigned int)m.filesWritten);
+    writer.name("bytes").value((unsigned int)m.bytesWritten);
+    writer.name("evict").value((unsigned int)m.numEvicted);
+    writer.name("bad").value((unsigned int)m.numCorrupted);
+    writer.name("sup").value((unsigned int)m.numSuperseded);
+    writer.name("exp").value((unsigned int)m.numExpired);
+    writer.name("max").value((unsigned int)m.maxQueueDepth);
+    writer.endObject();
+
+    size_t len = (writer.dataSize() < bufSize - 1) ? writer.dataSize() : bufSize - 1;
+    buf[len] = 0;
+    return len;
+}
+
+bool PublishQueuePosix::publishMetrics() {
+    char buf[256];
+    formatMetrics(buf, sizeof(buf));
+    resetMetrics();
+    diagLastMs = millis();
+
+    return publishWithPriority(0, diagEventName.length() ? diagEventName.c_str() : "pubqDiag", buf, PRIVATE | WITH_ACK);
+}
+
 void PublishQueuePosix::setup() {
     if (system_thread_get_state(nullptr) != spark::feature::ENABLED) {
         _log.error("SYSTEM_THREAD(ENABLED) is required");
@@ -51,44 +190,181 @@ void PublishQueuePosix::setup() {
     System.on(reset | cloud_status, systemEventHandler);
 
     // Start the background publish thread
-    BackgroundPublishRK::instance().start();
+    inFlight.resize(maxInFlight);
+    BackgroundPublishRK::instance().withNumSlots(maxInFlight).start();
+
+    // Higher priorities are stored in directories next to the main queue directory
+    for(uint8_t priority = 1; priority < PUBLISHQUEUE_NUM_PRIORITIES; priority++) {
+        char path[128];
+        snprintf(path, sizeof(path), "%s.p%u", getDirPath(), priority);
+        fileQueues[priority].withDirPath(path);
+    }
+    for(uint8_t priority = 0; priority < PUBLISHQUEUE_NUM_PRIORITIES; priority++) {
+        if (useSlotRecycling && !priorityUsesLog(priority)) {
+            // One more than the queue size, as an event is written before the oldest is discarded
+            fileQueues[priority].withSlotRecycling(fileQueueSize + 1);
+        }
+        fileQueues[priority].scanDir();
+    }
+
+    // The string table is loaded even if compact encoding is off, in case events were queued with it on
+    codec.withPath(String(fileQueues[0].getDirPath()) + "/strings");
+    codec.load();
+    eventLog.withCodec(&codec, useCompactEncoding);
 
-    fileQueue.scanDir();
+    if (useEventLog) {
+        eventLog.withDirPath(fileQueues[0].getDirPath());
+        eventLog.load();
+
+        // Move any events stored one-file-per-event into the log
+        while(true) {
+            int fileNum = fileQueues[0].getFileFromQueue(true);
+            if (!fileNum) {
+                break;
+            }
+            PublishQueueExpiry expiry;
+            PublishQueueEvent *event = readQueueFile(0, fileNum, &expiry);
+            if (event) {
+                eventLog.append(event, expiry.ttl ? &expiry : NULL);
+                PublishQueueEventPool::instance().release(event);
+            }
+            fileQueues[0].removeFileNum(fileNum, false);
+        }
+    }
 
     checkQueueLimits();
 
+    if (getFileQueueLen() == 0) {
+        // No stored event refers to the string table
+        codec.clear();
+    }
+
+    // Events queued before setup() have an unknown publish time
+    for(uint8_t priority = 0; priority < PUBLISHQUEUE_NUM_PRIORITIES; priority++) {
+        enqueueMs[priority].assign(getQueueDepth(priority), 0);
+    }
+    resetMetrics();
+    diagLastMs = millis();
+
     stateHandler = &PublishQueuePosix::stateConnectWait;
 }
 
 void PublishQueuePosix::loop() {
+    if (groupCommitPending && millis() - groupCommitStartMs >= groupCommitMaxAgeMs) {
+        _log.trace("group commit timeout");
+        writeQueueToFiles();
+    }
+
+    if (diagEventName.length() && millis() - diagLastMs >= diagPeriodMs) {
+        publishMetrics();
+    }
+
+    if (!expiryIndex.empty() && Time.isValid() && (int32_t)((uint32_t)Time.now() - nextExpiry) >= 0) {
+        removeExpiredEvents();
+    }
+
     if (stateHandler) {
         stateHandler(*this);
     }
+
+    if (codec.getNumStrings() != 0) {
+        WITH_LOCK(*this) {
+            if (!hasStoredEvents()) {
+                // No stored event refers to the string table, so start over before it fills up
+                codec.clear();
+            }
+        }
+    }
 }
 
 bool PublishQueuePosix::publishCommon(const char *eventName, const char *eventData, int ttl, PublishFlags flags1, PublishFlags flags2) {
+    // The ttl parameter of Particle.publish() is ignored by the cloud. Use withTtlRule() or publishWithTtl() instead.
+    (void)ttl;
+
+    if (!eventName) {
+        return false;
+    }
+    return publishWithPriority(getPriorityForEvent(eventName), eventName, eventData, flags1, flags2);
+}
+
+bool PublishQueuePosix::publishWithPriority(uint8_t priority, const char *eventName, const char *eventData, PublishFlags flags1, PublishFlags flags2) {
+    if (!eventName) {
+        return false;
+    }
+    return enqueueEvent(priority, NULL, getTtlForEvent(eventName), eventName, eventData, flags1 | flags2);
+}
+
+bool PublishQueuePosix::publishWithSupersedeKey(const char *supersedeKey, const char *eventName, const char *eventData, PublishFlags flags1, PublishFlags flags2) {
+    if (!eventName || !supersedeKey) {
+        return false;
+    }
+    return enqueueEvent(getPriorityForEvent(eventName), supersedeKey, getTtlForEvent(eventName), eventName, eventData, flags1 | flags2);
+}
+
+bool PublishQueuePosix::publishWithTtl(uint32_t ttl, const char *eventName, const char *eventData, PublishFlags flags1, PublishFlags flags2) {
+    if (!eventName) {
+        return false;
+    }
+    return enqueueEvent(getPriorityForEvent(eventName), NULL, ttl, eventName, eventData, flags1 | flags2);
+}
+
+bool PublishQueuePosix::enqueueEvent(uint8_t priority, const char *supersedeKey, uint32_t ttl, const char *eventName, const char *eventData, PublishFlags flags) {
+    if (priority >= PUBLISHQUEUE_NUM_PRIORITIES) {
+        priority = PUBLISHQUEUE_NUM_PRIORITIES - 1;
+    }
 
-    PublishQueueEvent *event = newRamEvent(eventName, eventData, flags1 | flags2);
+    PublishQueueEvent *event = newRamEvent(eventName, eventData, flags);
     if (!event) {
         return false;
     }
-    _log.trace("publishCommon eventName=%s eventData=%s", eventName, eventData ? eventData : "");
+    _log.trace("publishCommon eventName=%s eventData=%s priority=%u", eventName, eventData ? eventData : "", priority);
 
     WITH_LOCK(*this) {
-        ramQueue.push_back(event);
+        if (supersedeKey) {
+            supersede(supersedeKey, priority, event);
+        }
+        if (ttl && Time.isValid()) {
+            // Without the real time, the event is kept until sent
+            PublishQueueExpiryEntry entry;
+            entry.priority = priority;
+            entry.ramEvent = event;
+            entry.expiry.enqueueTime = (uint32_t)Time.now();
+            entry.expiry.ttl = ttl;
+
+            uint32_t expires = entry.expiry.enqueueTime + ttl;
+            if (expiryIndex.empty() || (int32_t)(expires - nextExpiry) < 0) {
+                nextExpiry = expires;
+            }
+            expiryIndex.push_back(entry);
+        }
+        ramQueues[priority].push_back(event);
+        enqueueMs[priority].push_back(millis() ? millis() : 1);
 
-        _log.trace("fileQueueLen=%u ramQueueLen=%u connected=%d", fileQueue.getQueueLen(), ramQueue.size(), Particle.connected());
+        _log.trace("fileQueueLen=%u ramQueueLen=%u connected=%d", (unsigned int)getFileQueueLen(priority), (unsigned int)getRamQueueLen(), Particle.connected());
 
-        if (fileQueue.getQueueLen() == 0 && (ramQueue.size() <= ramQueueSize) && Particle.connected()) {
+        if (getFileQueueLen(priority) == 0 && (getRamQueueLen() <= ramQueueSize) && Particle.connected()) {
             // No files in the disk-based queue, RAM-based queue is not full, and we are cloud connected
             // Leave the event in the RAM queue and return true
             _log.trace("queued to ramQueue");
         }
+        else if (getRamQueueLen() < groupCommitMaxEvents) {
+            // Hold the event in RAM to write it together with the next ones
+            if (!groupCommitPending) {
+                groupCommitPending = true;
+                groupCommitStartMs = millis();
+            }
+            _log.trace("held for group commit");
+        }
         else {
             // We need to move the queue to the file system
             writeQueueToFiles();
         }
         checkQueueLimits();
+
+        size_t numEvents = getNumEvents();
+        if (numEvents > metrics.maxQueueDepth) {
+            metrics.maxQueueDepth = (uint32_t)numEvents;
+        }
     }
 
 
@@ -109,7 +385,7 @@ PublishQueueEvent *PublishQueuePosix::newRamEvent(const char *eventName, const c
 
     PublishQueueEvent *event;
 
-    event = (PublishQueueEvent *) new char[sizeof(PublishQueueEvent) + strlen(eventData)];
+    event = PublishQueueEventPool::instance().alloc(sizeof(PublishQueueEvent) + strlen(eventData));
     if (event) {
         event->flags = flags;
         strcpy(event->eventName, eventName);
@@ -121,58 +397,212 @@ PublishQueueEvent *PublishQueuePosix::newRamEvent(const char *eventName, const c
 void PublishQueuePosix::writeQueueToFiles() {
 
     WITH_LOCK(*this) {
-        while(!ramQueue.empty()) {
-            PublishQueueEvent *event = ramQueue.front();
-            ramQueue.pop_front();
+        groupCommitPending = false;
+
+        for(uint8_t priority = 0; priority < PUBLISHQUEUE_NUM_PRIORITIES; priority++) {
+            std::deque<PublishQueueEvent*> &ramQueue = ramQueues[priority];
+
+            if (priorityUsesLog(priority) && ramQueue.size() > 1) {
+                // Append them all to the log together
+                std::vector<const PublishQueueEvent *> events(ramQueue.begin(), ramQueue.end());
+                std::vector<PublishQueueExpiry> expiry;
+                for(size_t ii = 0; ii < events.size(); ii++) {
+                    const PublishQueueExpiry *eventExpiry = getRamEventExpiry(events[ii]);
+                    if (eventExpiry) {
+                        expiry.resize(events.size(), PublishQueueExpiry());
+                        expiry[ii] = *eventExpiry;
+                    }
+                }
+                int seq = eventLog.append(&events[0], events.size(), expiry.empty() ? NULL : &expiry[0]);
+
+                // This message is monitored by the automated test tool. If you edit this, change that too.
+                for(size_t ii = 0; ii < events.size(); ii++) {
+                    _log.trace("writeQueueToFiles fileNum=%d", seq ? seq + (int)ii : 0);
+                    updateEventIndexes(events[ii], seq ? seq + (int)ii : 0);
+                }
+                for(auto it = ramQueue.begin(); it != ramQueue.end(); it++) {
+                    PublishQueueEventPool::instance().release(*it);
+                }
+                ramQueue.clear();
+            }
+
+            while(!ramQueue.empty()) {
+                PublishQueueEvent *event = ramQueue.front();
+                ramQueue.pop_front();
+
+                int id = writeFileQueueEvent(priority, event, getRamEventExpiry(event));
+                updateEventIndexes(event, id);
+
+                PublishQueueEventPool::instance().release(event);
+            }
+        }
+    }
+}
+
+void PublishQueuePosix::prepareForSleep() {
+    if (getRamQueueLen() != 0) {
+        _log.trace("prepareForSleep writing %u events", (unsigned int)getRamQueueLen());
+        writeQueueToFiles();
+    }
+    saveQueueManifests();
+}
+
+void PublishQueuePosix::saveQueueManifests() {
+    WITH_LOCK(*this) {
+        for(uint8_t priority = 0; priority < PUBLISHQUEUE_NUM_PRIORITIES; priority++) {
+            fileQueues[priority].saveManifest();
+        }
+    }
+}
+
+size_t PublishQueuePosix::getRamQueueLen() const {
+    size_t result = 0;
+
+    for(uint8_t priority = 0; priority < PUBLISHQUEUE_NUM_PRIORITIES; priority++) {
+        result += ramQueues[priority].size();
+    }
+    return result;
+}
+
+int PublishQueuePosix::writeFileQueueEvent(uint8_t priority, const PublishQueueEvent *event, const PublishQueueExpiry *expiry) {
+    int id = 0;
+
+    WITH_LOCK(*this) {
+        if (priorityUsesLog(priority)) {
+            id = eventLog.append(event, expiry);
 
+            // This message is monitored by the automated test tool. If you edit this, change that too.
+            _log.trace("writeQueueToFiles fileNum=%d", id);
+        }
+        else {
+            SequentialFile &fileQueue = fileQueues[priority];
             int fileNum = fileQueue.reserveFile();
 
-            int fd = open(fileQueue.getPathForFileNum(fileNum), O_RDWR | O_CREAT);
-            if (fd) {
-                PublishQueueFileHeader hdr;
-                hdr.magic = FILE_MAGIC;
-                hdr.version = FILE_VERSION;
-                hdr.headerSize = sizeof(PublishQueueFileHeader);
-                hdr.nameLen = sizeof(PublishQueueEvent::eventName);
-                write(fd, &hdr, sizeof(hdr));
+            PublishQueueFileHeader hdr;
+            hdr.magic = FILE_MAGIC;
+            hdr.version = FILE_VERSION;
+            hdr.headerSize = sizeof(PublishQueueFileHeader);
+            hdr.nameLen = sizeof(PublishQueueEvent::eventName);
+            if (expiry) {
+                hdr.headerSize += sizeof(PublishQueueExpiry);
+            }
+
+            // Header, expiry, and event in a single write
+            writeBuf.resize(hdr.headerSize);
+            if (useCompactEncoding && codec.encode(event, writeBuf)) {
+                hdr.version = FILE_VERSION_COMPACT;
+            }
+            else {
+                size_t eventSize = sizeof(PublishQueueEvent) + strlen(event->eventData);
+                writeBuf.resize(hdr.headerSize + eventSize);
+                memcpy(&writeBuf[hdr.headerSize], event, eventSize);
+            }
+            memcpy(&writeBuf[0], &hdr, sizeof(hdr));
+            if (expiry) {
+                memcpy(&writeBuf[sizeof(hdr)], expiry, sizeof(PublishQueueExpiry));
+            }
 
-                write(fd, event, sizeof(PublishQueueEvent) + strlen(event->eventData));
-                close(fd);
+            bool written = false;
+            if (fileQueue.getNumSlots()) {
+                // Overwrites a slot in place instead of creating a file
+                written = fileQueue.writeSlot(fileNum, &writeBuf[0], writeBuf.size());
+            }
+            else {
+                char path[SequentialFile::PATH_BUF_SIZE];
+                int fd = fileQueue.getPathForFileNum(fileNum, NULL, path, sizeof(path)) ? open(path, O_RDWR | O_CREAT) : -1;
+                if (fd >= 0) {
+                    written = (write(fd, &writeBuf[0], writeBuf.size()) == (ssize_t)writeBuf.size());
+                    close(fd);
+                    if (!written) {
+                        // Don't leave a truncated event file to be found by scanDir()
+                        unlink(path);
+                    }
+                }
+            }
+            if (written) {
+                metrics.filesWritten++;
+                metrics.bytesWritten += (uint32_t)writeBuf.size();
 
                 // This message is monitored by the automated test tool. If you edit this, change that too.
                 _log.trace("writeQueueToFiles fileNum=%d", fileNum);
-            }
-            fileQueue.addFileToQueue(fileNum);
 
-            delete event;
+                fileQueue.addFileToQueue(fileNum);
+                id = fileNum;
+            }
+            else {
+                _log.error("failed to write event file %d errno=%d", fileNum, errno);
+            }
         }
     }
+    return id;
 }
 
 
-PublishQueueEvent *PublishQueuePosix::readQueueFile(int fileNum) {
+PublishQueueEvent *PublishQueuePosix::readQueueFile(uint8_t priority, int fileNum, PublishQueueExpiry *expiry) {
     PublishQueueEvent *result = NULL;
-
-    int fd = open(fileQueue.getPathForFileNum(fileNum), O_RDONLY);
-    if (fd) {
-        struct stat sb;
-        fstat(fd, &sb);
-
-        _log.trace("fileNum=%d size=%ld", fileNum, sb.st_size);
+    PublishQueueExpiry fileExpiry = PublishQueueExpiry();
+
+    SequentialFile &fileQueue = fileQueues[priority];
+    off_t fileSize = 0;
+    int fd;
+    if (fileQueue.getNumSlots()) {
+        // Positioned after the slot header, so the rest is the same as reading an event file
+        size_t dataLen = 0;
+        fd = fileQueue.openSlot(fileNum, &dataLen);
+        fileSize = (off_t)dataLen;
+    }
+    else {
+        char path[SequentialFile::PATH_BUF_SIZE];
+        fileQueue.getPathForFileNum(fileNum, NULL, path, sizeof(path));
+        fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            struct stat sb;
+            fstat(fd, &sb);
+            fileSize = sb.st_size;
+        }
+    }
+    if (fd >= 0) {
+        _log.trace("fileNum=%d size=%ld", fileNum, (long)fileSize);
 
         PublishQueueFileHeader hdr;
         
-        lseek(fd, 0, SEEK_SET);
         read(fd, &hdr, sizeof(PublishQueueFileHeader));
-        if (sb.st_size >= (off_t)(sizeof(PublishQueueFileHeader) + sizeof(PublishQueueEvent)) &&
+
+        // Events with a time-to-live have a PublishQueueExpiry after the header
+        bool headerValid = false;
+        if (hdr.headerSize == sizeof(PublishQueueFileHeader)) {
+            headerValid = true;
+        }
+        else if (hdr.headerSize == sizeof(PublishQueueFileHeader) + sizeof(PublishQueueExpiry)) {
+            headerValid = (read(fd, &fileExpiry, sizeof(PublishQueueExpiry)) == (int)sizeof(PublishQueueExpiry));
+        }
+
+        if (headerValid &&
+            fileSize > (off_t)hdr.headerSize &&
+            fileSize <= (off_t)(hdr.headerSize + sizeof(PublishQueueEvent) + particle::protocol::MAX_EVENT_DATA_LENGTH) &&
+            hdr.magic == FILE_MAGIC && 
+            hdr.version == FILE_VERSION_COMPACT) {
+
+            readBuf.resize(fileSize - hdr.headerSize);
+            if (read(fd, &readBuf[0], readBuf.size()) == (int)readBuf.size()) {
+                result = codec.decode(&readBuf[0], readBuf.size());
+            }
+            if (result) {
+                _log.trace("readQueueFile %d event=%s data=%s", fileNum, result->eventName, result->eventData);
+            }
+            else {
+                _log.trace("readQueueFile %d corrupted compact event", fileNum);
+            }
+        } 
+        else if (headerValid &&
+            fileSize >= (off_t)(hdr.headerSize + sizeof(PublishQueueEvent)) &&
             hdr.magic == FILE_MAGIC && 
             hdr.version == FILE_VERSION &&
-            hdr.headerSize == sizeof(PublishQueueFileHeader) &&
             hdr.nameLen == sizeof(PublishQueueEvent::eventName)) {
 
-            size_t eventSize = sb.st_size - sizeof(PublishQueueFileHeader);
+            size_t eventSize = fileSize - hdr.headerSize;
 
-            result = (PublishQueueEvent *)new char[eventSize];
+            result = PublishQueueEventPool::instance().alloc(eventSize);
             if (result) {
                 read(fd, result, eventSize);
 
@@ -181,224 +611,1983 @@ PublishQueueEvent *PublishQueuePosix::readQueueFile(int fileNum) {
                 }
                 else {
                     _log.trace("readQueueFile %d corrupted event name or data", fileNum);
-                    delete result;
+                    PublishQueueEventPool::instance().release(result);
                     result = NULL;
                 }
 
             }
         } else {
-            _log.trace("readQueueFile %d bad magic=%08lx version=%u headerSize=%u nameLen=%u", fileNum, hdr.magic, hdr.version, hdr.headerSize, hdr.nameLen);
+            _log.trace("readQueueFile %d bad magic=%08lx version=%u headerSize=%u nameLen=%u", fileNum, (unsigned long)hdr.magic, hdr.version, hdr.headerSize, hdr.nameLen);
         }
 
         close(fd);
     }
+    if (expiry) {
+        *expiry = fileExpiry;
+    }
     return result;
 }
 
-void PublishQueuePosix::clearQueues() {
-    WITH_LOCK(*this) {
-        while(!ramQueue.empty()) {
-            PublishQueueEvent *event = ramQueue.front();
-            ramQueue.pop_front();
-
-            delete event;
+bool PublishQueuePosix::hasStoredEvents() const {
+    for(uint8_t priority = 0; priority < PUBLISHQUEUE_NUM_PRIORITIES; priority++) {
+        // Skipped log records are still read, so they count
+        if (priorityUsesLog(priority) ? (eventLog.getQueueLen() != 0) : (fileQueues[priority].getQueueLen() != 0)) {
+            return true;
         }
-
-        fileQueue.removeAll(true);
     }
-
-    _log.trace("clearQueues");
+    return false;
 }
 
-void PublishQueuePosix::setPausePublishing(bool value) { 
-    pausePublishing = value; 
+int PublishQueuePosix::getFileQueueLen() const {
+    int result = 0;
 
-    if (!value) {
-        // When resuming publishing, update the canSleep flag
-        if (getNumEvents() != 0) {
-            canSleep = false;
-        }
+    for(uint8_t priority = 0; priority < PUBLISHQUEUE_NUM_PRIORITIES; priority++) {
+        result += getFileQueueLen(priority);
     }
+    return result;
 }
 
+int PublishQueuePosix::getFileQueueLen(uint8_t priority) const {
+    if (priorityUsesLog(priority)) {
+        return (int)(eventLog.getQueueLen() - getNumSkippedLogEvents());
+    }
+    else {
+        return fileQueues[priority].getQueueLen();
+    }
+}
 
-
-void PublishQueuePosix::checkQueueLimits() {
+void PublishQueuePosix::removeFileQueueEvent(uint8_t priority, int id) {
     WITH_LOCK(*this) {
-        if (ramQueue.size() > ramQueueSize) {
-            // RAM queue is too large, move all to files
-            writeQueueToFiles();
+        if (priorityUsesLog(priority)) {
+            eventLog.removeFront(id);
+            _log.trace("removed log event %d", id);
+            removeSkippedLogEvents();
         }
-
-        while(fileQueue.getQueueLen() > (int)fileQueueSize) {
-            int fileNum = fileQueue.getFileFromQueue(true);
-            if (fileNum) {
+        else {
+            SequentialFile &fileQueue = fileQueues[priority];
+            int fileNum = fileQueue.getFileFromQueue(false);
+            if (fileNum == id) {
+                fileQueue.getFileFromQueue(true);
                 fileQueue.removeFileNum(fileNum, false);
-                _log.info("discarded event %d", fileNum);
+                _log.trace("removed file %d", fileNum);
             }
         }
     }
 }
 
-size_t PublishQueuePosix::getNumEvents() {
-    size_t result = 0;
+void PublishQueuePosix::removeFileQueueEvents(uint8_t priority, const std::vector<int> &ids) {
+    if (ids.empty()) {
+        return;
+    }
 
     WITH_LOCK(*this) {
-        result = ramQueue.size();
-        if (result == 0) {
-            result = fileQueue.getQueueLen();
-
-            if (curEvent && curFileNum == 0) {
-                // This happens when we are sending an event from the RAM queue
-                // It's not in the RAM queue, but we want to count it, because
-                // otherwise getNumEvents would return 1 for the event sent from
-                // a file (because the file is not deleted until sent) and
-                // this makes the behavior consistent.
-                result++;
+        if (priorityUsesLog(priority)) {
+            // Retires everything through the last one with a single cursor file write
+            eventLog.removeFront(ids.back());
+            _log.trace("removed log events %d to %d", ids.front(), ids.back());
+            removeSkippedLogEvents();
+        }
+        else if (fileQueues[priority].getFileFromQueue(false) == ids.front()) {
+            // The events are consecutive in the queue, so this removes just them, saving the manifest once
+            fileQueues[priority].removeRange(ids.front(), ids.back(), false);
+            _log.trace("removed files %d to %d", ids.front(), ids.back());
+        }
+        else {
+            for(auto it = ids.begin(); it != ids.end(); it++) {
+                removeFileQueueEvent(priority, *it);
             }
         }
     }
-    return result;
 }
 
-void PublishQueuePosix::publishCompleteCallback(bool succeeded, const char *eventName, const char *eventData) {
-    publishComplete = true;
-    publishSuccess = succeeded;
+void PublishQueuePosix::readFileQueueEvents(uint8_t priority, int afterId, std::function<bool(PublishQueueEvent *event, int id, const PublishQueueExpiry &expiry)> fn) {
+    WITH_LOCK(*this) {
+        if (priorityUsesLog(priority)) {
+            PublishQueueLogCursor cursor = eventLog.getHead();
+            uint32_t endSeq = cursor.seq + (uint32_t)eventLog.getQueueLen();
+
+            while(cursor.seq != endSeq) {
+                int seq = (int)cursor.seq;
+                PublishQueueExpiry expiry = PublishQueueExpiry();
+                PublishQueueEvent *event = eventLog.readNext(cursor, &expiry);
+                if (seq <= afterId || isLogEventSkipped(seq)) {
+                    // Skip over events that are already being sent, were superseded, or expired
+                    PublishQueueEventPool::instance().release(event);
+                    if (!event) {
+                        break;
+                    }
+                    continue;
+                }
+                if (!fn(event, seq, expiry) || !event) {
+                    break;
+                }
+            }
+        }
+        else {
+            for(size_t index = 0; ; index++) {
+                int fileNum = fileQueues[priority].getFileFromQueueAt(index);
+                if (!fileNum) {
+                    break;
+                }
+                if (fileNum <= afterId) {
+                    continue;
+                }
+                PublishQueueExpiry expiry;
+                PublishQueueEvent *event = readQueueFile(priority, fileNum, &expiry);
+                if (!fn(event, fileNum, expiry) || !event) {
+                    break;
+                }
+            }
+        }
+    }
 }
 
+bool PublishQueuePosix::addToBatch(std::vector<PublishQueueEvent *> &events, size_t &dataLen, PublishQueueEvent *event) const {
+    size_t len = strlen(event->eventData);
 
-void PublishQueuePosix::stateConnectWait() {
-    canSleep = (pausePublishing || getNumEvents() == 0);
+    if (events.empty()) {
+        events.push_back(event);
+        dataLen = len + 2;
+        return true;
+    }
 
-    if (Particle.connected()) {
-        stateTime = millis();
-        durationMs = waitAfterConnect;
-        stateHandler = &PublishQueuePosix::stateWait;
+    const PublishQueueEvent *first = events.front();
+    if (events.size() >= maxBatchSize ||
+        first->eventData[0] != '{' ||
+        event->eventData[0] != '{' ||
+        strcmp(first->eventName, event->eventName) != 0 ||
+        first->flags.value() != event->flags.value() ||
+        dataLen + 1 + len > particle::protocol::MAX_EVENT_DATA_LENGTH) {
+        return false;
     }
+
+    events.push_back(event);
+    dataLen += 1 + len;
+    return true;
 }
 
+PublishQueueEvent *PublishQueuePosix::newBatchEvent(const std::vector<PublishQueueEvent *> &events, size_t dataLen) {
+    PublishQueueEvent *event;
 
-void PublishQueuePosix::stateWait() {
-    if (!Particle.connected()) {
-        stateHandler = &PublishQueuePosix::stateConnectWait;
-        return;
+    event = PublishQueueEventPool::instance().alloc(sizeof(PublishQueueEvent) + dataLen);
+    if (event) {
+        event->flags = events.front()->flags;
+        strcpy(event->eventName, events.front()->eventName);
+
+        char *cp = event->eventData;
+        *cp++ = '[';
+        for(auto it = events.begin(); it != events.end(); it++) {
+            if (it != events.begin()) {
+                *cp++ = ',';
+            }
+            size_t len = strlen((*it)->eventData);
+            memcpy(cp, (*it)->eventData, len);
+            cp += len;
+        }
+        *cp++ = ']';
+        *cp = 0;
     }
+    return event;
+}
 
-    if (pausePublishing) {
-        canSleep = true;
-        return;
-    }
+PublishQueueEvent *PublishQueuePosix::readFileQueueBatch(uint8_t priority, int afterId, std::vector<int> &fileNums) {
+    std::vector<PublishQueueEvent *> events;
+    size_t dataLen = 0;
+    int badId = 0;
+    std::vector<int> expiredIds;
+    bool timeValid = Time.isValid();
+    uint32_t now = (uint32_t)Time.now();
 
-    if (millis() - stateTime < durationMs) {
-        canSleep = (getNumEvents() == 0);
-        return;
-    }
-    
-    curFileNum = fileQueue.getFileFromQueue(false);
-    if (curFileNum) {
-        curEvent = readQueueFile(curFileNum);
-        if (!curEvent) {
-            // Probably a corrupted file, discard
-            _log.info("discarding corrupted file %d", curFileNum);
-            fileQueue.getFileFromQueue(true);
-            fileQueue.removeFileNum(curFileNum, false);
+    fileNums.clear();
+
+    readFileQueueEvents(priority, afterId, [&](PublishQueueEvent *event, int id, const PublishQueueExpiry &expiry) {
+        if (!event) {
+            if (events.empty()) {
+                badId = id;
+            }
+            return false;
         }
-    }
-    else {
-        if (!ramQueue.empty()) {
-            curEvent = ramQueue.front();
-            ramQueue.pop_front();
+        if (timeValid && expiry.isExpired(now)) {
+            // Includes events that expired while the device was off, which are not in expiryIndex
+            PublishQueueEventPool::instance().release(event);
+            expiredIds.push_back(id);
+            return true;
         }
-        else {
-            curEvent = NULL;
+        if (!addToBatch(events, dataLen, event)) {
+            PublishQueueEventPool::instance().release(event);
+            return false;
+        }
+        fileNums.push_back(id);
+        return events.size() < maxBatchSize;
+    });
+
+    for(auto it = expiredIds.begin(); it != expiredIds.end(); it++) {
+        if (removeQueuedEvent(priority, *it, NULL)) {
+            _log.trace("expired event %d priority %u", *it, priority);
+            metrics.numExpired++;
         }
     }
 
-    if (curEvent) {
-        stateTime = millis();
-        stateHandler = &PublishQueuePosix::statePublishWait;
-        publishComplete = false;
-        publishSuccess = false;
-        canSleep = false;
-
-        // This message is monitored by the automated test tool. If you edit this, change that too.
-        _log.trace("publishing %s event=%s data=%s", (curFileNum ? "file" : "ram"), curEvent->eventName, curEvent->eventData);
-
-        if (BackgroundPublishRK::instance().publish(curEvent->eventName, curEvent->eventData, curEvent->flags, 
-            [this](bool succeeded, const char *eventName, const char *eventData, const void *context) {
-                publishCompleteCallback(succeeded, eventName, eventData);
-            })) {
-            // Successfully started publish
+    if (events.empty()) {
+        if (badId) {
+            fileNums.push_back(badId);
         }
+        return NULL;
     }
-    else {
-        // No events, can sleep
-        canSleep = true;
-    }
-}
-void PublishQueuePosix::statePublishWait() {
-    if (!publishComplete) {
-        return;
+    if (events.size() == 1) {
+        return events.front();
     }
 
-    if (publishSuccess) {
-        // Remove from the queue
-        _log.trace("publish success %d", curFileNum);
-
-        if (curFileNum) {
-            // Was from the file-based queue
-            int fileNum = fileQueue.getFileFromQueue(false);
-            if (fileNum == curFileNum) {
-                fileQueue.getFileFromQueue(true);
+    PublishQueueEvent *result = newBatchEvent(events, dataLen);
+    if (!result) {
+        // Out of memory, send the oldest event by itself
+        fileNums.resize(1);
+        result = events.front();
+        events.erase(events.begin());
+    }
+    for(auto it = events.begin(); it != events.end(); it++) {
+        PublishQueueEventPool::instance().release(*it);
+    }
+    return result;
+}
+
+PublishQueueEvent *PublishQueuePosix::takeRamQueueBatch(uint8_t priority, std::vector<PublishQueueEvent *> &ramEvents) {
+    std::deque<PublishQueueEvent*> &ramQueue = ramQueues[priority];
+    std::vector<PublishQueueEvent *> events;
+    size_t dataLen = 0;
+
+    ramEvents.clear();
+
+    // The events stay in supersedeIndex and expiryIndex until the publish succeeds, so if
+    // they're put back they can still be superseded and still expire
+    WITH_LOCK(*this) {
+        while(!ramQueue.empty() && addToBatch(events, dataLen, ramQueue.front())) {
+            ramQueue.pop_front();
+        }
+    }
+
+    if (events.size() <= 1) {
+        return events.empty() ? NULL : events.front();
+    }
+
+    PublishQueueEvent *result = newBatchEvent(events, dataLen);
+    if (!result) {
+        // Out of memory, put back all but the oldest event and send it by itself
+        WITH_LOCK(*this) {
+            for(auto it = events.rbegin(); it + 1 != events.rend(); it++) {
+                ramQueue.push_front(*it);
+            }
+        }
+        return events.front();
+    }
+
+    // The originals are kept so they can be put back in the RAM queue if the publish fails
+    ramEvents = events;
+    return result;
+}
+
+void PublishQueuePosix::clearQueues() {
+    WITH_LOCK(*this) {
+        for(uint8_t priority = 0; priority < PUBLISHQUEUE_NUM_PRIORITIES; priority++) {
+            std::deque<PublishQueueEvent*> &ramQueue = ramQueues[priority];
+
+            while(!ramQueue.empty()) {
+                PublishQueueEvent *event = ramQueue.front();
+                ramQueue.pop_front();
+
+                PublishQueueEventPool::instance().release(event);
+            }
+
+            fileQueues[priority].removeAll(true);
+            enqueueMs[priority].clear();
+        }
+        if (useEventLog) {
+            eventLog.removeAll();
+            eventLog.load();
+        }
+        codec.clear();
+        supersedeIndex.clear();
+        expiryIndex.clear();
+        skippedLogSeqs.clear();
+    }
+
+    _log.trace("clearQueues");
+}
+
+void PublishQueuePosix::setPausePublishing(bool value) { 
+    pausePublishing = value; 
+
+    if (!value) {
+        // When resuming publishing, update the canSleep flag
+        if (getNumEvents() != 0) {
+            canSleep = false;
+        }
+    }
+}
+
+
+
+void PublishQueuePosix::checkQueueLimits() {
+    WITH_LOCK(*this) {
+        if (getRamQueueLen() > ramQueueSize && getRamQueueLen() > groupCommitMaxEvents) {
+            // RAM queue is too large, move all to files
+            writeQueueToFiles();
+        }
+
+        while(getFileQueueLen() > (int)fileQueueSize) {
+            // Discard the oldest event with the lowest priority
+            uint8_t priority = 0;
+            while(priority < PUBLISHQUEUE_NUM_PRIORITIES - 1 && getFileQueueLen(priority) == 0) {
+                priority++;
+            }
+            numEvicted[priority]++;
+
+            if (priorityUsesLog(priority)) {
+                _log.info("discarded event %d", eventLog.getFrontSeq());
+                eventLog.discardFront();
+                continue;
+            }
+            SequentialFile &fileQueue = fileQueues[priority];
+            int fileNum = fileQueue.getFileFromQueue(true);
+            if (fileNum) {
                 fileQueue.removeFileNum(fileNum, false);
-                _log.trace("removed file %d", fileNum);
+                _log.info("discarded event %d priority %u", fileNum, priority);
             }
-            curFileNum = 0;
         }
 
-        delete curEvent;
-        curEvent = NULL;
-        durationMs = waitBetweenPublish;
+        for(uint8_t priority = 0; priority < PUBLISHQUEUE_NUM_PRIORITIES; priority++) {
+            updateEnqueueTimes(priority, 0);
+        }
     }
-    else {
-        // Wait and retry
-        // This message is monitored by the automated test tool. If you edit this, change that too.
-        _log.trace("publish failed %d", curFileNum);
-        durationMs = waitAfterFailure;
+}
 
-        if (curFileNum) {
-            // Was from the file-based queue
-            delete curEvent;
-            curEvent = NULL;
+void PublishQueuePosix::supersede(const char *supersedeKey, uint8_t priority, PublishQueueEvent *event) {
+    auto entry = supersedeIndex.begin();
+    while(entry != supersedeIndex.end() && entry->key != supersedeKey) {
+        entry++;
+    }
+    if (entry == supersedeIndex.end()) {
+        PublishQueueSupersedeEntry newEntry;
+        newEntry.key = supersedeKey;
+        newEntry.priority = priority;
+        newEntry.ramEvent = event;
+        supersedeIndex.push_back(newEntry);
+        return;
+    }
+
+    if (removeQueuedEvent(entry->priority, entry->id, entry->ramEvent)) {
+        _log.trace("superseded %s", supersedeKey);
+        metrics.numSuperseded++;
+
+        for(auto it = expiryIndex.begin(); it != expiryIndex.end(); it++) {
+            if (it->priority == entry->priority && it->id == entry->id && it->ramEvent == entry->ramEvent) {
+                expiryIndex.erase(it);
+                break;
+            }
+        }
+    }
+
+    entry->priority = priority;
+    entry->id = 0;
+    entry->ramEvent = event;
+}
+
+bool PublishQueuePosix::removeQueuedEvent(uint8_t priority, int id, PublishQueueEvent *ramEvent) {
+    // Position of the old event in enqueueMs, which is file queue events then RAM queue events
+    std::deque<uint32_t> &times = enqueueMs[priority];
+    size_t timesIndex = times.size();
+    bool removed = false;
+
+    if (ramEvent) {
+        std::deque<PublishQueueEvent*> &ramQueue = ramQueues[priority];
+        auto it = std::find(ramQueue.begin(), ramQueue.end(), ramEvent);
+        if (it != ramQueue.end()) {
+            if (times.size() >= ramQueue.size()) {
+                timesIndex = times.size() - ramQueue.size() + (it - ramQueue.begin());
+            }
+            PublishQueueEventPool::instance().release(*it);
+            ramQueue.erase(it);
+            removed = true;
+        }
+    }
+    else if (id > getLastInFlightFileNum(priority)) {
+        // Events that are being sent are not removed
+        if (priorityUsesLog(priority)) {
+            int frontSeq = (int)eventLog.getHead().seq;
+            if (id >= frontSeq && id < frontSeq + (int)eventLog.getQueueLen() && !isLogEventSkipped(id)) {
+                auto it = std::lower_bound(skippedLogSeqs.begin(), skippedLogSeqs.end(), id);
+                timesIndex = (size_t)(id - frontSeq) - (size_t)(it - std::lower_bound(skippedLogSeqs.begin(), it, frontSeq));
+                skippedLogSeqs.insert(it, id);
+                removed = true;
+            }
+        }
+        else {
+            SequentialFile &fileQueue = fileQueues[priority];
+            for(size_t ii = 0; ; ii++) {
+                int fileNum = fileQueue.getFileFromQueueAt(ii);
+                if (!fileNum || fileNum == id) {
+                    timesIndex = fileNum ? ii : times.size();
+                    break;
+                }
+            }
+            if (fileQueue.removeFileFromQueue(id)) {
+                fileQueue.removeFileNum(id, false);
+                removed = true;
+            }
+        }
+    }
+
+    if (removed) {
+        if (timesIndex < times.size()) {
+            times.erase(times.begin() + timesIndex);
+        }
+        removeSkippedLogEvents();
+    }
+    return removed;
+}
+
+void PublishQueuePosix::removeExpiredEvents() {
+    WITH_LOCK(*this) {
+        uint32_t now = (uint32_t)Time.now();
+        bool haveNext = false;
+
+        for(auto it = expiryIndex.begin(); it != expiryIndex.end(); ) {
+            if (!it->expiry.isExpired(now)) {
+                uint32_t expires = it->expiry.enqueueTime + it->expiry.ttl;
+                if (!haveNext || (int32_t)(expires - nextExpiry) < 0) {
+                    nextExpiry = expires;
+                    haveNext = true;
+                }
+                it++;
+                continue;
+            }
+
+            if (it->ramEvent && isRamEventInFlight(it->ramEvent)) {
+                // Kept until the publish completes. putBackInFlight() checks it again if it fails.
+                it++;
+                continue;
+            }
+
+            // Events from the file queue that are being sent or were already removed are just dropped from the index
+            if (removeQueuedEvent(it->priority, it->id, it->ramEvent)) {
+                _log.trace("expired event %d priority %u", it->id, it->priority);
+                metrics.numExpired++;
+
+                for(auto sit = supersedeIndex.begin(); sit != supersedeIndex.end(); sit++) {
+                    if (sit->priority == it->priority && sit->id == it->id && sit->ramEvent == it->ramEvent) {
+                        supersedeIndex.erase(sit);
+                        break;
+                    }
+                }
+            }
+            it = expiryIndex.erase(it);
+        }
+
+        if (!haveNext) {
+            // Only expired events that are being sent are left
+            nextExpiry = now + 3600;
+        }
+    }
+}
+
+const PublishQueueExpiry *PublishQueuePosix::getRamEventExpiry(const PublishQueueEvent *event) const {
+    for(auto it = expiryIndex.begin(); it != expiryIndex.end(); it++) {
+        if (it->ramEvent == event) {
+            return &it->expiry;
+        }
+    }
+    return NULL;
+}
+
+bool PublishQueuePosix::isRamEventInFlight(const PublishQueueEvent *event) const {
+    for(size_t ii = 0; ii < inFlightCount; ii++) {
+        const PublishQueueInFlight &entry = getInFlight(ii);
+        if (!entry.fileNums.empty()) {
+            continue;
+        }
+        if (entry.event == event || std::find(entry.ramEvents.begin(), entry.ramEvents.end(), event) != entry.ramEvents.end()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void PublishQueuePosix::updateEventIndexes(const PublishQueueEvent *event, int id) {
+    for(auto it = supersedeIndex.begin(); it != supersedeIndex.end(); it++) {
+        if (it->ramEvent == event) {
+            if (id) {
+                it->id = id;
+                it->ramEvent = NULL;
+            }
+            else {
+                supersedeIndex.erase(it);
+            }
+            break;
+        }
+    }
+    for(auto it = expiryIndex.begin(); it != expiryIndex.end(); it++) {
+        if (it->ramEvent == event) {
+            if (id) {
+                it->id = id;
+                it->ramEvent = NULL;
+            }
+            else {
+                expiryIndex.erase(it);
+            }
+            break;
+        }
+    }
+}
+
+void PublishQueuePosix::removeSkippedLogEvents() {
+    if (skippedLogSeqs.empty()) {
+        return;
+    }
+
+    // Forget events that are no longer in the log
+    int frontSeq = (int)eventLog.getHead().seq;
+    skippedLogSeqs.erase(skippedLogSeqs.begin(), std::lower_bound(skippedLogSeqs.begin(), skippedLogSeqs.end(), frontSeq));
+
+    size_t count = 0;
+    while(count < skippedLogSeqs.size() && skippedLogSeqs[count] == frontSeq + (int)count) {
+        count++;
+    }
+    if (count) {
+        eventLog.removeFront(frontSeq + (int)count - 1);
+        skippedLogSeqs.erase(skippedLogSeqs.begin(), skippedLogSeqs.begin() + count);
+        _log.trace("removed %u skipped log events", (unsigned int)count);
+    }
+}
+
+bool PublishQueuePosix::isLogEventSkipped(int seq) const {
+    return std::binary_search(skippedLogSeqs.begin(), skippedLogSeqs.end(), seq);
+}
+
+size_t PublishQueuePosix::getNumSkippedLogEvents() const {
+    return skippedLogSeqs.end() - std::lower_bound(skippedLogSeqs.begin(), skippedLogSeqs.end(), (int)eventLog.getHead().seq);
+}
+
+void PublishQueuePosix::updateEnqueueTimes(uint8_t priority, size_t numAcked) {
+    std::deque<uint32_t> &times = enqueueMs[priority];
+
+    for(size_t ii = 0; ii < numAcked && !times.empty(); ii++) {
+        recordAck(times.front());
+        times.pop_front();
+    }
+
+    // Anything else removed was discarded from the front of the queue
+    size_t depth = getQueueDepth(priority);
+    while(times.size() > depth) {
+        times.pop_front();
+    }
+}
+
+void PublishQueuePosix::recordAck(uint32_t start) {
+    metrics.numAcked++;
+    if (start != 0) {
+        unsigned long elapsed = millis() - start;
+        size_t bucket = 0;
+        while(bucket < PublishQueueMetrics::NUM_LATENCY_BUCKETS - 1 && elapsed >= PublishQueueMetrics::latencyBucketMs[bucket]) {
+            bucket++;
+        }
+        metrics.latency[bucket]++;
+    }
+}
+
+size_t PublishQueuePosix::getNumEvents() {
+    size_t result = 0;
+
+    WITH_LOCK(*this) {
+        result = getRamQueueLen();
+        if (result == 0) {
+            result = getFileQueueLen();
+
+            for(size_t ii = 0; ii < inFlightCount; ii++) {
+                const PublishQueueInFlight &entry = getInFlight(ii);
+                if (entry.fileNums.empty()) {
+                    // This happens when we are sending an event from the RAM queue
+                    // It's not in the RAM queue, but we want to count it, because
+                    // otherwise getNumEvents would return 1 for the event sent from
+                    // a file (because the file is not deleted until sent) and
+                    // this makes the behavior consistent.
+                    result += entry.ramEvents.empty() ? 1 : entry.ramEvents.size();
+                }
+            }
+        }
+    }
+    return result;
+}
+
+void PublishQueuePosix::publishCompleteCallback(PublishQueueInFlight *entry, bool succeeded) {
+    WITH_LOCK(*this) {
+        entry->success = succeeded;
+        entry->completeMs = millis();
+        entry->complete = true;
+    }
+}
+
+int PublishQueuePosix::getLastInFlightFileNum(uint8_t priority) const {
+    int result = 0;
+
+    for(size_t ii = 0; ii < inFlightCount; ii++) {
+        const PublishQueueInFlight &entry = getInFlight(ii);
+        if (entry.priority == priority && !entry.fileNums.empty()) {
+            result = entry.fileNums.back();
+        }
+    }
+    return result;
+}
+
+bool PublishQueuePosix::startPublish() {
+    PublishQueueInFlight &entry = getInFlight(inFlightCount);
+
+    for(uint8_t priority = PUBLISHQUEUE_NUM_PRIORITIES; priority-- > 0; ) {
+        int afterId = getLastInFlightFileNum(priority);
+        entry.event = readFileQueueBatch(priority, afterId, entry.fileNums);
+        if (!entry.event && !entry.fileNums.empty()) {
+            // Probably a corrupted file. Discard it once it's the oldest event.
+            if (afterId == 0) {
+                _log.info("discarding corrupted file %d", entry.fileNums.front());
+                removeFileQueueEvent(priority, entry.fileNums.front());
+                metrics.numCorrupted++;
+                updateEnqueueTimes(priority, 0);
+            }
+            entry.fileNums.clear();
+            return false;
+        }
+        if (!entry.event) {
+            entry.event = takeRamQueueBatch(priority, entry.ramEvents);
+        }
+        if (entry.event) {
+            entry.priority = priority;
+            break;
+        }
+    }
+    if (!entry.event) {
+        return false;
+    }
+
+    entry.complete = false;
+    entry.success = false;
+    entry.startMs = millis();
+    inFlightCount++;
+    metrics.numAttempts += (uint32_t)entry.getNumEvents();
+
+    // This message is monitored by the automated test tool. If you edit this, change that too.
+    _log.trace("publishing %s event=%s data=%s", (entry.fileNums.empty() ? "ram" : "file"), entry.event->eventName, entry.event->eventData);
+
+    if (entry.fileNums.size() > 1 || !entry.ramEvents.empty()) {
+        _log.trace("batch of %u events", (unsigned int)(entry.fileNums.size() + entry.ramEvents.size()));
+    }
+
+    PublishQueueInFlight *pEntry = &entry;
+    if (!BackgroundPublishRK::instance().publish(entry.event->eventName, entry.event->eventData, entry.event->flags, 
+        [this, pEntry](bool succeeded, const char *eventName, const char *eventData, const void *context) {
+            (void)eventName;
+            (void)eventData;
+            (void)context;
+            publishCompleteCallback(pEntry, succeeded);
+        })) {
+        // All background publish slots are busy. Put the event back and try again later.
+        inFlightCount--;
+        putBackInFlight(entry);
+        return false;
+    }
+    return true;
+}
+
+void PublishQueuePosix::putBackInFlight(PublishQueueInFlight &entry) {
+    WITH_LOCK(*this) {
+        std::deque<PublishQueueEvent*> &ramQueue = ramQueues[entry.priority];
+        bool expiryDue = false;
+
+        if (!entry.fileNums.empty()) {
+            // Was from the file-based queue. All events in the batch are still in the queue.
+            PublishQueueEventPool::instance().release(entry.event);
+        }
+        else if (!entry.ramEvents.empty()) {
+            // Was a batch from the RAM-based queue. Put back the original events, not the combined one.
+            for(auto it = entry.ramEvents.rbegin(); it != entry.ramEvents.rend(); it++) {
+                ramQueue.push_front(*it);
+                expiryDue = expiryDue || getRamEventExpiry(*it);
+            }
+            PublishQueueEventPool::instance().release(entry.event);
         }
         else {
             // Was in the RAM-based queue, put back
+            ramQueue.push_front(entry.event);
+            expiryDue = getRamEventExpiry(entry.event) != NULL;
+        }
+
+        if (expiryDue) {
+            // The events may have expired while they were being sent
+            nextExpiry = (uint32_t)Time.now();
+        }
+
+        entry.event = NULL;
+        entry.fileNums.clear();
+        entry.ramEvents.clear();
+    }
+}
+
+void PublishQueuePosix::checkInFlight() {
+    if (!publishFailed) {
+        // A failure anywhere in flight stops new publishes, even if older ones are still waiting
+        for(size_t ii = 0; ii < inFlightCount; ii++) {
+            PublishQueueInFlight &entry = getInFlight(ii);
+
+            bool complete, success;
             WITH_LOCK(*this) {
-                ramQueue.push_front(curEvent);
+                complete = entry.complete;
+                success = entry.success;
             }
-            // Then write the entire queue to files
-            _log.trace("writing to files after publish failure");
-            writeQueueToFiles();
+            if (complete && !success) {
+                // Wait and retry
+                // This message is monitored by the automated test tool. If you edit this, change that too.
+                _log.trace("publish failed %d", entry.fileNums.empty() ? 0 : entry.fileNums.front());
+                publishFailed = true;
+                metrics.numFailures++;
+                updatePublishEstimates(entry);
+                durationMs = getFailureWaitMs();
+                stateTime = millis();
+                break;
+            }
+        }
+    }
+
+    while(inFlightCount > 0) {
+        PublishQueueInFlight &entry = getInFlight(0);
+
+        bool complete, success;
+        WITH_LOCK(*this) {
+            complete = entry.complete;
+            success = entry.success;
+        }
+        if (!complete) {
+            break;
+        }
+        int fileNum = entry.fileNums.empty() ? 0 : entry.fileNums.front();
+
+        if (!success) {
+            // Once everything started after the failed event completes, put back the events
+            // that were not sent so they are sent again in order
+            for(size_t ii = 1; ii < inFlightCount; ii++) {
+                WITH_LOCK(*this) {
+                    complete = getInFlight(ii).complete;
+                }
+                if (!complete) {
+                    return;
+                }
+            }
+
+            // With nothing in flight, removeQueuedEvent() can remove events from the middle of the queue
+            size_t count = inFlightCount;
+            inFlightCount = 0;
+
+            bool hasRamEvents = false;
+            for(size_t ii = count; ii-- > 0; ) {
+                PublishQueueInFlight &other = getInFlight(ii);
+                if (other.success) {
+                    // Already sent, so it's removed instead of being sent again
+                    _log.trace("publish success %d", other.fileNums.empty() ? 0 : other.fileNums.front());
+                    updatePublishEstimates(other);
+
+                    // The entries before it are still in enqueueMs, so its events come after theirs
+                    std::deque<uint32_t> &times = enqueueMs[other.priority];
+                    size_t timesIndex = 0;
+                    for(size_t jj = 0; jj < ii; jj++) {
+                        if (getInFlight(jj).priority == other.priority) {
+                            timesIndex += getInFlight(jj).getNumEvents();
+                        }
+                    }
+                    size_t numEvents = other.getNumEvents();
+                    for(size_t jj = timesIndex; jj < timesIndex + numEvents; jj++) {
+                        recordAck(jj < times.size() ? times[jj] : 0);
+                    }
+
+                    if (other.fileNums.empty()) {
+                        if (timesIndex < times.size()) {
+                            times.erase(times.begin() + timesIndex, times.begin() + std::min(timesIndex + numEvents, times.size()));
+                        }
+                    }
+                    else {
+                        // Also removes their enqueueMs entries
+                        for(auto it = other.fileNums.begin(); it != other.fileNums.end(); it++) {
+                            removeQueuedEvent(other.priority, *it, NULL);
+                        }
+                    }
+                    releaseInFlight(other);
+                    continue;
+                }
+                if (other.fileNums.empty()) {
+                    hasRamEvents = true;
+                }
+                putBackInFlight(other);
+            }
+            publishFailed = false;
+
+            if (hasRamEvents) {
+                // Then write the entire queue to files
+                _log.trace("writing to files after publish failure");
+                writeQueueToFiles();
+            }
+            break;
+        }
+
+        // Remove from the queue
+        _log.trace("publish success %d", fileNum);
+
+        updatePublishEstimates(entry);
+
+        size_t numEvents = entry.getNumEvents();
+
+        if (!entry.fileNums.empty()) {
+            // Was from the file-based queue
+            removeFileQueueEvents(entry.priority, entry.fileNums);
+        }
+        releaseInFlight(entry);
+
+        inFlightFirst = (inFlightFirst + 1) % inFlight.size();
+        inFlightCount--;
+        updateEnqueueTimes(entry.priority, numEvents);
+
+        if (maxInFlight == 1) {
+            // Wait between the end of one publish and the start of the next. With more than
+            // one in flight, stateWait() spaces out the start of each publish instead. In
+            // burst drain mode, burstTokens limits the rate instead.
+            durationMs = burstDrain ? 0 : getPublishGapMs();
+            stateTime = millis();
+        }
+    }
+}
+
+void PublishQueuePosix::releaseInFlight(PublishQueueInFlight &entry) {
+    WITH_LOCK(*this) {
+        if (entry.fileNums.empty() && entry.ramEvents.empty()) {
+            updateEventIndexes(entry.event, 0);
+        }
+        for(auto it = entry.ramEvents.begin(); it != entry.ramEvents.end(); it++) {
+            updateEventIndexes(*it, 0);
         }
     }
+    entry.fileNums.clear();
 
-    stateHandler = &PublishQueuePosix::stateWait;
-    stateTime = millis();
+    for(auto it = entry.ramEvents.begin(); it != entry.ramEvents.end(); it++) {
+        PublishQueueEventPool::instance().release(*it);
+    }
+    entry.ramEvents.clear();
+
+    PublishQueueEventPool::instance().release(entry.event);
+    entry.event = NULL;
 }
 
 
-PublishQueuePosix::PublishQueuePosix() {
-    fileQueue.withDirPath("/usr/pubqueue");
+void PublishQueuePosix::updatePublishEstimates(const PublishQueueInFlight &entry) {
+    unsigned long elapsed = entry.completeMs - entry.startMs;
+
+    // Expected worst-case publish time, like the TCP retransmission timeout
+    unsigned long rto = avgPublishMs + 4 * publishDevMs;
+
+    if (entry.success) {
+        // Only successful publishes measure the publish time; a lost one just times out
+        unsigned long diff = (elapsed > avgPublishMs) ? (elapsed - avgPublishMs) : (avgPublishMs - elapsed);
+        publishDevMs = (publishDevMs * 3 + diff) / 4;
+        avgPublishMs = (avgPublishMs * 7 + elapsed) / 8;
+
+        failureRate = failureRate * 7 / 8;
+        consecutiveFailures = 0;
+        adaptiveGapMs = adaptiveGapMs * 3 / 4;
+    }
+    else {
+        failureRate = failureRate * 7 / 8 + 1000 / 8;
+        consecutiveFailures++;
+
+        if (elapsed < rto) {
+            // Failed sooner than a lost acknowledgement would, so the cloud likely rejected 
+            // or throttled it. Slow down.
+            adaptiveGapMs = (adaptiveGapMs > waitBetweenPublish) ? adaptiveGapMs * 2 : waitBetweenPublish * 2;
+            if (adaptiveGapMs > maxPublishGap) {
+                adaptiveGapMs = maxPublishGap;
+            }
+        }
+    }
+    _log.trace("publish %s in %lu ms, avg=%lu dev=%lu failureRate=%u gap=%lu", (entry.success ? "succeeded" : "failed"), 
+        elapsed, avgPublishMs, publishDevMs, failureRate, getPublishGapMs());
 }
 
-PublishQueuePosix::~PublishQueuePosix() {
+unsigned long PublishQueuePosix::getPublishGapMs() const {
+    if (!adaptiveRetry) {
+        return waitBetweenPublish;
+    }
 
+    // Grows with the failure rate, up to the expected worst-case publish time at 100%
+    unsigned long result = waitBetweenPublish + (avgPublishMs + 4 * publishDevMs) * failureRate / 1000;
+    if (adaptiveGapMs > result) {
+        result = adaptiveGapMs;
+    }
+    if (result > maxPublishGap) {
+        result = maxPublishGap;
+    }
+    return (result > waitBetweenPublish) ? result : waitBetweenPublish;
 }
 
-void PublishQueuePosix::systemEventHandler(system_event_t event, int param) {
-    if ((event == reset) || ((event == cloud_status) && (param == cloud_status_disconnecting))) {
-        _log.trace("reset or disconnect event, save files to queue");
-        PublishQueuePosix::instance().writeQueueToFiles();
+unsigned long PublishQueuePosix::getFailureWaitMs() const {
+    if (!adaptiveRetry) {
+        return waitAfterFailure;
+    }
+
+    unsigned long result = avgPublishMs + 4 * publishDevMs;
+    if (result < minFailureWait) {
+        result = minFailureWait;
+    }
+    for(size_t ii = 1; ii < consecutiveFailures && result < maxFailureWait; ii++) {
+        result *= 2;
     }
+    return (result < maxFailureWait) ? result : maxFailureWait;
 }
 
+void PublishQueuePosix::refillBurstTokens() {
+    unsigned long elapsed = millis() - burstRefillMs;
+    if (elapsed >= waitBetweenPublish) {
+        size_t add = (waitBetweenPublish != 0) ? (elapsed / waitBetweenPublish) : PUBLISHQUEUE_BURST_SIZE;
+        burstTokens = (burstTokens + add < PUBLISHQUEUE_BURST_SIZE) ? burstTokens + add : PUBLISHQUEUE_BURST_SIZE;
+        burstRefillMs += (waitBetweenPublish != 0) ? add * waitBetweenPublish : elapsed;
+    }
+    if (burstTokens == PUBLISHQUEUE_BURST_SIZE) {
+        burstRefillMs = millis();
+    }
+}
+
+unsigned long PublishQueuePosix::startBurstDrain() {
+    if (getNumEvents() != 0) {
+        burstDrain = true;
+        if (maxInFlight == 1 && inFlightCount == 0) {
+            // Don't wait waitBetweenPublish after the previous publish
+            durationMs = 0;
+        }
+    }
+    unsigned long result = getTimeToEmptyMs();
+    _log.trace("startBurstDrain %u events, estimated %lu ms", (unsigned int)getNumEvents(), result);
+    return result;
+}
+
+unsigned long PublishQueuePosix::getTimeToEmptyMs() {
+    size_t numEvents = getNumEvents();
+    if (numEvents == 0) {
+        return 0;
+    }
+
+    size_t batchSize = (maxBatchSize > 1) ? maxBatchSize : 1;
+    unsigned long numPublishes = (numEvents + batchSize - 1) / batchSize;
+
+    // Publishes started before the queue is empty, limited by the number in flight and the rate limit
+    unsigned long completeBound = (numPublishes + maxInFlight - 1) / maxInFlight * avgPublishMs;
+    unsigned long rateBound;
+    if (burstDrain) {
+        refillBurstTokens();
+        rateBound = (numPublishes > burstTokens) ? (numPublishes - burstTokens) * waitBetweenPublish : 0;
+        rateBound += avgPublishMs;
+    }
+    else {
+        rateBound = (numPublishes - 1) * waitBetweenPublish + avgPublishMs;
+        if (maxInFlight == 1) {
+            // Also waits waitBetweenPublish after each publish completes
+            completeBound += (numPublishes - 1) * waitBetweenPublish;
+        }
+    }
+    unsigned long result = (completeBound > rateBound) ? completeBound : rateBound;
+
+    // Still waiting to start publishing
+    unsigned long elapsed = millis() - stateTime;
+    if (!stateWaitActive) {
+        result += waitAfterConnect;
+    }
+    else if ((durationMs > waitBetweenPublish || publishFailed) && elapsed < durationMs) {
+        result += durationMs - elapsed;
+    }
+    return result;
+}
+
+void PublishQueuePosix::stateConnectWait() {
+    checkInFlight();
+
+    canSleep = (pausePublishing || getNumEvents() == 0);
+
+    if (Particle.connected()) {
+        stateTime = millis();
+        durationMs = waitAfterConnect;
+        stateWaitActive = true;
+        stateHandler = &PublishQueuePosix::stateWait;
+    }
+}
+
+
+void PublishQueuePosix::stateWait() {
+    checkInFlight();
+
+    if (!Particle.connected()) {
+        // Burst drain mode ends when disconnected
+        burstDrain = false;
+        stateWaitActive = false;
+        stateHandler = &PublishQueuePosix::stateConnectWait;
+        return;
+    }
+
+    if (pausePublishing) {
+        canSleep = (inFlightCount == 0);
+        return;
+    }
+
+    if (burstDrain && inFlightCount == 0 && getNumEvents() == 0) {
+        _log.trace("burst drain complete");
+        burstDrain = false;
+    }
+    refillBurstTokens();
+
+    if (millis() - stateTime < durationMs || 
+        publishFailed ||
+        inFlightCount >= inFlight.size() ||
+        (burstDrain && burstTokens == 0) ||
+        BackgroundPublishRK::instance().getNumBusySlots() >= BackgroundPublishRK::instance().getNumSlots()) {
+        canSleep = (getNumEvents() == 0);
+        return;
+    }
+
+    if (startPublish()) {
+        // Publishes are started at most waitBetweenPublish apart, but do not need to wait
+        // for the previous one to complete if maxInFlight > 1. In burst drain mode, they
+        // are limited by burstTokens instead.
+        if (burstTokens > 0) {
+            burstTokens--;
+        }
+        stateTime = millis();
+        durationMs = burstDrain ? 0 : getPublishGapMs();
+        canSleep = false;
+    }
+    else {
+        // No events, can sleep
+        canSleep = (getNumEvents() == 0);
+    }
+}
+
+
+PublishQueuePosix::PublishQueuePosix() {
+    fileQueues[0].withDirPath("/usr/pubqueue");
+}
+
+PublishQueuePosix::~PublishQueuePosix() {
+
+}
+
+void PublishQueuePosix::systemEventHandler(system_event_t event, int param) {
+    if ((event == reset) || ((event == cloud_status) && (param == cloud_status_disconnecting))) {
+        _log.trace("reset or disconnect event, save files to queue");
+        PublishQueuePosix::instance().writeQueueToFiles();
+        PublishQueuePosix::instance().saveQueueManifests();
+    }
+}
+
+
+
+//
+// PublishQueueLog
+//
+
+PublishQueueLog::PublishQueueLog() {
+    head.seq = tail.seq = 1;
+    head.segment = tail.segment = 0;
+    head.reserved = tail.reserved = 0;
+    head.offset = tail.offset = 0;
+}
+
+PublishQueueLog::~PublishQueueLog() {
+
+}
+
+PublishQueueLog &PublishQueueLog::withSegments(size_t numSegments, size_t segmentSize) {
+    if (numSegments < 1) {
+        numSegments = 1;
+    }
+    if (numSegments > 255) {
+        numSegments = 255;
+    }
+    this->numSegments = numSegments;
+    this->segmentSize = segmentSize;
+    return *this;
+}
+
+bool PublishQueueLog::load() {
+    if (dirPath.length() <= 1) {
+        _log.error("unconfigured dirPath");
+        return false;
+    }
+    if (!SequentialFile::createDirIfNecessary(dirPath)) {
+        return false;
+    }
+
+    bool loaded = false;
+    bool configChanged = false;
+
+    char path[SequentialFile::PATH_BUF_SIZE];
+    getCursorPath(path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd != -1) {
+        PublishQueueLogCursorFile cf;
+        if (read(fd, &cf, sizeof(cf)) == (int)sizeof(cf) &&
+            cf.magic == CURSOR_MAGIC &&
+            cf.version == CURSOR_VERSION &&
+            cf.crc == SequentialFile::crc32(&cf, offsetof(PublishQueueLogCursorFile, crc))) {
+            if (cf.numSegments == numSegments && cf.segmentSize == segmentSize) {
+                head = cf.head;
+                tail = cf.tail;
+                loaded = true;
+            }
+            else {
+                _log.info("log segment configuration changed, discarding log");
+                configChanged = true;
+            }
+        }
+        else {
+            _log.info("log cursor file invalid, recovering from segments");
+        }
+        close(fd);
+    }
+
+    if (!loaded && !configChanged) {
+        // Each record has its own CRC, so the queue can be rebuilt without the cursors
+        loaded = recoverCursors();
+        if (loaded) {
+            saveCursors();
+        }
+    }
+
+    if (!loaded) {
+        // Start over with empty segments so stale records are not recovered below
+        removeAll();
+        saveCursors();
+    }
+
+    // Records may have been appended after the cursor file was last written
+    PublishQueueLogRecordHeader hdr;
+    while(readRecord(tail, hdr, NULL)) {
+        tail.offset += sizeof(PublishQueueLogRecordHeader) + hdr.size;
+        tail.seq++;
+    }
+
+    _log.trace("log loaded head=%lu tail=%lu len=%u", (unsigned long)head.seq, (unsigned long)tail.seq, (unsigned int)getQueueLen());
+    return true;
+}
+
+int PublishQueueLog::append(const PublishQueueEvent * const *events, size_t count, const PublishQueueExpiry *expiry) {
+    int firstSeq = 0;
+    bool failed = false;
+
+    writeBuf.clear();
+    PublishQueueLogCursor bufStart = tail;
+
+    for(size_t ii = 0; ii < count; ii++) {
+        const PublishQueueEvent *event = events[ii];
+
+        // Compact records must be encoded before anything is written, as this can add to the string table
+        uint16_t magic = RECORD_MAGIC;
+        const uint8_t *eventBytes = (const uint8_t *)event;
+        size_t eventSize = sizeof(PublishQueueEvent) + strlen(event->eventData);
+        bool hasExpiry = (expiry && expiry[ii].ttl != 0);
+
+        codecBuf.clear();
+        if (hasExpiry) {
+            const uint8_t *expiryBytes = (const uint8_t *)&expiry[ii];
+            codecBuf.insert(codecBuf.end(), expiryBytes, expiryBytes + sizeof(PublishQueueExpiry));
+        }
+        if (codec && encodeEvents && codec->encode(event, codecBuf)) {
+            magic = hasExpiry ? RECORD_MAGIC_COMPACT_EXPIRY : RECORD_MAGIC_COMPACT;
+            eventBytes = &codecBuf[0];
+            eventSize = codecBuf.size();
+        }
+        else if (hasExpiry) {
+            magic = RECORD_MAGIC_EXPIRY;
+            codecBuf.insert(codecBuf.end(), eventBytes, eventBytes + eventSize);
+            eventBytes = &codecBuf[0];
+            eventSize = codecBuf.size();
+        }
+
+        size_t recordSize = sizeof(PublishQueueLogRecordHeader) + eventSize;
+        if (recordSize > segmentSize) {
+            _log.error("event too large for log segment %u", (unsigned int)recordSize);
+            continue;
+        }
+
+        if (tail.offset + recordSize > segmentSize) {
+            // Does not fit in this segment. Write what's buffered, then move to the start of the next one.
+            if (!writeRecords(writeBuf, bufStart.offset)) {
+                failed = true;
+                break;
+            }
+            writeBuf.clear();
+            advanceTailSegment();
+            bufStart = tail;
+        }
+
+        PublishQueueLogRecordHeader hdr;
+        hdr.magic = magic;
+        hdr.size = (uint16_t) eventSize;
+        hdr.seq = tail.seq;
+        hdr.crc = SequentialFile::crc32(eventBytes, eventSize, SequentialFile::crc32(&hdr, offsetof(PublishQueueLogRecordHeader, crc)));
+
+        const uint8_t *hdrBytes = (const uint8_t *)&hdr;
+        writeBuf.insert(writeBuf.end(), hdrBytes, hdrBytes + sizeof(hdr));
+        writeBuf.insert(writeBuf.end(), eventBytes, eventBytes + eventSize);
+
+        if (!firstSeq) {
+            firstSeq = (int)tail.seq;
+        }
+        tail.offset += recordSize;
+        tail.seq++;
+    }
+
+    if (failed || !writeRecords(writeBuf, bufStart.offset)) {
+        // Everything buffered since the last segment change is lost
+        if (firstSeq >= (int)bufStart.seq) {
+            firstSeq = 0;
+        }
+        tail = bufStart;
+    }
+    writeBuf.clear();
+
+    return firstSeq;
+}
+
+bool PublishQueueLog::writeRecords(const std::vector<uint8_t> &buf, uint32_t offset) {
+    if (buf.empty()) {
+        return true;
+    }
+
+    char path[SequentialFile::PATH_BUF_SIZE];
+    getSegmentPath(tail.segment, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CREAT);
+    if (fd == -1) {
+        _log.error("failed to open log segment %u errno=%d", tail.segment, errno);
+        return false;
+    }
+    int count = -1;
+    if (lseek(fd, offset, SEEK_SET) == (off_t)offset) {
+        count = write(fd, &buf[0], buf.size());
+    }
+    close(fd);
+
+    if (count > 0) {
+        bytesWritten += count;
+    }
+    if (count != (int)buf.size()) {
+        _log.error("failed to write log segment %u count=%d errno=%d", tail.segment, count, errno);
+        return false;
+    }
+
+    return true;
+}
+
+void PublishQueueLog::advanceTailSegment() {
+    tail.segment = (uint16_t)((tail.segment + 1) % numSegments);
+    tail.offset = 0;
+
+    // Discard the oldest events if they are in the segment being reused
+    bool evicted = false;
+    while(getQueueLen() != 0) {
+        PublishQueueLogRecordHeader hdr;
+        if (!readRecord(head, hdr, NULL)) {
+            _log.error("log record %lu corrupted, discarding %u events", (unsigned long)head.seq, (unsigned int)getQueueLen());
+            numCorrupted += getQueueLen();
+            head = tail;
+            evicted = true;
+            break;
+        }
+        if (head.segment != tail.segment) {
+            break;
+        }
+        head.offset += sizeof(PublishQueueLogRecordHeader) + hdr.size;
+        head.seq++;
+        numOverwritten++;
+        evicted = true;
+    }
+    if (getQueueLen() == 0) {
+        head = tail;
+    }
+    if (evicted) {
+        saveCursors();
+    }
+}
+
+PublishQueueEvent *PublishQueueLog::readFront() {
+    if (getQueueLen() == 0) {
+        return NULL;
+    }
+
+    PublishQueueLogRecordHeader hdr;
+    PublishQueueEvent *event = NULL;
+    if (!readRecord(head, hdr, &event)) {
+        _log.error("log record %lu corrupted, discarding %u events", (unsigned long)head.seq, (unsigned int)getQueueLen());
+        numCorrupted += getQueueLen();
+        head = tail;
+        saveCursors();
+        return NULL;
+    }
+    return event;
+}
+
+PublishQueueEvent *PublishQueueLog::readNext(PublishQueueLogCursor &cursor, PublishQueueExpiry *expiry) {
+    if ((int32_t)(tail.seq - cursor.seq) <= 0) {
+        return NULL;
+    }
+
+    PublishQueueLogRecordHeader hdr;
+    PublishQueueEvent *event = NULL;
+    if (!readRecord(cursor, hdr, &event, expiry)) {
+        return NULL;
+    }
+    cursor.offset += sizeof(PublishQueueLogRecordHeader) + hdr.size;
+    cursor.seq++;
+
+    return event;
+}
+
+void PublishQueueLog::removeFront(int seq) {
+    bool removed = false;
+
+    while(getQueueLen() != 0 && (int32_t)(head.seq - (uint32_t)seq) <= 0) {
+        advanceHead();
+        removed = true;
+    }
+    if (removed) {
+        saveCursors();
+    }
+}
+
+void PublishQueueLog::discardFront() {
+    if (getQueueLen() != 0) {
+        advanceHead();
+        saveCursors();
+    }
+}
+
+void PublishQueueLog::removeAll() {
+    char path[SequentialFile::PATH_BUF_SIZE];
+
+    for(size_t segment = 0; segment < numSegments; segment++) {
+        getSegmentPath((uint16_t)segment, path, sizeof(path));
+        unlink(path);
+    }
+    getCursorPath(path, sizeof(path));
+    unlink(path);
+
+    head.seq = tail.seq = 1;
+    head.segment = tail.segment = 0;
+    head.offset = tail.offset = 0;
+    numOverwritten = 0;
+}
+
+void PublishQueueLog::getSegmentPath(uint16_t segment, char *buf, size_t bufSize) const {
+    // The names must not match the SequentialFile pattern (%08d) used for one-file-per-event
+    snprintf(buf, bufSize, "%s/seg%u", dirPath.c_str(), (unsigned int)segment);
+}
+
+void PublishQueueLog::getCursorPath(char *buf, size_t bufSize) const {
+    snprintf(buf, bufSize, "%s/cursor", dirPath.c_str());
+}
+
+bool PublishQueueLog::readRecordAt(const PublishQueueLogCursor &cursor, PublishQueueLogRecordHeader &hdr, PublishQueueEvent **event, PublishQueueExpiry *expiry) {
+    bool result = false;
+
+    if (cursor.offset + sizeof(PublishQueueLogRecordHeader) > segmentSize) {
+        return false;
+    }
+
+    char path[SequentialFile::PATH_BUF_SIZE];
+    getSegmentPath(cursor.segment, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    lseek(fd, cursor.offset, SEEK_SET);
+    bool hdrValid = (read(fd, &hdr, sizeof(hdr)) == (int)sizeof(hdr));
+
+    bool compact = (hdr.magic == RECORD_MAGIC_COMPACT || hdr.magic == RECORD_MAGIC_COMPACT_EXPIRY);
+    bool hasExpiry = (hdr.magic == RECORD_MAGIC_EXPIRY || hdr.magic == RECORD_MAGIC_COMPACT_EXPIRY);
+    size_t expirySize = hasExpiry ? sizeof(PublishQueueExpiry) : 0;
+
+    // Compact records are at least the flags; raw records are at least an empty event
+    size_t minEventSize = compact ? sizeof(PublishFlags) : sizeof(PublishQueueEvent);
+
+    if (hdrValid &&
+        (compact ? (codec != NULL) : (hdr.magic == RECORD_MAGIC || hdr.magic == RECORD_MAGIC_EXPIRY)) &&
+        hdr.seq == cursor.seq &&
+        hdr.size >= expirySize + minEventSize &&
+        hdr.size <= expirySize + sizeof(PublishQueueEvent) + particle::protocol::MAX_EVENT_DATA_LENGTH &&
+        cursor.offset + sizeof(hdr) + hdr.size <= segmentSize) {
+
+        codecBuf.resize(hdr.size);
+        if (read(fd, &codecBuf[0], hdr.size) == (int)hdr.size &&
+            hdr.crc == SequentialFile::crc32(&codecBuf[0], hdr.size, SequentialFile::crc32(&hdr, offsetof(PublishQueueLogRecordHeader, crc)))) {
+
+            if (expiry) {
+                *expiry = PublishQueueExpiry();
+                if (hasExpiry) {
+                    memcpy(expiry, &codecBuf[0], sizeof(PublishQueueExpiry));
+                }
+            }
+
+            const uint8_t *eventBytes = &codecBuf[expirySize];
+            size_t eventSize = hdr.size - expirySize;
+
+            if (compact) {
+                if (event) {
+                    // Decoded only when the event is needed, not when skipping over records
+                    *event = codec->decode(eventBytes, eventSize);
+                    result = (*event != NULL);
+                }
+                else {
+                    result = true;
+                }
+            }
+            else if (eventBytes[eventSize - 1] == 0) {
+                if (event) {
+                    *event = PublishQueueEventPool::instance().alloc(eventSize);
+                    if (*event) {
+                        memcpy(*event, eventBytes, eventSize);
+                        result = true;
+                    }
+                }
+                else {
+                    result = true;
+                }
+            }
+        }
+    }
+    close(fd);
+
+    return result;
+}
+
+bool PublishQueueLog::readRecord(PublishQueueLogCursor &cursor, PublishQueueLogRecordHeader &hdr, PublishQueueEvent **event, PublishQueueExpiry *expiry) {
+    if (readRecordAt(cursor, hdr, event, expiry)) {
+        return true;
+    }
+
+    if (cursor.offset != 0) {
+        // The writer moves to the start of the next segment when a record does not fit in the current one
+        PublishQueueLogCursor next = cursor;
+        next.segment = (uint16_t)((cursor.segment + 1) % numSegments);
+        next.offset = 0;
+        if (readRecordAt(next, hdr, event, expiry)) {
+            cursor = next;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool PublishQueueLog::recoverCursors() {
+    // The run of consecutive records at the start of each segment. A segment with no records has end offset 0.
+    std::vector<uint32_t> firstSeq(numSegments, 0);
+    std::vector<PublishQueueLogCursor> end(numSegments);
+
+    int newest = -1;
+    for(size_t segment = 0; segment < numSegments; segment++) {
+        char path[SequentialFile::PATH_BUF_SIZE];
+        getSegmentPath((uint16_t)segment, path, sizeof(path));
+        int fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            continue;
+        }
+        PublishQueueLogRecordHeader hdr;
+        bool hdrValid = (read(fd, &hdr, sizeof(hdr)) == (int)sizeof(hdr));
+        close(fd);
+        if (!hdrValid) {
+            continue;
+        }
+
+        PublishQueueLogCursor cursor;
+        cursor.seq = firstSeq[segment] = hdr.seq;
+        cursor.segment = (uint16_t)segment;
+        cursor.reserved = 0;
+        cursor.offset = 0;
+        while(readRecordAt(cursor, hdr, NULL)) {
+            cursor.offset += sizeof(PublishQueueLogRecordHeader) + hdr.size;
+            cursor.seq++;
+        }
+        end[segment] = cursor;
+
+        if (cursor.offset != 0 && (newest < 0 || (int32_t)(cursor.seq - end[newest].seq) > 0)) {
+            newest = (int)segment;
+        }
+    }
+    if (newest < 0) {
+        return false;
+    }
+
+    // Walk back from the newest segment while the segments before it continue the sequence
+    size_t oldest = (size_t)newest;
+    for(size_t ii = 1; ii < numSegments; ii++) {
+        size_t prev = (oldest + numSegments - 1) % numSegments;
+        if (end[prev].offset == 0 || end[prev].seq != firstSeq[oldest]) {
+            break;
+        }
+        oldest = prev;
+    }
+
+    head.seq = firstSeq[oldest];
+    head.segment = (uint16_t)oldest;
+    head.reserved = 0;
+    head.offset = 0;
+    tail = end[newest];
+
+    // Events already sent are resent if their segment has not been reused yet
+    _log.info("log recovered %u events from segments", (unsigned int)getQueueLen());
+    return true;
+}
+
+void PublishQueueLog::advanceHead() {
+    PublishQueueLogRecordHeader hdr;
+    if (readRecord(head, hdr, NULL)) {
+        head.offset += sizeof(PublishQueueLogRecordHeader) + hdr.size;
+        head.seq++;
+    }
+    else {
+        _log.error("log record %lu corrupted, discarding %u events", (unsigned long)head.seq, (unsigned int)getQueueLen());
+        numCorrupted += getQueueLen();
+        head = tail;
+    }
+}
+
+bool PublishQueueLog::saveCursors() {
+    PublishQueueLogCursorFile cf;
+    memset(&cf, 0, sizeof(cf));
+    cf.magic = CURSOR_MAGIC;
+    cf.version = CURSOR_VERSION;
+    cf.numSegments = (uint8_t) numSegments;
+    cf.segmentSize = (uint32_t) segmentSize;
+    cf.head = head;
+    cf.tail = tail;
+    cf.crc = SequentialFile::crc32(&cf, offsetof(PublishQueueLogCursorFile, crc));
+
+    // Rewritten in place; the file is only created the first time
+    char path[SequentialFile::PATH_BUF_SIZE];
+    getCursorPath(path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CREAT);
+    if (fd == -1) {
+        _log.error("failed to open log cursor file errno=%d", errno);
+        return false;
+    }
+    int count = write(fd, &cf, sizeof(cf));
+    close(fd);
+    if (count > 0) {
+        bytesWritten += count;
+    }
+    if (count != (int)sizeof(cf)) {
+        _log.error("failed to write log cursor file count=%d errno=%d", count, errno);
+        return false;
+    }
+    return true;
+}
+
+
+
+//
+// PublishQueueEventPool
+//
+
+// Slot sizes are rounded up to a multiple of 8 so a free slot can hold the free list pointer.
+// The storage arrays are uint64_t for the same alignment, with an extra element so they are
+// never zero-sized.
+#define POOL_SLOT_SIZE(size) ((((size) + 7) / 8) * 8)
+#define POOL_LARGE_SIZE POOL_SLOT_SIZE(sizeof(PublishQueueEvent) + particle::protocol::MAX_EVENT_DATA_LENGTH)
+
+static uint64_t poolSmallStorage[(PUBLISHQUEUE_POOL_SMALL_SLOTS * POOL_SLOT_SIZE(PUBLISHQUEUE_POOL_SMALL_SIZE)) / 8 + 1];
+static uint64_t poolMediumStorage[(PUBLISHQUEUE_POOL_MEDIUM_SLOTS * POOL_SLOT_SIZE(PUBLISHQUEUE_POOL_MEDIUM_SIZE)) / 8 + 1];
+static uint64_t poolLargeStorage[(PUBLISHQUEUE_POOL_LARGE_SLOTS * POOL_LARGE_SIZE) / 8 + 1];
+
+PublishQueueEventPool *PublishQueueEventPool::_instance;
+
+PublishQueueEventPool &PublishQueueEventPool::instance() {
+    if (!_instance) {
+        _instance = new PublishQueueEventPool();
+    }
+    return *_instance;
+}
+
+PublishQueueEventPool::PublishQueueEventPool() {
+    os_mutex_create(&mutex);
+
+    uint8_t *storage[NUM_SIZE_CLASSES] = { (uint8_t *)poolSmallStorage, (uint8_t *)poolMediumStorage, (uint8_t *)poolLargeStorage };
+    size_t slotSize[NUM_SIZE_CLASSES] = { POOL_SLOT_SIZE(PUBLISHQUEUE_POOL_SMALL_SIZE), POOL_SLOT_SIZE(PUBLISHQUEUE_POOL_MEDIUM_SIZE), POOL_LARGE_SIZE };
+    size_t numSlots[NUM_SIZE_CLASSES] = { PUBLISHQUEUE_POOL_SMALL_SLOTS, PUBLISHQUEUE_POOL_MEDIUM_SLOTS, PUBLISHQUEUE_POOL_LARGE_SLOTS };
+
+    for(size_t sizeClass = 0; sizeClass < NUM_SIZE_CLASSES; sizeClass++) {
+        Slab &slab = slabs[sizeClass];
+        slab.storage = storage[sizeClass];
+        slab.slotSize = slotSize[sizeClass];
+        slab.numSlots = numSlots[sizeClass];
+        slab.freeList = NULL;
+        slab.inUse = slab.highWater = 0;
+
+        // Build the free list so the first slot is allocated first
+        for(size_t ii = slab.numSlots; ii-- > 0; ) {
+            void *slot = &slab.storage[ii * slab.slotSize];
+            *(void **)slot = slab.freeList;
+            slab.freeList = slot;
+        }
+    }
+}
+
+PublishQueueEventPool::~PublishQueueEventPool() {
+
+}
+
+PublishQueueEvent *PublishQueueEventPool::alloc(size_t size) {
+    void *result = NULL;
+    bool fromHeap = false;
+
+    os_mutex_lock(mutex);
+
+    // Smallest size class that fits and has a free slot
+    for(size_t sizeClass = 0; sizeClass < NUM_SIZE_CLASSES; sizeClass++) {
+        Slab &slab = slabs[sizeClass];
+        if (size <= slab.slotSize && slab.freeList) {
+            result = slab.freeList;
+            slab.freeList = *(void **)result;
+            if (++slab.inUse > slab.highWater) {
+                slab.highWater = slab.inUse;
+            }
+            break;
+        }
+    }
+
+    if (!result) {
+        result = new char[size];
+        if (result) {
+            heapFallbacks++;
+            heapInUse++;
+            fromHeap = true;
+        }
+    }
+
+    os_mutex_unlock(mutex);
+
+    if (fromHeap) {
+        _log.trace("event pool has no free slot for %u bytes, using heap", (unsigned int)size);
+    }
+
+    return (PublishQueueEvent *)result;
+}
+
+void PublishQueueEventPool::release(PublishQueueEvent *event) {
+    if (!event) {
+        return;
+    }
+    uint8_t *p = (uint8_t *)event;
+
+    os_mutex_lock(mutex);
+
+    bool found = false;
+    for(size_t sizeClass = 0; sizeClass < NUM_SIZE_CLASSES; sizeClass++) {
+        Slab &slab = slabs[sizeClass];
+        if (p >= slab.storage && p < &slab.storage[slab.numSlots * slab.slotSize]) {
+            *(void **)p = slab.freeList;
+            slab.freeList = p;
+            slab.inUse--;
+            found = true;
+            break;
+        }
+    }
+
+    if (!found) {
+        delete[] (char *)event;
+        heapInUse--;
+    }
+
+    os_mutex_unlock(mutex);
+}
+
+void PublishQueueEventPool::logStats() const {
+    static const char * const names[NUM_SIZE_CLASSES] = { "small", "medium", "large" };
+
+    for(size_t sizeClass = 0; sizeClass < NUM_SIZE_CLASSES; sizeClass++) {
+        const Slab &slab = slabs[sizeClass];
+        _log.info("event pool %s (%u bytes): %u of %u in use, high-water %u", names[sizeClass], 
+            (unsigned int)slab.slotSize, (unsigned int)slab.inUse, (unsigned int)slab.numSlots, (unsigned int)slab.highWater);
+    }
+    _log.info("event pool heap fallbacks: %u, %u in use", (unsigned int)heapFallbacks, (unsigned int)heapInUse);
+}
+
+//
+// PublishQueueCodec
+//
+
+// Values are stored 4 bits per character
+static const uint8_t CODEC_NIBBLE_PERIOD = 10;
+static const uint8_t CODEC_NIBBLE_MINUS = 11;
+static const uint8_t CODEC_NIBBLE_END = 0xf;
+
+static bool codecIsDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static uint8_t codecGetNibble(const uint8_t *values, size_t index) {
+    return (index & 1) ? (values[index / 2] & 0xf) : (values[index / 2] >> 4);
+}
+
+void PublishQueueCodec::load() {
+    strings.clear();
+    full = false;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+
+    struct stat sb;
+    fstat(fd, &sb);
+
+    std::vector<char> buf(sb.st_size);
+    if (!buf.empty() && read(fd, &buf[0], buf.size()) == (int)buf.size()) {
+        // Each string is a 16-bit length followed by the string and a null terminator
+        size_t offset = 0;
+        while(offset + sizeof(uint16_t) <= buf.size() && strings.size() < MAX_STRINGS) {
+            uint16_t len;
+            memcpy(&len, &buf[offset], sizeof(uint16_t));
+            offset += sizeof(uint16_t);
+            if (offset + len >= buf.size() || buf[offset + len] != 0) {
+                // Partially written, possibly reset while writing
+                full = true;
+                break;
+            }
+            strings.push_back(String(&buf[offset]));
+            offset += len + 1;
+        }
+    }
+    close(fd);
+
+    _log.trace("codec loaded %u strings", (unsigned int)strings.size());
+}
+
+void PublishQueueCodec::clear() {
+    if (!strings.empty() || full) {
+        _log.trace("codec cleared %u strings", (unsigned int)strings.size());
+    }
+    unlink(path);
+    strings.clear();
+    full = false;
+}
+
+uint8_t PublishQueueCodec::lookup(const char *str, size_t len) const {
+    for(size_t ii = 0; ii < strings.size(); ii++) {
+        if (strings[ii].length() == len && memcmp(strings[ii].c_str(), str, len) == 0) {
+            return (uint8_t)ii;
+        }
+    }
+    return INLINE;
+}
+
+uint8_t PublishQueueCodec::intern(const char *str, size_t len) {
+    uint8_t index = lookup(str, len);
+    if (index != INLINE || full || strings.size() >= MAX_STRINGS) {
+        return index;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT);
+    if (fd == -1) {
+        return INLINE;
+    }
+
+    // The string must be in the file before any event that refers to it
+    std::vector<char> buf(sizeof(uint16_t) + len + 1);
+    uint16_t len16 = (uint16_t)len;
+    memcpy(&buf[0], &len16, sizeof(uint16_t));
+    memcpy(&buf[sizeof(uint16_t)], str, len + 1);
+
+    lseek(fd, 0, SEEK_END);
+    bool written = (write(fd, &buf[0], buf.size()) == (int)buf.size());
+    close(fd);
+
+    if (!written) {
+        // Strings appended after a partial one could not be found by load()
+        _log.error("codec string table write failed");
+        full = true;
+        return INLINE;
+    }
+
+    strings.push_back(String(str));
+    return (uint8_t)(strings.size() - 1);
+}
+
+bool PublishQueueCodec::encode(const PublishQueueEvent *event, std::vector<uint8_t> &buf) {
+    // Split the data into the template and values
+    templateBuf.clear();
+    valueBuf.clear();
+    for(const char *cp = event->eventData; *cp; ) {
+        if (*cp == VALUE_MARKER) {
+            return false;
+        }
+        if (codecIsDigit(*cp) || (*cp == '-' && codecIsDigit(cp[1]))) {
+            templateBuf.push_back((char)VALUE_MARKER);
+            valueBuf.push_back((*cp == '-') ? CODEC_NIBBLE_MINUS : (uint8_t)(*cp - '0'));
+            for(cp++; codecIsDigit(*cp) || *cp == '.'; cp++) {
+                valueBuf.push_back((*cp == '.') ? CODEC_NIBBLE_PERIOD : (uint8_t)(*cp - '0'));
+            }
+            valueBuf.push_back(CODEC_NIBBLE_END);
+        }
+        else {
+            templateBuf.push_back(*cp++);
+        }
+    }
+    templateBuf.push_back(0);
+    size_t templateLen = templateBuf.size() - 1;
+
+    size_t nameLen = strnlen(event->eventName, sizeof(PublishQueueEvent::eventName) - 1);
+    size_t eventSize = sizeof(PublishQueueEvent) + strlen(event->eventData);
+
+    // Size if the name and template are in the table, adding them if they're new. Checked before
+    // adding anything, as adding a string writes to the file and uses up a table entry.
+    // The name is added first, as intern() is called in that order below.
+    size_t room = full ? 0 : (MAX_STRINGS - strings.size());
+    size_t bestSize = sizeof(PublishFlags) + 1 + 1 + (valueBuf.size() + 1) / 2;
+    if (lookup(event->eventName, nameLen) == INLINE) {
+        if (room) {
+            room--;
+        }
+        else {
+            bestSize += nameLen + 1;
+        }
+    }
+    if (templateLen == 0 || (lookup(&templateBuf[0], templateLen) == INLINE && !room)) {
+        bestSize += templateLen + 1;
+    }
+    if (bestSize >= eventSize) {
+        return false;
+    }
+
+    size_t start = buf.size();
+
+    const uint8_t *flagBytes = (const uint8_t *)&event->flags;
+    buf.insert(buf.end(), flagBytes, flagBytes + sizeof(PublishFlags));
+
+    uint8_t index = intern(event->eventName, nameLen);
+    buf.push_back(index);
+    if (index == INLINE) {
+        buf.insert(buf.end(), event->eventName, event->eventName + nameLen);
+        buf.push_back(0);
+    }
+
+    index = (templateLen == 0) ? INLINE : intern(&templateBuf[0], templateLen);
+    buf.push_back(index);
+    if (index == INLINE) {
+        buf.insert(buf.end(), templateBuf.begin(), templateBuf.end());
+    }
+
+    for(size_t ii = 0; ii < valueBuf.size(); ii += 2) {
+        uint8_t low = (ii + 1 < valueBuf.size()) ? valueBuf[ii + 1] : CODEC_NIBBLE_END;
+        buf.push_back((uint8_t)((valueBuf[ii] << 4) | low));
+    }
+
+    if (buf.size() - start >= eventSize) {
+        // No smaller than storing the event as-is, as the table could not be written
+        buf.resize(start);
+        return false;
+    }
+    return true;
+}
+
+bool PublishQueueCodec::decodeString(const uint8_t *&cp, const uint8_t *end, const char *&str, size_t &len) const {
+    if (cp >= end) {
+        return false;
+    }
+    uint8_t index = *cp++;
+    if (index != INLINE) {
+        if (index >= strings.size()) {
+            return false;
+        }
+        str = strings[index].c_str();
+        len = strings[index].length();
+        return true;
+    }
+
+    const uint8_t *nullPtr = (const uint8_t *)memchr(cp, 0, end - cp);
+    if (!nullPtr) {
+        return false;
+    }
+    str = (const char *)cp;
+    len = nullPtr - cp;
+    cp = nullPtr + 1;
+    return true;
+}
+
+PublishQueueEvent *PublishQueueCodec::decode(const uint8_t *buf, size_t len) const {
+    const uint8_t *end = buf + len;
+    const uint8_t *cp = buf;
+
+    if (len < sizeof(PublishFlags)) {
+        return NULL;
+    }
+    PublishFlags flags;
+    memcpy(&flags, cp, sizeof(PublishFlags));
+    cp += sizeof(PublishFlags);
+
+    const char *name, *templ;
+    size_t nameLen, templLen;
+    if (!decodeString(cp, end, name, nameLen) || !decodeString(cp, end, templ, templLen) ||
+        nameLen >= sizeof(PublishQueueEvent::eventName)) {
+        return NULL;
+    }
+
+    // First pass finds the size of the data and checks that there's a value for each marker
+    const uint8_t *values = cp;
+    size_t numNibbles = (end - cp) * 2;
+    size_t nibble = 0;
+    size_t dataLen = 0;
+    for(size_t ii = 0; ii < templLen; ii++) {
+        if (templ[ii] != VALUE_MARKER) {
+            dataLen++;
+            continue;
+        }
+        while(true) {
+            if (nibble >= numNibbles) {
+                return NULL;
+            }
+            uint8_t n = codecGetNibble(values, nibble++);
+            if (n == CODEC_NIBBLE_END) {
+                break;
+            }
+            if (n > CODEC_NIBBLE_MINUS) {
+                return NULL;
+            }
+            dataLen++;
+        }
+    }
+    if (dataLen > particle::protocol::MAX_EVENT_DATA_LENGTH) {
+        return NULL;
+    }
+
+    PublishQueueEvent *event = PublishQueueEventPool::instance().alloc(sizeof(PublishQueueEvent) + dataLen);
+    if (!event) {
+        return NULL;
+    }
+    event->flags = flags;
+    memcpy(event->eventName, name, nameLen);
+    event->eventName[nameLen] = 0;
+
+    // Second pass expands the data
+    char *dp = event->eventData;
+    nibble = 0;
+    for(size_t ii = 0; ii < templLen; ii++) {
+        if (templ[ii] != VALUE_MARKER) {
+            *dp++ = templ[ii];
+            continue;
+        }
+        for(uint8_t n = codecGetNibble(values, nibble++); n != CODEC_NIBBLE_END; n = codecGetNibble(values, nibble++)) {
+            *dp++ = (n == CODEC_NIBBLE_PERIOD) ? '.' : ((n == CODEC_NIBBLE_MINUS) ? '-' : (char)('0' + n));
+        }
+    }
+    *dp = 0;
+
+    return event;
+}
@@ -8,6 +8,7 @@
 #include "SequentialFileRK.h"
 
 #include <deque>
+#include <vector>
 
 /**
  * @brief Structure stored before the event data in files on the flash file system
@@ -15,6 +16,9 @@
  * Each file is sequentially numbered and has one event. The contents of the file
  * are this header (8 bytes) followed by the PublishQueueEvent structure, which
  * is variably sized based on the size of the event.    
+ * 
+ * For an event with a time-to-live, headerSize includes a PublishQueueExpiry that 
+ * follows this header.
  */
 struct PublishQueueFileHeader {
     uint32_t magic;         //!< PublishQueuePosix::FILE_MAGIC = 0x31b67663
@@ -23,10 +27,25 @@ struct PublishQueueFileHeader {
     uint16_t nameLen;       //!< sizeof(PublishQueueEvent::eventName) = 64
 };
 
+/**
+ * @brief When an event with a time-to-live was published and how long it lasts
+ * 
+ * Stored with the event in the file queue and log store. See PublishQueuePosix::withTtlRule().
+ */
+struct PublishQueueExpiry {
+    uint32_t enqueueTime;   //!< Time.now() value when the event was published
+    uint32_t ttl;           //!< Seconds after enqueueTime the event expires, or 0 if it does not expire
+
+    /**
+     * @brief Returns true if the event has expired at time now (from Time.now())
+     */
+    bool isExpired(uint32_t now) const { return ttl != 0 && (int32_t)(now - (enqueueTime + ttl)) >= 0; };
+};
+
 /**
  * @brief Structure to hold an event in RAM or in files
  * 
- * In RAM, this structure is stored in the ramQueue. 
+ * In RAM, this structure is stored in one of the ramQueues. 
  * 
  * On the flash file system, each file contains one event and consists of the
  * PublishQueueFileHeader above (8 bytes) plus this structure.
@@ -40,6 +59,712 @@ struct PublishQueueEvent {
     char eventData[1]; //!< Variable size event data
 };
 
+#ifndef PUBLISHQUEUE_POOL_SMALL_SLOTS
+/**
+ * @brief Number of small slots in PublishQueueEventPool (default: 8, can be 0)
+ */
+#define PUBLISHQUEUE_POOL_SMALL_SLOTS 8
+#endif
+
+#ifndef PUBLISHQUEUE_POOL_SMALL_SIZE
+/**
+ * @brief Size of each small slot in bytes, including the PublishQueueEvent header (default: 256)
+ */
+#define PUBLISHQUEUE_POOL_SMALL_SIZE 256
+#endif
+
+#ifndef PUBLISHQUEUE_POOL_MEDIUM_SLOTS
+/**
+ * @brief Number of medium slots in PublishQueueEventPool (default: 4, can be 0)
+ */
+#define PUBLISHQUEUE_POOL_MEDIUM_SLOTS 4
+#endif
+
+#ifndef PUBLISHQUEUE_POOL_MEDIUM_SIZE
+/**
+ * @brief Size of each medium slot in bytes, including the PublishQueueEvent header (default: 512)
+ */
+#define PUBLISHQUEUE_POOL_MEDIUM_SIZE 512
+#endif
+
+#ifndef PUBLISHQUEUE_POOL_LARGE_SLOTS
+/**
+ * @brief Number of large slots in PublishQueueEventPool (default: 2, can be 0)
+ * 
+ * Large slots hold an event with the maximum event data size.
+ */
+#define PUBLISHQUEUE_POOL_LARGE_SLOTS 2
+#endif
+
+#ifndef PUBLISHQUEUE_NUM_PRIORITIES
+/**
+ * @brief Number of event priorities in PublishQueuePosix (default: 3)
+ * 
+ * Each priority has its own RAM queue and file queue. Priority 0 is the default and the lowest.
+ */
+#define PUBLISHQUEUE_NUM_PRIORITIES 3
+#endif
+
+#ifndef PUBLISHQUEUE_BURST_SIZE
+/**
+ * @brief Number of publishes that can be sent back-to-back in burst drain mode (default: 4)
+ * 
+ * The Particle cloud allows a burst of up to 4 publishes, then an average of 1 per second.
+ */
+#define PUBLISHQUEUE_BURST_SIZE 4
+#endif
+
+/**
+ * @brief Fixed-size slab pool for PublishQueueEvent structures
+ * 
+ * Events are variably sized and short-lived, and allocating them from the heap for months
+ * at a time fragments it. Instead, events are allocated from three size classes of slots
+ * in statically allocated memory. An event uses the smallest free slot that fits it. The
+ * heap is only used when there is no free slot large enough.
+ * 
+ * The number and size of slots are set at compile time using the PUBLISHQUEUE_POOL_ 
+ * defines. With the defaults, the pool uses about 6 Kbytes of RAM.
+ * 
+ * It's safe to call alloc() and release() from different threads.
+ */
+class PublishQueueEventPool {
+public:
+    /**
+     * @brief Gets the singleton instance of this class
+     */
+    static PublishQueueEventPool &instance();
+
+    /**
+     * @brief Allocate memory for an event
+     * 
+     * @param size Size in bytes, typically sizeof(PublishQueueEvent) + strlen(eventData)
+     * 
+     * May return NULL if out of memory. The contents are not initialized. Free the result
+     * using release(), not delete.
+     */
+    PublishQueueEvent *alloc(size_t size);
+
+    /**
+     * @brief Free an event allocated using alloc(). NULL is ignored.
+     */
+    void release(PublishQueueEvent *event);
+
+    /**
+     * @brief Gets the size of each slot in a size class in bytes
+     * 
+     * @param sizeClass 0 (small), 1 (medium), or 2 (large)
+     */
+    size_t getSlotSize(size_t sizeClass) const { return (sizeClass < NUM_SIZE_CLASSES) ? slabs[sizeClass].slotSize : 0; };
+
+    /**
+     * @brief Gets the number of slots in a size class
+     */
+    size_t getNumSlots(size_t sizeClass) const { return (sizeClass < NUM_SIZE_CLASSES) ? slabs[sizeClass].numSlots : 0; };
+
+    /**
+     * @brief Gets the number of slots in a size class currently allocated
+     */
+    size_t getInUse(size_t sizeClass) const { return (sizeClass < NUM_SIZE_CLASSES) ? slabs[sizeClass].inUse : 0; };
+
+    /**
+     * @brief Gets the largest number of slots in a size class allocated at the same time
+     */
+    size_t getHighWater(size_t sizeClass) const { return (sizeClass < NUM_SIZE_CLASSES) ? slabs[sizeClass].highWater : 0; };
+
+    /**
+     * @brief Gets the number of times an event was allocated from the heap because no slot was free
+     */
+    size_t getHeapFallbacks() const { return heapFallbacks; };
+
+    /**
+     * @brief Gets the number of events currently allocated from the heap
+     */
+    size_t getHeapInUse() const { return heapInUse; };
+
+    /**
+     * @brief Log the slot usage, high-water marks, and heap fallbacks at info level
+     */
+    void logStats() const;
+
+    /**
+     * @brief Number of slot size classes
+     */
+    static const size_t NUM_SIZE_CLASSES = 3;
+
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueEventPool(const PublishQueueEventPool&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueEventPool& operator=(const PublishQueueEventPool&) = delete;
+
+protected:
+    /**
+     * @brief Constructor. Use instance() to get the singleton instance.
+     */
+    PublishQueueEventPool();
+
+    /**
+     * @brief Destructor. The singleton is never deleted.
+     */
+    virtual ~PublishQueueEventPool();
+
+    /**
+     * @brief Slots of one size class
+     */
+    struct Slab {
+        uint8_t *storage;       //!< numSlots * slotSize bytes of statically allocated memory
+        size_t slotSize;        //!< Size of each slot in bytes, a multiple of 8
+        size_t numSlots;        //!< Number of slots
+        void *freeList;         //!< First free slot. Each free slot holds a pointer to the next.
+        size_t inUse;           //!< Number of slots allocated
+        size_t highWater;       //!< Maximum value of inUse
+    };
+
+    Slab slabs[NUM_SIZE_CLASSES];   //!< Size classes, smallest first
+    size_t heapFallbacks = 0;       //!< Allocations from the heap because no slot was free
+    size_t heapInUse = 0;           //!< Heap allocations not yet released
+    os_mutex_t mutex = 0;           //!< Protects slabs and the counters
+
+    static PublishQueueEventPool *_instance; //!< singleton instance of this class
+};
+
+/**
+ * @brief Compact encoding of events stored in flash, see PublishQueuePosix::withCompactEncoding()
+ * 
+ * Event names and the text of the event data are interned in a table of strings that is 
+ * persisted in a small file, so each event only stores their index. The event data is
+ * split into a template and values: each number in the data (an optional minus sign, a 
+ * digit, then digits and periods) is replaced by a marker in the template, and the numbers
+ * are stored separately two characters per byte. Events from a device that always sends
+ * the same JSON keys in the same order share one template, so an event of a few hundred
+ * bytes is stored in a few tens of bytes.
+ * 
+ * Encoded events are:
+ * 
+ * - The PublishFlags
+ * - The index of the event name in the table, or INLINE followed by the c-string name
+ * - The index of the template, or INLINE followed by the c-string template
+ * - The values, 4 bits per character, each value terminated by 0xF
+ * 
+ * The table holds up to MAX_STRINGS strings. Once it's full, new names and templates are 
+ * stored in the event. Entries are never removed while events may refer to them; the 
+ * table is emptied when the queue is empty at setup() and by clearQueues().
+ * 
+ * This class does not do its own locking. PublishQueuePosix only calls it with its queue
+ * mutex locked.
+ */
+class PublishQueueCodec {
+public:
+    /**
+     * @brief Sets the pathname of the string table file
+     */
+    PublishQueueCodec &withPath(const char *path) { this->path = path; return *this; };
+
+    /**
+     * @brief Load the string table from the file
+     */
+    void load();
+
+    /**
+     * @brief Remove the string table file and empty the table
+     */
+    void clear();
+
+    /**
+     * @brief Append the encoded event to buf
+     * 
+     * @return false if the event cannot be encoded or the encoding is not smaller than the
+     * event, in which case buf is unchanged and the event must be stored unencoded
+     * 
+     * New event names and templates are only added to the table once the encoding is known
+     * to be smaller, so events stored unencoded don't use up the table.
+     */
+    bool encode(const PublishQueueEvent *event, std::vector<uint8_t> &buf);
+
+    /**
+     * @brief Decode an event into a PublishQueueEvent allocated from PublishQueueEventPool
+     * 
+     * @return The event, or NULL if buf is not a valid encoded event. Release it using
+     * PublishQueueEventPool::release().
+     */
+    PublishQueueEvent *decode(const uint8_t *buf, size_t len) const;
+
+    /**
+     * @brief Gets the number of strings in the table
+     */
+    size_t getNumStrings() const { return strings.size(); };
+
+    /**
+     * @brief Maximum number of strings in the table
+     */
+    static const size_t MAX_STRINGS = 254;
+
+    /**
+     * @brief Index meaning the string follows in the event instead of being in the table
+     */
+    static const uint8_t INLINE = 0xff;
+
+    /**
+     * @brief Character in a template where a value goes
+     */
+    static const char VALUE_MARKER = 0x01;
+
+protected:
+    /**
+     * @brief Find a string in the table, without adding it
+     * 
+     * @param str The string, which must be null terminated at str[len]
+     * 
+     * @return The index, or INLINE if the string is not in the table
+     */
+    uint8_t lookup(const char *str, size_t len) const;
+
+    /**
+     * @brief Find a string in the table, adding it if necessary
+     * 
+     * @param str The string, which must be null terminated at str[len]
+     * 
+     * @return The index, or INLINE if the table is full or the file could not be written
+     */
+    uint8_t intern(const char *str, size_t len);
+
+    /**
+     * @brief Get a string from the table (index) or from the encoded event (INLINE)
+     * 
+     * @param cp Pointer to the index, advanced past the index and inline string
+     * 
+     * @return false if the index is not in the table or the inline string is not terminated
+     */
+    bool decodeString(const uint8_t *&cp, const uint8_t *end, const char *&str, size_t &len) const;
+
+    String path;                    //!< Pathname of the string table file
+    std::vector<String> strings;    //!< Event names and templates, in the order they were added
+    bool full = false;              //!< true if no more strings can be added to the file
+    std::vector<char> templateBuf;  //!< Template being encoded
+    std::vector<uint8_t> valueBuf;  //!< Values being encoded, one nibble per byte
+};
+
+/**
+ * @brief Structure stored before each event in a PublishQueueLog segment file
+ * 
+ * Records are stored back-to-back in the segment. The header is followed by the 
+ * PublishQueueEvent structure, which is variably sized based on the size of the event.
+ * If the magic is RECORD_MAGIC_COMPACT, it's followed by the event encoded by 
+ * PublishQueueCodec instead. With RECORD_MAGIC_EXPIRY and RECORD_MAGIC_COMPACT_EXPIRY,
+ * a PublishQueueExpiry comes first, and is included in size and crc.
+ */
+struct PublishQueueLogRecordHeader {
+    uint16_t magic;         //!< PublishQueueLog::RECORD_MAGIC = 0x7151
+    uint16_t size;          //!< Size of the PublishQueueEvent or encoded event that follows, including the null terminator
+    uint32_t seq;           //!< Sequence number. Records in the log are numbered consecutively.
+    uint32_t crc;           //!< CRC-32 of magic, size, seq, and the PublishQueueEvent
+};
+
+/**
+ * @brief A position in the log: segment index, byte offset in the segment, and the sequence number
+ * of the record stored at that position
+ */
+struct PublishQueueLogCursor {
+    uint32_t seq;           //!< Sequence number of the record at this position
+    uint16_t segment;       //!< Segment file index (0 to numSegments - 1)
+    uint16_t reserved;      //!< Reserved, set to 0
+    uint32_t offset;        //!< Byte offset in the segment file
+};
+
+/**
+ * @brief Contents of the cursor file, which persists the head and tail of the log
+ */
+struct PublishQueueLogCursorFile {
+    uint32_t magic;                 //!< PublishQueueLog::CURSOR_MAGIC = 0x31b67664
+    uint8_t version;                //!< PublishQueueLog::CURSOR_VERSION = 1
+    uint8_t numSegments;            //!< Number of segment files
+    uint16_t reserved;              //!< Reserved, set to 0
+    uint32_t segmentSize;           //!< Size of each segment file in bytes
+    PublishQueueLogCursor head;     //!< Oldest record in the queue
+    PublishQueueLogCursor tail;     //!< Where the next record will be written
+    uint32_t crc;                   //!< CRC-32 of the preceding fields
+};
+
+/**
+ * @brief Segmented append-only log of PublishQueueEvent records
+ * 
+ * Instead of one file per event, events are appended to a small, fixed number of segment 
+ * files that are reused in a ring. Each record is length-prefixed and CRC-checked. The
+ * head (oldest event) and tail (next write position) are persisted in a cursor file, 
+ * which is rewritten in place when events are retired. In steady state there are no
+ * file creates or unlinks, so the directory metadata is not modified.
+ * 
+ * The tail is also recovered at load() by scanning forward from the persisted tail, so 
+ * events appended after the cursor file was last written are not lost.
+ * 
+ * When a record does not fit in the remainder of the current segment, the writer moves 
+ * to the start of the next segment. If that segment still holds the oldest events, they
+ * are discarded to make room.
+ * 
+ * This class does not do its own locking. PublishQueuePosix only calls it with its queue
+ * mutex locked.
+ */
+class PublishQueueLog {
+public:
+    /**
+     * @brief Constructor
+     */
+    PublishQueueLog();
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~PublishQueueLog();
+
+    /**
+     * @brief Sets the directory to store the segment and cursor files in
+     * 
+     * @param dirPath the pathname, Unix-style with / as the directory separator. Must not end with a slash.
+     */
+    PublishQueueLog &withDirPath(const char *dirPath) { this->dirPath = dirPath; return *this; };
+
+    /**
+     * @brief Encode appended events using codec. Records are decoded with it regardless.
+     * 
+     * @param codec The codec, or NULL to store events unencoded (the default)
+     * 
+     * @param encode true to encode appended events
+     */
+    PublishQueueLog &withCodec(PublishQueueCodec *codec, bool encode) { this->codec = codec; encodeEvents = encode; return *this; };
+
+    /**
+     * @brief Sets the number and size of segment files (default: 4 segments of 16384 bytes)
+     * 
+     * @param numSegments Number of segment files, 1 to 255. At least 2 is recommended, as 
+     * moving to a new segment discards all events in it.
+     * 
+     * @param segmentSize Maximum size of each segment file in bytes. Must be large enough to 
+     * hold at least one maximum size event (about 1100 bytes).
+     * 
+     * Changing these values after events have been stored discards the stored events.
+     */
+    PublishQueueLog &withSegments(size_t numSegments, size_t segmentSize);
+
+    /**
+     * @brief Read the cursor file and recover the tail of the log. Call before any other operations.
+     * 
+     * If the cursor file is missing or damaged, the head and tail are rebuilt from the records in 
+     * the segments.
+     */
+    bool load();
+
+    /**
+     * @brief Append an event to the tail of the log
+     * 
+     * @param event The event to append. It is copied to the log; the caller still owns it.
+     * 
+     * @param expiry The time-to-live of the event, or NULL if it doesn't expire
+     * 
+     * @return The sequence number of the stored event, or 0 if it could not be stored
+     */
+    int append(const PublishQueueEvent *event, const PublishQueueExpiry *expiry = NULL) { return append(&event, 1, expiry); };
+
+    /**
+     * @brief Append several events to the tail of the log
+     * 
+     * @param events The events to append, oldest first. They are copied to the log; the caller still owns them.
+     * 
+     * @param count Number of events
+     * 
+     * @param expiry Array of count time-to-live values, in the same order as events, or NULL 
+     * if none of the events expire
+     * 
+     * Records that go in the same segment are written with a single write, so this is much
+     * less flash activity than calling append() for each event.
+     * 
+     * @return The sequence number of the first stored event, or 0 if none could be stored
+     */
+    int append(const PublishQueueEvent * const *events, size_t count, const PublishQueueExpiry *expiry = NULL);
+
+    /**
+     * @brief Gets the sequence number of the oldest event in the log, or 0 if the log is empty
+     */
+    int getFrontSeq() const { return (getQueueLen() != 0) ? (int)head.seq : 0; };
+
+    /**
+     * @brief Read the oldest event in the log
+     * 
+     * May return NULL if the log is empty, out of memory, or the record is corrupted. If 
+     * the record is corrupted, the rest of the log is discarded as record boundaries cannot
+     * be determined.
+     * 
+     * You must free the result from this method using PublishQueueEventPool::release() when you are done using it. 
+     */
+    PublishQueueEvent *readFront();
+
+    /**
+     * @brief Gets the position of the oldest event in the log, for use with readNext()
+     */
+    const PublishQueueLogCursor &getHead() const { return head; };
+
+    /**
+     * @brief Read the event at cursor and advance cursor to the event after it
+     * 
+     * @param cursor The position to read, initially from getHead(). The sequence number 
+     * of the event is cursor.seq before the call.
+     * 
+     * @param expiry If non-NULL, filled in with the time-to-live of the event (ttl is 0 if it doesn't expire)
+     * 
+     * Returns NULL at the end of the log, if the record is corrupted, or out of memory. Unlike
+     * readFront(), a corrupted record does not discard the log.
+     * 
+     * You must free the result from this method using PublishQueueEventPool::release() when you are done using it. 
+     */
+    PublishQueueEvent *readNext(PublishQueueLogCursor &cursor, PublishQueueExpiry *expiry = NULL);
+
+    /**
+     * @brief Retire events from the front of the log and persist the cursors
+     * 
+     * @param seq The sequence number of the last event to retire. All older events in the log 
+     * are retired as well. If the oldest event in the log is newer than seq (because it was 
+     * discarded), nothing is removed.
+     * 
+     * The cursor file is only written once, even if multiple events are retired.
+     */
+    void removeFront(int seq);
+
+    /**
+     * @brief Discard the oldest event in the log and persist the cursors
+     */
+    void discardFront();
+
+    /**
+     * @brief Remove the segment and cursor files and empty the log
+     */
+    void removeAll();
+
+    /**
+     * @brief Gets the number of events in the log
+     */
+    size_t getQueueLen() const { return (size_t)(tail.seq - head.seq); };
+
+    /**
+     * @brief Gets the number of events discarded because the segment they were in was needed for new events
+     */
+    size_t getNumOverwritten() const { return numOverwritten; };
+
+    /**
+     * @brief Gets the number of events discarded because a record was corrupted
+     */
+    size_t getNumCorrupted() const { return numCorrupted; };
+
+    /**
+     * @brief Gets the number of bytes written to the segment and cursor files
+     */
+    size_t getBytesWritten() const { return bytesWritten; };
+
+    /**
+     * @brief Magic bytes at the beginning of each record
+     */
+    static const uint16_t RECORD_MAGIC = 0x7151;
+
+    /**
+     * @brief Magic bytes at the beginning of a record containing an event encoded by PublishQueueCodec
+     */
+    static const uint16_t RECORD_MAGIC_COMPACT = 0x7152;
+
+    /**
+     * @brief Magic bytes at the beginning of a record with a PublishQueueExpiry before the event
+     */
+    static const uint16_t RECORD_MAGIC_EXPIRY = 0x7161;
+
+    /**
+     * @brief Magic bytes at the beginning of a record with a PublishQueueExpiry before the encoded event
+     */
+    static const uint16_t RECORD_MAGIC_COMPACT_EXPIRY = 0x7162;
+
+    /**
+     * @brief Magic bytes at the beginning of the cursor file
+     */
+    static const uint32_t CURSOR_MAGIC = 0x31b67664;
+
+    /**
+     * @brief Version of the cursor file
+     */
+    static const uint8_t CURSOR_VERSION = 1;
+
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueLog(const PublishQueueLog&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueLog& operator=(const PublishQueueLog&) = delete;
+
+protected:
+    /**
+     * @brief Gets the pathname to a segment file
+     * 
+     * @param buf Buffer to store the pathname in, SequentialFile::PATH_BUF_SIZE bytes
+     */
+    void getSegmentPath(uint16_t segment, char *buf, size_t bufSize) const;
+
+    /**
+     * @brief Gets the pathname to the cursor file
+     * 
+     * @param buf Buffer to store the pathname in, SequentialFile::PATH_BUF_SIZE bytes
+     */
+    void getCursorPath(char *buf, size_t bufSize) const;
+
+    /**
+     * @brief Read and validate the record at cursor, without following to the next segment
+     * 
+     * @param cursor The position to read. cursor.seq must match the record.
+     * 
+     * @param hdr Filled in with the record header
+     * 
+     * @param event If non-NULL, filled in with a newly allocated copy of the event. You must release it.
+     * 
+     * @param expiry If non-NULL, filled in with the time-to-live of the event
+     */
+    bool readRecordAt(const PublishQueueLogCursor &cursor, PublishQueueLogRecordHeader &hdr, PublishQueueEvent **event, PublishQueueExpiry *expiry = NULL);
+
+    /**
+     * @brief Read the record at cursor, following to the start of the next segment if necessary
+     * 
+     * If the record is found at the start of the next segment, cursor is updated.
+     */
+    bool readRecord(PublishQueueLogCursor &cursor, PublishQueueLogRecordHeader &hdr, PublishQueueEvent **event, PublishQueueExpiry *expiry = NULL);
+
+    /**
+     * @brief Rebuild head and tail by reading the records in the segments
+     * 
+     * Used when the cursor file is missing or invalid. Events whose segment has not been reused
+     * yet are recovered even if they were already sent, so they may be sent again.
+     * 
+     * @return true if any records were found
+     */
+    bool recoverCursors();
+
+    /**
+     * @brief Advance head past the oldest record without persisting the cursors
+     */
+    void advanceHead();
+
+    /**
+     * @brief Move tail to the start of the next segment, discarding the oldest events in it
+     */
+    void advanceTailSegment();
+
+    /**
+     * @brief Write buffered records to the tail segment at offset
+     */
+    bool writeRecords(const std::vector<uint8_t> &buf, uint32_t offset);
+
+    /**
+     * @brief Write the cursor file
+     * 
+     * @return false if it could not be written. The records are still in the segments, and load()
+     * recovers the cursors from them if the file is not valid.
+     */
+    bool saveCursors();
+
+    String dirPath;                 //!< Directory to store the files in
+    size_t numSegments = 4;         //!< Number of segment files
+    size_t segmentSize = 16384;     //!< Maximum size of each segment file in bytes
+    PublishQueueLogCursor head;     //!< Oldest record
+    PublishQueueLogCursor tail;     //!< Next write position
+    size_t numOverwritten = 0;      //!< Events discarded to make room in a segment
+    size_t numCorrupted = 0;        //!< Events discarded because a record was corrupted
+    size_t bytesWritten = 0;        //!< Bytes written to the segment and cursor files
+    PublishQueueCodec *codec = NULL; //!< Codec for compact records, set by withCodec()
+    bool encodeEvents = false;      //!< true to append compact records
+    std::vector<uint8_t> codecBuf;  //!< Record payload being written or read, reused to avoid allocating for every event
+    std::vector<uint8_t> writeBuf;  //!< Records being appended, reused to avoid allocating on every append
+};
+
+/**
+ * @brief An event, or batch of events, passed to BackgroundPublishRK and not yet removed from the queue
+ */
+struct PublishQueueInFlight {
+    PublishQueueEvent *event = NULL;            //!< The event being published. For a batch, the combined event.
+    std::vector<int> fileNums;                  //!< File queue identifiers of the events, oldest first (empty if from the RAM queue)
+    std::vector<PublishQueueEvent*> ramEvents;  //!< RAM queue events combined into event (empty if not a batch from the RAM queue)
+    uint8_t priority = 0;                       //!< Priority of the events, which selects the queue they came from
+    unsigned long startMs = 0;                  //!< millis() value when the publish was started
+    unsigned long completeMs = 0;               //!< millis() value when the publish completed
+    bool complete = false;                      //!< true if the publish has completed (successfully or not)
+    bool success = false;                       //!< true if the publish succeeded
+
+    /**
+     * @brief Gets the number of queued events this publish contains
+     */
+    size_t getNumEvents() const { return fileNums.empty() ? (ramEvents.empty() ? 1 : ramEvents.size()) : fileNums.size(); };
+};
+
+/**
+ * @brief Assigns a priority to events whose name starts with a prefix. See PublishQueuePosix::withPriorityRule().
+ */
+struct PublishQueuePriorityRule {
+    String eventNamePrefix;     //!< Event names starting with this get priority
+    uint8_t priority;           //!< Priority, 0 to PUBLISHQUEUE_NUM_PRIORITIES - 1
+};
+
+/**
+ * @brief Sets the time-to-live of events whose name starts with a prefix. See PublishQueuePosix::withTtlRule().
+ */
+struct PublishQueueTtlRule {
+    String eventNamePrefix;     //!< Event names starting with this get ttl
+    uint32_t ttl;               //!< Time-to-live in seconds
+};
+
+/**
+ * @brief A queued event with a time-to-live. See PublishQueuePosix::withTtlRule().
+ * 
+ * Like PublishQueueSupersedeEntry, the event is either in the RAM queue (ramEvent) or in the
+ * file queue (id), and id is checked before it's used.
+ */
+struct PublishQueueExpiryEntry {
+    uint8_t priority = 0;                   //!< Priority of the event, which selects the queue it's in
+    int id = 0;                             //!< File queue identifier, or 0 if in the RAM queue
+    PublishQueueEvent *ramEvent = NULL;     //!< The event in the RAM queue, or NULL if in the file queue
+    PublishQueueExpiry expiry;              //!< When the event expires
+};
+
+/**
+ * @brief Newest pending event published with a supersede key. See PublishQueuePosix::publishWithSupersedeKey().
+ * 
+ * The event is either in the RAM queue (ramEvent) or in the file queue (id). Entries for events
+ * in the file queue are not removed when the event is sent, so id is checked before it's used.
+ */
+struct PublishQueueSupersedeEntry {
+    String key;                             //!< Supersede key
+    uint8_t priority = 0;                   //!< Priority of the event, which selects the queue it's in
+    int id = 0;                             //!< File queue identifier, or 0 if in the RAM queue
+    PublishQueueEvent *ramEvent = NULL;     //!< The event in the RAM queue, or NULL if in the file queue
+};
+
+/**
+ * @brief Queue metrics since setup() or the last resetMetrics(). See PublishQueuePosix::getMetrics().
+ */
+struct PublishQueueMetrics {
+    static const size_t NUM_LATENCY_BUCKETS = 8;    //!< Number of buckets in latency
+    static const unsigned long latencyBucketMs[NUM_LATENCY_BUCKETS - 1]; //!< Upper bound of each latency bucket except the last, in milliseconds
+
+    uint32_t latency[NUM_LATENCY_BUCKETS] = {};     //!< Events acknowledged, by time from publish() to acknowledgement (<1s, <5s, <30s, <2m, <10m, <1h, <6h, 6h+)
+    uint32_t numAcked = 0;          //!< Events acknowledged, including ones queued before setup() that are not in latency
+    uint32_t numAttempts = 0;       //!< Events sent, including failed attempts. Divide by numAcked for attempts per event.
+    uint32_t numFailures = 0;       //!< Publishes that failed
+    uint32_t filesWritten = 0;      //!< Event files written to the file queue
+    uint32_t bytesWritten = 0;      //!< Bytes written to the file queue or log store
+    uint32_t numEvicted = 0;        //!< Events discarded because the queue was full
+    uint32_t numCorrupted = 0;      //!< Events discarded because the file or log record was corrupted
+    uint32_t numSuperseded = 0;     //!< Events discarded because a newer event with the same supersede key was published
+    uint32_t numExpired = 0;        //!< Events discarded because their time-to-live passed before they were sent
+    uint32_t maxQueueDepth = 0;     //!< Largest number of events queued
+};
+
 /**
  * @brief Class for asynchronous publishing of events
  * 
@@ -80,7 +805,8 @@ public:
      * 
      * @param size The maximum number of files to store (one event per file)
      * 
-     * If you exceed this number of events, the oldest event is discarded.
+     * If you exceed this number of events, the oldest event with the lowest priority is discarded.
+     * The limit is for all priorities combined.
      */
     PublishQueuePosix &withFileQueueSize(size_t size);
 
@@ -98,19 +824,279 @@ public:
      * ("/usr/myqueue"). The directory will be created if necessary, however only one
      * level of directory will be created. The parent must already exist.
      * 
-     * The dirPath can end with a slash or not, but if you include it, it will be
-     * removed.
+     * The dirPath can end with a slash or not, but if you include it, it will be
+     * removed.
+     * 
+     * You must call this as you cannot use the root directory as a queue!
+     */
+    PublishQueuePosix &withDirPath(const char *dirPath) { fileQueues[0].withDirPath(dirPath); return *this; };
+
+    /**
+     * @brief Hold events in RAM while offline and write them to the file queue together
+     * 
+     * @param maxEvents Write when this many events are waiting. 0 or 1 disables group commit (the default).
+     * 
+     * @param maxAgeMs Write when the oldest waiting event has waited this long, in milliseconds
+     * 
+     * Normally, when not connected to the cloud, each event is written to the flash file system
+     * as soon as it's published. With group commit, events are held in RAM and written together,
+     * which with the log store is a single write. If the device connects before they are 
+     * written, they are sent from RAM without being written at all.
+     * 
+     * Held events are also written before a reset, when disconnecting from the cloud, and 
+     * when prepareForSleep() is called. Events held when power is lost are lost.
+     */
+    PublishQueuePosix &withGroupCommit(size_t maxEvents, unsigned long maxAgeMs) { groupCommitMaxEvents = maxEvents; groupCommitMaxAgeMs = maxAgeMs; return *this; };
+
+    /**
+     * @brief Gets the maximum number of events held for group commit
+     */
+    size_t getGroupCommitMaxEvents() const { return groupCommitMaxEvents; };
+
+    /**
+     * @brief Keep a manifest of the file queue so setup() does not need to read the queue directory
+     * 
+     * @param value true to use a manifest (default: false)
+     * 
+     * @param saveEvery Rewrite the manifest after this many event files are added or removed 
+     * (default: 16)
+     * 
+     * Must be called before setup(). A small manifest file listing the files in the queue is 
+     * rewritten after every saveEvery changes, before a reset, when disconnecting from the cloud, 
+     * and when prepareForSleep() is called. During setup() the queue is loaded from the manifest 
+     * instead of reading the directory, so startup time does not depend on the number of queued 
+     * events. Events queued or sent after the manifest was last saved are found by checking a few
+     * file numbers. If the manifest is damaged, the directory is read as before.
+     * 
+     * See SequentialFile::withManifest(). Not used for events stored in the log store.
+     */
+    PublishQueuePosix &withQueueManifest(bool value = true, size_t saveEvery = SequentialFile::MANIFEST_SAVE_EVERY);
+
+    /**
+     * @brief Store the file queue in a fixed pool of slot files that are overwritten in place
+     * 
+     * @param value true to use slot recycling (default: false)
+     * 
+     * Must be called before setup(). Instead of creating a file for each event and removing it
+     * once sent, setup() creates one more slot file than the file queue size (withFileQueueSize)
+     * in each priority's queue directory, and events are written to them round-robin. Once the 
+     * slots exist, queueing and sending events only overwrite them, with no files created or 
+     * removed, which on LittleFS avoids most directory updates. Events left in one-file-per-event
+     * format are moved into slots during setup().
+     * 
+     * See SequentialFile::withSlotRecycling(). The queue manifest is not used with slot recycling.
+     * Not used for events stored in the log store.
+     */
+    PublishQueuePosix &withSlotRecycling(bool value = true) { useSlotRecycling = value; return *this; };
+
+    /**
+     * @brief Returns true if withSlotRecycling() was used
+     */
+    bool getUseSlotRecycling() const { return useSlotRecycling; };
+
+    /**
+     * @brief Store the file queue in a segmented append-only log instead of one file per event
+     * 
+     * @param numSegments Number of segment files (default: 4)
+     * 
+     * @param segmentSize Maximum size of each segment file in bytes (default: 16384)
+     * 
+     * Must be called before setup(). The segment files are stored in the directory set using
+     * withDirPath(). Any events left in one-file-per-event format are moved into the log 
+     * during setup().
+     * 
+     * The file queue size limit (withFileQueueSize) still applies. Events are also discarded,
+     * oldest first, when the segments are full.
+     * 
+     * Only priority 0 events are stored in the log. Higher priority events are expected to be
+     * rare and are still stored one file per event.
+     */
+    PublishQueuePosix &withLogStore(size_t numSegments = 4, size_t segmentSize = 16384) { eventLog.withSegments(numSegments, segmentSize); useEventLog = true; return *this; };
+
+    /**
+     * @brief Store events in flash in a compact encoding
+     * 
+     * @param value true to encode events written to the file queue or log store
+     * 
+     * Event names and the text of the JSON data are stored once in a small table, and each
+     * event only stores their index and the numbers in its data. See PublishQueueCodec. A
+     * typical sensor reading is stored in about a tenth of the space, so many more events fit
+     * in the log store, and fewer bytes are written to flash. Events are expanded back to 
+     * their original name and data when they're read from the queue to be published.
+     * 
+     * Events already in the queue in either format can always be read, so this can be turned
+     * on or off at any time.
+     */
+    PublishQueuePosix &withCompactEncoding(bool value = true) { useCompactEncoding = value; eventLog.withCodec(&codec, value); return *this; };
+
+    /**
+     * @brief Returns true if withCompactEncoding() was used
+     */
+    bool getUseCompactEncoding() const { return useCompactEncoding; };
+
+    /**
+     * @brief Returns true if withLogStore() was used
+     */
+    bool getUseLogStore() const { return useEventLog; };
+
+    /**
+     * @brief Sets the maximum number of queued events to combine into one publish (default is 1, no batching)
+     * 
+     * @param count The maximum number of events per publish. 0 or 1 disables batching.
+     * 
+     * When consecutive events in the queue have the same event name and flags and their data
+     * is a JSON object, up to count of them are sent as one publish. The data is a JSON array 
+     * of the original objects, for example `[{"a":1},{"a":2}]`, up to MAX_EVENT_DATA_LENGTH. 
+     * An event that cannot be combined with the next one is sent by itself, unchanged, so 
+     * whatever receives the event must accept both a single object and an array.
+     * 
+     * All events in a batch are removed from the queue when the publish succeeds. If it fails,
+     * none are removed and they are sent again later.
+     */
+    PublishQueuePosix &withMaxBatchSize(size_t count) { maxBatchSize = count; return *this; };
+
+    /**
+     * @brief Gets the maximum number of events combined into one publish
+     */
+    size_t getMaxBatchSize() const { return maxBatchSize; };
+
+    /**
+     * @brief Sets the maximum number of publishes in progress at the same time (default is 1)
+     * 
+     * @param count The number of publishes, at least 1. Must be called before setup().
+     * 
+     * With the default of 1, each publish must complete before the next one starts, so sending
+     * the queue takes at least one cloud round trip per event. With a larger value, publishes 
+     * are started waitBetweenPublish (1 second) apart without waiting for the previous ones to 
+     * complete, which is much faster when acknowledgements are slow.
+     * 
+     * Events are always started in queue order. If a publish fails, no more are started, even if 
+     * earlier publishes have not completed yet. Once all of them complete, events that were sent 
+     * successfully are removed from the queue and the others are put back and sent again in order.
+     * 
+     * This sets the number of BackgroundPublishRK slots during setup(), unless BackgroundPublishRK 
+     * was already started.
+     */
+    PublishQueuePosix &withMaxInFlight(size_t count) { if (!stateHandler) { maxInFlight = (count < 1) ? 1 : count; } return *this; };
+
+    /**
+     * @brief Gets the maximum number of publishes in progress at the same time
+     */
+    size_t getMaxInFlight() const { return maxInFlight; };
+
+    /**
+     * @brief Sets the priority of events whose name starts with eventNamePrefix
+     * 
+     * @param eventNamePrefix Event name prefix to match. An exact event name also works.
+     * 
+     * @param priority 0 (the default, lowest) to PUBLISHQUEUE_NUM_PRIORITIES - 1 (highest)
+     * 
+     * Rules are checked in the order they were added and the first match is used. Events that
+     * don't match any rule have priority 0. publishWithPriority() overrides the rules.
+     * 
+     * Queued events with a higher priority are always sent before those with a lower priority,
+     * so an alert queued after days of routine events is sent first after connecting. Within a 
+     * priority, events are sent in the order they were published. When the file queue is full,
+     * the oldest event with the lowest priority is discarded.
+     */
+    PublishQueuePosix &withPriorityRule(const char *eventNamePrefix, uint8_t priority);
+
+    /**
+     * @brief Gets the priority for an event name from the rules set using withPriorityRule()
+     */
+    uint8_t getPriorityForEvent(const char *eventName) const;
+
+    /**
+     * @brief Sets the time-to-live of events whose name starts with eventNamePrefix
+     * 
+     * @param eventNamePrefix Event name prefix to match. An exact event name also works.
+     * 
+     * @param ttl Seconds after publish() that the event is no longer worth sending
+     * 
+     * Rules are checked in the order they were added and the first match is used. Events that
+     * don't match any rule don't expire. publishWithTtl() overrides the rules.
+     * 
+     * An expired event is discarded without being sent. The time it was published is stored
+     * with the event, so this works across resets, but requires the real-time clock to be set 
+     * (Time.isValid()). Events published before the time is set don't expire.
+     */
+    PublishQueuePosix &withTtlRule(const char *eventNamePrefix, uint32_t ttl);
+
+    /**
+     * @brief Gets the time-to-live in seconds for an event name from the rules set using withTtlRule(), or 0
+     */
+    uint32_t getTtlForEvent(const char *eventName) const;
+
+    /**
+     * @brief Gets the number of queued events with a priority
+     * 
+     * @param priority 0 to PUBLISHQUEUE_NUM_PRIORITIES - 1
+     * 
+     * Includes events in the RAM queue, the file queue, and being sent.
+     */
+    size_t getQueueDepth(uint8_t priority);
+
+    /**
+     * @brief Gets the number of events with a priority discarded because the queue was full
+     * 
+     * @param priority 0 to PUBLISHQUEUE_NUM_PRIORITIES - 1
+     * 
+     * For priority 0 with the log store, this includes events overwritten because the 
+     * segments were full.
+     */
+    size_t getNumEvicted(uint8_t priority) const;
+
+    /**
+     * @brief Gets the queue metrics since setup() or the last resetMetrics()
+     * 
+     * The latency histogram only includes events published since setup(), as the time
+     * events were published is not stored in the file queue.
+     */
+    PublishQueueMetrics getMetrics() const;
+
+    /**
+     * @brief Reset the counters returned by getMetrics() to 0
+     */
+    void resetMetrics();
+
+    /**
+     * @brief Format the metrics as compact JSON
+     * 
+     * @param buf Buffer to write to
+     * 
+     * @param bufSize Size of buf in bytes. The output is always null terminated.
+     * 
+     * @return The length of the JSON, not including the null terminator
+     * 
+     * For example: {"lat":[10,2,0,0,0,3,0,0],"ack":15,"att":16,"fail":1,"files":5,"bytes":1030,"evict":0,"bad":0,"max":5}
+     */
+    size_t formatMetrics(char *buf, size_t bufSize) const;
+
+    /**
+     * @brief Publish the metrics periodically as a diagnostic event
+     * 
+     * @param eventName The event name. Set to NULL or an empty string to stop (the default).
+     * 
+     * @param periodMs How often to publish, in milliseconds (default: once a day)
+     * 
+     * The event data is the output of formatMetrics(), and the metrics are reset after each
+     * one. The event is queued like any other priority 0 event.
+     */
+    PublishQueuePosix &withDiagnosticEvent(const char *eventName, unsigned long periodMs = 24 * 60 * 60 * 1000UL) { diagEventName = eventName ? eventName : ""; diagPeriodMs = periodMs; diagLastMs = millis(); return *this; };
+
+    /**
+     * @brief Publish the metrics as a diagnostic event now and reset them
      * 
-     * You must call this as you cannot use the root directory as a queue!
+     * Uses the event name set with withDiagnosticEvent(), or "pubqDiag" if not set.
      */
-    PublishQueuePosix &withDirPath(const char *dirPath) { fileQueue.withDirPath(dirPath); return *this; };
+    bool publishMetrics();
 
     /**
      * @brief Gets the directory path set using withDirPath()
      * 
      * The returned path will not end with a slash.
      */
-    const char *getDirPath() const { return fileQueue.getDirPath(); };
+    const char *getDirPath() const { return fileQueues[0].getDirPath(); };
 
     /**
      * @brief You must call this from setup() to initialize this library
@@ -206,11 +1192,84 @@ public:
 	 */
 	virtual bool publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags());
 
+	/**
+	 * @brief Publish an event with a priority, instead of using the withPriorityRule() rules
+	 *
+	 * @param priority 0 (lowest) to PUBLISHQUEUE_NUM_PRIORITIES - 1 (highest). Larger values are
+	 * treated as the highest priority.
+	 *
+	 * @param eventName The name of the event (63 character maximum).
+	 *
+	 * @param data The event data (255 bytes maximum, 622 bytes in system firmware 0.8.0-rc.4 and later).
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 */
+	bool publishWithPriority(uint8_t priority, const char *eventName, const char *data, PublishFlags flags1, PublishFlags flags2 = PublishFlags());
+
+	/**
+	 * @brief Publish an event that replaces any pending event with the same supersede key
+	 *
+	 * @param supersedeKey Identifies events where only the latest value matters, such as "status".
+	 * Usually the event name, but events with the same name can have different keys.
+	 *
+	 * @param eventName The name of the event (63 character maximum).
+	 *
+	 * @param data The event data (255 bytes maximum, 622 bytes in system firmware 0.8.0-rc.4 and later).
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 *
+	 * The older event is removed from the RAM queue, file queue, or log store without reading
+	 * any files, using an index kept in RAM. An event that is already being sent is not removed. The
+	 * index is not saved, so events queued before a reset are not superseded. The priority is set
+	 * by the withPriorityRule() rules, as with publish().
+	 */
+	bool publishWithSupersedeKey(const char *supersedeKey, const char *eventName, const char *data, PublishFlags flags1, PublishFlags flags2 = PublishFlags());
+
+	/**
+	 * @brief Publish an event with a time-to-live, instead of using the withTtlRule() rules
+	 *
+	 * @param ttl Seconds after now that the event is no longer worth sending. 0 means it doesn't expire.
+	 *
+	 * @param eventName The name of the event (63 character maximum).
+	 *
+	 * @param data The event data (255 bytes maximum, 622 bytes in system firmware 0.8.0-rc.4 and later).
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 */
+	bool publishWithTtl(uint32_t ttl, const char *eventName, const char *data, PublishFlags flags1, PublishFlags flags2 = PublishFlags());
+
     /**
      * @brief If there are events in the RAM queue, write them to files in the flash file system
      */
     void writeQueueToFiles();
 
+    /**
+     * @brief Call before sleep so events held in RAM are not lost if the device does not wake normally
+     * 
+     * Writes events held by withGroupCommit() and any other events in the RAM queue to the flash
+     * file system.
+     */
+    void prepareForSleep();
+
+    /**
+     * @brief Save the file queue manifests, if withQueueManifest() is used and the queue changed
+     * 
+     * This is done by prepareForSleep() and before a reset or disconnecting from the cloud.
+     */
+    void saveQueueManifests();
+
     /**
      * @brief Empty both the RAM and file based queues. Any queued events are discarded. 
      */
@@ -244,6 +1303,93 @@ public:
      */
     bool getCanSleep() const { return canSleep; };
 
+    /**
+     * @brief Send the queued events as fast as the cloud allows, until the queue is empty
+     * 
+     * @return The estimated time until the queue is empty in milliseconds, see getTimeToEmptyMs().
+     * 
+     * Normally publishes are started waitBetweenPublish (1 second) apart. In burst drain mode,
+     * up to PUBLISHQUEUE_BURST_SIZE publishes are started back-to-back, then one per 
+     * waitBetweenPublish, which stays within the cloud publish rate limit. With the default of
+     * one publish in flight, the next publish starts as soon as the previous one completes.
+     * 
+     * Call this right after connecting to shorten the time the cellular modem needs to stay on.
+     * Burst drain mode ends when the queue is empty or the cloud connection is lost.
+     */
+    unsigned long startBurstDrain();
+
+    /**
+     * @brief Returns true if burst drain mode is on. See startBurstDrain().
+     */
+    bool getBurstDrain() const { return burstDrain; };
+
+    /**
+     * @brief Gets the estimated time until the queue is empty, in milliseconds
+     * 
+     * This is based on the number of queued events, the batch size, the number of publishes
+     * in flight, the publish rate limit, and the average time recent publishes took to complete.
+     * It assumes the device stays connected and publishes succeed. If not connected, it's
+     * the time after connecting. Returns 0 if the queue is empty.
+     */
+    unsigned long getTimeToEmptyMs();
+
+    /**
+     * @brief Gets the average time for a publish to complete, in milliseconds
+     */
+    unsigned long getAvgPublishMs() const { return avgPublishMs; };
+
+    /**
+     * @brief Size the gap between publishes and the wait after a failure from observed publishes
+     * 
+     * @param minFailureWaitMs Shortest wait after a failed publish (default: 15 seconds)
+     * 
+     * @param maxFailureWaitMs Longest wait after a failed publish (default: 5 minutes)
+     * 
+     * @param maxPublishGapMs Longest gap between publishes (default: 10 seconds)
+     * 
+     * Normally the queue waits waitAfterFailure (30 seconds) after any failed publish and 
+     * starts publishes waitBetweenPublish (1 second) apart. With adaptive retry, it keeps a
+     * moving estimate of the publish time, its variation, and the failure rate, like TCP 
+     * retransmission timers:
+     * 
+     * - After a failure, the wait is the expected worst-case publish time, doubled for each 
+     * failure in a row, within minFailureWaitMs and maxFailureWaitMs. A short outage is 
+     * retried sooner, and a long one wastes fewer attempts.
+     * - A failure that arrives sooner than a publish normally takes, which happens when the
+     * cloud rejects or throttles the publish rather than the acknowledgement being lost, also
+     * doubles the gap between publishes. The gap shrinks back as publishes succeed.
+     * - The gap also grows with the failure rate, up to maxPublishGapMs.
+     * 
+     * The gap is never less than waitBetweenPublish.
+     */
+    PublishQueuePosix &withAdaptiveRetry(unsigned long minFailureWaitMs = 15000, unsigned long maxFailureWaitMs = 300000, unsigned long maxPublishGapMs = 10000) { 
+        adaptiveRetry = true; minFailureWait = minFailureWaitMs; maxFailureWait = maxFailureWaitMs; maxPublishGap = maxPublishGapMs; return *this; 
+    };
+
+    /**
+     * @brief Gets the variation in the time for a publish to complete, in milliseconds
+     */
+    unsigned long getPublishDeviationMs() const { return publishDevMs; };
+
+    /**
+     * @brief Gets the moving average of the fraction of publishes that fail, 0 to 1000
+     */
+    unsigned int getFailureRate() const { return failureRate; };
+
+    /**
+     * @brief Gets the current time to wait between publishes, in milliseconds
+     * 
+     * This is waitBetweenPublish unless withAdaptiveRetry() is used.
+     */
+    unsigned long getPublishGapMs() const;
+
+    /**
+     * @brief Gets the time to wait after the next failed publish, in milliseconds
+     * 
+     * This is waitAfterFailure unless withAdaptiveRetry() is used.
+     */
+    unsigned long getFailureWaitMs() const;
+
     /**
      * @brief Gets the total number of events queued
      * 
@@ -290,6 +1436,11 @@ public:
      */
     static const uint8_t FILE_VERSION = 1;
 
+    /**
+     * @brief Version of the file header for events encoded by PublishQueueCodec
+     */
+    static const uint8_t FILE_VERSION_COMPACT = 2;
+
 protected:
     /**
      * @brief Constructor 
@@ -324,25 +1475,312 @@ protected:
      * 
      * May return NULL if eventName or eventData are invalid (too long) or out of memory.
      * 
-     * You must delete the result from this method when you are done using it. 
+     * You must free the result from this method using PublishQueueEventPool::release() when you are done using it. 
      */
     PublishQueueEvent *newRamEvent(const char *eventName, const char *eventData, PublishFlags flags);
 
+    /**
+     * @brief Returns true if the file queue for priority is stored in eventLog
+     */
+    bool priorityUsesLog(uint8_t priority) const { return useEventLog && priority == 0; };
+
+    /**
+     * @brief Gets the number of events in the RAM queues of all priorities
+     */
+    size_t getRamQueueLen() const;
+
     /**
      * @brief Read an event from a sequentially numbered file 
      * 
+     * @param priority Priority of the file queue
+     * 
      * @param fileNum The file number to read 
      * 
+     * @param expiry If non-NULL, filled in with the time-to-live of the event (ttl is 0 if it doesn't expire)
+     * 
      * May return NULL if file does not exist, or out of memory.
      * 
-     * You must delete the result from this method when you are done using it. 
+     * You must free the result from this method using PublishQueueEventPool::release() when you are done using it. 
+     */
+    PublishQueueEvent *readQueueFile(uint8_t priority, int fileNum, PublishQueueExpiry *expiry = NULL);
+
+    /**
+     * @brief Returns true if any file queue or the log store holds events, including skipped log records
+     */
+    bool hasStoredEvents() const;
+
+    /**
+     * @brief Gets the number of events in the file queues of all priorities (files or log store)
+     */
+    int getFileQueueLen() const;
+
+    /**
+     * @brief Gets the number of events in the file queue for a priority (files or log store)
+     */
+    int getFileQueueLen(uint8_t priority) const;
+
+    /**
+     * @brief Remove the oldest event from the file queue for priority if it is id
+     * 
+     * The id is a file number, or a sequence number when using the log store.
+     */
+    void removeFileQueueEvent(uint8_t priority, int id);
+
+    /**
+     * @brief Remove events from the front of the file queue for priority after they have been sent
+     * 
+     * @param priority Priority of the file queue
+     * 
+     * @param ids Identifiers of consecutive events, oldest first, as passed to readFileQueueEvents()
+     */
+    void removeFileQueueEvents(uint8_t priority, const std::vector<int> &ids);
+
+    /**
+     * @brief Read events from the file queue for priority in order, starting with the oldest
+     * 
+     * @param priority Priority of the file queue
+     * 
+     * @param afterId Skip events with this identifier and older ones, or 0 to start with the oldest event
+     * 
+     * @param fn Called for each event with the event, its identifier, and its time-to-live. fn 
+     * takes ownership of event and must release it. Return false to stop reading. If an event 
+     * cannot be read, fn is called with NULL for event, then reading stops.
+     * 
+     * Reading also stops at the end of the queue. Superseded and expired events in the log store
+     * are skipped.
+     */
+    void readFileQueueEvents(uint8_t priority, int afterId, std::function<bool(PublishQueueEvent *event, int id, const PublishQueueExpiry &expiry)> fn);
+
+    /**
+     * @brief Add an event to the end of the file queue for priority
+     * 
+     * @param priority Priority of the file queue
+     * 
+     * @param event The event to store. The caller still owns it.
+     * 
+     * @param expiry The time-to-live of the event, or NULL if it doesn't expire
+     * 
+     * @return The file queue identifier of the event, or 0 if it could not be stored
+     */
+    int writeFileQueueEvent(uint8_t priority, const PublishQueueEvent *event, const PublishQueueExpiry *expiry);
+
+    /**
+     * @brief Queue an event. Used by publishWithPriority(), publishWithSupersedeKey(), and publishWithTtl().
+     * 
+     * @param supersedeKey Key for publishWithSupersedeKey(), or NULL
+     * 
+     * @param ttl Time-to-live in seconds, or 0
+     */
+    bool enqueueEvent(uint8_t priority, const char *supersedeKey, uint32_t ttl, const char *eventName, const char *eventData, PublishFlags flags);
+
+    /**
+     * @brief Remove a queued event that is not being sent, from anywhere in its queue
+     * 
+     * @param priority Priority of the event
+     * 
+     * @param id File queue identifier, or 0 for an event in the RAM queue
+     * 
+     * @param ramEvent The event in the RAM queue, which is released, or NULL for a file queue event
+     * 
+     * @return false if the event is no longer queued or is being sent
+     * 
+     * The indexes are not updated.
+     */
+    bool removeQueuedEvent(uint8_t priority, int id, PublishQueueEvent *ramEvent);
+
+    /**
+     * @brief Remove queued events whose time-to-live has passed, using expiryIndex
+     */
+    void removeExpiredEvents();
+
+    /**
+     * @brief Gets the time-to-live of an event in the RAM queue from expiryIndex, or NULL if it doesn't expire
+     */
+    const PublishQueueExpiry *getRamEventExpiry(const PublishQueueEvent *event) const;
+
+    /**
+     * @brief Remove the pending event with supersedeKey, if there is one, and make event the pending one
+     * 
+     * @param supersedeKey The key
+     * 
+     * @param priority Priority of event
+     * 
+     * @param event The new event, which will be added to the end of the RAM queue for priority
+     */
+    void supersede(const char *supersedeKey, uint8_t priority, PublishQueueEvent *event);
+
+    /**
+     * @brief Update the supersede and expiry indexes when an event leaves the RAM queue
+     * 
+     * @param event The event from the RAM queue
+     * 
+     * @param id The file queue identifier if the event was written to the file queue, or 0 if 
+     * it was sent or discarded
+     * 
+     * Events that are being sent are still in the indexes, and are removed when the publish succeeds.
+     */
+    void updateEventIndexes(const PublishQueueEvent *event, int id);
+
+    /**
+     * @brief Returns true if event, from the RAM queue, is being sent by itself or in a batch
+     */
+    bool isRamEventInFlight(const PublishQueueEvent *event) const;
+
+    /**
+     * @brief Remove skipped events from the front of the log store
+     * 
+     * Superseded and expired events can't be removed from the middle of the log, so they're 
+     * skipped when reading and removed once they reach the front.
+     */
+    void removeSkippedLogEvents();
+
+    /**
+     * @brief Returns true if the log store event seq was superseded or expired
+     */
+    bool isLogEventSkipped(int seq) const;
+
+    /**
+     * @brief Gets the number of skipped events still in the log store
+     */
+    size_t getNumSkippedLogEvents() const;
+
+    /**
+     * @brief Add event to a batch if it can be combined with the events already in it
+     * 
+     * @param events The batch. If empty, event is always added.
+     * 
+     * @param dataLen The length of the combined data, including the enclosing brackets. Updated
+     * when event is added.
+     * 
+     * @param event The event to add. Ownership is not transferred.
+     * 
+     * @return true if event was added to events
+     */
+    bool addToBatch(std::vector<PublishQueueEvent *> &events, size_t &dataLen, PublishQueueEvent *event) const;
+
+    /**
+     * @brief Allocate an event whose data is a JSON array of the data of events
+     * 
+     * @param events The events to combine, from addToBatch(). They are not modified or deleted.
+     * 
+     * @param dataLen The combined data length from addToBatch()
+     * 
+     * May return NULL if out of memory. You must free the result from this method using 
+     * PublishQueueEventPool::release() when you are done using it. 
+     */
+    PublishQueueEvent *newBatchEvent(const std::vector<PublishQueueEvent *> &events, size_t dataLen);
+
+    /**
+     * @brief Read the next event, or batch of events, to send from the file queue for priority
+     * 
+     * @param priority Priority of the file queue
+     * 
+     * @param afterId Identifier of the newest file queue event already being sent, or 0
+     * 
+     * @param fileNums Filled in with the identifiers of the events that were read
+     * 
+     * Returns NULL if there are no more events. If the next event cannot be read, returns NULL
+     * with its identifier in fileNums.
+     */
+    PublishQueueEvent *readFileQueueBatch(uint8_t priority, int afterId, std::vector<int> &fileNums);
+
+    /**
+     * @brief Remove the next event, or batch of events, from the front of the RAM queue for priority
+     * 
+     * @param priority Priority of the RAM queue
+     * 
+     * @param ramEvents Filled in with the original events if more than one event was combined
+     * 
+     * Returns NULL if the RAM queue is empty.
+     */
+    PublishQueueEvent *takeRamQueueBatch(uint8_t priority, std::vector<PublishQueueEvent *> &ramEvents);
+
+    /**
+     * @brief Gets an in-flight publish
+     * 
+     * @param index 0 is the oldest
+     */
+    PublishQueueInFlight &getInFlight(size_t index) { return inFlight[(inFlightFirst + index) % inFlight.size()]; };
+
+    /**
+     * @brief Gets an in-flight publish
+     * 
+     * @param index 0 is the oldest
+     */
+    const PublishQueueInFlight &getInFlight(size_t index) const { return inFlight[(inFlightFirst + index) % inFlight.size()]; };
+
+    /**
+     * @brief Gets the identifier of the newest event from the file queue for priority being sent, or 0 if none
+     */
+    int getLastInFlightFileNum(uint8_t priority) const;
+
+    /**
+     * @brief Start publishing the next event or batch of events
+     * 
+     * Events are taken from the highest priority that has any. Within a priority, events in 
+     * the file queue are older than those in the RAM queue, so are sent first.
+     * 
+     * @return true if a publish was started, false if there are no events to send or all 
+     * background publish slots are busy
+     */
+    bool startPublish();
+
+    /**
+     * @brief Retire completed publishes in the order they were started
+     * 
+     * If a publish fails, waits for all in-flight publishes to complete, then puts them all
+     * back in the queue.
+     */
+    void checkInFlight();
+
+    /**
+     * @brief Update the publish time, failure rate, and publish gap estimates from a completed publish
+     */
+    void updatePublishEstimates(const PublishQueueInFlight &entry);
+
+    /**
+     * @brief Update the publish times in enqueueMs after events are removed from a priority
+     * 
+     * @param priority The priority the events were removed from
+     * 
+     * @param numAcked The number of oldest events that were sent successfully. They're added to the 
+     * latency histogram.
+     * 
+     * Events discarded from the front of the queue by checkQueueLimits(), or for being corrupted,
+     * are also removed from enqueueMs so it has one entry per queued event.
+     */
+    void updateEnqueueTimes(uint8_t priority, size_t numAcked);
+
+    /**
+     * @brief Count an acknowledged event in the metrics, including its latency
+     * 
+     * @param start The millis() value when it was published, or 0 if unknown
+     */
+    void recordAck(uint32_t start);
+
+    /**
+     * @brief Add to burstTokens for the time since the last refill, one per waitBetweenPublish
+     */
+    void refillBurstTokens();
+
+    /**
+     * @brief Return the events of an in-flight publish to the queue
+     * 
+     * Events from the file queue are still in it. Events from the RAM queue are put back at 
+     * the front of the RAM queue.
+     */
+    void putBackInFlight(PublishQueueInFlight &entry);
+
+    /**
+     * @brief Free the events of an in-flight publish that was sent and remove its RAM events from
+     * supersedeIndex and expiryIndex. Files and log records are not removed.
      */
-    PublishQueueEvent *readQueueFile(int fileNum);
+    void releaseInFlight(PublishQueueInFlight &entry);
 
     /**
      * @brief Callback for BackgroundPublishRK library
      */
-    void publishCompleteCallback(bool succeeded, const char *eventName, const char *eventData);
+    void publishCompleteCallback(PublishQueueInFlight *entry, bool succeeded);
 
     /**
      * @brief State handler for waiting to connect to the Particle cloud
@@ -352,42 +1790,86 @@ protected:
     void stateConnectWait();
 
     /**
-     * @brief State handler for waiting to publish
+     * @brief State handler for publishing
      * 
      * stateTime and durationMs determine whether to stay in this state waiting, or whether
-     * to publish and go into statePublishWait.
+     * to start another publish. Completed publishes are handled by checkInFlight().
      * 
-     * Next state: statePublishWait or stateConnectWait
+     * Next state: stateConnectWait
      */
     void stateWait();
 
     /**
-     * @brief State handler for waiting for publish to complete
+     * @brief SequentialFileRK library objects for maintaining the queue of files on the POSIX file system, one per priority
      * 
-     * Next state: stateWait
+     * Priority 0 uses the directory set by withDirPath(). Higher priorities use the same path with
+     * .p1, .p2, etc. appended.
      */
-    void statePublishWait();
+    SequentialFile fileQueues[PUBLISHQUEUE_NUM_PRIORITIES];
 
     /**
-     * @brief SequentialFileRK library object for maintaining the queue of files on the POSIX file system
+     * @brief Segmented log used instead of fileQueues[0] when withLogStore() is used
      */
-    SequentialFile fileQueue;
+    PublishQueueLog eventLog;
 
+    bool useEventLog = false; //!< true to store the file queue in eventLog instead of one file per event
+    bool useSlotRecycling = false; //!< true to store the file queues in reused slot files, see withSlotRecycling()
+    PublishQueueCodec codec; //!< Compact encoding, used for reading regardless of useCompactEncoding
+    bool useCompactEncoding = false; //!< true to write events using codec
+    std::vector<uint8_t> readBuf; //!< Encoded event being read, reused to avoid allocating for every event
 
     size_t ramQueueSize = 2; //!< size of the queue in RAM
     size_t fileQueueSize = 100; //!< size of the queue on the flash file system
+    size_t maxBatchSize = 1; //!< maximum number of events to combine into one publish
 
     os_mutex_recursive_t mutex; //!< mutex for protecting the queue
-    std::deque<PublishQueueEvent*> ramQueue; //!< Queue in RAM
+    std::deque<PublishQueueEvent*> ramQueues[PUBLISHQUEUE_NUM_PRIORITIES]; //!< Queues in RAM, one per priority
+
+    std::vector<PublishQueuePriorityRule> priorityRules; //!< Rules set using withPriorityRule()
+    std::vector<PublishQueueSupersedeEntry> supersedeIndex; //!< Newest pending event for each supersede key
+    std::vector<PublishQueueTtlRule> ttlRules; //!< Rules set using withTtlRule()
+    std::vector<PublishQueueExpiryEntry> expiryIndex; //!< Queued events that expire
+    uint32_t nextExpiry = 0; //!< Earliest expiry in expiryIndex, as a Time.now() value
+    std::vector<int> skippedLogSeqs; //!< Superseded or expired events still in the log store, in increasing order
+    std::vector<uint8_t> writeBuf; //!< Used to write an event file with a single write, reused to avoid allocating for every event
+
+    size_t groupCommitMaxEvents = 0; //!< Events to hold in RAM before writing them to the file queue (0 = off)
+    unsigned long groupCommitMaxAgeMs = 0; //!< Maximum time to hold an event in RAM before writing it to the file queue
+    bool groupCommitPending = false; //!< true if events are held in RAM waiting for group commit
+    unsigned long groupCommitStartMs = 0; //!< millis() value when the oldest held event was published
+    size_t numEvicted[PUBLISHQUEUE_NUM_PRIORITIES] = {}; //!< Events discarded by checkQueueLimits(), per priority
+
+    PublishQueueMetrics metrics; //!< Metrics counted by this class, see getMetrics()
+    size_t metricsEvictedBase = 0; //!< Total evicted events when resetMetrics() was called
+    size_t metricsLogCorruptedBase = 0; //!< eventLog.getNumCorrupted() when resetMetrics() was called
+    size_t metricsLogBytesBase = 0; //!< eventLog.getBytesWritten() when resetMetrics() was called
+    std::deque<uint32_t> enqueueMs[PUBLISHQUEUE_NUM_PRIORITIES]; //!< millis() when each queued event was published, oldest first, 0 if unknown
+    String diagEventName; //!< Event name for the diagnostic event, see withDiagnosticEvent()
+    unsigned long diagPeriodMs = 0; //!< How often to publish the diagnostic event
+    unsigned long diagLastMs = 0; //!< millis() value when the diagnostic event was last published
 
-    PublishQueueEvent *curEvent = 0; //!< Current event being published
-    int curFileNum = 0; //!< Current file number being published (0 if from RAM queue)
+    std::vector<PublishQueueInFlight> inFlight; //!< Ring of publishes in progress, maxInFlight entries, allocated in setup()
+    size_t inFlightFirst = 0; //!< Index in inFlight of the oldest publish in progress
+    size_t inFlightCount = 0; //!< Number of publishes in progress
+    size_t maxInFlight = 1; //!< maximum number of publishes in progress at the same time
+    bool publishFailed = false; //!< true if a publish failed and the in-flight publishes have not all completed yet
     unsigned long stateTime = 0; //!< millis() value when entering the state, used for stateWait
     unsigned long durationMs = 0; //!< how long to wait before publishing in milliseconds, used in stateWait
-    bool publishComplete = false; //!< true if the publish has completed (successfully or not)
-    bool publishSuccess = false; //!< true if the publish succeeded
     bool pausePublishing = false; //!< flag to pause publishing (used from automated test)
     bool canSleep = false; //!< returns true if this is a good time to go to sleep
+    bool burstDrain = false; //!< true if in burst drain mode, see startBurstDrain()
+    bool stateWaitActive = false; //!< true if connected and the state handler is stateWait
+    size_t burstTokens = PUBLISHQUEUE_BURST_SIZE; //!< Publishes that can be started now without exceeding the cloud rate limit
+    unsigned long burstRefillMs = 0; //!< millis() value when burstTokens was last refilled
+    unsigned long avgPublishMs = 1000; //!< Moving average of the time for a publish to complete
+    unsigned long publishDevMs = 500; //!< Moving average of the difference between the publish time and avgPublishMs
+    unsigned int failureRate = 0; //!< Moving average of the fraction of publishes that failed, 0 to 1000
+    size_t consecutiveFailures = 0; //!< Failed publishes since the last successful one
+    unsigned long adaptiveGapMs = 0; //!< Gap between publishes increased by quick failures, used by getPublishGapMs()
+    bool adaptiveRetry = false; //!< Set by withAdaptiveRetry()
+    unsigned long minFailureWait = 15000; //!< Set by withAdaptiveRetry()
+    unsigned long maxFailureWait = 300000; //!< Set by withAdaptiveRetry()
+    unsigned long maxPublishGap = 10000; //!< Set by withAdaptiveRetry()
 
     unsigned long waitAfterConnect = 2000; //!< time to wait after Particle.connected() before publishing
     unsigned long waitBetweenPublish = 1000; //!< how long to wait in milliseconds between publishes
@@ -115,6 +115,7 @@ int testHandler(String param) {
             if (fd) {
                 close(fd);
             }
+            sequentialFile.addFileExtension(fileNum, "sha1");
         }
         else {
             Log.info("arg required (fileNum)");
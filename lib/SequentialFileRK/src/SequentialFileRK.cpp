@@ -4,9 +4,15 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#include <algorithm>
+#include <vector>
+
 
 static Logger _log("app.seqfile");
 
+// Slot files are numbered by slot, not file number. See withSlotRecycling().
+static const char * const SLOT_PATTERN = "slot%04d";
+
 
 SequentialFile::SequentialFile() {
 
@@ -21,6 +27,9 @@ SequentialFile &SequentialFile::withDirPath(const char *dirPath) {
     if (this->dirPath.endsWith("/")) {
         this->dirPath = this->dirPath.substring(0, this->dirPath.length() - 1);
     }
+    if (this->dirPath.length() > SEQUENTIALFILE_MAX_DIR_PATH) {
+        _log.error("dirPath longer than SEQUENTIALFILE_MAX_DIR_PATH %s", this->dirPath.c_str());
+    }
     return *this; 
 };
 
@@ -36,6 +45,25 @@ bool SequentialFile::scanDir(void) {
         return false;
     }
 
+    if (numSlots) {
+        bool result = scanSlots();
+        scanDirCompleted = true;
+        return result;
+    }
+    else {
+        // Files written now need to be moved into slots if slot recycling is turned on again
+        char markerPath[PATH_BUF_SIZE];
+        struct stat sb;
+        if (getSlotMarkerPath(markerPath, sizeof(markerPath)) && stat(markerPath, &sb) == 0) {
+            unlink(markerPath);
+        }
+    }
+
+    if (useManifest && loadManifest()) {
+        scanDirCompleted = true;
+        return true;
+    }
+
     _log.trace("scanning %s with pattern %s", dirPath.c_str(), pattern.c_str());
 
     DIR *dir = opendir(dirPath);
@@ -44,6 +72,7 @@ bool SequentialFile::scanDir(void) {
     }
     
     lastFileNum = 0;
+    resetExtIndex(true);
 
     while(true) {
         struct dirent* ent = readdir(dir); 
@@ -58,6 +87,19 @@ bool SequentialFile::scanDir(void) {
         
         int fileNum;
         if (sscanf(ent->d_name, pattern, &fileNum) == 1) {
+            // Every numbered file is indexed, as removeFileNum() with allExtensions removes them all
+            char name[SEQUENTIALFILE_MAX_NAME + 1];
+            snprintf(name, sizeof(name), pattern, fileNum);
+            size_t nameLen = strlen(name);
+            const char *ext = &ent->d_name[nameLen];
+            if (strncmp(ent->d_name, name, nameLen) == 0 && (ext[0] == 0 || (ext[0] == '.' && ext[1] != 0))) {
+                addToExtIndex(fileNum, (ext[0] == '.') ? ext + 1 : ext);
+            }
+            else {
+                // Can't be recreated from the number and extension
+                resetExtIndex(false);
+            }
+
             if (filenameExtension.length() == 0 || String(ent->d_name).endsWith(filenameExtension)) {
                 // 
                 if (preScanAddHook(ent->d_name)) {
@@ -66,16 +108,22 @@ bool SequentialFile::scanDir(void) {
                     }
                     _log.trace("adding to queue %d %s", fileNum, ent->d_name);
 
+                    // Directory order is not necessarily file number order
                     queueMutexLock();
-                    queue.push_back(fileNum); 
+                    insertFileNum(fileNum);
                     queueMutexUnlock();
                 }
             }
         }
     }
     closedir(dir);
-    
+
     scanDirCompleted = true;
+
+    if (useManifest) {
+        manifestChanges = 1;
+        saveManifest();
+    }
     return true;
 }
 
@@ -84,7 +132,9 @@ int SequentialFile::reserveFile(void) {
         scanDir();
     }
 
-    return ++lastFileNum;
+    int fileNum = ++lastFileNum;
+    addToExtIndex(fileNum, filenameExtension);
+    return fileNum;
 }
 
 void SequentialFile::addFileToQueue(int fileNum) {
@@ -96,8 +146,11 @@ void SequentialFile::addFileToQueue(int fileNum) {
     }
 
     queueMutexLock();
-    queue.push_back(fileNum); 
+    insertFileNum(fileNum);
     queueMutexUnlock();
+
+    addToExtIndex(fileNum, filenameExtension);
+    manifestChanged();
 }
  
 int SequentialFile::getFileFromQueue(bool remove) {
@@ -109,9 +162,16 @@ int SequentialFile::getFileFromQueue(bool remove) {
 
     queueMutexLock();
     if (!queue.empty()) {
-        fileNum = queue.front();
+        SequentialFileRange &range = queue.front();
+        fileNum = range.first;
         if (remove) {
-            queue.pop_front();
+            if (range.first == range.last) {
+                queue.pop_front();
+            }
+            else {
+                range.first++;
+            }
+            queueLen--;
         }
     }
     queueMutexUnlock();
@@ -123,26 +183,144 @@ int SequentialFile::getFileFromQueue(bool remove) {
     return fileNum;
 }
 
+int SequentialFile::getFileFromQueueAt(size_t index) {
+    int fileNum = 0;
+
+    if (!scanDirCompleted) {
+        scanDir();
+    }
+
+    queueMutexLock();
+    if (index < (size_t)queueLen) {
+        for(auto it = queue.begin(); it != queue.end(); it++) {
+            size_t rangeLen = (size_t)(it->last - it->first) + 1;
+            if (index < rangeLen) {
+                fileNum = it->first + (int)index;
+                break;
+            }
+            index -= rangeLen;
+        }
+    }
+    queueMutexUnlock();
+
+    return fileNum;
+}
+
+bool SequentialFile::removeFileFromQueue(int fileNum) {
+    bool result = false;
+
+    if (!scanDirCompleted) {
+        scanDir();
+    }
+
+    queueMutexLock();
+    result = (eraseRange(fileNum, fileNum) != 0);
+    queueMutexUnlock();
+
+    return result;
+}
+
+int SequentialFile::eraseRange(int first, int last) {
+    int count = 0;
+
+    // The ranges are in increasing order; find the first one that ends at or after first
+    auto it = std::lower_bound(queue.begin(), queue.end(), first, [](const SequentialFileRange &range, int value) {
+        return range.last < value;
+    });
+    while(it != queue.end() && it->first <= last) {
+        int from = (it->first > first) ? it->first : first;
+        int to = (it->last < last) ? it->last : last;
+        count += to - from + 1;
+
+        if (from == it->first && to == it->last) {
+            it = queue.erase(it);
+        }
+        else if (from == it->first) {
+            it->first = to + 1;
+            break;
+        }
+        else if (to == it->last) {
+            it->last = from - 1;
+            it++;
+        }
+        else {
+            // Split the range around first to last
+            SequentialFileRange before = { it->first, from - 1 };
+            it->first = to + 1;
+            queue.insert(it, before);
+            break;
+        }
+    }
+    queueLen -= count;
+
+    return count;
+}
 
 String SequentialFile::getNameForFileNum(int fileNum, const char *overrideExt) {
-    String name = String::format(pattern.c_str(), fileNum);
+    char name[SEQUENTIALFILE_MAX_NAME + 1];
+    getNameForFileNum(fileNum, overrideExt, name, sizeof(name));
+
+    return name;
+}
+
+bool SequentialFile::getNameForFileNum(int fileNum, const char *overrideExt, char *buf, size_t bufSize) const {
+    const char *ext = overrideExt ? overrideExt : filenameExtension.c_str();
+
+    if (numSlots) {
+        return formatName(SLOT_PATTERN, (int)getSlotForFileNum(fileNum), ext, buf, bufSize);
+    }
+    return formatName(pattern, fileNum, ext, buf, bufSize);
+}
 
-    return getNameWithOptionalExt(name, (overrideExt ? overrideExt : filenameExtension.c_str()));
+String SequentialFile::getPathForFileNum(int fileNum, const char *overrideExt) const {
+    char path[PATH_BUF_SIZE];
+    getPathForFileNum(fileNum, overrideExt, path, sizeof(path));
+
+    return path;
 }
 
-String SequentialFile::getPathForFileNum(int fileNum, const char *overrideExt) {
-    String result;
-    result.reserve(dirPath.length() + pattern.length() + 4);
+bool SequentialFile::getPathForFileNum(int fileNum, const char *overrideExt, char *buf, size_t bufSize) const {
+    return formatPathForFileNum(fileNum, overrideExt, buf, bufSize);
+}
 
+bool SequentialFile::formatPathForFileNum(int fileNum, const char *ext, char *buf, size_t bufSize) const {
     // dirPath never ends with a "/" because withDirName() removes it if it was passed in
-    result = dirPath + String("/") + getNameForFileNum(fileNum, overrideExt);
+    int len = snprintf(buf, bufSize, "%s/", dirPath.c_str());
+    if (len < 0 || (size_t)len >= bufSize) {
+        return false;
+    }
+    return getNameForFileNum(fileNum, ext, &buf[len], bufSize - len);
+}
 
-    return result;
+bool SequentialFile::getPathForName(const char *name, char *buf, size_t bufSize) const {
+    // dirPath never ends with a "/" because withDirName() removes it if it was passed in
+    int len = snprintf(buf, bufSize, "%s/%s", dirPath.c_str(), name);
+
+    return len >= 0 && (size_t)len < bufSize;
+}
+
+// [static]
+bool SequentialFile::formatName(const char *pattern, int value, const char *ext, char *buf, size_t bufSize) {
+    int len = snprintf(buf, bufSize, pattern, value);
+    if (len >= 0 && (size_t)len < bufSize && ext && *ext) {
+        len += snprintf(&buf[len], bufSize - len, ".%s", ext);
+    }
+
+    return len >= 0 && (size_t)len < bufSize;
 }
 
 
 void SequentialFile::removeFileNum(int fileNum, bool allExtensions) {
-    if (allExtensions) {
+    if (numSlots) {
+        // Files for other extensions are named after the slot and are reused with it
+        emptySlot(fileNum);
+        return;
+    }
+
+    if (allExtensions && extIndexValid) {
+        unlinkExtensions(fileNum, removeFromExtIndex(fileNum, NULL));
+    }
+    else if (allExtensions) {
         DIR *dir = opendir(dirPath);
         if (dir) {
             while(true) {
@@ -159,10 +337,11 @@ void SequentialFile::removeFileNum(int fileNum, bool allExtensions) {
                 int curFileNum;
                 if (sscanf(ent->d_name, pattern.c_str(), &curFileNum) == 1) {
                     if (curFileNum == fileNum) {
-                        // dirPath never ends with a "/" because withDirName() removes it if it was passed in
-                        String path = dirPath + String("/") + ent->d_name;
-                        unlink(path);
-                        _log.trace("removed %s", path.c_str());
+                        char path[PATH_BUF_SIZE];
+                        if (getPathForName(ent->d_name, path, sizeof(path))) {
+                            unlink(path);
+                            _log.trace("removed %s", path);
+                        }
                     }
                 }
             }
@@ -170,10 +349,93 @@ void SequentialFile::removeFileNum(int fileNum, bool allExtensions) {
         }
     }
     else {
-        String path = getPathForFileNum(fileNum); 
-        unlink(path);
-        _log.trace("removed %s", path.c_str());
+        char path[PATH_BUF_SIZE];
+        if (formatPathForFileNum(fileNum, NULL, path, sizeof(path))) {
+            unlink(path);
+            _log.trace("removed %s", path);
+        }
+        removeFromExtIndex(fileNum, filenameExtension);
     }
+
+    manifestChanged();
+}
+
+int SequentialFile::removeRange(int first, int last, bool allExtensions) {
+    if (!scanDirCompleted) {
+        scanDir();
+    }
+
+    // File numbers in the queue, which are the ones to unlink without allExtensions
+    std::vector<SequentialFileRange> &queued = removeBuf;
+
+    queueMutexLock();
+    queued.clear();
+    for(auto it = queue.begin(); it != queue.end() && it->first <= last; it++) {
+        if (it->last >= first) {
+            SequentialFileRange range = { (it->first > first) ? it->first : first, (it->last < last) ? it->last : last };
+            queued.push_back(range);
+        }
+    }
+    int count = eraseRange(first, last);
+    queueMutexUnlock();
+
+    if (numSlots) {
+        for(auto it = queued.begin(); it != queued.end(); it++) {
+            for(int fileNum = it->first; fileNum <= it->last; fileNum++) {
+                emptySlot(fileNum);
+            }
+        }
+    }
+    else if (!allExtensions) {
+        for(auto it = queued.begin(); it != queued.end(); it++) {
+            for(int fileNum = it->first; fileNum <= it->last; fileNum++) {
+                char path[PATH_BUF_SIZE];
+                if (formatPathForFileNum(fileNum, NULL, path, sizeof(path))) {
+                    unlink(path);
+                }
+                removeFromExtIndex(fileNum, filenameExtension);
+            }
+        }
+    }
+    else if (extIndexValid) {
+        queueMutexLock();
+        int indexFirst = (extFirstFileNum > first) ? extFirstFileNum : first;
+        int indexLast = extFirstFileNum + (int)extMasks.size() - 1;
+        if (indexLast > last) {
+            indexLast = last;
+        }
+        queueMutexUnlock();
+
+        for(int fileNum = indexFirst; fileNum <= indexLast; fileNum++) {
+            unlinkExtensions(fileNum, removeFromExtIndex(fileNum, NULL));
+        }
+    }
+    else {
+        // One pass through the directory for the whole range
+        DIR *dir = opendir(dirPath);
+        if (dir) {
+            while(true) {
+                struct dirent* ent = readdir(dir); 
+                if (!ent) {
+                    break;
+                }
+                
+                int curFileNum;
+                char path[PATH_BUF_SIZE];
+                if (ent->d_type == DT_REG && sscanf(ent->d_name, pattern.c_str(), &curFileNum) == 1 && curFileNum >= first && curFileNum <= last &&
+                    getPathForName(ent->d_name, path, sizeof(path))) {
+                    unlink(path);
+                    _log.trace("removed %s", path);
+                }
+            }
+            closedir(dir);
+        }
+    }
+
+    manifestChanged();
+
+    _log.trace("removed range %d to %d, %d in queue", first, last, count);
+    return count;
 }
 
 void SequentialFile::removeAll(bool removeDir) {
@@ -190,15 +452,22 @@ void SequentialFile::removeAll(bool removeDir) {
                 continue;
             }
             
-            String path = dirPath + String("/") + ent->d_name;
-            unlink(path);
-            _log.trace("removed %s", path.c_str());
+            char path[PATH_BUF_SIZE];
+            if (getPathForName(ent->d_name, path, sizeof(path))) {
+                unlink(path);
+                _log.trace("removed %s", path);
+            }
         }
         closedir(dir);
     }    
+    resetExtIndex(false);
+
     queueMutexLock();
 
     queue.clear();
+    queueLen = 0;
+    slotFileNums.clear();
+    slotsRemapped = false;
 
     if (removeDir) {
         rmdir(dirPath);
@@ -211,12 +480,691 @@ void SequentialFile::removeAll(bool removeDir) {
 
 int SequentialFile::getQueueLen() const {
     queueMutexLock();
-    int size = queue.size();
+    int size = queueLen;
+    queueMutexUnlock();
+
+    return size;
+}
+
+size_t SequentialFile::getNumRanges() const {
+    queueMutexLock();
+    size_t size = queue.size();
     queueMutexUnlock();
 
     return size;
 }
 
+void SequentialFile::addToExtIndex(int fileNum, const char *ext) {
+    queueMutexLock();
+    if (extIndexValid) {
+        size_t extIndex = 0;
+        while(extIndex < extensions.size() && extensions[extIndex] != ext) {
+            extIndex++;
+        }
+        if (extIndex == extensions.size() && extIndex < MAX_EXTENSIONS) {
+            extensions.push_back(ext);
+        }
+
+        if (extMasks.empty()) {
+            extFirstFileNum = fileNum;
+        }
+        uint32_t numFileNums = (uint32_t)(extMasks.size());
+        if (fileNum < extFirstFileNum) {
+            numFileNums += (uint32_t)(extFirstFileNum - fileNum);
+        }
+        else if (fileNum >= extFirstFileNum + (int)extMasks.size()) {
+            numFileNums = (uint32_t)(fileNum - extFirstFileNum + 1);
+        }
+
+        if (extIndex < MAX_EXTENSIONS && numFileNums <= MANIFEST_MAX_FILE_NUMS) {
+            if (fileNum < extFirstFileNum) {
+                extMasks.insert(extMasks.begin(), (size_t)(extFirstFileNum - fileNum), 0);
+                extFirstFileNum = fileNum;
+            }
+            else if (numFileNums > extMasks.size()) {
+                extMasks.resize(numFileNums, 0);
+            }
+            extMasks[fileNum - extFirstFileNum] |= (uint8_t)(1 << extIndex);
+        }
+        else {
+            // Too many extensions or too far apart, fall back to reading the directory
+            _log.trace("extension index not used for %s", dirPath.c_str());
+            extIndexValid = false;
+            extensions.clear();
+            extMasks.clear();
+        }
+    }
+    queueMutexUnlock();
+}
+
+uint8_t SequentialFile::removeFromExtIndex(int fileNum, const char *ext) {
+    uint8_t result = 0;
+
+    queueMutexLock();
+    if (fileNum >= extFirstFileNum && fileNum < extFirstFileNum + (int)extMasks.size()) {
+        uint8_t &mask = extMasks[fileNum - extFirstFileNum];
+        if (ext) {
+            for(size_t extIndex = 0; extIndex < extensions.size(); extIndex++) {
+                if (extensions[extIndex] == ext) {
+                    result = mask & (uint8_t)(1 << extIndex);
+                    break;
+                }
+            }
+            mask &= ~result;
+        }
+        else {
+            result = mask;
+            mask = 0;
+        }
+
+        // Only the file numbers from the oldest to the newest with files are kept
+        while(!extMasks.empty() && extMasks.front() == 0) {
+            extMasks.pop_front();
+            extFirstFileNum++;
+        }
+        while(!extMasks.empty() && extMasks.back() == 0) {
+            extMasks.pop_back();
+        }
+    }
+    queueMutexUnlock();
+
+    return result;
+}
+
+void SequentialFile::resetExtIndex(bool valid) {
+    queueMutexLock();
+    extIndexValid = valid;
+    extensions.clear();
+    extMasks.clear();
+    extFirstFileNum = 0;
+    queueMutexUnlock();
+}
+
+void SequentialFile::unlinkExtensions(int fileNum, uint8_t extMask) {
+    for(size_t extIndex = 0; extIndex < MAX_EXTENSIONS; extIndex++) {
+        if (extMask & (1 << extIndex)) {
+            char ext[SEQUENTIALFILE_MAX_NAME + 1] = {0};
+            queueMutexLock();
+            if (extIndex < extensions.size()) {
+                strncpy(ext, extensions[extIndex].c_str(), sizeof(ext) - 1);
+            }
+            queueMutexUnlock();
+
+            // Not getPathForFileNum(), which would add it back to the index
+            char path[PATH_BUF_SIZE];
+            if (formatPathForFileNum(fileNum, ext, path, sizeof(path))) {
+                unlink(path);
+                _log.trace("removed %s", path);
+            }
+        }
+    }
+}
+
+void SequentialFile::insertFileNum(int fileNum) {
+    if (queue.empty() || fileNum > queue.back().last + 1) {
+        SequentialFileRange range = { fileNum, fileNum };
+        queue.push_back(range);
+        queueLen++;
+        return;
+    }
+    if (fileNum == queue.back().last + 1) {
+        // The usual case, the next file number
+        queue.back().last = fileNum;
+        queueLen++;
+        return;
+    }
+
+    // Out of order. Find the first range that ends at or after fileNum - 1, which fileNum is in, extends, or goes before.
+    auto it = std::lower_bound(queue.begin(), queue.end(), fileNum - 1, [](const SequentialFileRange &range, int value) {
+        return range.last < value;
+    });
+    if (it->first <= fileNum && fileNum <= it->last) {
+        // Already in the queue
+        return;
+    }
+    if (fileNum == it->last + 1) {
+        it->last = fileNum;
+        auto next = it + 1;
+        if (next != queue.end() && next->first == fileNum + 1) {
+            // Filled the gap between two ranges
+            it->last = next->last;
+            queue.erase(next);
+        }
+    }
+    else if (fileNum == it->first - 1) {
+        it->first = fileNum;
+    }
+    else {
+        SequentialFileRange range = { fileNum, fileNum };
+        queue.insert(it, range);
+    }
+    queueLen++;
+}
+
+void SequentialFile::manifestChanged() {
+    if (++manifestChanges >= manifestSaveEvery) {
+        saveManifest();
+    }
+}
+
+void SequentialFile::saveManifest() {
+    if (!useManifest || numSlots || !scanDirCompleted || !manifestChanges) {
+        return;
+    }
+    manifestChanges = 0;
+
+    SequentialFileManifestHeader hdr;
+    hdr.magic = MANIFEST_MAGIC;
+    hdr.version = MANIFEST_VERSION;
+    hdr.headerSize = sizeof(SequentialFileManifestHeader);
+    hdr.reserved = 0;
+    hdr.firstFileNum = 0;
+    hdr.numFileNums = 0;
+    hdr.lastFileNum = lastFileNum;
+
+    char path[PATH_BUF_SIZE];
+    if (!getManifestPath(path, sizeof(path))) {
+        return;
+    }
+
+    std::vector<uint8_t> &buf = manifestBuf;
+    buf.clear();
+
+    queueMutexLock();
+    if (!queue.empty()) {
+        hdr.firstFileNum = queue.front().first;
+        hdr.numFileNums = (uint32_t)(queue.back().last - queue.front().first + 1);
+    }
+    if (hdr.numFileNums <= MANIFEST_MAX_FILE_NUMS) {
+        size_t bitmapSize = (hdr.numFileNums + 7) / 8;
+        buf.resize(sizeof(hdr) + bitmapSize + sizeof(uint32_t), 0);
+
+        uint8_t *bitmap = &buf[sizeof(hdr)];
+        memset(bitmap, 0xff, bitmapSize);
+        for(auto it = queue.begin(); it != queue.end(); it++) {
+            for(int fileNum = it->first; fileNum <= it->last; fileNum++) {
+                uint32_t bit = (uint32_t)(fileNum - hdr.firstFileNum);
+                bitmap[bit / 8] &= ~(1 << (bit % 8));
+            }
+        }
+    }
+    queueMutexUnlock();
+
+    if (buf.empty()) {
+        // Queue spans too many file numbers, scan the directory next time instead
+        unlink(path);
+        _log.trace("queue too sparse for manifest");
+        return;
+    }
+
+    memcpy(&buf[0], &hdr, sizeof(hdr));
+    uint32_t crc = crc32(&buf[0], buf.size() - sizeof(uint32_t));
+    memcpy(&buf[buf.size() - sizeof(uint32_t)], &crc, sizeof(uint32_t));
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC);
+    if (fd >= 0) {
+        write(fd, &buf[0], buf.size());
+        close(fd);
+    }
+}
+
+bool SequentialFile::loadManifest() {
+    std::vector<uint8_t> buf;
+
+    char path[PATH_BUF_SIZE];
+    int fd = getManifestPath(path, sizeof(path)) ? open(path, O_RDONLY) : -1;
+    if (fd < 0) {
+        _log.trace("no manifest in %s", dirPath.c_str());
+        return false;
+    }
+    struct stat sb;
+    fstat(fd, &sb);
+    if (sb.st_size >= (off_t)(sizeof(SequentialFileManifestHeader) + sizeof(uint32_t))) {
+        buf.resize(sb.st_size);
+        if (read(fd, &buf[0], buf.size()) != (ssize_t)buf.size()) {
+            buf.clear();
+        }
+    }
+    close(fd);
+
+    SequentialFileManifestHeader hdr;
+    if (!buf.empty()) {
+        memcpy(&hdr, &buf[0], sizeof(hdr));
+    }
+    uint32_t crc = 0;
+    if (!buf.empty()) {
+        memcpy(&crc, &buf[buf.size() - sizeof(uint32_t)], sizeof(uint32_t));
+    }
+    if (buf.empty() ||
+        hdr.magic != MANIFEST_MAGIC ||
+        hdr.version != MANIFEST_VERSION ||
+        hdr.headerSize != sizeof(SequentialFileManifestHeader) ||
+        hdr.numFileNums > MANIFEST_MAX_FILE_NUMS ||
+        buf.size() != sizeof(hdr) + (hdr.numFileNums + 7) / 8 + sizeof(uint32_t) ||
+        crc != crc32(&buf[0], buf.size() - sizeof(uint32_t))) {
+        _log.info("manifest in %s not valid, scanning", dirPath.c_str());
+        return false;
+    }
+
+    const uint8_t *bitmap = &buf[sizeof(hdr)];
+
+    // The manifest does not record extensions, so removing all of them reads the directory
+    resetExtIndex(false);
+
+    queueMutexLock();
+    queue.clear();
+    queueLen = 0;
+    for(uint32_t bit = 0; bit < hdr.numFileNums; bit++) {
+        if ((bitmap[bit / 8] & (1 << (bit % 8))) == 0) {
+            insertFileNum(hdr.firstFileNum + (int)bit);
+        }
+    }
+    lastFileNum = hdr.lastFileNum;
+    queueMutexUnlock();
+
+    // Files sent since the manifest was last saved were removed from the front of the queue
+    bool changed = false;
+    while(true) {
+        queueMutexLock();
+        int fileNum = queue.empty() ? 0 : queue.front().first;
+        queueMutexUnlock();
+
+        struct stat sb;
+        if (!fileNum || !formatPathForFileNum(fileNum, NULL, path, sizeof(path)) || stat(path, &sb) == 0) {
+            break;
+        }
+        _log.trace("removing from queue %d (not in directory)", fileNum);
+
+        queueMutexLock();
+        eraseRange(fileNum, fileNum);
+        queueMutexUnlock();
+        changed = true;
+    }
+
+    // Files added since the manifest was last saved, or written but not yet added to the queue 
+    // when the device reset, are after the newest one. Some of those may have been removed 
+    // already, so stop after as many missing file numbers as changes between saves.
+    for(int fileNum = lastFileNum + 1; fileNum <= lastFileNum + (int)manifestSaveEvery; fileNum++) {
+        struct stat sb;
+        if (!formatPathForFileNum(fileNum, NULL, path, sizeof(path))) {
+            break;
+        }
+        if (stat(path, &sb) != 0) {
+            continue;
+        }
+        lastFileNum = fileNum;
+        _log.trace("adding to queue %d (not in manifest)", lastFileNum);
+
+        queueMutexLock();
+        insertFileNum(lastFileNum);
+        queueMutexUnlock();
+        changed = true;
+    }
+    scanDirCompleted = true;
+    if (changed) {
+        manifestChanges = 1;
+        saveManifest();
+    }
+
+    _log.trace("loaded manifest %s, %d files in queue", dirPath.c_str(), getQueueLen());
+    return true;
+}
+
+bool SequentialFile::writeSlot(int fileNum, const void *data, size_t dataLen) {
+    if (!numSlots) {
+        return false;
+    }
+
+    size_t slot = getSlotForFileNum(fileNum);
+
+    queueMutexLock();
+    if (slot >= slotFileNums.size()) {
+        // scanDir() has not been called
+        queueMutexUnlock();
+        return false;
+    }
+    int oldFileNum = slotFileNums[slot];
+    slotFileNums[slot] = fileNum;
+    if (oldFileNum != 0 && oldFileNum != fileNum && eraseRange(oldFileNum, oldFileNum) != 0) {
+        _log.info("slot %u reused, discarded %d", (unsigned int)slot, oldFileNum);
+    }
+    queueMutexUnlock();
+
+    // Header, data, and data CRC in a single write, over the previous contents of the slot. The
+    // file is not truncated; anything after the CRC is ignored. The data CRC catches a write that
+    // updated the header but not all of the data, which would otherwise return the old data.
+    SequentialFileSlotHeader hdr;
+    makeSlotHeader(hdr, SLOT_STATE_FULL, fileNum, dataLen);
+    uint32_t dataCrc = crc32(data, dataLen);
+    slotBuf.resize(sizeof(hdr) + dataLen + sizeof(uint32_t));
+    memcpy(&slotBuf[0], &hdr, sizeof(hdr));
+    if (dataLen) {
+        memcpy(&slotBuf[sizeof(hdr)], data, dataLen);
+    }
+    memcpy(&slotBuf[sizeof(hdr) + dataLen], &dataCrc, sizeof(uint32_t));
+
+    bool result = false;
+    char path[PATH_BUF_SIZE];
+    int fd = getPathForSlot(slot, filenameExtension, path, sizeof(path)) ? open(path, O_RDWR | O_CREAT) : -1;
+    if (fd >= 0) {
+        result = (write(fd, &slotBuf[0], slotBuf.size()) == (ssize_t)slotBuf.size());
+        close(fd);
+    }
+    if (!result) {
+        _log.error("failed to write slot %u (%d) errno=%d", (unsigned int)slot, fileNum, errno);
+
+        queueMutexLock();
+        if (slotFileNums[slot] == fileNum) {
+            slotFileNums[slot] = 0;
+        }
+        queueMutexUnlock();
+    }
+    return result;
+}
+
+int SequentialFile::openSlot(int fileNum, size_t *dataLen) {
+    if (!numSlots) {
+        return -1;
+    }
+
+    size_t slot = getSlotForFileNum(fileNum);
+
+    queueMutexLock();
+    bool inSlot = (slot < slotFileNums.size() && slotFileNums[slot] == fileNum);
+    queueMutexUnlock();
+    if (!inSlot) {
+        return -1;
+    }
+
+    char path[PATH_BUF_SIZE];
+    int fd = getPathForSlot(slot, filenameExtension, path, sizeof(path)) ? open(path, O_RDONLY) : -1;
+    if (fd >= 0) {
+        SequentialFileSlotHeader hdr;
+        if (read(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) || !isSlotHeaderValid(hdr) || 
+            hdr.state != SLOT_STATE_FULL || hdr.fileNum != fileNum) {
+            _log.info("slot %u does not hold %d", (unsigned int)slot, fileNum);
+            close(fd);
+            fd = -1;
+        }
+        else if (hdr.version >= 2 && !isSlotDataValid(fd, hdr.dataLen)) {
+            _log.info("slot %u (%d) data not valid", (unsigned int)slot, fileNum);
+            close(fd);
+            fd = -1;
+        }
+        else if (dataLen) {
+            *dataLen = hdr.dataLen;
+        }
+    }
+    return fd;
+}
+
+bool SequentialFile::scanSlots() {
+    _log.trace("scanning %u slots in %s", (unsigned int)numSlots, dirPath.c_str());
+
+    // Slots are opened by name, so the extension index is not used
+    resetExtIndex(false);
+
+    queueMutexLock();
+    queue.clear();
+    queueLen = 0;
+    slotFileNums.assign(numSlots, 0);
+    slotsRemapped = false;
+    queueMutexUnlock();
+
+    lastFileNum = 0;
+
+    for(size_t slot = 0; slot < numSlots; slot++) {
+        char path[PATH_BUF_SIZE];
+        if (!getPathForSlot(slot, filenameExtension, path, sizeof(path))) {
+            return false;
+        }
+        SequentialFileSlotHeader hdr;
+
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            // Create the slot now so using it does not create a file
+            makeSlotHeader(hdr, SLOT_STATE_EMPTY, 0, 0);
+            fd = open(path, O_RDWR | O_CREAT);
+            bool written = false;
+            if (fd >= 0) {
+                written = (write(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr));
+                close(fd);
+            }
+            if (!written) {
+                // An incomplete header is treated as empty on the next scan
+                _log.error("failed to create slot %u errno=%d", (unsigned int)slot, errno);
+            }
+            continue;
+        }
+        bool valid = (read(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr) && isSlotHeaderValid(hdr));
+        close(fd);
+
+        if (!valid) {
+            // Treated as empty, and overwritten when the slot is next used
+            _log.info("slot %u header not valid", (unsigned int)slot);
+            continue;
+        }
+        if (hdr.fileNum > lastFileNum) {
+            // Empty slots count too, so file numbers keep increasing after the queue empties
+            lastFileNum = hdr.fileNum;
+        }
+        if (hdr.state == SLOT_STATE_FULL && hdr.fileNum > 0) {
+            _log.trace("adding to queue %d from slot %u", hdr.fileNum, (unsigned int)slot);
+
+            queueMutexLock();
+            slotFileNums[slot] = hdr.fileNum;
+            if ((size_t)hdr.fileNum % numSlots != slot) {
+                slotsRemapped = true;
+            }
+            insertFileNum(hdr.fileNum);
+            queueMutexUnlock();
+        }
+    }
+
+    if (!migrateToSlots()) {
+        return false;
+    }
+
+    _log.trace("loaded slots %s, %d files in queue", dirPath.c_str(), getQueueLen());
+    return true;
+}
+
+bool SequentialFile::migrateToSlots() {
+    char markerPath[PATH_BUF_SIZE];
+    struct stat sb;
+    if (!getSlotMarkerPath(markerPath, sizeof(markerPath))) {
+        return false;
+    }
+    if (stat(markerPath, &sb) == 0) {
+        // Already done, so the directory does not need to be read
+        return true;
+    }
+
+    std::vector<int> fileNums;
+    DIR *dir = opendir(dirPath);
+    if (!dir) {
+        return false;
+    }
+    while(true) {
+        struct dirent* ent = readdir(dir); 
+        if (!ent) {
+            break;
+        }
+
+        int fileNum;
+        if (ent->d_type == DT_REG && sscanf(ent->d_name, pattern, &fileNum) == 1 && 
+            (filenameExtension.length() == 0 || String(ent->d_name).endsWith(filenameExtension)) &&
+            preScanAddHook(ent->d_name)) {
+            fileNums.push_back(fileNum);
+        }
+    }
+    closedir(dir);
+    std::sort(fileNums.begin(), fileNums.end());
+
+    std::vector<uint8_t> data;
+    for(auto it = fileNums.begin(); it != fileNums.end(); it++) {
+        char name[SEQUENTIALFILE_MAX_NAME + 1];
+        char path[PATH_BUF_SIZE];
+        if (!formatName(pattern, *it, filenameExtension, name, sizeof(name)) || !getPathForName(name, path, sizeof(path))) {
+            continue;
+        }
+
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            struct stat sb;
+            fstat(fd, &sb);
+            data.resize(sb.st_size);
+            bool readOk = (data.empty() || read(fd, &data[0], data.size()) == (ssize_t)data.size());
+            close(fd);
+
+            int fileNum = ++lastFileNum;
+            if (readOk && writeSlot(fileNum, data.empty() ? NULL : &data[0], data.size())) {
+                _log.trace("moved %s to slot %u", path, (unsigned int)getSlotForFileNum(fileNum));
+                queueMutexLock();
+                insertFileNum(fileNum);
+                queueMutexUnlock();
+            }
+        }
+        unlink(path);
+    }
+
+    // If this is interrupted, the files not yet moved are moved on the next scan
+    int fd = open(markerPath, O_RDWR | O_CREAT);
+    if (fd >= 0) {
+        close(fd);
+    }
+    _log.trace("moved %u files to slots", (unsigned int)fileNums.size());
+    return true;
+}
+
+size_t SequentialFile::getSlotForFileNum(int fileNum) const {
+    size_t slot = (size_t)fileNum % numSlots;
+
+    queueMutexLock();
+    if (slotsRemapped && (slot >= slotFileNums.size() || slotFileNums[slot] != fileNum)) {
+        // The number of slots was changed while files were queued, so the file may be elsewhere
+        for(size_t ii = 0; ii < slotFileNums.size(); ii++) {
+            if (slotFileNums[ii] == fileNum) {
+                slot = ii;
+                break;
+            }
+        }
+    }
+    queueMutexUnlock();
+
+    return slot;
+}
+
+bool SequentialFile::getPathForSlot(size_t slot, const char *ext, char *buf, size_t bufSize) const {
+    // dirPath never ends with a "/" because withDirName() removes it if it was passed in
+    int len = snprintf(buf, bufSize, "%s/", dirPath.c_str());
+    if (len < 0 || (size_t)len >= bufSize) {
+        return false;
+    }
+    return formatName(SLOT_PATTERN, (int)slot, ext, &buf[len], bufSize - len);
+}
+
+bool SequentialFile::emptySlot(int fileNum) {
+    size_t slot = getSlotForFileNum(fileNum);
+
+    queueMutexLock();
+    bool inSlot = (slot < slotFileNums.size() && slotFileNums[slot] == fileNum);
+    if (inSlot) {
+        slotFileNums[slot] = 0;
+    }
+    queueMutexUnlock();
+
+    if (!inSlot) {
+        // Already reused for a newer file number
+        return true;
+    }
+
+    // Only the header is rewritten. The file number is kept as the generation.
+    SequentialFileSlotHeader hdr;
+    makeSlotHeader(hdr, SLOT_STATE_EMPTY, fileNum, 0);
+
+    bool result = false;
+    char path[PATH_BUF_SIZE];
+    int fd = getPathForSlot(slot, filenameExtension, path, sizeof(path)) ? open(path, O_RDWR) : -1;
+    if (fd >= 0) {
+        result = (write(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr));
+        close(fd);
+    }
+    if (result) {
+        _log.trace("emptied slot %u (%d)", (unsigned int)slot, fileNum);
+    }
+    else {
+        // The slot is still marked full, so the file number is queued again after a reset
+        _log.error("failed to empty slot %u (%d) errno=%d", (unsigned int)slot, fileNum, errno);
+    }
+    return result;
+}
+
+// [static]
+void SequentialFile::makeSlotHeader(SequentialFileSlotHeader &hdr, uint8_t state, int fileNum, size_t dataLen) {
+    hdr.magic = SLOT_MAGIC;
+    hdr.version = SLOT_VERSION;
+    hdr.headerSize = sizeof(SequentialFileSlotHeader);
+    hdr.state = state;
+    hdr.reserved = 0;
+    hdr.fileNum = fileNum;
+    hdr.dataLen = (uint32_t)dataLen;
+    hdr.crc = crc32(&hdr, offsetof(SequentialFileSlotHeader, crc));
+}
+
+// [static]
+bool SequentialFile::isSlotHeaderValid(const SequentialFileSlotHeader &hdr) {
+    // Version 1 has the same header, without the data CRC
+    return hdr.magic == SLOT_MAGIC &&
+        (hdr.version == 1 || hdr.version == SLOT_VERSION) &&
+        hdr.headerSize == sizeof(SequentialFileSlotHeader) &&
+        hdr.state <= SLOT_STATE_FULL &&
+        hdr.crc == crc32(&hdr, offsetof(SequentialFileSlotHeader, crc));
+}
+
+// [static]
+bool SequentialFile::isSlotDataValid(int fd, size_t dataLen) {
+    uint8_t buf[128];
+    uint32_t crc = 0;
+
+    for(size_t offset = 0; offset < dataLen; ) {
+        size_t count = (dataLen - offset < sizeof(buf)) ? (dataLen - offset) : sizeof(buf);
+        if (read(fd, buf, count) != (ssize_t)count) {
+            return false;
+        }
+        crc = crc32(buf, count, crc);
+        offset += count;
+    }
+
+    uint32_t dataCrc;
+    if (read(fd, &dataCrc, sizeof(dataCrc)) != (ssize_t)sizeof(dataCrc) || dataCrc != crc) {
+        return false;
+    }
+    return lseek(fd, sizeof(SequentialFileSlotHeader), SEEK_SET) == (off_t)sizeof(SequentialFileSlotHeader);
+}
+
+bool SequentialFile::getManifestPath(char *buf, size_t bufSize) const {
+    return getPathForName("manifest", buf, bufSize);
+}
+
+bool SequentialFile::getSlotMarkerPath(char *buf, size_t bufSize) const {
+    return getPathForName("slots", buf, bufSize);
+}
+
+// [static]
+uint32_t SequentialFile::crc32(const void *data, size_t len, uint32_t crc) {
+    const uint8_t *p = (const uint8_t *)data;
+
+    crc = ~crc;
+    for(size_t ii = 0; ii < len; ii++) {
+        crc ^= p[ii];
+        for(int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
 
 void SequentialFile::queueMutexLock() const {
     if (!queueMutex) {
@@ -4,6 +4,69 @@
 #include "Particle.h"
 
 #include <deque>
+#include <vector>
+
+#ifndef SEQUENTIALFILE_MAX_DIR_PATH
+/**
+ * @brief Longest queue directory path, in characters (default: 63)
+ * 
+ * Used with SEQUENTIALFILE_MAX_NAME to size the buffers pathnames are built in, see 
+ * SequentialFile::PATH_BUF_SIZE.
+ */
+#define SEQUENTIALFILE_MAX_DIR_PATH 63
+#endif
+
+#ifndef SEQUENTIALFILE_MAX_NAME
+/**
+ * @brief Longest filename in the queue directory, in characters, including the dot and extension (default: 31)
+ * 
+ * The default pattern %08d with a 4 character extension is 13.
+ */
+#define SEQUENTIALFILE_MAX_NAME 31
+#endif
+
+/**
+ * @brief Header of the manifest file, see SequentialFile::withManifest()
+ * 
+ * Followed by a bitmap of numFileNums bits, one per file number starting with firstFileNum,
+ * set for numbers that are not in the queue (holes). Then a CRC-32 of the header and bitmap.
+ */
+struct SequentialFileManifestHeader {
+    uint32_t magic;         //!< SequentialFile::MANIFEST_MAGIC = 0x5146716d
+    uint8_t version;        //!< SequentialFile::MANIFEST_VERSION = 1
+    uint8_t headerSize;     //!< sizeof(SequentialFileManifestHeader) = 20
+    uint16_t reserved;      //!< Reserved, set to 0
+    int32_t firstFileNum;   //!< Oldest file number in the queue, or 0 if the queue is empty
+    uint32_t numFileNums;   //!< Number of bits in the hole bitmap (newest - oldest + 1)
+    int32_t lastFileNum;    //!< Value of lastFileNum
+};
+
+/**
+ * @brief Header at the beginning of each slot file, see SequentialFile::withSlotRecycling()
+ * 
+ * Followed by dataLen bytes of data when the slot is full. In version 2, the data is followed
+ * by a CRC-32 of the data; version 1 slots, written by earlier versions, don't have it.
+ */
+struct SequentialFileSlotHeader {
+    uint32_t magic;         //!< SequentialFile::SLOT_MAGIC = 0x5146736c
+    uint8_t version;        //!< SequentialFile::SLOT_VERSION = 2
+    uint8_t headerSize;     //!< sizeof(SequentialFileSlotHeader) = 20
+    uint8_t state;          //!< SequentialFile::SLOT_STATE_EMPTY (0) or SLOT_STATE_FULL (1)
+    uint8_t reserved;       //!< Reserved, set to 0
+    int32_t fileNum;        //!< File number last stored in the slot. Only increases, so it's also the generation.
+    uint32_t dataLen;       //!< Number of bytes of data after the header, 0 if empty
+    uint32_t crc;           //!< CRC-32 of the fields before this one
+};
+
+/**
+ * @brief A run of consecutive file numbers in the queue, first to last inclusive
+ * 
+ * File numbers are almost always consecutive, so the whole queue is usually one range.
+ */
+struct SequentialFileRange {
+    int first;      //!< Oldest file number in the run
+    int last;       //!< Newest file number in the run, >= first
+};
 
 /**
  * @brief Class for maintaining a directory of files as a queue with unique filenames
@@ -58,7 +121,7 @@ public:
      * level of directory will be created. The parent must already exist.
      * 
      * The dirPath can end with a slash or not, but if you include it, it will be
-     * removed.
+     * removed. It can be up to SEQUENTIALFILE_MAX_DIR_PATH characters long.
      * 
      * You must call this as you cannot use the root directory as a queue!
      */
@@ -102,6 +165,67 @@ public:
      */
     const char *getFilenameExtension() const { return filenameExtension; };
 
+    /**
+     * @brief Keep a manifest file so scanDir() does not need to read the directory (default: false)
+     * 
+     * @param value true to use the manifest
+     * 
+     * @param saveEvery Save the manifest after this many changes to the queue (default: 
+     * MANIFEST_SAVE_EVERY, 16). 1 saves it on every change.
+     * 
+     * The manifest holds the oldest and newest file numbers in the queue and a bitmap of the 
+     * numbers in between that are not in the queue. Rewriting it on every addFileToQueue() and 
+     * removeFileNum() would add a file write to each, so it's only saved after saveEvery changes,
+     * and when you call saveManifest(), for example before sleep or reset. In return, scanDir() 
+     * only reads one file regardless of the number of files in the queue, and the queue is in 
+     * file number order.
+     * 
+     * Changes made after the manifest was last saved are recovered by scanDir(): files after the
+     * newest one in the manifest are found by checking for up to saveEvery file numbers past it, 
+     * and files removed from the front of the queue are dropped. A file removed from the middle 
+     * of the queue is still in it; opening it fails, as for a file removed by another task.
+     * 
+     * If the manifest is missing or fails its CRC check, scanDir() reads the directory as usual
+     * and writes a new manifest. The manifest is named "manifest" and is stored in the queue 
+     * directory.
+     */
+    SequentialFile &withManifest(bool value = true, size_t saveEvery = MANIFEST_SAVE_EVERY) { useManifest = value; manifestSaveEvery = saveEvery ? saveEvery : 1; return *this; };
+
+    /**
+     * @brief Returns true if withManifest() was used
+     */
+    bool getUseManifest() const { return useManifest; };
+
+    /**
+     * @brief Store the queue in a fixed pool of slot files that are reused (default: 0, one file per file number)
+     * 
+     * @param numSlots Number of slot files, which is the maximum queue length. 0 turns slot recycling off.
+     * 
+     * Normally each file number is a new file that's created and later removed, and on LittleFS each
+     * of those changes the directory. With slot recycling, scanDir() creates numSlots files once, and
+     * file numbers are then stored in them round-robin. Writing and removing a file number overwrite
+     * the slot in place, so once the slots exist no files are created or removed.
+     * 
+     * Each slot file starts with a SequentialFileSlotHeader that marks it empty or full and holds
+     * the file number, which increases with each use of a slot so the queue order is kept across
+     * a reboot. The data is followed by a CRC-32 of it, checked by openSlot(). Use writeSlot() and 
+     * openSlot() instead of opening the file from getPathForFileNum(). When all slots are full, 
+     * writing a new file number discards the oldest one.
+     * 
+     * Must be called before scanDir(). Files from before slot recycling was turned on are moved 
+     * into slots by the first scanDir(), which then creates a marker file named "slots" so later
+     * scans don't read the directory. The manifest (withManifest()) is not used, as scanDir() reads the 
+     * slot headers instead of the directory. getPathForFileNum() with an overrideExt returns a 
+     * file named after the slot, which is reused along with it; removeFileNum() and removeRange() 
+     * only mark the slot empty and don't remove these files.
+     */
+    SequentialFile &withSlotRecycling(size_t numSlots) { this->numSlots = numSlots; return *this; };
+
+    /**
+     * @brief Gets the number of slots set using withSlotRecycling(), 0 if not used
+     */
+    size_t getNumSlots() const { return numSlots; };
+
     /**
      * @brief Scans the queue directory for files. Typically called during setup().
      */
@@ -121,6 +245,10 @@ public:
      * Use reserveFile() to get the next file number, addFileToQueue() to add it to the queue
      * and getFileFromQueue() to get an item from the queue.
      * 
+     * The queue is kept in file number order, so a file number lower than the newest one is
+     * inserted in order rather than at the end. Adding a file number that is already in the 
+     * queue does nothing.
+     * 
      * It's safe to call reserveFile(), addFileToQueue(), and getFileFromQueue() from different
      * threads. Locking is handled internally.
      */
@@ -147,6 +275,32 @@ public:
      */
     int getFileFromQueue(bool remove = true);
 
+    /**
+     * @brief Gets a file number from the queue without removing it
+     * 
+     * @param index 0 is the oldest file in the queue (same as getFileFromQueue(false)), 1 is the
+     * next oldest, etc.
+     * 
+     * @return The fileNum, or 0 if index is not less than getQueueLen().
+     * 
+     * This is used to look ahead in the queue, for example to process several files at once. 
+     * It does not access the filesystem. It's proportional to the number of runs of consecutive
+     * file numbers (getNumRanges()), not the index.
+     */
+    int getFileFromQueueAt(size_t index);
+
+    /**
+     * @brief Removes a file number from anywhere in the queue
+     * 
+     * @param fileNum The file number to remove
+     * 
+     * @return true if fileNum was in the queue and was removed
+     * 
+     * This only removes it from the queue in RAM. Use removeFileNum() to remove the file, which
+     * also updates the manifest.
+     */
+    bool removeFileFromQueue(int fileNum);
+
     /**
      * @brief Uses pattern to create a filename given a fileNum
      * 
@@ -160,6 +314,22 @@ public:
      */
     String getNameForFileNum(int fileNum, const char *overrideExt = NULL);
 
+    /**
+     * @brief Uses pattern to create a filename given a fileNum, without allocating
+     * 
+     * @param fileNum A file number, typically from reserveFile() or getFileFromQueue()
+     * 
+     * @param overrideExt If non-null, use this extension instead of the configured
+     * filename extension. It should not contain the preceeding dot.
+     * 
+     * @param buf Buffer to store the filename in, typically SEQUENTIALFILE_MAX_NAME + 1 bytes
+     * 
+     * @param bufSize Size of buf in bytes
+     * 
+     * @return false if the filename did not fit in buf. It's still null terminated, but truncated.
+     */
+    bool getNameForFileNum(int fileNum, const char *overrideExt, char *buf, size_t bufSize) const;
+
     /**
      * @brief Gets a full pathname based on dirName and getNameForFileNum
      * 
@@ -170,8 +340,48 @@ public:
      * 
      * The overrideExt is used when you create multiple files per queue entry fileNum,
      * for example a data file and a .sha1 hash for the file. Or other metadata.
+     * 
+     * This does not change anything. After creating a file with an overrideExt, call 
+     * addFileExtension() so removeFileNum() with allExtensions and removeRange() know to remove it.
      */
-    String getPathForFileNum(int fileNum, const char *overrideExt = NULL);
+    String getPathForFileNum(int fileNum, const char *overrideExt = NULL) const;
+
+    /**
+     * @brief Gets a full pathname based on dirName and getNameForFileNum, without allocating
+     * 
+     * @param fileNum A file number, typically from reserveFile() or getFileFromQueue()
+     * 
+     * @param overrideExt If non-null, use this extension instead of the configured
+     * filename extension.
+     * 
+     * @param buf Buffer to store the pathname in, typically PATH_BUF_SIZE bytes
+     * 
+     * @param bufSize Size of buf in bytes
+     * 
+     * @return false if the pathname did not fit in buf. It's still null terminated, but truncated.
+     * 
+     * This is the same as the version that returns a String, but does not use the heap, so it's 
+     * better for code that runs for every file:
+     * 
+     * ```
+     * char path[SequentialFile::PATH_BUF_SIZE];
+     * queue.getPathForFileNum(fileNum, NULL, path, sizeof(path));
+     * ```
+     */
+    bool getPathForFileNum(int fileNum, const char *overrideExt, char *buf, size_t bufSize) const;
+
+    /**
+     * @brief Record that a file with an extension other than the configured one was created for fileNum
+     * 
+     * @param fileNum A file number, typically from reserveFile()
+     * 
+     * @param ext The extension without the dot, the overrideExt passed to getPathForFileNum()
+     * 
+     * Call this after creating a file such as a .sha1 hash for fileNum, so removeFileNum() with 
+     * allExtensions and removeRange() remove it without reading the directory. Files with the
+     * configured extension are recorded by reserveFile() and addFileToQueue().
+     */
+    void addFileExtension(int fileNum, const char *ext) { addToExtIndex(fileNum, ext ? ext : filenameExtension.c_str()); };
 
     /**
      * @brief Remove fileNum from the flash file system
@@ -180,9 +390,78 @@ public:
      * 
      * @param allExtensions If true, all files with that number regardless of extension are removed.
      * 
+     * With allExtensions, only the files in the extension index are removed, without reading 
+     * the directory, if the index is complete. See getExtIndexValid().
      */
     void removeFileNum(int fileNum, bool allExtensions);
 
+    /**
+     * @brief Remove file numbers first to last from the queue and the flash file system
+     * 
+     * @param first The first file number to remove
+     * 
+     * @param last The last file number to remove, inclusive
+     * 
+     * @param allExtensions If true, all files with those numbers regardless of extension are removed.
+     * If false, only the files in the queue with the configured extension.
+     * 
+     * @return The number of file numbers that were removed from the queue
+     * 
+     * The manifest is saved once for the whole range. With allExtensions, files are found using
+     * the extension index, or a single read of the directory if it's not complete.
+     */
+    int removeRange(int first, int last, bool allExtensions);
+
+    /**
+     * @brief Returns true if the extension index knows every file in the queue directory
+     * 
+     * The index is built by scanDir() when it reads the directory, and is updated by 
+     * reserveFile(), addFileToQueue(), addFileExtension(), and the remove methods. It's not complete when the 
+     * queue was loaded from the manifest, which does not record extensions, when more than 
+     * MAX_EXTENSIONS different extensions are used, or when the numbers in it span more than 
+     * MANIFEST_MAX_FILE_NUMS. Removing all extensions then reads the directory instead.
+     */
+    bool getExtIndexValid() const { return extIndexValid; };
+
+    /**
+     * @brief Write the data for fileNum to its slot, when using withSlotRecycling()
+     * 
+     * @param fileNum A file number, typically from reserveFile()
+     * 
+     * @param data The data to store
+     * 
+     * @param dataLen The number of bytes of data
+     * 
+     * @return true if the slot was written. If not, the slot is left unassigned and the file 
+     * number must not be added to the queue.
+     * 
+     * The slot header, data, and a CRC-32 of the data are written with a single write, over the
+     * previous contents of the slot. If the slot holds an older file number that's still in the
+     * queue, it's removed from the queue. Call addFileToQueue() after writing, as usual.
+     */
+    bool writeSlot(int fileNum, const void *data, size_t dataLen);
+
+    /**
+     * @brief Open the slot for fileNum for reading, when using withSlotRecycling()
+     * 
+     * @param fileNum A file number, typically from getFileFromQueue()
+     * 
+     * @param dataLen If not NULL, filled in with the number of bytes of data
+     * 
+     * @return A file descriptor positioned at the start of the data, or -1 if the slot does not
+     * hold fileNum or the data does not match its CRC. Close it with close().
+     */
+    int openSlot(int fileNum, size_t *dataLen);
+
+    /**
+     * @brief Write the manifest file from the queue in RAM, if withManifest() was used
+     * 
+     * This is done automatically every saveEvery changes (see withManifest()). Call it before 
+     * sleep or reset so the next scanDir() does not need to recover changes. Does nothing if the
+     * queue has not changed since the manifest was last saved.
+     */
+    void saveManifest();
+
     /**
      * @brief Removes all of the files in the queue directory
      * 
@@ -198,6 +477,14 @@ public:
      */
     int getQueueLen() const;
 
+    /**
+     * @brief Gets the number of runs of consecutive file numbers the queue is stored as
+     * 
+     * The RAM used by the queue is proportional to this, not getQueueLen(). It's 1 (or 0 when 
+     * empty) unless files were removed from the middle of the queue or are missing.
+     */
+    size_t getNumRanges() const;
+
     /**
      * @brief This class is not copyable
      */
@@ -229,7 +516,220 @@ public:
      */
     static String getNameWithOptionalExt(const char *name, const char *ext);
 
+    /**
+     * @brief Magic bytes at the beginning of the manifest file
+     */
+    static const uint32_t MANIFEST_MAGIC = 0x5146716d;
+
+    /**
+     * @brief Version of the manifest file
+     */
+    static const uint8_t MANIFEST_VERSION = 1;
+
+    /**
+     * @brief Maximum number of file numbers from oldest to newest in a manifest (8192, a 1 Kbyte bitmap)
+     * 
+     * If the queue spans more, no manifest is stored and scanDir() reads the directory.
+     */
+    static const uint32_t MANIFEST_MAX_FILE_NUMS = 8192;
+
+    /**
+     * @brief Default number of queue changes between manifest saves (16), see withManifest()
+     */
+    static const size_t MANIFEST_SAVE_EVERY = 16;
+
+    /**
+     * @brief Maximum number of different filename extensions in the extension index (8)
+     * 
+     * No extension counts as one of them.
+     */
+    static const size_t MAX_EXTENSIONS = 8;
+
+    /**
+     * @brief Size of a buffer that holds any pathname in the queue directory, including the null terminator
+     * 
+     * SEQUENTIALFILE_MAX_DIR_PATH + 1 + SEQUENTIALFILE_MAX_NAME + 1 (96 by default).
+     */
+    static const size_t PATH_BUF_SIZE = SEQUENTIALFILE_MAX_DIR_PATH + 1 + SEQUENTIALFILE_MAX_NAME + 1;
+
+    /**
+     * @brief Magic bytes at the beginning of each slot file
+     */
+    static const uint32_t SLOT_MAGIC = 0x5146736c;
+
+    /**
+     * @brief Version of the slot header. Version 2 adds a CRC-32 after the data.
+     */
+    static const uint8_t SLOT_VERSION = 2;
+
+    /**
+     * @brief SequentialFileSlotHeader state of a slot that's free to reuse
+     */
+    static const uint8_t SLOT_STATE_EMPTY = 0;
+
+    /**
+     * @brief SequentialFileSlotHeader state of a slot that holds a file number in the queue
+     */
+    static const uint8_t SLOT_STATE_FULL = 1;
+
+    /**
+     * @brief Computes a CRC-32 (IEEE 802.3, same as zlib), used to check the manifest and slot files
+     * 
+     * @param data Data to add to the CRC
+     * 
+     * @param len Length of data in bytes
+     * 
+     * @param crc Previous CRC value, to calculate the CRC of data spread across multiple buffers. Pass 0 initially.
+     */
+    static uint32_t crc32(const void *data, size_t len, uint32_t crc = 0);
+
 protected:
+    /**
+     * @brief Rebuild the queue from the manifest file
+     * 
+     * @return false if there is no manifest or it's not valid, in which case the directory must be scanned
+     */
+    bool loadManifest();
+
+    /**
+     * @brief Count a change to the queue, saving the manifest if there have been saveEvery of them
+     */
+    void manifestChanged();
+
+    /**
+     * @brief Gets the path to the manifest file
+     * 
+     * @return false if it did not fit in buf
+     */
+    bool getManifestPath(char *buf, size_t bufSize) const;
+
+    /**
+     * @brief Gets the path to the file that records that files from before slot recycling were moved into slots
+     */
+    bool getSlotMarkerPath(char *buf, size_t bufSize) const;
+
+    /**
+     * @brief Move files from before slot recycling was turned on into slots, oldest first
+     * 
+     * Only done if the marker file (getSlotMarkerPath()) does not exist, which is then created.
+     */
+    bool migrateToSlots();
+
+    /**
+     * @brief Gets the path to the file name in the queue directory
+     * 
+     * @return false if it did not fit in buf
+     */
+    bool getPathForName(const char *name, char *buf, size_t bufSize) const;
+
+    /**
+     * @brief Gets the path for fileNum, the same as getPathForFileNum()
+     * 
+     * @param ext The extension without the dot, or NULL for the configured filename extension
+     * 
+     * @return false if it did not fit in buf
+     */
+    bool formatPathForFileNum(int fileNum, const char *ext, char *buf, size_t bufSize) const;
+
+    /**
+     * @brief Format pattern with value, followed by a dot and ext if ext is not empty, into buf
+     * 
+     * @return false if it did not fit in buf
+     */
+    static bool formatName(const char *pattern, int value, const char *ext, char *buf, size_t bufSize);
+
+    /**
+     * @brief Rebuild the queue from the slot headers, when using withSlotRecycling()
+     * 
+     * Creates any slot files that don't exist, and moves files from before slot recycling was
+     * turned on into slots.
+     */
+    bool scanSlots();
+
+    /**
+     * @brief Gets the slot that holds fileNum, or that fileNum will be written to
+     * 
+     * This is fileNum modulo numSlots, unless the number of slots was changed while files were queued.
+     */
+    size_t getSlotForFileNum(int fileNum) const;
+
+    /**
+     * @brief Gets the path of a slot file
+     * 
+     * @param ext The extension without the dot, or an empty string for none
+     * 
+     * @return false if it did not fit in buf
+     */
+    bool getPathForSlot(size_t slot, const char *ext, char *buf, size_t bufSize) const;
+
+    /**
+     * @brief Fill in a slot header, including the CRC
+     */
+    static void makeSlotHeader(SequentialFileSlotHeader &hdr, uint8_t state, int fileNum, size_t dataLen);
+
+    /**
+     * @brief Returns true if hdr has the correct magic, version, size, and CRC
+     */
+    static bool isSlotHeaderValid(const SequentialFileSlotHeader &hdr);
+
+    /**
+     * @brief Check the data of a version 2 slot against its CRC
+     * 
+     * @param fd The slot file, positioned after the header. On success it's positioned there again.
+     * 
+     * @param dataLen The dataLen from the header
+     */
+    static bool isSlotDataValid(int fd, size_t dataLen);
+
+    /**
+     * @brief Mark the slot holding fileNum as empty, if it has not already been reused
+     * 
+     * @return false if the slot header could not be written. The slot is then still full on the
+     * file system, so fileNum is queued again by the next scanDir().
+     */
+    bool emptySlot(int fileNum);
+
+    /**
+     * @brief Add fileNum to queue in order. The caller must hold the queue mutex.
+     * 
+     * Appending the next file number after the newest one, the usual case, only updates the 
+     * last range.
+     */
+    void insertFileNum(int fileNum);
+
+    /**
+     * @brief Remove file numbers first to last from queue. The caller must hold the queue mutex.
+     * 
+     * @return The number of file numbers removed
+     */
+    int eraseRange(int first, int last);
+
+    /**
+     * @brief Record in the extension index that the file fileNum with extension ext may exist
+     * 
+     * @param ext The extension without the dot, or an empty string for none
+     */
+    void addToExtIndex(int fileNum, const char *ext);
+
+    /**
+     * @brief Remove fileNum from the extension index
+     * 
+     * @param ext Only remove this extension, or NULL to remove all of them
+     * 
+     * @return Bitmask of the indexes into extensions that were recorded for fileNum
+     */
+    uint8_t removeFromExtIndex(int fileNum, const char *ext);
+
+    /**
+     * @brief Empty the extension index and set whether it's complete
+     */
+    void resetExtIndex(bool valid);
+
+    /**
+     * @brief Unlink the files for fileNum in the extension index bitmask extMask
+     */
+    void unlinkExtensions(int fileNum, uint8_t extMask);
+
     /**
      * @brief Allows a subclass to choose whether to queue a file or not during scanDir.
      * 
@@ -240,7 +740,7 @@ protected:
      * This would allow a subclass to do some validation of the file before adding
      * it to the queue when reading the files from disk after reboot.
      */
-    virtual bool preScanAddHook(const char *name) { return true; };
+    virtual bool preScanAddHook(const char *name) { (void)name; return true; };
 
     /**
      * @brief Lock the mutex used to protect the queue
@@ -273,6 +773,21 @@ protected:
      */
     bool scanDirCompleted = false;
 
+    /**
+     * @brief Set by withManifest()
+     */
+    bool useManifest = false;
+
+    /**
+     * @brief Number of queue changes between manifest saves, set by withManifest()
+     */
+    size_t manifestSaveEvery = MANIFEST_SAVE_EVERY;
+
+    /**
+     * @brief Number of queue changes since the manifest was last saved
+     */
+    size_t manifestChanges = 0;
+
     /**
      * @brief Last file number used.
      * 
@@ -287,11 +802,68 @@ protected:
     mutable os_mutex_t queueMutex = 0;
 
     /**
-     * @brief Queue of files
+     * @brief Queue of files, as runs of consecutive file numbers in increasing order
      * 
      * Items are added using scanDir() and addFileToQueue(). Removed using getFileFromQueue().
      */
-    std::deque<int> queue;
+    std::deque<SequentialFileRange> queue;
+
+    /**
+     * @brief Number of file numbers in queue, so getQueueLen() does not need to add up the ranges
+     */
+    int queueLen = 0;
+
+    /**
+     * @brief Filename extensions in the extension index, without the dot. Index n is bit n in extMasks.
+     */
+    std::vector<String> extensions;
+
+    /**
+     * @brief Extension index: for each file number from extFirstFileNum, a bitmask of the extensions that may exist
+     * 
+     * One byte per file number from the oldest to the newest in the index.
+     */
+    std::deque<uint8_t> extMasks;
+
+    /**
+     * @brief File number of the first entry in extMasks
+     */
+    int extFirstFileNum = 0;
+
+    /**
+     * @brief True if extMasks has every file in the queue directory. See getExtIndexValid().
+     */
+    bool extIndexValid = false;
+
+    /**
+     * @brief Number of slot files, set by withSlotRecycling(). 0 for one file per file number.
+     */
+    size_t numSlots = 0;
+
+    /**
+     * @brief File number held by each slot, or 0 if the slot is empty
+     */
+    std::vector<int> slotFileNums;
+
+    /**
+     * @brief True if some slot holds a file number other than the usual one, see getSlotForFileNum()
+     */
+    bool slotsRemapped = false;
+
+    /**
+     * @brief Slot header and data being written, reused to avoid allocating on every write
+     */
+    std::vector<uint8_t> slotBuf;
+
+    /**
+     * @brief Manifest file being written, reused to avoid allocating on every write
+     */
+    std::vector<uint8_t> manifestBuf;
+
+    /**
+     * @brief File numbers being removed by removeRange(), reused to avoid allocating on every call
+     */
+    std::vector<SequentialFileRange> removeBuf;
 };
 
 #endif // __SEQUENTIALFILERK_H
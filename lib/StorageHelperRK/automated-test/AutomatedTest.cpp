@@ -1,6 +1,8 @@
 #include "Particle.h"
 #include "StorageHelperRK.h"
 
+#include <chrono>
+
 
 void readTestData(const char *filename, char *&data, size_t &size) {
 
@@ -293,6 +295,941 @@ void customPersistentDataTest() {
 }
 
 
+void deferredHashTest() {
+	unlink(persistentDataPath);
+
+	MyPersistentData data;
+	data.withSaveDelayMs(60000);
+	data.load();
+
+	// Changing values only marks the hash as out of date
+	uint32_t hash = data.myData.header.hash;
+	data.setValue_test1(1234);
+	data.setValue_test3(5.5);
+	data.setValue_test4("deferred");
+	assertInt("", data.myData.header.hash, hash);
+	assertInt("", data.myData.header.hash == data.getHash(), false);
+
+	// The hash is calculated when saving, before the data is written
+	data.flush(true);
+	assertInt("", data.myData.header.hash, data.getHash());
+
+	MyPersistentData data2;
+	data2.load();
+	assertInt("", data2.getValue_test1(), 1234);
+	assertDouble("", data2.getValue_test3(), 5.5, 0.001);
+	assertStr("", data2.getValue_test4(), "deferred");
+
+	// A change without a save can't be loaded
+	data.setValue_test1(5678);
+	MyPersistentData data3;
+	data3.load();
+	assertInt("", data3.getValue_test1(), 1234);
+
+	// Without deferred hashing the hash is always up to date
+	data.withDeferredHash(false);
+	assertInt("", data.myData.header.hash, data.getHash());
+	data.setValue_test1(9999);
+	assertInt("", data.myData.header.hash, data.getHash());
+
+	data.flush(true);
+	MyPersistentData data4;
+	data4.load();
+	assertInt("", data4.getValue_test1(), 9999);
+
+	unlink(persistentDataPath);
+}
+
+void atomicSaveTest() {
+	String path2 = String(persistentDataPath) + ".b";
+	unlink(persistentDataPath);
+	unlink(path2);
+
+	// File saved before atomic save was turned on
+	{
+		MyPersistentData data;
+		data.load();
+		data.setValue_test1(1);
+		data.flush(true);
+	}
+
+	MyPersistentData data;
+	data.withAtomicSave();
+	data.load();
+	assertInt("", data.getValue_test1(), 1);
+
+	// Saves alternate between the two files
+	data.setValue_test1(2);
+	data.flush(true);
+	struct stat sb;
+	assertInt("", stat(path2, &sb), 0);
+	assertInt("", (int)sb.st_size, (int)sizeof(MyPersistentData::MyData));
+
+	data.setValue_test1(3);
+	data.flush(true);
+
+	{
+		MyPersistentData data2;
+		data2.load();
+		assertInt("", data2.getValue_test1(), 3);
+	}
+
+	// Power lost while saving test1=4 to the second file: truncated or partially written
+	data.setValue_test1(4);
+	data.flush(true);
+	truncate(path2, 10);
+	{
+		MyPersistentData data2;
+		data2.load();
+		assertInt("", data2.getValue_test1(), 3);
+	}
+
+	data.setValue_test1(5);
+	data.flush(true);
+	data.setValue_test1(6);
+	data.flush(true);
+	{
+		FILE *fp = fopen(path2, "r+");
+		fseek(fp, offsetof(MyPersistentData::MyData, test1), SEEK_SET);
+		fputc(0xff, fp);
+		fclose(fp);
+
+		MyPersistentData data2;
+		data2.load();
+		assertInt("", data2.getValue_test1(), 5);
+
+		// Saving after loading the older file writes over the damaged one
+		data2.withAtomicSave();
+		data2.setValue_test1(7);
+		data2.flush(true);
+
+		MyPersistentData data3;
+		data3.withAtomicSave();
+		data3.load();
+		assertInt("", data3.getValue_test1(), 7);
+	}
+
+	// Without atomic save, the second file is only read if the first one is not valid
+	{
+		MyPersistentData data2;
+		data2.load();
+		assertInt("", data2.getValue_test1(), 5);
+		data2.setValue_test1(8);
+		data2.flush(true);
+
+		truncate(persistentDataPath, 10);
+		MyPersistentData data3;
+		data3.load();
+		assertInt("", data3.getValue_test1(), 7);
+	}
+
+	unlink(persistentDataPath);
+	unlink(path2);
+}
+
+void setterBenchmark() {
+	unlink(persistentDataPath);
+
+	const int numSets = 1000000;
+	double nsPerSet[2];
+
+	for(int deferred = 0; deferred < 2; deferred++) {
+		MyPersistentData data;
+		data.withSaveDelayMs(60000);
+		data.withDeferredHash(deferred != 0);
+		data.load();
+
+		auto start = std::chrono::steady_clock::now();
+		for(int ii = 0; ii < numSets; ii++) {
+			data.setValue_test1(ii);
+		}
+		auto end = std::chrono::steady_clock::now();
+
+		nsPerSet[deferred] = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / numSets;
+		assertInt("", data.getValue_test1(), numSets - 1);
+	}
+
+	printf("setValue (%d byte structure): hash on every change %.1f ns, deferred hash %.1f ns\n", 
+		(int)sizeof(MyPersistentData::MyData), nsPerSet[0], nsPerSet[1]);
+
+	unlink(persistentDataPath);
+}
+
+
+class CountingFileSystem : public StorageHelperRK::FileSystemPosix {
+public:
+	virtual bool open(const char *filename, int mode) {
+		if (mode & (O_WRONLY | O_RDWR)) {
+			writeOpens++;
+		}
+		return FileSystemPosix::open(filename, mode);
+	}
+
+	virtual size_t write(const uint8_t *buffer, size_t length) {
+		if (failWrites) {
+			// Like a full file system
+			return 0;
+		}
+		writes++;
+		bytesWritten += length;
+		return FileSystemPosix::write(buffer, length);
+	}
+
+	static void resetCounters() {
+		writeOpens = writes = 0;
+		bytesWritten = 0;
+	}
+
+	static int writeOpens;
+	static int writes;
+	static size_t bytesWritten;
+	static bool failWrites;
+};
+int CountingFileSystem::writeOpens = 0;
+int CountingFileSystem::writes = 0;
+size_t CountingFileSystem::bytesWritten = 0;
+bool CountingFileSystem::failWrites = false;
+
+
+class JournalTestData : public StorageHelperRK::PersistentDataFileSystem {
+public:
+	class MyData {
+	public:
+		StorageHelperRK::PersistentDataBase::SavedDataHeader header;
+		int value;
+		uint8_t other[60];
+	};
+
+	JournalTestData(const char *path, uint32_t magic) : PersistentDataFileSystem(new CountingFileSystem(), path, &myData.header, sizeof(MyData), magic, 1) {};
+
+	int getValue_value() const {
+		return getValue<int>(offsetof(MyData, value));
+	}
+
+	void setValue_value(int value) {
+		setValue<int>(offsetof(MyData, value), value);
+	}
+
+	MyData myData;
+};
+
+const char *journalPath = "./temp03.jnl";
+const char *journalDataPathA = "./temp03a.dat";
+const char *journalDataPathB = "./temp03b.dat";
+
+void journalCleanup() {
+	unlink(journalPath);
+	unlink(journalDataPathA);
+	unlink(journalDataPathB);
+	unlink(String(journalDataPathA) + ".b");
+}
+
+class JournalTestSet {
+public:
+	JournalTestSet(size_t compactSize = 4096, bool atomicSave = false) : a(journalDataPathA, 0x3a1c07d2), b(journalDataPathB, 0x3a1c07d3), journal(journalPath) {
+		journal
+			.withData(&a)
+			.withData(&b)
+			.withCompactSize(compactSize);
+		a.withAtomicSave(atomicSave);
+		a.load();
+		b.load();
+		journal.load();
+	}
+
+	JournalTestData a;
+	JournalTestData b;
+	StorageHelperRK::PersistentDataJournalFile journal;
+};
+
+void journalTest() {
+	const size_t recordSize = sizeof(StorageHelperRK::PersistentDataJournal::RecordHeader) + 2 * sizeof(JournalTestData::MyData);
+	struct stat sb;
+
+	journalCleanup();
+
+	{
+		JournalTestSet set;
+		assertInt("", (int)set.journal.getJournalSize(), 0);
+
+		// Changes to both objects are saved in one record, not to the data files
+		set.a.setValue_value(1);
+		set.b.setValue_value(2);
+		set.a.flush(false);
+		assertInt("", (int)set.journal.getJournalSize(), 0);
+		set.a.flush(true);
+		assertInt("", (int)set.journal.getJournalSize(), (int)recordSize);
+		assertInt("", stat(journalDataPathA, &sb), -1);
+		assertInt("", stat(journalDataPathB, &sb), -1);
+
+		// Record with only the changed object
+		set.b.setValue_value(3);
+		set.journal.flush(true);
+		assertInt("", (int)set.journal.getJournalSize(), (int)(recordSize + recordSize - sizeof(JournalTestData::MyData)));
+	}
+
+	{
+		JournalTestSet set;
+		assertInt("", set.a.getValue_value(), 1);
+		assertInt("", set.b.getValue_value(), 3);
+
+		set.a.setValue_value(4);
+		set.b.setValue_value(5);
+		set.b.flush(true);
+	}
+
+	// Power lost while writing the last record: neither change is applied
+	truncate(journalPath, 2 * recordSize + 10);
+	{
+		JournalTestSet set;
+		assertInt("", set.a.getValue_value(), 1);
+		assertInt("", set.b.getValue_value(), 3);
+		assertInt("", (int)set.journal.getJournalSize(), (int)(2 * recordSize - sizeof(JournalTestData::MyData)));
+		
+		// Records can be added after the removed one
+		set.a.setValue_value(6);
+		set.a.flush(true);
+	}
+	{
+		JournalTestSet set;
+		assertInt("", set.a.getValue_value(), 6);
+		assertInt("", set.b.getValue_value(), 3);
+	}
+
+	journalCleanup();
+
+	// Compacting saves the data files and empties the journal
+	{
+		JournalTestSet set(4 * recordSize);
+		for(int ii = 1; ii <= 4; ii++) {
+			set.a.setValue_value(ii);
+			set.b.setValue_value(ii * 10);
+			set.journal.flush(true);
+		}
+		assertInt("", (int)set.journal.getJournalSize(), 0);
+
+		set.a.setValue_value(5);
+		set.journal.flush(true);
+	}
+	{
+		JournalTestData a(journalDataPathA, 0x3a1c07d2);
+		JournalTestData b(journalDataPathB, 0x3a1c07d3);
+		a.load();
+		b.load();
+		assertInt("", a.getValue_value(), 4);
+		assertInt("", b.getValue_value(), 40);
+	}
+	{
+		// Changes loaded from the journal are saved by the next compact
+		JournalTestSet set;
+		assertInt("", set.a.getValue_value(), 5);
+		assertInt("", set.b.getValue_value(), 40);
+		set.journal.compact();
+		assertInt("", (int)set.journal.getJournalSize(), 0);
+	}
+	{
+		JournalTestData a(journalDataPathA, 0x3a1c07d2);
+		a.load();
+		assertInt("", a.getValue_value(), 5);
+	}
+
+	journalCleanup();
+
+	// Objects without records in the journal are not saved when compacting
+	{
+		const size_t recordSizeA = sizeof(StorageHelperRK::PersistentDataJournal::RecordHeader) + sizeof(JournalTestData::MyData);
+		JournalTestSet set(2 * recordSizeA);
+		set.a.setValue_value(1);
+		set.journal.flush(true);
+		set.a.setValue_value(2);
+		set.journal.flush(true);
+		assertInt("", (int)set.journal.getJournalSize(), 0);
+		assertInt("", stat(journalDataPathA, &sb), 0);
+		assertInt("", stat(journalDataPathB, &sb), -1);
+	}
+
+	journalCleanup();
+
+	// Replaying a record keeps the sequence number of the file that was loaded, so with atomic save 
+	// the next save does not give both files the same sequence number
+	{
+		JournalTestSet set(4096, true);
+		set.a.setValue_value(1);
+		set.journal.flush(true);
+
+		// Saved as compact() does, then reset before the journal was emptied
+		set.a.save();
+		assertInt("", (int)set.a.myData.header.reserved1, 1);
+	}
+	{
+		JournalTestSet set(4096, true);
+		assertInt("", set.a.getValue_value(), 1);
+		assertInt("", (int)set.a.myData.header.reserved1, 1);
+
+		set.a.setValue_value(2);
+		set.a.save();
+		assertInt("", (int)set.a.myData.header.reserved1, 2);
+	}
+	{
+		JournalTestData a(journalDataPathA, 0x3a1c07d2);
+		a.withAtomicSave();
+		a.load();
+		assertInt("", a.getValue_value(), 2);
+		assertInt("", (int)a.myData.header.reserved1, 2);
+	}
+
+	journalCleanup();
+}
+
+void journalBenchmark() {
+	// A day of hourly reporting cycles, each changing both objects
+	const int numCycles = 24;
+
+	for(int useJournal = 0; useJournal < 2; useJournal++) {
+		journalCleanup();
+
+		JournalTestData a(journalDataPathA, 0x3a1c07d2);
+		JournalTestData b(journalDataPathB, 0x3a1c07d3);
+		StorageHelperRK::PersistentDataJournal journal(new CountingFileSystem(), journalPath);
+		if (useJournal) {
+			journal.withData(&a).withData(&b);
+		}
+		a.load();
+		b.load();
+		journal.load();
+
+		CountingFileSystem::resetCounters();
+
+		for(int ii = 0; ii < numCycles; ii++) {
+			a.setValue_value(ii + 1);
+			b.setValue_value(ii + 1);
+			a.flush(true);
+			b.flush(true);
+		}
+
+		printf("%s: %.2f file opens for writing, %.2f writes, %.1f bytes per reporting cycle\n", 
+			useJournal ? "journal" : "separate files",
+			(double)CountingFileSystem::writeOpens / numCycles, (double)CountingFileSystem::writes / numCycles, 
+			(double)CountingFileSystem::bytesWritten / numCycles);
+	}
+
+	journalCleanup();
+}
+
+
+void deltaSaveCleanup() {
+	unlink(persistentDataPath);
+	unlink((String(persistentDataPath) + ".b").c_str());
+	unlink((String(persistentDataPath) + ".log").c_str());
+}
+
+int getFileSize(const char *path) {
+	struct stat sb;
+	if (stat(path, &sb) != 0) {
+		return -1;
+	}
+	return (int)sb.st_size;
+}
+
+void deltaSaveTest() {
+	String logPath = String(persistentDataPath) + ".log";
+	// Record for changing one byte, such as test1 from 1 to 2
+	const int recordSize = sizeof(StorageHelperRK::PersistentDataFileSystem::DeltaRecordHeader) + sizeof(StorageHelperRK::PersistentDataFileSystem::DeltaRange) + 1;
+
+	deltaSaveCleanup();
+
+	MyPersistentData data;
+	data.withDeltaSave(4 * recordSize);
+	data.load();
+
+	// The first save saves the whole structure
+	data.setValue_test1(1);
+	data.flush(true);
+	assertInt("", getFileSize(persistentDataPath), (int)sizeof(MyPersistentData::MyData));
+	assertInt("", getFileSize(logPath), -1);
+
+	// Then only the changed bytes are saved
+	data.setValue_test1(2);
+	data.flush(true);
+	assertInt("", getFileSize(logPath), recordSize);
+
+	data.setValue_test3(1.5);
+	data.setValue_test4("delta");
+	data.flush(true);
+	{
+		MyPersistentData data2;
+		data2.load();
+		assertInt("", data2.getValue_test1(), 2);
+		assertDouble("", data2.getValue_test3(), 1.5, 0.001);
+		assertStr("", data2.getValue_test4(), "delta");
+	}
+
+	// Saving the whole structure empties the log
+	for(int ii = 3; getFileSize(logPath) != 0; ii++) {
+		data.setValue_test1(ii);
+		data.flush(true);
+	}
+	int value = data.getValue_test1();
+	{
+		MyPersistentData data2;
+		data2.load();
+		assertInt("", data2.getValue_test1(), value);
+	}
+
+	// Power lost while appending a record
+	data.setValue_test1(10);
+	data.flush(true);
+	data.setValue_test1(11);
+	data.flush(true);
+	truncate(logPath, 2 * recordSize - 3);
+	{
+		MyPersistentData data2;
+		data2.withDeltaSave(4 * recordSize);
+		data2.load();
+		assertInt("", data2.getValue_test1(), 10);
+		assertInt("", getFileSize(logPath), recordSize);
+
+		data2.setValue_test2(true);
+		data2.flush(true);
+
+		MyPersistentData data3;
+		data3.load();
+		assertInt("", data3.getValue_test1(), 10);
+		assertInt("", data3.getValue_test2(), true);
+	}
+
+	// Power lost after saving the whole structure but before emptying the log: the old records are not applied
+	{
+		deltaSaveCleanup();
+
+		MyPersistentData data2;
+		data2.withDeltaSave();
+		data2.load();
+		data2.setValue_test1(20);
+		data2.flush(true);
+		data2.setValue_test1(21);
+		data2.flush(true);
+
+		char *oldLog;
+		size_t oldLogSize;
+		readTestData(logPath, oldLog, oldLogSize);
+
+		data2.withDeltaSave(0);
+		data2.setValue_test1(22);
+		data2.flush(true);
+		assertInt("", getFileSize(logPath), 0);
+
+		FILE *fp = fopen(logPath, "w");
+		fwrite(oldLog, 1, oldLogSize, fp);
+		fclose(fp);
+		free(oldLog);
+
+		MyPersistentData data3;
+		data3.withDeltaSave();
+		data3.load();
+		assertInt("", data3.getValue_test1(), 22);
+		assertInt("", getFileSize(logPath), 0);
+	}
+
+	// With atomic save, power lost while saving the whole structure
+	{
+		deltaSaveCleanup();
+
+		MyPersistentData data2;
+		data2.withAtomicSave().withDeltaSave(recordSize);
+		data2.load();
+		data2.setValue_test1(30);
+		data2.flush(true);
+		data2.setValue_test1(31);
+		data2.flush(true);
+
+		char *oldLog;
+		size_t oldLogSize;
+		readTestData(logPath, oldLog, oldLogSize);
+
+		// Saved to the other file, which is then damaged, and the log is not emptied
+		data2.setValue_test1(32);
+		data2.flush(true);
+		truncate(persistentDataPath, 10);
+
+		FILE *fp = fopen(logPath, "w");
+		fwrite(oldLog, 1, oldLogSize, fp);
+		fclose(fp);
+		free(oldLog);
+
+		MyPersistentData data3;
+		data3.load();
+		assertInt("", data3.getValue_test1(), 31);
+	}
+
+	deltaSaveCleanup();
+}
+
+
+class MetricsTestData : public StorageHelperRK::PersistentDataFile {
+public:
+	class MyData {
+	public:
+		StorageHelperRK::PersistentDataBase::SavedDataHeader header;
+		int value;
+		StorageHelperRK::PersistentDataBase::WriteMetrics writeMetrics;
+	};
+
+	MetricsTestData() : PersistentDataFile(persistentDataPath, &myData.header, sizeof(MyData), 0x6d31c0a5, 1) {
+		withSaveDelayMs(60000);
+		withWriteMetrics(offsetof(MyData, writeMetrics));
+	};
+
+	void setValue_value(int value) {
+		setValue<int>(offsetof(MyData, value), value);
+	}
+
+	void setStartTime(uint32_t value) {
+		writeMetrics.startTime = value;
+	}
+
+	MyData myData;
+};
+
+void writeMetricsTest() {
+	typedef StorageHelperRK::PersistentDataBase::WriteMetrics WriteMetrics;
+	const int dataSize = (int)sizeof(MetricsTestData::MyData);
+
+	deltaSaveCleanup();
+
+	{
+		MetricsTestData data;
+		data.load();
+		WriteMetrics metrics = data.getWriteMetrics();
+		assertInt("", metrics.saves, 0);
+		assertInt("", metrics.bytesWritten, 0);
+		uint32_t hashCount = metrics.hashCount;
+
+		// Changes while a save is waiting are suppressed, and deferred hashing calculates the hash once
+		data.setValue_value(1);
+		data.setValue_value(2);
+		data.setValue_value(3);
+		data.flush(true);
+		metrics = data.getWriteMetrics();
+		assertInt("", metrics.saves, 1);
+		assertInt("", metrics.bytesWritten, dataSize);
+		assertInt("", metrics.savesSuppressed, 2);
+		assertInt("", metrics.hashCount, hashCount + 1);
+		assertInt("", metrics.startTime != 0, true);
+
+		// Nothing to save
+		data.flush(true);
+		assertInt("", data.getWriteMetrics().saves, 1);
+
+		data.setValue_value(4);
+		data.flush(true);
+		metrics = data.getWriteMetrics();
+		assertInt("", metrics.saves, 2);
+		assertInt("", metrics.bytesWritten, 2 * dataSize);
+	}
+
+	{
+		// The counters are kept across resets, up to the save before the last one
+		MetricsTestData data;
+		data.load();
+		WriteMetrics metrics = data.getWriteMetrics();
+		assertInt("", metrics.saves, 1);
+		assertInt("", metrics.bytesWritten, dataSize);
+		assertInt("", metrics.savesSuppressed, 2);
+
+		// 96 saves per day
+		data.resetWriteMetrics();
+		for(int ii = 0; ii < 96; ii++) {
+			data.setValue_value(100 + ii);
+			data.flush(true);
+		}
+		data.setStartTime((uint32_t)Time.now() - 86400);
+		double years = StorageHelperRK::PersistentDataBase::projectEnduranceYears(96, 96 * dataSize);
+		assertDouble("", data.getProjectedEnduranceYears(), years, years / 100);
+
+		// 1 MB flash in 1000 byte blocks, 10,000 erase cycles, 50 bytes of file system overhead per save.
+		// 10 bytes per save still uses a whole block, plus 50 / 1000 of a metadata block.
+		assertDouble("", StorageHelperRK::PersistentDataBase::projectEnduranceYears(100, 1000, 1000000, 10000, 50, 1000), 10000000.0 / 105 / 365, 0.01);
+		// 2500 bytes per save uses 3 blocks
+		assertDouble("", StorageHelperRK::PersistentDataBase::projectEnduranceYears(10, 25000, 1000000, 10000, 50, 1000), 10000000.0 / 30.5 / 365, 0.01);
+		assertDouble("", StorageHelperRK::PersistentDataBase::projectEnduranceYears(0, 0), 0, 0.01);
+
+		data.setStartTime((uint32_t)Time.now() - 60);
+		assertDouble("", data.getProjectedEnduranceYears(), 0, 0.01);
+	}
+
+	deltaSaveCleanup();
+
+	{
+		// With atomic save, two saves write the second file and then the first one
+		MetricsTestData data;
+		data.withAtomicSave();
+		data.load();
+		data.setValue_value(1);
+		data.flush(true);
+		data.setValue_value(2);
+		data.flush(true);
+	}
+	{
+		// The second file is valid but older, so the counters come from the first file
+		MetricsTestData data;
+		data.withAtomicSave();
+		data.load();
+		assertInt("", data.myData.value, 2);
+		assertInt("", data.getWriteMetrics().saves, 1);
+		assertInt("", data.getWriteMetrics().bytesWritten, dataSize);
+	}
+
+	deltaSaveCleanup();
+
+	{
+		// Failed writes are not counted, for delta records or for the whole structure
+		JournalTestData data(persistentDataPath, 0x6d31c0a6);
+		data.withDeltaSave();
+		data.load();
+		data.setValue_value(1);
+		data.flush(true);
+		assertInt("", data.getWriteMetrics().saves, 1);
+
+		CountingFileSystem::failWrites = true;
+		data.setValue_value(2);
+		data.flush(true);
+		CountingFileSystem::failWrites = false;
+		WriteMetrics metrics = data.getWriteMetrics();
+		assertInt("", metrics.saves, 1);
+		assertInt("", metrics.bytesWritten, (int)sizeof(JournalTestData::MyData));
+	}
+
+	deltaSaveCleanup();
+}
+
+
+class FieldTestData : public StorageHelperRK::PersistentDataFile {
+public:
+	// Same layout as MyPersistentData::MyData
+#define FIELD_TEST_FIELDS(FIELD, STRING) \
+	FIELD(int, test1) \
+	FIELD(bool, test2) \
+	FIELD(double, test3) \
+	STRING(test4, 10)
+
+	STORAGEHELPER_STRUCT(MyData, header, FIELD_TEST_FIELDS)
+
+	static const uint32_t DATA_MAGIC = 0x20a99e73;
+	static const uint16_t DATA_VERSION = 1;
+
+	FieldTestData() : PersistentDataFile(persistentDataPath, &myData.header, sizeof(MyData), DATA_MAGIC, DATA_VERSION) {};
+
+	STORAGEHELPER_ACCESSORS(MyData, FIELD_TEST_FIELDS)
+
+	MyData myData;
+};
+
+void fieldTest() {
+	assertInt("", sizeof(FieldTestData::MyData), sizeof(MyPersistentData::MyData));
+	assertInt("", offsetof(FieldTestData::MyData, test4), offsetof(MyPersistentData::MyData, test4));
+
+	unlink(persistentDataPath);
+
+	{
+		MyPersistentData data;
+		data.load();
+		data.setValue_test1(0x55aa1234);
+		data.setValue_test2(true);
+		data.setValue_test3(9999999.25);
+		data.setValue_test4("testing!");
+		data.flush(true);
+	}
+
+	{
+		// Reads the file saved using getValue and setValue
+		FieldTestData data;
+		data.load();
+		assertInt("", data.get_test1(), 0x55aa1234);
+		assertInt("", data.get_test2(), true);
+		assertDouble("", data.get_test3(), 9999999.25, 0.001);
+		assertStr("", data.get_test4().c_str(), "testing!");
+
+		data.set_test1(-1);
+		data.set_test3(-0.5);
+		assertInt("", data.set_test4("123456789"), true);
+		assertInt("", data.set_test4("1234567890"), false);
+		assertStr("", data.get_test4().c_str(), "123456789");
+		data.flush(true);
+	}
+
+	{
+		MyPersistentData data;
+		data.load();
+		assertInt("", data.getValue_test1(), -1);
+		assertInt("", data.getValue_test2(), true);
+		assertDouble("", data.getValue_test3(), -0.5, 0.001);
+		assertStr("", data.getValue_test4().c_str(), "123456789");
+	}
+
+	{
+		// Setting the same value does not save
+		FieldTestData data;
+		data.load();
+		data.set_test1(-1);
+		data.set_test4("123456789");
+		data.flush(true);
+		assertInt("", data.getWriteMetrics().saves, 0);
+
+		data.set_test2(false);
+		data.flush(true);
+		assertInt("", data.getWriteMetrics().saves, 1);
+		assertInt("", data.getValue<bool>(offsetof(FieldTestData::MyData, test2)), false);
+	}
+
+	unlink(persistentDataPath);
+}
+
+void getterBenchmark() {
+	unlink(persistentDataPath);
+
+	const int numGets = 10000000;
+	double nsPerGet[2];
+	volatile int sum = 0;
+
+	FieldTestData data;
+	data.load();
+	data.set_test1(1);
+
+	auto start = std::chrono::steady_clock::now();
+	for(int ii = 0; ii < numGets; ii++) {
+		sum += data.getValue<int>(offsetof(FieldTestData::MyData, test1));
+	}
+	auto end = std::chrono::steady_clock::now();
+	nsPerGet[0] = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / numGets;
+
+	start = std::chrono::steady_clock::now();
+	for(int ii = 0; ii < numGets; ii++) {
+		sum += data.get_test1();
+	}
+	end = std::chrono::steady_clock::now();
+	nsPerGet[1] = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / numGets;
+
+	assertInt("", sum, 2 * numGets);
+
+	printf("get int: getValue %.1f ns, field table accessor %.1f ns\n", nsPerGet[0], nsPerGet[1]);
+
+	unlink(persistentDataPath);
+}
+
+
+class BenchSysStatus : public StorageHelperRK::PersistentDataFileSystem {
+public:
+	// Same layout as the Connected-Sensor-Next sysStatus data
+	class SysData {
+	public:
+		StorageHelperRK::PersistentDataBase::SavedDataHeader sysHeader;
+		uint8_t structuresVersion;
+		bool verboseMode;
+		bool solarPowerMode;
+		bool lowPowerMode;
+		bool lowBatteryMode;
+		uint8_t resetCount;
+		char timeZoneStr[39];
+		uint8_t openTime;
+		uint8_t closeTime;
+		time_t lastReport;
+		time_t lastConnection;
+		time_t lastHookResponse;
+		uint16_t lastConnectionDuration;
+		uint8_t sensorType;
+		bool verizonSIM;
+	};
+
+	BenchSysStatus() : PersistentDataFileSystem(new CountingFileSystem(), persistentDataPath, &sysData.sysHeader, sizeof(SysData), 0x20a15e75, 1) {};
+
+	SysData sysData;
+};
+
+class BenchCurrent : public StorageHelperRK::PersistentDataFileSystem {
+public:
+	// Same layout as the Connected-Sensor-Next current data
+	class CurrentData {
+	public:
+		StorageHelperRK::PersistentDataBase::SavedDataHeader currentHeader;
+		uint16_t distance;
+		time_t lastCountTime;
+		float internalTempC;
+		float externalTempC;
+		uint8_t alertCode;
+		time_t lastAlertTime;
+		float stateOfCharge;
+		uint8_t batteryState;
+	};
+
+	BenchCurrent() : PersistentDataFileSystem(new CountingFileSystem(), journalDataPathA, &currentData.currentHeader, sizeof(CurrentData), 0x20c1e47a, 1) {};
+
+	CurrentData currentData;
+};
+
+void deltaSaveBenchmark() {
+	typedef BenchSysStatus::SysData SysData;
+	typedef BenchCurrent::CurrentData CurrentData;
+
+	static const char * const modeNames[] = { "whole file save", "delta save", "journal" };
+
+	for(int mode = 0; mode < 3; mode++) {
+		deltaSaveCleanup();
+		journalCleanup();
+		unlink((String(journalDataPathA) + ".log").c_str());
+
+		BenchSysStatus sysStatus;
+		BenchCurrent current;
+		StorageHelperRK::PersistentDataJournal journal(new CountingFileSystem(), journalPath);
+		if (mode == 1) {
+			sysStatus.withDeltaSave();
+			current.withDeltaSave();
+		}
+		if (mode == 2) {
+			journal.withData(&sysStatus).withData(&current);
+		}
+		sysStatus.load();
+		current.load();
+		journal.load();
+		sysStatus.setValueString(offsetof(SysData, timeZoneStr), sizeof(SysData::timeZoneStr), "SGT-8");
+		sysStatus.setValue<uint8_t>(offsetof(SysData, closeTime), 22);
+		sysStatus.flush(true);
+		current.flush(true);
+
+		CountingFileSystem::resetCounters();
+
+		// A day of hourly reports, like the Connected-Sensor-Next state machine
+		time_t now = 1700000000;
+		for(int hour = 0; hour < 24; hour++, now += 3600) {
+			current.setValue<uint16_t>(offsetof(CurrentData, distance), (uint16_t)(200 + hour));
+			current.setValue<float>(offsetof(CurrentData, externalTempC), 10.0f + hour * 0.25f);
+			current.setValue<float>(offsetof(CurrentData, internalTempC), 15.0f + hour * 0.5f);
+			current.setValue<uint8_t>(offsetof(CurrentData, batteryState), (uint8_t)(hour % 2 ? 2 : 3));
+			current.setValue<float>(offsetof(CurrentData, stateOfCharge), 80.0f - hour * 0.1f);
+			sysStatus.setValue<time_t>(offsetof(SysData, lastReport), now);
+			current.flush(true);
+			sysStatus.flush(true);
+
+			sysStatus.setValue<uint16_t>(offsetof(SysData, lastConnectionDuration), (uint16_t)(30 + hour));
+			sysStatus.setValue<time_t>(offsetof(SysData, lastConnection), now + 30 + hour);
+			sysStatus.flush(true);
+
+			sysStatus.setValue<time_t>(offsetof(SysData, lastHookResponse), now + 35 + hour);
+			sysStatus.flush(true);
+		}
+
+		printf("%s: %d file opens for writing, %d writes, %d bytes written per day, projected endurance %.0f years\n", 
+			modeNames[mode],
+			CountingFileSystem::writeOpens, CountingFileSystem::writes, (int)CountingFileSystem::bytesWritten,
+			StorageHelperRK::PersistentDataBase::projectEnduranceYears(CountingFileSystem::writes, CountingFileSystem::bytesWritten));
+	}
+
+	deltaSaveCleanup();
+	journalCleanup();
+	unlink((String(journalDataPathA) + ".log").c_str());
+}
+
+
 class RetainedDataTest : public StorageHelperRK::PersistentDataBase {
 public:
 	class MyData {
@@ -405,5 +1342,15 @@ void customRetainedDataTest() {
 int main(int argc, char *argv[]) {
 	customPersistentDataTest();
 	customRetainedDataTest();
+	deferredHashTest();
+	atomicSaveTest();
+	journalTest();
+	deltaSaveTest();
+	writeMetricsTest();
+	fieldTest();
+	setterBenchmark();
+	getterBenchmark();
+	journalBenchmark();
+	deltaSaveBenchmark();
 	return 0;
 }
@@ -116,6 +116,9 @@ public:
     }
     
     void vprintf(LogLevel level, const char *fmt, va_list ap) const {
+        if (level < minLevel()) {
+            return;
+        }
         char buf[512];
         vsnprintf(buf, sizeof(buf), fmt, ap);
         const char *levelStr;
@@ -182,6 +185,16 @@ public:
         }   
     }
 
+    /**
+     * @brief Messages below this level are not printed (default: print everything)
+     *
+     * Not part of Device OS. Used to keep trace output from drowning out test results.
+     */
+    static LogLevel &minLevel() {
+        static LogLevel level = LOG_LEVEL_ALL;
+        return level;
+    }
+
     String name;
 };
 // spark_wiring_logging.h
@@ -1,5 +1,8 @@
 #include "StorageHelperRK.h"
 
+#include <algorithm>
+#include <cmath>
+
 
 
 //
@@ -23,6 +26,10 @@ bool StorageHelperRK::PersistentDataBase::load() {
 
 
 void StorageHelperRK::PersistentDataBase::flush(bool force) {
+    if (journal) {
+        journal->flush(force);
+        return;
+    }
     if (lastUpdate) {
         if (force || (millis() - lastUpdate >= saveDelayMs)) {
             save();
@@ -33,7 +40,14 @@ void StorageHelperRK::PersistentDataBase::flush(bool force) {
 
 void StorageHelperRK::PersistentDataBase::saveOrDefer() {
     if (saveDelayMs) {
+        if (lastUpdate) {
+            writeMetrics.savesSuppressed++;
+        }
+        lastUpdate = millis();
+    }
+    else if (journal) {
         lastUpdate = millis();
+        journal->flush(true);
     }
     else {
         save();
@@ -92,6 +106,7 @@ uint32_t StorageHelperRK::PersistentDataBase::getHash() const {
 #endif 
         hash = StorageHelperRK::murmur3_32((const uint8_t *)savedDataHeader, savedDataHeader->size, HASH_SEED);
         savedDataHeader->hash = savedHash;
+        writeMetrics.hashCount++;
     }
 
     // Log.trace("hash=%08lx", hash);
@@ -100,13 +115,26 @@ uint32_t StorageHelperRK::PersistentDataBase::getHash() const {
 }
 
 void StorageHelperRK::PersistentDataBase::updateHash() {
-    savedDataHeader->hash = getHash();
+    // With deferred hashing, the hash is calculated once in save() instead of on every change
+    hashDirty = true;
+    if (!deferHash) {
+        updateHashIfDirty();
+    }
+    saveOrDefer();
+}
+
+void StorageHelperRK::PersistentDataBase::updateHashIfDirty() {
+    WITH_LOCK(*this) {
+        if (hashDirty) {
+            savedDataHeader->hash = getHash();
+            hashDirty = false;
 #ifdef LOG_HASH
-        Log.trace("updateHash size=%u hash=%08lx", (int)savedDataHeader->size, savedDataHeader->hash);
-        Log.dump((const uint8_t *)savedDataHeader, savedDataHeader->size);
-        Log.print("\n");
+            Log.trace("updateHash size=%u hash=%08lx", (int)savedDataHeader->size, savedDataHeader->hash);
+            Log.dump((const uint8_t *)savedDataHeader, savedDataHeader->size);
+            Log.print("\n");
 #endif
-    saveOrDefer();
+        }
+    }
 }
 
 bool StorageHelperRK::PersistentDataBase::validate(size_t dataSize) {
@@ -136,7 +164,13 @@ bool StorageHelperRK::PersistentDataBase::validate(size_t dataSize) {
             }
             savedDataHeader->size = (uint16_t) savedDataSize;
             savedDataHeader->hash = getHash();
+            hashDirty = false;
             isValid = true;
+
+            if (writeMetricsOffset && (size_t)dataSize >= writeMetricsOffset + sizeof(WriteMetrics)) {
+                // Continue counting from the saved counters
+                memcpy(&writeMetrics, (const uint8_t *)savedDataHeader + writeMetricsOffset, sizeof(WriteMetrics));
+            }
         }
     }   
     if (!isValid && dataSize != 0 && savedDataHeader->magic != 0) {
@@ -154,10 +188,83 @@ void StorageHelperRK::PersistentDataBase::initialize() {
     savedDataHeader->version = savedDataVersion;
     savedDataHeader->size = (uint16_t) savedDataSize;
     savedDataHeader->hash = getHash();
+    hashDirty = false;
+}
+
+StorageHelperRK::PersistentDataBase &StorageHelperRK::PersistentDataBase::withWriteMetrics(size_t offset) {
+    if (offset >= sizeof(SavedDataHeader) && offset + sizeof(WriteMetrics) <= savedDataSize) {
+        writeMetricsOffset = offset;
+    }
+    else {
+        Log.error("invalid write metrics offset %d", (int)offset);
+    }
+    return *this;
+}
+
+StorageHelperRK::PersistentDataBase::WriteMetrics StorageHelperRK::PersistentDataBase::getWriteMetrics() const {
+    WriteMetrics result;
+
+    WITH_LOCK(*this) {
+        result = writeMetrics;
+    }
+    return result;
+}
+
+void StorageHelperRK::PersistentDataBase::resetWriteMetrics() {
+    WITH_LOCK(*this) {
+        memset(&writeMetrics, 0, sizeof(WriteMetrics));
+    }
+}
+
+double StorageHelperRK::PersistentDataBase::getProjectedEnduranceYears() const {
+    WriteMetrics metrics = getWriteMetrics();
+
+    if (!Time.isValid() || metrics.startTime == 0 || (uint32_t)Time.now() < metrics.startTime + 3600) {
+        return 0;
+    }
+    double days = (double)((uint32_t)Time.now() - metrics.startTime) / 86400.0;
+
+    return projectEnduranceYears((double)metrics.saves / days, (double)metrics.bytesWritten / days);
+}
+
+// [static]
+double StorageHelperRK::PersistentDataBase::projectEnduranceYears(double savesPerDay, double bytesPerDay, size_t flashSize, uint32_t eraseCycles, size_t saveOverhead, size_t blockSize) {
+    if (savesPerDay <= 0 || blockSize == 0) {
+        return 0;
+    }
+    // The file system is copy-on-write, so each save writes its data to new blocks, and a block must be
+    // erased before it can be written again, no matter how few bytes were written to it. The metadata
+    // commit for each save is appended to a metadata block, which is erased when it fills up.
+    double blocksPerSave = ceil(bytesPerDay / savesPerDay / (double)blockSize) + (double)saveOverhead / (double)blockSize;
+    double erasesPerDay = savesPerDay * blocksPerSave;
+
+    // With wear leveling, the erases are spread across all of the blocks
+    double totalErases = (double)(flashSize / blockSize) * (double)eraseCycles;
+
+    return totalErases / erasesPerDay / 365.0;
+}
+
+void StorageHelperRK::PersistentDataBase::countWrite(size_t bytes) {
+    WITH_LOCK(*this) {
+        writeMetrics.saves++;
+        writeMetrics.bytesWritten += (uint32_t) bytes;
+        if (writeMetrics.startTime == 0 && Time.isValid()) {
+            writeMetrics.startTime = (uint32_t) Time.now();
+        }
+    }
+}
+
+void StorageHelperRK::PersistentDataBase::updateWriteMetrics() {
+    WITH_LOCK(*this) {
+        if (writeMetricsOffset) {
+            memcpy((uint8_t *)savedDataHeader + writeMetricsOffset, &writeMetrics, sizeof(WriteMetrics));
+            hashDirty = true;
+        }
+    }
 }
 
 void StorageHelperRK::PersistentDataBase::save() {
-    savedDataHeader->hash = getHash();
+    updateHashIfDirty();
     if (logData) {
         Log.info("saving data size=%d", (int)savedDataHeader->size);
         Log.dump((const uint8_t *)savedDataHeader, savedDataHeader->size);
@@ -199,6 +306,8 @@ bool StorageHelperRK::PersistentDataEEPROM::load() {
 
 void StorageHelperRK::PersistentDataEEPROM::save() {
     WITH_LOCK(*this) {
+        updateWriteMetrics();
+        updateHashIfDirty();
 #ifdef USE_HAL_EEPROM
         HAL_EEPROM_Put(eepromOffset, savedDataHeader, savedDataSize);        
 #else
@@ -220,6 +329,7 @@ void StorageHelperRK::PersistentDataEEPROM::save() {
         Log.dump(test, sizeof(test));
         Log.print("\n");
 #endif        
+        countWrite(savedDataSize);
     }
     PersistentDataBase::save();
 }
@@ -227,47 +337,564 @@ void StorageHelperRK::PersistentDataEEPROM::save() {
 
 bool StorageHelperRK::PersistentDataFileSystem::load() {
     WITH_LOCK(*this) {
-        bool loaded = false;
+        currentSlot = 0;
+        bool loaded = loadFile(getSlotFilename(0));
+
+        // The second file is only written by withAtomicSave(). Without it, the second file is only 
+        // read if the first one is not valid. With it, use the valid file with the newest sequence number.
+        if (atomicSave || !loaded) {
+            // Keep the data and write counters from the first file in case the second one is older or not valid
+            std::vector<uint8_t> data0;
+            WriteMetrics metrics0 = writeMetrics;
+            if (loaded) {
+                const uint8_t *p = (const uint8_t *)savedDataHeader;
+                data0.assign(p, p + savedDataSize);
+            }
+            uint32_t seq0 = savedDataHeader->reserved1;
+
+            if (loadFile(getSlotFilename(1)) && (!loaded || (int32_t)(savedDataHeader->reserved1 - seq0) > 0)) {
+                currentSlot = 1;
+                loaded = true;
+            }
+            else if (loaded) {
+                memcpy(savedDataHeader, data0.data(), savedDataSize);
+                writeMetrics = metrics0;
+            }
+        }
+        
+        if (loaded) {
+            // The log file only exists if withDeltaSave() has been used
+            loaded = loadDelta();
+        }
+        else {
+            currentSlot = 0;
+            initialize();
+        }
+
+        if (loaded && deltaLogMaxSize) {
+            const uint8_t *p = (const uint8_t *)savedDataHeader;
+            savedImage.assign(p, p + savedDataSize);
+        }
+        else {
+            // The data has not been saved, so the first save saves the whole structure
+            savedImage.clear();
+        }
+    }
+
+    return true;
+}
+
+void StorageHelperRK::PersistentDataFileSystem::save() {
+    WITH_LOCK(*this) {
+        updateWriteMetrics();
+        if (!deltaLogMaxSize || !saveDelta()) {
+            saveSnapshot();
+        }
+    }
+    PersistentDataBase::save();
+}
+
+void StorageHelperRK::PersistentDataFileSystem::saveSnapshot() {
+    bool saved;
+
+    // The sequence number is saved in every mode so load() can tell which file is newer if 
+    // withAtomicSave() is turned on or off, and which file the records in the log file apply to
+    savedDataHeader->reserved1++;
+    hashDirty = true;
+    updateHashIfDirty();
+
+    if (atomicSave) {
+        // Never write the file that has the current data
+        int slot = 1 - currentSlot;
+        saved = saveFile(getSlotFilename(slot), O_RDWR | O_CREAT);
+        if (saved) {
+            currentSlot = slot;
+        }
+    }
+    else {
+        saved = saveFile(getSlotFilename(0), O_RDWR | O_CREAT | O_TRUNC);
+        currentSlot = 0;
+    }
+
+    if (saved && deltaLogMaxSize) {
+        const uint8_t *p = (const uint8_t *)savedDataHeader;
+        savedImage.assign(p, p + savedDataSize);
+    }
+    else {
+        // Records in the log must be for a saved sequence number, so save the whole structure next time
+        savedImage.clear();
+    }
 
-        int dataSize = 0;
+    if (saved && deltaLogSize) {
+        // The changes in the log are in the file now
+        if (fs->open(getLogFilename(), O_RDWR | O_TRUNC)) {
+            fs->close();
+        }
+        deltaLogSize = 0;
+    }
+}
 
-        int fd = fs->open(filename, O_RDONLY);
-        if (fd != -1) {
-            dataSize = fs->read((uint8_t *)savedDataHeader, savedDataSize);
+bool StorageHelperRK::PersistentDataFileSystem::saveDelta() {
+    if (savedImage.size() != savedDataSize || deltaLogSize >= deltaLogMaxSize) {
+        return false;
+    }
 
-            // Log.info("request to read %d, got %d bytes", (int)savedDataSize, (int) dataSize);
-            // Log.dump((const uint8_t *)savedDataHeader, dataSize);
+    const uint8_t *cur = (const uint8_t *)savedDataHeader;
+    const uint8_t *prev = savedImage.data();
 
-            if (validate(dataSize)) {
-                loaded = true;
+    recordBuf.resize(sizeof(DeltaRecordHeader));
+    uint16_t count = 0;
+
+    // The header is not compared because the hash is updated on every change
+    size_t ii = sizeof(SavedDataHeader);
+    while(ii < savedDataSize) {
+        if (cur[ii] == prev[ii]) {
+            ii++;
+            continue;
+        }
+
+        // Unchanged bytes shorter than a DeltaRange are included in the range
+        size_t end = ii + 1;
+        for(size_t jj = end; jj < savedDataSize && jj - end < sizeof(DeltaRange); jj++) {
+            if (cur[jj] != prev[jj]) {
+                end = jj + 1;
             }
-            fs->close();
         }
-        else {
-            Log.trace("did not open file %s", filename.c_str());
+
+        DeltaRange range;
+        range.offset = (uint16_t) ii;
+        range.length = (uint16_t) (end - ii);
+        recordBuf.insert(recordBuf.end(), (const uint8_t *)&range, (const uint8_t *)&range + sizeof(DeltaRange));
+        recordBuf.insert(recordBuf.end(), &cur[ii], &cur[end]);
+        count++;
+
+        ii = end;
+    }
+    if (count == 0) {
+        return true;
+    }
+    if (recordBuf.size() >= savedDataSize) {
+        // Smaller to save the whole structure
+        return false;
+    }
+
+    DeltaRecordHeader recordHeader;
+    recordHeader.seq = savedDataHeader->reserved1;
+    recordHeader.count = count;
+    recordHeader.length = (uint16_t) (recordBuf.size() - sizeof(DeltaRecordHeader));
+    recordHeader.hash = 0;
+    memcpy(recordBuf.data(), &recordHeader, sizeof(DeltaRecordHeader));
+    recordHeader.hash = murmur3_32(recordBuf.data(), recordBuf.size(), HASH_SEED);
+    memcpy(recordBuf.data(), &recordHeader, sizeof(DeltaRecordHeader));
+
+    bool saved = false;
+    if (fs->open(getLogFilename(), O_RDWR | O_CREAT)) {
+        fs->seek(-1);
+        saved = (fs->write(recordBuf.data(), recordBuf.size()) == recordBuf.size());
+        deltaLogSize = fs->getLength();
+        fs->close();
+    }
+    if (!saved) {
+        Log.error("failed to save %s", getLogFilename().c_str());
+        return false;
+    }
+    countWrite(recordBuf.size());
+
+    memcpy(savedImage.data(), cur, savedDataSize);
+    return true;
+}
+
+bool StorageHelperRK::PersistentDataFileSystem::loadDelta() {
+    deltaLogSize = 0;
+
+    if (!fs->open(getLogFilename(), O_RDWR)) {
+        return true;
+    }
+
+    int fileLength = fs->getLength();
+    size_t validLength = 0;
+    int numApplied = 0;
+    
+    while(true) {
+        DeltaRecordHeader recordHeader;
+        if (fs->read((uint8_t *)&recordHeader, sizeof(DeltaRecordHeader)) != sizeof(DeltaRecordHeader) ||
+            recordHeader.length >= savedDataSize) {
+            break;
         }
-        
-        if (!loaded) {
+        recordBuf.resize(sizeof(DeltaRecordHeader) + recordHeader.length);
+        if (fs->read(&recordBuf[sizeof(DeltaRecordHeader)], recordHeader.length) != recordHeader.length) {
+            break;
+        }
+        uint32_t hash = recordHeader.hash;
+        recordHeader.hash = 0;
+        memcpy(recordBuf.data(), &recordHeader, sizeof(DeltaRecordHeader));
+        if (murmur3_32(recordBuf.data(), recordBuf.size(), HASH_SEED) != hash) {
+            break;
+        }
+        validLength += recordBuf.size();
+
+        if (recordHeader.seq != savedDataHeader->reserved1) {
+            // Record for an older file
+            continue;
+        }
+
+        // Check all of the ranges before changing anything
+        bool valid = true;
+        size_t offset = sizeof(DeltaRecordHeader);
+        for(uint16_t jj = 0; jj < recordHeader.count && valid; jj++) {
+            DeltaRange range;
+            if (offset + sizeof(DeltaRange) > recordBuf.size()) {
+                valid = false;
+                break;
+            }
+            memcpy(&range, &recordBuf[offset], sizeof(DeltaRange));
+            offset += sizeof(DeltaRange);
+            if (range.offset < sizeof(SavedDataHeader) || (size_t)range.offset + range.length > savedDataSize || offset + range.length > recordBuf.size()) {
+                valid = false;
+            }
+            offset += range.length;
+        }
+        if (!valid) {
+            break;
+        }
+
+        offset = sizeof(DeltaRecordHeader);
+        for(uint16_t jj = 0; jj < recordHeader.count; jj++) {
+            DeltaRange range;
+            memcpy(&range, &recordBuf[offset], sizeof(DeltaRange));
+            offset += sizeof(DeltaRange);
+            memcpy((uint8_t *)savedDataHeader + range.offset, &recordBuf[offset], range.length);
+            offset += range.length;
+        }
+        numApplied++;
+    }
+
+    if (numApplied == 0) {
+        // All of the records are for older files
+        validLength = 0;
+    }
+    if ((int)validLength < fileLength) {
+        fs->truncate(validLength);
+    }
+    deltaLogSize = validLength;
+    fs->close();
+
+    if (numApplied) {
+        Log.trace("applied %d records from %s", numApplied, getLogFilename().c_str());
+        hashDirty = true;
+        updateHashIfDirty();
+        if (!validate(savedDataSize)) {
             initialize();
+            return false;
+        }
+    }
+    return true;
+}
+
+String StorageHelperRK::PersistentDataFileSystem::getSlotFilename(int slot) const {
+    if (slot == 0) {
+        return filename;
+    }
+    else {
+        return filename + ".b";
+    }
+}
+
+String StorageHelperRK::PersistentDataFileSystem::getLogFilename() const {
+    return filename + ".log";
+}
+
+bool StorageHelperRK::PersistentDataFileSystem::loadFile(const char *path) {
+    bool loaded = false;
+
+    if (fs->open(path, O_RDONLY)) {
+        int dataSize = fs->read((uint8_t *)savedDataHeader, savedDataSize);
+
+        // Log.info("request to read %d, got %d bytes", (int)savedDataSize, (int) dataSize);
+        // Log.dump((const uint8_t *)savedDataHeader, dataSize);
+
+        loaded = validate(dataSize);
+        fs->close();
+    }
+    else {
+        Log.trace("did not open file %s", path);
+    }
+    return loaded;
+}
+
+bool StorageHelperRK::PersistentDataFileSystem::saveFile(const char *path, int mode) {
+    bool saved = false;
+
+    if (fs->open(path, mode)) {
+        size_t count = fs->write((const uint8_t *)savedDataHeader, savedDataSize);
+
+        // Log.info("request to write %d, wrote %d bytes", (int)savedDataSize, (int) count);
+        // Log.dump((const uint8_t *)savedDataHeader, savedDataSize);
+
+        saved = (count == savedDataSize);
+        fs->close();
+    }
+    if (saved) {
+        countWrite(savedDataSize);
+    }
+    else {
+        Log.error("failed to save %s", path);
+    }
+    return saved;
+}
+
+
+//
+// PersistentDataJournal
+//
+
+// Checks the hash of saved data in a buffer, the same way as PersistentDataBase::getHash()
+static bool isSavedDataValid(uint8_t *buf) {
+    StorageHelperRK::PersistentDataBase::SavedDataHeader *hdr = (StorageHelperRK::PersistentDataBase::SavedDataHeader *)buf;
+
+    uint32_t savedHash = hdr->hash;
+    hdr->hash = 0;
+    uint32_t hash = StorageHelperRK::murmur3_32(buf, hdr->size, StorageHelperRK::PersistentDataBase::HASH_SEED);
+    hdr->hash = savedHash;
+
+    return hash == savedHash;
+}
+
+StorageHelperRK::PersistentDataJournal &StorageHelperRK::PersistentDataJournal::withData(PersistentDataBase *data) {
+    WITH_LOCK(*this) {
+        if (findData(data->savedDataMagic)) {
+            Log.error("journal already has data with magic %08lx", (unsigned long)data->savedDataMagic);
+        }
+        else {
+            dataList.push_back(data);
+            data->journal = this;
         }
     }
+    return *this;
+}
+
+bool StorageHelperRK::PersistentDataJournal::load() {
+    WITH_LOCK(*this) {
+        if (!fs->open(filename, O_RDWR | O_CREAT)) {
+            Log.error("failed to open journal %s", filename.c_str());
+            return false;
+        }
+
+        // Each object is in a record at most once, so this holds all of the data in a record
+        size_t bufSize = 0;
+        for(auto it = dataList.begin(); it != dataList.end(); it++) {
+            bufSize += (*it)->savedDataSize;
+        }
+        uint8_t *buf = new uint8_t[bufSize];
+
+        struct Entry {
+            PersistentDataBase *data;
+            size_t bufOffset;
+            size_t size;
+        };
+        std::vector<Entry> entries;
+
+        int fileLength = fs->getLength();
+        size_t validLength = 0;
+        int numRecords = 0;
+
+        while(true) {
+            RecordHeader recordHeader;
+            if (fs->read((uint8_t *)&recordHeader, sizeof(RecordHeader)) != sizeof(RecordHeader) ||
+                recordHeader.magic != RECORD_MAGIC ||
+                recordHeader.hash != murmur3_32((const uint8_t *)&recordHeader, offsetof(RecordHeader, hash), PersistentDataBase::HASH_SEED)) {
+                break;
+            }
+
+            size_t fileOffset = validLength + sizeof(RecordHeader);
+            size_t bufOffset = 0;
+            bool valid = true;
+            entries.clear();
+
+            for(uint16_t ii = 0; ii < recordHeader.count && valid; ii++) {
+                PersistentDataBase::SavedDataHeader savedDataHeader;
+                if (fs->read((uint8_t *)&savedDataHeader, sizeof(savedDataHeader)) != sizeof(savedDataHeader) || 
+                    savedDataHeader.size < sizeof(savedDataHeader)) {
+                    valid = false;
+                    break;
+                }
+                size_t size = savedDataHeader.size;
+
+                PersistentDataBase *data = findData(savedDataHeader.magic);
+                if (!data || size > data->savedDataSize || bufOffset + size > bufSize) {
+                    // Object that is no longer in the journal, skip it
+                    fileOffset += size;
+                    fs->seek(fileOffset);
+                    continue;
+                }
+
+                uint8_t *p = &buf[bufOffset];
+                memcpy(p, &savedDataHeader, sizeof(savedDataHeader));
+                size_t dataSize = size - sizeof(savedDataHeader);
+                if (fs->read(p + sizeof(savedDataHeader), dataSize) != dataSize || !isSavedDataValid(p)) {
+                    valid = false;
+                    break;
+                }
+                entries.push_back(Entry({data, bufOffset, size}));
+
+                fileOffset += size;
+                bufOffset += size;
+            }
+            if (!valid || (int)fileOffset > fileLength) {
+                break;
+            }
+
+            // The whole record is valid, so apply the changes to all of the objects in it
+            for(auto it = entries.begin(); it != entries.end(); it++) {
+                PersistentDataBase *data = it->data;
+                WITH_LOCK(*data) {
+                    // reserved1 is the sequence number of the file the object was loaded from, which 
+                    // withAtomicSave() uses to tell its two files apart. The record has the value from
+                    // when it was written, which may be older.
+                    uint32_t fileSeq = data->savedDataHeader->reserved1;
+                    memcpy(data->savedDataHeader, &buf[it->bufOffset], it->size);
+                    if (!data->validate(it->size)) {
+                        data->initialize();
+                    }
+                    data->savedDataHeader->reserved1 = fileSeq;
+                    data->hashDirty = true;
+                    data->updateHashIfDirty();
+                    data->lastUpdate = 0;
+                }
+                addUnsaved(data);
+            }
+            validLength = fileOffset;
+            seq = recordHeader.seq;
+            numRecords++;
+        }
+
+        if ((int)validLength < fileLength) {
+            // Remove an incomplete record so records can be added after the last valid one
+            Log.info("journal %s removing %d bytes after record %d", filename.c_str(), fileLength - (int)validLength, numRecords);
+            fs->truncate(validLength);
+        }
+        journalSize = validLength;
+        fs->close();
+
+        delete[] buf;
+
+        Log.trace("journal %s loaded %d records", filename.c_str(), numRecords);
+    }
 
     return true;
 }
 
-void StorageHelperRK::PersistentDataFileSystem::save() {
+void StorageHelperRK::PersistentDataJournal::save() {
     WITH_LOCK(*this) {
-        int fd = fs->open(filename, O_RDWR | O_CREAT | O_TRUNC);
-        if (fd != -1) {            
-            /* size_t count = */fs->write((const uint8_t *)savedDataHeader, savedDataSize);
+        if (writeRecord(false) && journalSize >= compactSize) {
+            compact();
+        }
+    }
+}
 
-            // Log.info("request to write %d, wrote %d bytes", (int)savedDataSize, (int) count);
-            // Log.dump((const uint8_t *)savedDataHeader, savedDataSize);
+void StorageHelperRK::PersistentDataJournal::flush(bool force) {
+    WITH_LOCK(*this) {
+        for(auto it = dataList.begin(); it != dataList.end(); it++) {
+            PersistentDataBase *data = *it;
+            if (data->lastUpdate && (force || (millis() - data->lastUpdate >= data->saveDelayMs))) {
+                save();
+                break;
+            }
+        }
+    }
+}
 
+void StorageHelperRK::PersistentDataJournal::compact() {
+    WITH_LOCK(*this) {
+        // Only objects with records in the journal need to be saved. Their records are not removed until
+        // all of them are saved, so if a save fails partway through, load() restores the data from the journal.
+        for(auto it = unsavedList.begin(); it != unsavedList.end(); it++) {
+            (*it)->save();
+        }
+        unsavedList.clear();
+
+        if (fs->open(filename, O_RDWR | O_CREAT | O_TRUNC)) {
             fs->close();
         }
+        journalSize = 0;
     }
-    PersistentDataBase::save();
+}
+
+bool StorageHelperRK::PersistentDataJournal::writeRecord(bool all) {
+    bool result = false;
+
+    WITH_LOCK(*this) {
+        std::vector<PersistentDataBase *> saveList;
+        for(auto it = dataList.begin(); it != dataList.end(); it++) {
+            if (all || (*it)->lastUpdate) {
+                saveList.push_back(*it);
+            }
+        }
+        if (saveList.empty()) {
+            return false;
+        }
+
+        RecordHeader recordHeader;
+        recordHeader.magic = RECORD_MAGIC;
+        recordHeader.seq = ++seq;
+        recordHeader.count = (uint16_t) saveList.size();
+        recordHeader.reserved = 0;
+        recordHeader.hash = murmur3_32((const uint8_t *)&recordHeader, offsetof(RecordHeader, hash), PersistentDataBase::HASH_SEED);
+
+        // The record is written with a single write
+        recordBuf.resize(sizeof(RecordHeader));
+        memcpy(recordBuf.data(), &recordHeader, sizeof(RecordHeader));
+
+        for(auto it = saveList.begin(); it != saveList.end(); it++) {
+            PersistentDataBase *data = *it;
+            WITH_LOCK(*data) {
+                data->updateWriteMetrics();
+                data->updateHashIfDirty();
+                const uint8_t *p = (const uint8_t *)data->savedDataHeader;
+                recordBuf.insert(recordBuf.end(), p, p + data->savedDataSize);
+                data->lastUpdate = 0;
+            }
+        }
+
+        if (!fs->open(filename, O_RDWR | O_CREAT)) {
+            Log.error("failed to open journal %s", filename.c_str());
+            return false;
+        }
+        fs->seek(-1);
+        size_t count = fs->write(recordBuf.data(), recordBuf.size());
+        journalSize = fs->getLength();
+        fs->close();
+
+        result = (count == recordBuf.size());
+        if (!result) {
+            Log.error("failed to save journal %s", filename.c_str());
+        }
+
+        for(auto it = saveList.begin(); it != saveList.end(); it++) {
+            if (result) {
+                (*it)->countWrite((*it)->savedDataSize);
+            }
+            // A partial record is ignored by load(), but saving the object again does no harm
+            addUnsaved(*it);
+        }
+    }
+
+    return result;
+}
+
+void StorageHelperRK::PersistentDataJournal::addUnsaved(PersistentDataBase *data) {
+    if (std::find(unsavedList.begin(), unsavedList.end(), data) == unsavedList.end()) {
+        unsavedList.push_back(data);
+    }
+}
+
+StorageHelperRK::PersistentDataBase *StorageHelperRK::PersistentDataJournal::findData(uint32_t magic) const {
+    for(auto it = dataList.begin(); it != dataList.end(); it++) {
+        if ((*it)->savedDataMagic == magic) {
+            return *it;
+        }
+    }
+    return 0;
 }
 
 
@@ -4,6 +4,108 @@
 #include "Particle.h"
 
 #include <fcntl.h>
+#include <vector>
+
+/**
+ * @brief Declares a field. Used by STORAGEHELPER_STRUCT.
+ */
+#define STORAGEHELPER_FIELD_DECLARE(type, name) type name;
+
+/**
+ * @brief Declares a string field. Used by STORAGEHELPER_STRUCT.
+ */
+#define STORAGEHELPER_STRING_DECLARE(name, size) char name[size];
+
+/**
+ * @brief Declares get_name() and set_name() for a field. Used by STORAGEHELPER_ACCESSORS.
+ */
+#define STORAGEHELPER_FIELD_ACCESSORS(type, name) \
+    type get_##name() const { \
+        return getField<StorageHelperFieldData, type, offsetof(StorageHelperFieldData, name)>(); \
+    } \
+    void set_##name(type value) { \
+        setField<StorageHelperFieldData, type, offsetof(StorageHelperFieldData, name)>(value); \
+    }
+
+/**
+ * @brief Declares get_name() and set_name() for a string field. Used by STORAGEHELPER_ACCESSORS.
+ */
+#define STORAGEHELPER_STRING_ACCESSORS(name, size) \
+    String get_##name() const { \
+        return getFieldString<StorageHelperFieldData, offsetof(StorageHelperFieldData, name), size>(); \
+    } \
+    bool set_##name(const char *str) { \
+        return setFieldString<StorageHelperFieldData, offsetof(StorageHelperFieldData, name), size>(str); \
+    }
+
+/**
+ * @brief Declares a structure for persistent data from a list of fields
+ * 
+ * @param DataType Name of the structure class to declare
+ * @param header Name of the SavedDataHeader field at the beginning of the structure
+ * @param FIELDS Macro that lists the fields. It's passed two macros, FIELD(type, name) and STRING(name, size).
+ * 
+ * For example:
+ * 
+ * ```
+ * #define MY_DATA_FIELDS(FIELD, STRING) \
+ *     FIELD(int, test1) \
+ *     FIELD(bool, test2) \
+ *     STRING(test4, 10)
+ * 
+ * STORAGEHELPER_STRUCT(MyData, header, MY_DATA_FIELDS)
+ * ```
+ */
+#define STORAGEHELPER_STRUCT(DataType, header, FIELDS) \
+    class DataType { \
+    public: \
+        StorageHelperRK::PersistentDataBase::SavedDataHeader header; \
+        FIELDS(STORAGEHELPER_FIELD_DECLARE, STORAGEHELPER_STRING_DECLARE) \
+    };
+
+/**
+ * @brief Declares get_ and set_ methods for each field in a structure declared with STORAGEHELPER_STRUCT
+ * 
+ * @param DataType Name of the structure class
+ * @param FIELDS The same macro that lists the fields that was passed to STORAGEHELPER_STRUCT
+ * 
+ * Use this in the public section of your PersistentDataBase subclass, after the structure. It declares 
+ * `type get_name() const` and `void set_name(type value)` for each field, and `String get_name() const` and 
+ * `bool set_name(const char *str)` for each string. The offsets are checked at compile time.
+ */
+#define STORAGEHELPER_ACCESSORS(DataType, FIELDS) \
+    typedef DataType StorageHelperFieldData; \
+    FIELDS(STORAGEHELPER_FIELD_ACCESSORS, STORAGEHELPER_STRING_ACCESSORS)
+
+#ifndef STORAGEHELPER_FLASH_FS_SIZE
+/**
+ * @brief Size of the flash file system in bytes, used by PersistentDataBase::getProjectedEnduranceYears()
+ * 
+ * The default is the 2 MB file system on Gen 3 devices.
+ */
+#define STORAGEHELPER_FLASH_FS_SIZE (2 * 1024 * 1024)
+#endif
+
+#ifndef STORAGEHELPER_FLASH_BLOCK_SIZE
+/**
+ * @brief Size of a file system block (flash erase unit) in bytes, used by PersistentDataBase::getProjectedEnduranceYears()
+ */
+#define STORAGEHELPER_FLASH_BLOCK_SIZE 4096
+#endif
+
+#ifndef STORAGEHELPER_FLASH_ERASE_CYCLES
+/**
+ * @brief Number of times each flash block can be erased, used by PersistentDataBase::getProjectedEnduranceYears()
+ */
+#define STORAGEHELPER_FLASH_ERASE_CYCLES 100000
+#endif
+
+#ifndef STORAGEHELPER_FLASH_SAVE_OVERHEAD
+/**
+ * @brief Bytes of file system metadata written for each save, used by PersistentDataBase::getProjectedEnduranceYears()
+ */
+#define STORAGEHELPER_FLASH_SAVE_OVERHEAD 64
+#endif
 #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
 #include <sys/stat.h>
 #endif
@@ -549,6 +651,8 @@ public:
 
     #endif /* HAL_PLATFORM_FILESYSTEM || defined(UNITTEST) || defined(DOXYGEN_BUILD) */
 
+    class PersistentDataJournal;
+
     /**
      * @brief Base class for storing persistent binary data to a file or retained memory
      * 
@@ -568,9 +672,24 @@ public:
             uint16_t version;               //!< savedDataVersion, should rarely, if ever, change
             uint16_t size;                  //!< size of the whole structure, including the user data after it
             uint32_t hash;                  //!< hash value for verifying data integrity
-            uint32_t reserved1;             //!< reserved for future use
+            uint32_t reserved1;             //!< save sequence number for PersistentDataFileSystem, otherwise reserved
             // You cannot change the size of this structure without changing the version number!
         };
+
+        /**
+         * @brief Counters for writes to storage. See getWriteMetrics().
+         * 
+         * To keep the counters across resets, add a field of this type to the end of your structure and
+         * call withWriteMetrics().
+         */
+        class WriteMetrics { // 20 bytes
+        public:
+            uint32_t saves;                 //!< Number of times the data was written to storage
+            uint32_t bytesWritten;          //!< Number of bytes written to storage
+            uint32_t savesSuppressed;       //!< Changes that did not cause a save because a save was already waiting (saveDelayMs)
+            uint32_t hashCount;             //!< Number of times the hash was calculated
+            uint32_t startTime;             //!< Time (Time.now()) of the first save that was counted, or 0 if not known
+        };
         
         /**
          * @brief Base class for persistent data saved in file or RAM
@@ -617,6 +736,87 @@ public:
             return *this;
         }
 
+        /**
+         * @brief Keep the write counters in the saved data so they're kept across resets
+         * 
+         * @param offset Offset of a WriteMetrics field in your structure, normally offsetof(MyData, writeMetrics)
+         * @return PersistentDataBase& 
+         * 
+         * Add the field to the end of your structure, like any other new field. The counters are copied into the 
+         * field on each save, and read from it when loading. Call this before load().
+         */
+        PersistentDataBase &withWriteMetrics(size_t offset);
+
+        /**
+         * @brief Gets the counters of writes to storage
+         * 
+         * The counters are since the object was constructed, or since resetWriteMetrics(). With withWriteMetrics()
+         * they are also kept across resets, up to the save before the reset.
+         */
+        WriteMetrics getWriteMetrics() const;
+
+        /**
+         * @brief Reset the counters returned by getWriteMetrics() to 0
+         */
+        void resetWriteMetrics();
+
+        /**
+         * @brief Gets the projected number of years until the flash file system wears out, at the rate of
+         * writes in getWriteMetrics()
+         * 
+         * @return double Years, or 0 if the time is not valid or less than an hour of writes has been counted
+         * 
+         * This counts block erases: LittleFS is copy-on-write, so each save writes the file's data to whole new
+         * blocks and adds a metadata commit that erases a metadata block once it fills up. It assumes that the
+         * file system spreads the erases evenly across the whole flash (wear leveling), and that only this
+         * object is written. It uses STORAGEHELPER_FLASH_FS_SIZE, STORAGEHELPER_FLASH_BLOCK_SIZE,
+         * STORAGEHELPER_FLASH_ERASE_CYCLES, and STORAGEHELPER_FLASH_SAVE_OVERHEAD. It's an estimate to compare
+         * save settings, not a guarantee.
+         */
+        double getProjectedEnduranceYears() const;
+
+        /**
+         * @brief Gets the projected number of years until flash wears out
+         * 
+         * @param savesPerDay Number of saves per day
+         * @param bytesPerDay Number of bytes written per day
+         * @param flashSize Size of the flash that writes are spread over, in bytes
+         * @param eraseCycles Number of times each flash block can be erased
+         * @param saveOverhead Bytes of file system metadata written for each save
+         * @param blockSize Size of a file system block in bytes
+         * @return double Years, or 0 if nothing is written
+         * 
+         * Each save costs the blocks needed to hold the bytes written by that save, rounded up, plus
+         * saveOverhead / blockSize of a metadata block.
+         */
+        static double projectEnduranceYears(double savesPerDay, double bytesPerDay, size_t flashSize = STORAGEHELPER_FLASH_FS_SIZE, 
+            uint32_t eraseCycles = STORAGEHELPER_FLASH_ERASE_CYCLES, size_t saveOverhead = STORAGEHELPER_FLASH_SAVE_OVERHEAD,
+            size_t blockSize = STORAGEHELPER_FLASH_BLOCK_SIZE);
+
+        /**
+         * @brief Wait until the data is saved to calculate the hash. Default is true for data saved to a file,
+         * EEPROM, or FRAM and false for retained memory.
+         * 
+         * @param value true to calculate the hash when saving, false to calculate it on every change
+         * @return PersistentDataBase& 
+         * 
+         * When set, changing a value only copies the value and marks the hash as out of date. The hash is calculated
+         * once by save(), just before the data is written, instead of on every set call. This makes setting several
+         * values in a row much faster.
+         * 
+         * Turn this off if the data in RAM must always have a valid hash, such as retained memory that is used
+         * directly without saving it.
+         */
+        PersistentDataBase &withDeferredHash(bool value = true) {
+            WITH_LOCK(*this) {
+                deferHash = value;
+                if (!deferHash) {
+                    updateHashIfDirty();
+                }
+            }
+            return *this;
+        }
+
 
         
 
@@ -650,6 +850,8 @@ public:
          * is used when you're about to sleep or reset, for example.
          * 
          * This call is fast if a save is not required so you can call it frequently, even every loop.
+         * 
+         * If this object has been added to a PersistentDataJournal, this flushes the journal instead.
          */
         virtual void flush(bool force);
 
@@ -730,6 +932,109 @@ public:
          * The templated setValue method doesn't work with string values, so this version should be used instead.
          */
         bool setValueString(size_t offset, size_t size, const char *value);
+
+        /**
+         * @brief Get the value of a field, with the offset checked at compile time
+         * 
+         * @tparam DataType Your structure, beginning with the SavedDataHeader. Its size must be the savedDataSize.
+         * @tparam T The type of the field
+         * @tparam OFFSET Offset into the structure, normally offsetof(DataType, field)
+         * @return T 
+         * 
+         * This is the same as getValue() without the check of the offset at run time. Fields of 4 bytes or less
+         * that are aligned are read with a single load, so the mutex is not locked. You normally use 
+         * STORAGEHELPER_ACCESSORS instead of calling this directly.
+         */
+        template<class DataType, class T, size_t OFFSET>
+        T getField() const {
+            static_assert(OFFSET >= sizeof(SavedDataHeader), "field is inside the SavedDataHeader");
+            static_assert(OFFSET + sizeof(T) <= sizeof(DataType), "field is past the end of the structure");
+
+            const T *p = (const T *)((const uint8_t *)savedDataHeader + OFFSET);
+            if (sizeof(T) <= sizeof(uint32_t) && (OFFSET % sizeof(T)) == 0) {
+                return *p;
+            }
+
+            T result;
+            WITH_LOCK(*this) {
+                result = *p;
+            }
+            return result;
+        }
+
+        /**
+         * @brief Set the value of a field, with the offset checked at compile time
+         * 
+         * @tparam DataType Your structure, beginning with the SavedDataHeader. Its size must be the savedDataSize.
+         * @tparam T The type of the field
+         * @tparam OFFSET Offset into the structure, normally offsetof(DataType, field)
+         * @param value The value to set
+         * 
+         * This is the same as setValue() without the check of the offset at run time. You normally use 
+         * STORAGEHELPER_ACCESSORS instead of calling this directly.
+         */
+        template<class DataType, class T, size_t OFFSET>
+        void setField(T value) {
+            static_assert(OFFSET >= sizeof(SavedDataHeader), "field is inside the SavedDataHeader");
+            static_assert(OFFSET + sizeof(T) <= sizeof(DataType), "field is past the end of the structure");
+
+            T *p = (T *)((uint8_t *)savedDataHeader + OFFSET);
+            WITH_LOCK(*this) {
+                if (*p != value) {
+                    *p = value;
+                    updateHash();
+                }
+            }
+        }
+
+        /**
+         * @brief Get the value of a string field, with the offset and size checked at compile time
+         * 
+         * @tparam DataType Your structure, beginning with the SavedDataHeader. Its size must be the savedDataSize.
+         * @tparam OFFSET Offset into the structure, normally offsetof(DataType, field)
+         * @tparam SIZE Size of the field in bytes, including the null terminator
+         * @return String 
+         */
+        template<class DataType, size_t OFFSET, size_t SIZE>
+        String getFieldString() const {
+            static_assert(OFFSET >= sizeof(SavedDataHeader), "field is inside the SavedDataHeader");
+            static_assert(OFFSET + SIZE <= sizeof(DataType), "field is past the end of the structure");
+
+            String result;
+            WITH_LOCK(*this) {
+                result = (const char *)savedDataHeader + OFFSET;
+            }
+            return result;
+        }
+
+        /**
+         * @brief Set the value of a string field, with the offset and size checked at compile time
+         * 
+         * @tparam DataType Your structure, beginning with the SavedDataHeader. Its size must be the savedDataSize.
+         * @tparam OFFSET Offset into the structure, normally offsetof(DataType, field)
+         * @tparam SIZE Size of the field in bytes, including the null terminator
+         * @param value The value to set
+         * @return true if set, false if the value is too long for the field
+         */
+        template<class DataType, size_t OFFSET, size_t SIZE>
+        bool setFieldString(const char *value) {
+            static_assert(OFFSET >= sizeof(SavedDataHeader), "field is inside the SavedDataHeader");
+            static_assert(OFFSET + SIZE <= sizeof(DataType), "field is past the end of the structure");
+
+            if (strlen(value) >= SIZE) {
+                return false;
+            }
+
+            char *p = (char *)savedDataHeader + OFFSET;
+            WITH_LOCK(*this) {
+                if (strcmp(value, p) != 0) {
+                    memset(p, 0, SIZE);
+                    strcpy(p, value);
+                    updateHash();
+                }
+            }
+            return true;
+        }
         
         
         /**
@@ -738,8 +1043,10 @@ public:
         uint32_t getHash() const;
 
         /**
-         * @brief Update the hash
+         * @brief Update the hash after changing the data
          * 
+         * If withDeferredHash() is set, this only marks the hash as out of date and it's calculated when the data
+         * is saved. Either way, the data is saved or deferred based on saveDelayMs.
          */
         void updateHash();
 
@@ -779,6 +1086,30 @@ public:
          */
         virtual void initialize();
 
+        /**
+         * @brief Calculates the hash if the data changed since it was last calculated
+         * 
+         * If you subclass this to save to other storage, call this in save() before writing the data.
+         */
+        void updateHashIfDirty();
+
+        /**
+         * @brief Count a write to storage in the write metrics
+         * 
+         * @param bytes Number of bytes written
+         * 
+         * If you subclass this to save to other storage, call this in save() after the data was written 
+         * successfully. Failed writes are not counted.
+         */
+        void countWrite(size_t bytes);
+
+        /**
+         * @brief Copy the write metrics into the saved data, if withWriteMetrics() was used
+         * 
+         * If you subclass this to save to other storage, call this in save() before writing the data.
+         */
+        void updateWriteMetrics();
+
 
         SavedDataHeader *savedDataHeader = 0; //!< Pointer to the saved data header, which is followed by the data
         uint32_t savedDataSize = 0;     //!< Size of the saved data (header + actual data)
@@ -790,6 +1121,13 @@ public:
         uint32_t saveDelayMs = 1000; //!< How long to wait to save before writing file to disk. Set to 0 to write immediately.
 
         bool logData = false; //!< Log data when read and saved
+        bool deferHash = false; //!< Calculate the hash in save() instead of on every change
+        bool hashDirty = false; //!< The data has changed since the hash was calculated
+        PersistentDataJournal *journal = 0; //!< Journal that saves changes, or 0 to save using save()
+        mutable WriteMetrics writeMetrics = {}; //!< Counters returned by getWriteMetrics()
+        size_t writeMetricsOffset = 0; //!< Offset of the WriteMetrics in the saved data (withWriteMetrics()), or 0 if not saved
+
+        friend class PersistentDataJournal;
     };
 
     /**
@@ -837,6 +1175,7 @@ public:
          */
         PersistentDataEEPROM(int eepromOffset, SavedDataHeader *savedDataHeader, size_t savedDataSize, uint32_t savedDataMagic, uint16_t savedDataVersion) : 
             PersistentDataBase(savedDataHeader, savedDataSize, savedDataMagic, savedDataVersion), eepromOffset(eepromOffset) {
+            deferHash = true;
         };
         
 
@@ -876,6 +1215,7 @@ public:
          */
         PersistentDataFRAM(MB85RC &fram, int framOffset, SavedDataHeader *savedDataHeader, size_t savedDataSize, uint32_t savedDataMagic, uint16_t savedDataVersion) : 
             PersistentDataBase(savedDataHeader, savedDataSize, savedDataMagic, savedDataVersion), fram(fram), framOffset(framOffset) {
+            deferHash = true;
         };
         
         /**
@@ -900,7 +1240,11 @@ public:
          */
         virtual void save() {
             WITH_LOCK(*this) {
-                fram.writeData(framOffset, (const uint8_t*)savedDataHeader, savedDataSize);
+                updateWriteMetrics();
+                updateHashIfDirty();
+                if (fram.writeData(framOffset, (const uint8_t*)savedDataHeader, savedDataSize)) {
+                    countWrite(savedDataSize);
+                }
             }
             PersistentDataBase::save();
         } 
@@ -919,6 +1263,28 @@ public:
      */
     class PersistentDataFileSystem : public PersistentDataBase {
     public:
+        /**
+         * @brief Header at the beginning of each record in the log file used by withDeltaSave()
+         * 
+         * It's followed by count ranges, each a DeltaRange followed by the data bytes.
+         */
+        class DeltaRecordHeader { // 12 bytes
+        public:
+            uint32_t seq;                   //!< Sequence number (SavedDataHeader reserved1) of the file this applies to
+            uint16_t count;                 //!< Number of ranges
+            uint16_t length;                //!< Number of bytes after this header
+            uint32_t hash;                  //!< hash of the whole record, with this field set to 0
+        };
+
+        /**
+         * @brief Range of bytes in a log file record
+         */
+        class DeltaRange { // 4 bytes
+        public:
+            uint16_t offset;                //!< Offset from the beginning of the saved data header
+            uint16_t length;                //!< Number of bytes
+        };
+
         /**
          * @brief Class for persistent data saved to a file system
          * 
@@ -935,6 +1301,7 @@ public:
          */
         PersistentDataFileSystem(FileSystemBase *fs, const char *filename, SavedDataHeader *savedDataHeader, size_t savedDataSize, uint32_t savedDataMagic, uint16_t savedDataVersion) : 
             PersistentDataBase(savedDataHeader, savedDataSize, savedDataMagic, savedDataVersion), fs(fs), filename(filename) {
+            deferHash = true;
         };
 
         virtual ~PersistentDataFileSystem() {
@@ -952,6 +1319,48 @@ public:
             return *this;
         }
 
+        /**
+         * @brief Save to two files, alternating between them, so a failed save does not lose the data
+         * 
+         * @param value true to alternate between two files, false to rewrite one file
+         * @return PersistentDataFileSystem& 
+         * 
+         * Normally the file is truncated and rewritten on each save. If the device loses power or resets
+         * during the save, the file is not valid and the data is reinitialized on the next load.
+         * 
+         * In this mode, saves alternate between the file and a second file with ".b" added to the filename,
+         * and the file with the current data is never written. Each save increments a sequence number in
+         * the header and load() uses the valid file with the newest sequence number, so a failed save only 
+         * loses the changes it was saving.
+         * 
+         * When this is off, load() only reads the second file if the first one is not valid, so no extra 
+         * file is opened. You can turn this on without losing data, but after turning it off, the first
+         * file may be one save older than the second one.
+         */
+        PersistentDataFileSystem &withAtomicSave(bool value = true) {
+            atomicSave = value;
+            return *this;
+        }
+
+        /**
+         * @brief Save only the bytes that changed to a log file, instead of rewriting the whole file
+         * 
+         * @param maxLogSize When the log file reaches this size in bytes, the whole file is saved and the log is
+         * emptied. Default is 1024. Pass 0 to turn off delta save.
+         * @return PersistentDataFileSystem& 
+         * 
+         * Each save compares the data to a copy of what was last saved, and appends the changed ranges of bytes to a 
+         * file with ".log" added to the filename. load() reads the file, then applies the changes in the log.
+         * Saving the whole file increments the sequence number in the header, and changes in the log are only 
+         * applied to the file with the same sequence number.
+         * 
+         * This uses an additional savedDataSize bytes of RAM for the copy. Call this before load().
+         */
+        PersistentDataFileSystem &withDeltaSave(size_t maxLogSize = 1024) {
+            deltaLogMaxSize = maxLogSize;
+            return *this;
+        }
+
         /**
          * @brief Load the persistent data file. You normally do not need to call this; it will be loaded automatically.
          * 
@@ -965,11 +1374,67 @@ public:
          */
         virtual void save();
 
- 
+        /**
+         * @brief Gets the filename for one of the files used by withAtomicSave()
+         * 
+         * @param slot 0 for the file set by the constructor or withFilename() or 1 for the second file
+         * @return String 
+         */
+        String getSlotFilename(int slot) const;
+
+        /**
+         * @brief Gets the filename of the log file used by withDeltaSave()
+         * 
+         * @return String 
+         */
+        String getLogFilename() const;
 
     protected:
+        /**
+         * @brief Read and validate one file. Used internally by load().
+         * 
+         * @param path Filename to read
+         * @return true if the file was read and is valid
+         */
+        bool loadFile(const char *path);
+
+        /**
+         * @brief Write the data to one file. Used internally by save().
+         * 
+         * @param path Filename to write
+         * @param mode Open mode flags 
+         * @return true if all of the data was written
+         */
+        bool saveFile(const char *path, int mode);
+
+        /**
+         * @brief Save the whole structure. Used internally by save().
+         */
+        void saveSnapshot();
+
+        /**
+         * @brief Append the changed bytes to the log file. Used internally by save().
+         * 
+         * @return true if the changes were saved (or there were no changes), false if the whole structure 
+         * must be saved instead
+         */
+        bool saveDelta();
+
+        /**
+         * @brief Apply the changes in the log file after loading. Used internally by load().
+         * 
+         * @return false if the data is not valid after applying the changes and was initialized
+         */
+        bool loadDelta();
+
         FileSystemBase *fs; //!< The file system object the persistent data will be stored on
         String filename; //!<  The filename on the file system
+        bool atomicSave = false; //!< Alternate between two files when saving (withAtomicSave())
+        int currentSlot = 0; //!< The file the current data was loaded from or last saved to, 0 or 1
+        size_t deltaLogMaxSize = 0; //!< Maximum size of the log file (withDeltaSave()), or 0 to not use a log
+        size_t deltaLogSize = 0; //!< Size of the log file in bytes
+        std::vector<uint8_t> savedImage; //!< Copy of the data as last saved, used by withDeltaSave()
+        std::vector<uint8_t> recordBuf; //!< Buffer for log file records
     };
 
     #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST) || defined(DOXYGEN_BUILD)
@@ -996,6 +1461,181 @@ public:
     };
     #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST) || defined(DOXYGEN_BUILD)
 
+    /**
+     * @brief Journal that saves changes to several persistent data objects together
+     * 
+     * Normally each persistent data object rewrites its own file when it's saved. When objects are added to
+     * a journal using withData(), their changes are appended to the journal file instead. Changes to all of
+     * the objects that are waiting to be saved are written together as one record, so data that is changed
+     * together is also saved together, and there's one write instead of one per object.
+     * 
+     * When the journal file reaches the compact size, the objects that have records in the journal are
+     * saved to their own files using save() and the journal is emptied.
+     */
+    class PersistentDataJournal : public CustomRecursiveMutex {
+    public:
+        /**
+         * @brief Header at the beginning of each record in the journal file. 
+         * 
+         * It's followed by the data for count objects, each beginning with its SavedDataHeader.
+         */
+        class RecordHeader { // 16 bytes
+        public:
+            uint32_t magic;                 //!< RECORD_MAGIC
+            uint32_t seq;                   //!< Sequence number, incremented for each record
+            uint16_t count;                 //!< Number of objects saved in this record
+            uint16_t reserved;              //!< reserved for future use
+            uint32_t hash;                  //!< hash of the fields above
+        };
+
+        /**
+         * @brief Journal saved in a file system (POSIX, SdFat, SPIFFS)
+         * 
+         * @param fs The FileSystemBase object subclass to use (Posix, SdFat, SPIFFS, etc.) 
+         * @param filename The filename or pathname to the journal file
+         * 
+         * The fs object passed into this constructor is deleted when this object is destructed.
+         */
+        PersistentDataJournal(FileSystemBase *fs, const char *filename) : fs(fs), filename(filename) {
+        };
+
+        virtual ~PersistentDataJournal() {
+            delete fs;
+        }
+
+        /**
+         * @brief Add a persistent data object to the journal
+         * 
+         * @param data The persistent data object. It must not be deleted while the journal is in use.
+         * @return PersistentDataJournal& 
+         * 
+         * Objects are identified in the journal by their magic bytes, so each object must use 
+         * different magic bytes.
+         * 
+         * The saveDelayMs of each object still applies. When the delay for any changed object expires, the 
+         * changes to all of the objects are saved.
+         */
+        PersistentDataJournal &withData(PersistentDataBase *data);
+
+        /**
+         * @brief Size of the journal file that causes it to be compacted. Default is 4096 bytes.
+         * 
+         * @param value Size in bytes
+         * @return PersistentDataJournal& 
+         */
+        PersistentDataJournal &withCompactSize(size_t value) {
+            compactSize = value;
+            return *this;
+        }
+
+        /**
+         * @brief Apply the changes in the journal file to the objects
+         * 
+         * @return true 
+         * @return false 
+         * 
+         * Call this after loading each of the objects from their own storage using load() or setup(), 
+         * and before changing any values. Incomplete records, such as from losing power while saving, are
+         * ignored and removed from the file. If a record contains changes to several objects, either all
+         * or none of the changes are applied.
+         */
+        bool load();
+
+        /**
+         * @brief Write a record with the changed objects to the journal. You normally do not need to call this.
+         * 
+         * If the journal file is larger than the compact size afterwards, it's compacted.
+         */
+        void save();
+
+        /**
+         * @brief Write changes to the journal if there are changes and the wait to save time has expired
+         * 
+         * @param force Pass true to ignore the wait to save time and save immediately if necessary. This
+         * is used when you're about to sleep or reset, for example.
+         * 
+         * Calling flush() on any of the objects in the journal does the same thing, so you don't need to 
+         * change code that already calls flush() on each object.
+         */
+        void flush(bool force);
+
+        /**
+         * @brief Save each object that has records in the journal using its own save() method and empty the journal
+         * 
+         * This is done automatically when the journal reaches the compact size. Objects that were not
+         * changed since the last compact are not saved again, because their own files are up to date.
+         */
+        void compact();
+
+        /**
+         * @brief Get the size of the journal file in bytes
+         */
+        size_t getJournalSize() const {
+            return journalSize;
+        }
+
+        static const uint32_t RECORD_MAGIC = 0x4a6e6c52; //!< Magic bytes for RecordHeader
+
+    protected:
+        /**
+         * This class cannot be copied
+         */
+        PersistentDataJournal(const PersistentDataJournal&) = delete;
+
+        /**
+         * This class cannot be copied
+         */
+        PersistentDataJournal& operator=(const PersistentDataJournal&) = delete;
+
+        /**
+         * @brief Append a record to the journal file
+         * 
+         * @param all true to save all objects, false to save only changed objects
+         * @return true if a record was written
+         */
+        bool writeRecord(bool all);
+
+        /**
+         * @brief Find an object in the journal by its magic bytes
+         * 
+         * @param magic The magic bytes
+         * @return PersistentDataBase* The object or 0 if not found
+         */
+        PersistentDataBase *findData(uint32_t magic) const;
+
+        /**
+         * @brief Add an object to unsavedList if it's not already there
+         * 
+         * @param data The object, which has a record in the journal file
+         */
+        void addUnsaved(PersistentDataBase *data);
+
+        FileSystemBase *fs; //!< The file system object the journal will be stored on
+        String filename; //!< The filename of the journal
+        std::vector<PersistentDataBase *> dataList; //!< Objects in this journal
+        std::vector<PersistentDataBase *> unsavedList; //!< Objects with records in the journal file, which compact() saves
+        std::vector<uint8_t> recordBuf; //!< Buffer used to build a record before writing it
+        size_t compactSize = 4096; //!< Compact the journal when it reaches this size in bytes
+        size_t journalSize = 0; //!< Size of the journal file in bytes
+        uint32_t seq = 0; //!< Sequence number of the last record
+    };
+
+    #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST) || defined(DOXYGEN_BUILD)
+    /**
+     * @brief Journal stored in a file on the POSIX file system on Gen 3, P2, and Photon 2
+     */
+    class PersistentDataJournalFile : public PersistentDataJournal {
+    public:
+        /**
+         * @brief Journal saved in a file
+         * 
+         * @param filename The filename or pathname to the journal file
+         */
+        PersistentDataJournalFile(const char *filename) : PersistentDataJournal(new FileSystemPosix(), filename) {
+        };
+    };
+    #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST) || defined(DOXYGEN_BUILD)
+
     /**
      * @brief Murmur3 hash algorithm implementation
      * 
@@ -62,6 +62,7 @@ bool dataInFlight = false;                          // Flag for whether we are w
 // Timing variables
 const int wakeBoundary = 1*3600 + 0*60 + 0;         // Sets a reporting frequency of 1 hour 0 minutes 0 seconds
 const unsigned long stayAwakeLong = 90000;          // In lowPowerMode, how long to stay awake every hour
+const unsigned long stayAwakeShort = 5000;          // In lowPowerMode, how long to stay awake after the publish queue is expected to be empty
 const unsigned long webhookWait = 30000;            // How long will we wait for a WebHook response
 const unsigned long resetWait = 30000;              // How long will we wait in ERROR_STATE until reset
 unsigned long stayAwakeTimeStamp = 0;               // Timestamps for our timing variables..
@@ -88,7 +89,7 @@ void setup() {
 	sysStatus.setup();								// Initialize persistent storage
 	current.setup();
 
-  	PublishQueuePosix::instance().setup();          // Start the Publish Queue
+  	PublishQueuePosix::instance().withQueueManifest().withGroupCommit(4, 10 * 60 * 1000UL).withAdaptiveRetry().withCompactEncoding().setup();  // Start the Publish Queue - manifest avoids a directory scan on each boot, offline events written in groups and compactly, retries sized to the cell
 
     ab1805.withFOUT(D8).setup();                	// Initialize AB1805 RTC   
     ab1805.setWDT(AB1805::WATCHDOG_MAX_SECONDS);	// Enable watchdog
@@ -129,7 +130,7 @@ void loop() {
 	switch (state) {
 		case IDLE_STATE: {													// Unlike most sketches - nodes spend most time in sleep and only transit IDLE once or twice each period
 			if (state != oldState) publishStateTransition();
-			if (sysStatus.get_lowPowerMode() && (millis() - stayAwakeTimeStamp) > stayAwake) state = SLEEPING_STATE;         // When in low power mode, we can nap between taps
+			if (sysStatus.get_lowPowerMode() && (millis() - stayAwakeTimeStamp) > stayAwake && (PublishQueuePosix::instance().getCanSleep() || (millis() - stayAwakeTimeStamp) > stayAwakeLong)) state = SLEEPING_STATE;  // When in low power mode, we can nap once the queue is sent
 			if (Time.hour() != Time.hour(sysStatus.get_lastReport())) state = REPORTING_STATE;                                  // We want to report on the hour but not after bedtime
 		} break;
 
@@ -146,6 +147,7 @@ void loop() {
 			config.mode(SystemSleepMode::ULTRA_LOW_POWER)
 				.gpio(BUTTON_PIN,CHANGE)
 				.duration(wakeInSeconds * 1000L);
+			PublishQueuePosix::instance().prepareForSleep();                  // Write any events held in RAM to flash before we sleep
 			ab1805.stopWDT();  												   // No watchdogs interrupting our slumber
 			SystemSleepResult result = System.sleep(config);              	// Put the device to sleep device continues operations from here
 			ab1805.resumeWDT();                                                // Wakey Wakey - WDT can resume
@@ -211,7 +213,7 @@ void loop() {
     		}
 
     		if (!dataInFlight)  {                                              // Response received --> back to IDLE state
-				stayAwake = stayAwakeLong;
+				stayAwake = min(PublishQueuePosix::instance().getTimeToEmptyMs() + stayAwakeShort, stayAwakeLong);	// Only stay awake long enough to send what is queued
 				stayAwakeTimeStamp = millis();
 				// sysStatus.set_lowPowerMode(true);
       			state = IDLE_STATE;
@@ -245,6 +247,7 @@ void loop() {
 				snprintf(data, sizeof(data),"Connected in %i secs",sysStatus.get_lastConnectionDuration());  // Make up connection string and publish
 				Log.info(data);
 				if (sysStatus.get_verboseMode()) Particle.publish("Cellular",data,PRIVATE);
+				PublishQueuePosix::instance().startBurstDrain();                 // Send anything queued while we were offline as fast as the cloud allows
 				(retainedOldState == REPORTING_STATE) ? state = RESP_WAIT_STATE : state = IDLE_STATE; // so, if we are connecting to report - next step is response wait - otherwise IDLE
 			}
 			else if (sysStatus.get_lastConnectionDuration() > 600) { // What happens if we do not connect
@@ -363,6 +366,9 @@ void dailyCleanup() {
     // setLowPowerMode("1");
   }
   current.resetEverything();                                                   // If so, we need to Zero the counts for the new day
+  PublishQueueEventPool::instance().logStats();                                // Check the publish queue event pool is sized for our traffic
+  Log.info("Background publish thread wakeups per hour: %lu", (unsigned long)BackgroundPublishRK::instance().getWakeupsPerHour());  // Should be a few per event, not polling
+  PublishQueuePosix::instance().publishMetrics();                               // Daily queue latency, retry, and flash write metrics so we can tune the queue
 }
 
 /**
@@ -26,8 +26,14 @@ sysStatusData::~sysStatusData() {
 }
 
 void sysStatusData::setup() {
+    // Atomic save alternates between sysStatus.dat and sysStatus.dat.b so a reset during a save
+    // can't lose the settings. Delta save appends only the changed bytes to sysStatus.dat.log and
+    // rewrites a whole file when the log reaches 1024 bytes. An existing sysStatus.dat from before
+    // this loads as-is; the .b and .log files are created by the first saves.
     sysStatus
     //  .withLogData(true)
+        .withAtomicSave()
+        .withDeltaSave()
         .withSaveDelayMs(100)
         .load();
 
@@ -75,116 +81,6 @@ void sysStatusData::initialize() {
     sysStatus.set_lastConnectionDuration(0);                               // New measure
 }
 
-uint8_t sysStatusData::get_structuresVersion() const {
-    return getValue<uint8_t>(offsetof(SysData, structuresVersion));
-}
-
-void sysStatusData::set_structuresVersion(uint8_t value) {
-    setValue<uint8_t>(offsetof(SysData, structuresVersion), value);
-}
-
-bool sysStatusData::get_verboseMode() const {
-    return getValue<bool>(offsetof(SysData,verboseMode));
-}
-
-void sysStatusData::set_verboseMode(bool value) {
-    setValue<bool>(offsetof(SysData, verboseMode), value);
-}
-
-bool sysStatusData::get_solarPowerMode() const  {
-    return getValue<bool>(offsetof(SysData,solarPowerMode ));
-}
-void sysStatusData::set_solarPowerMode(bool value) {
-    setValue<bool>(offsetof(SysData, solarPowerMode), value);
-}
-
-bool sysStatusData::get_lowPowerMode() const  {
-    return getValue<bool>(offsetof(SysData,lowPowerMode ));
-}
-void sysStatusData::set_lowPowerMode(bool value) {
-    setValue<bool>(offsetof(SysData, lowPowerMode), value);
-}
-
-bool sysStatusData::get_lowBatteryMode() const  {
-    return getValue<bool>(offsetof(SysData, lowBatteryMode));
-}
-void sysStatusData::set_lowBatteryMode(bool value) {
-    setValue<bool>(offsetof(SysData, lowBatteryMode), value);
-}
-
-uint8_t sysStatusData::get_resetCount() const  {
-    return getValue<uint8_t>(offsetof(SysData,resetCount));
-}
-void sysStatusData::set_resetCount(uint8_t value) {
-    setValue<uint8_t>(offsetof(SysData, resetCount), value);
-}
-
-String sysStatusData::get_timeZoneStr() const {
-	String result;
-	getValueString(offsetof(SysData, timeZoneStr), sizeof(SysData::timeZoneStr), result);
-	return result;
-}
-
-bool sysStatusData::set_timeZoneStr(const char *str) {
-	return setValueString(offsetof(SysData, timeZoneStr), sizeof(SysData::timeZoneStr), str);
-}
-
-uint8_t sysStatusData::get_openTime() const  {
-    return getValue<uint8_t>(offsetof(SysData,openTime));
-}
-void sysStatusData::set_openTime(uint8_t value) {
-    setValue<uint8_t>(offsetof(SysData, openTime), value);
-}
-
-uint8_t sysStatusData::get_closeTime() const  {
-    return getValue<uint8_t>(offsetof(SysData,closeTime));
-}
-void sysStatusData::set_closeTime(uint8_t value) {
-    setValue<uint8_t>(offsetof(SysData, closeTime), value);
-}
-
-time_t sysStatusData::get_lastReport() const  {
-    return getValue<time_t>(offsetof(SysData,lastReport));
-}
-void sysStatusData::set_lastReport(time_t value) {
-    setValue<time_t>(offsetof(SysData, lastReport), value);
-}
-
-time_t sysStatusData::get_lastConnection() const  {
-    return getValue<time_t>(offsetof(SysData,lastConnection));
-}
-void sysStatusData::set_lastConnection(time_t value) {
-    setValue<time_t>(offsetof(SysData, lastConnection), value);
-}
-
-uint16_t sysStatusData::get_lastConnectionDuration() const  {
-    return getValue<uint16_t>(offsetof(SysData,lastConnectionDuration));
-}
-void sysStatusData::set_lastConnectionDuration(uint16_t value) {
-    setValue<uint16_t>(offsetof(SysData, lastConnectionDuration), value);
-}
-
-time_t sysStatusData::get_lastHookResponse() const  {
-    return getValue<time_t>(offsetof(SysData,lastHookResponse));
-}
-void sysStatusData::set_lastHookResponse(time_t value) {
-    setValue<time_t>(offsetof(SysData, lastHookResponse), value);
-}
-
-uint8_t sysStatusData::get_sensorType() const  {
-    return getValue<uint8_t>(offsetof(SysData,sensorType));
-}
-void sysStatusData::set_sensorType(uint8_t value) {
-    setValue<uint8_t>(offsetof(SysData, sensorType), value);
-}
-
-bool sysStatusData::get_verizonSIM() const  {
-    return getValue<bool>(offsetof(SysData,verizonSIM));
-}
-void sysStatusData::set_verizonSIM(bool value) {
-    setValue<bool>(offsetof(SysData,verizonSIM), value);
-}
-
 // *****************  Current Status Storage Object *******************
 // 
 // ********************************************************************
@@ -208,8 +104,11 @@ currentStatusData::~currentStatusData() {
 }
 
 void currentStatusData::setup() {
+    // Atomic and delta save, as for sysStatus
     current
     //    .withLogData(true)
+        .withAtomicSave()
+        .withDeltaSave()
         .withSaveDelayMs(250)
         .load();
 }
@@ -245,65 +144,3 @@ void currentStatusData::initialize() {
     // If you manually update fields here, be sure to update the hash
     updateHash();
 }
-
-uint16_t currentStatusData::get_distance() const {
-    return getValue<uint16_t>(offsetof(CurrentData, distance));
-}
-
-void currentStatusData::set_distance(uint16_t value) {
-    setValue<uint16_t>(offsetof(CurrentData, distance), value);
-}
-
-time_t currentStatusData::get_lastCountTime() const {
-    return getValue<time_t>(offsetof(CurrentData, lastCountTime));
-}
-
-void currentStatusData::set_lastCountTime(time_t value) {
-    setValue<time_t>(offsetof(CurrentData, lastCountTime), value);
-}
-
-float currentStatusData::get_internalTempC() const {
-    return getValue<float>(offsetof(CurrentData, internalTempC));
-}
-
-void currentStatusData::set_internalTempC(float value) {
-    setValue<float>(offsetof(CurrentData, internalTempC), value);
-}
-
-float currentStatusData::get_externalTempC() const {
-    return getValue<float>(offsetof(CurrentData, externalTempC));
-}
-
-void currentStatusData::set_externalTempC(float value) {
-    setValue<float>(offsetof(CurrentData, externalTempC), value);
-}
-
-int8_t currentStatusData::get_alertCode() const {
-    return getValue<int8_t>(offsetof(CurrentData, alertCode));
-}
-
-void currentStatusData::set_alertCode(int8_t value) {
-    setValue<int8_t>(offsetof(CurrentData, alertCode), value);
-}
-
-time_t currentStatusData::get_lastAlertTime() const {
-    return getValue<int8_t>(offsetof(CurrentData,lastAlertTime));
-}
-
-void currentStatusData::set_lastAlertTime(time_t value) {
-    setValue<time_t>(offsetof(CurrentData,lastAlertTime),value);
-}
-
-float currentStatusData::get_stateOfCharge() const  {
-    return getValue<float>(offsetof(CurrentData,stateOfCharge));
-}
-void currentStatusData::set_stateOfCharge(float value) {
-    setValue<float>(offsetof(CurrentData, stateOfCharge), value);
-}
-
-uint8_t currentStatusData::get_batteryState() const  {
-    return getValue<uint8_t>(offsetof(CurrentData, batteryState));
-}
-void currentStatusData::set_batteryState(uint8_t value) {
-    setValue<uint8_t>(offsetof(CurrentData, batteryState), value);
-}
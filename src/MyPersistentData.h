@@ -67,106 +67,39 @@ public:
 	void initialize();
 
 
-	class SysData {
-	public:
-		// This structure must always begin with the header (16 bytes)
-		StorageHelperRK::PersistentDataBase::SavedDataHeader sysHeader;
-		// Your fields go here. Once you've added a field you cannot add fields
-		// (except at the end), insert fields, remove fields, change size of a field.
-		// Doing so will cause the data to be corrupted!
-		uint8_t structuresVersion;                        // Version of the data structures (system and data)
-		bool verboseMode;                                 // Turns on extra messaging
-		bool solarPowerMode;                              // Powered by a solar panel or utility power
-  		bool lowPowerMode;                                // Does the device need to run disconnected to save battery
-		bool lowBatteryMode;                              // Is the battery level so low that we can no longer connect
-		uint8_t resetCount;                               // reset count of device (0-256)
-		char timeZoneStr[39];							  // String for the timezone - https://developer.ibm.com/technologies/systems/articles/au-aix-posix/
-		uint8_t openTime;                                 // Hour the park opens (0-23)
-		uint8_t closeTime;                                // Hour the park closes (0-23)
-		time_t lastReport;								  // The last time we sent a webhook to the queue
-		time_t lastConnection;                     		  // Last time we successfully connected to Particle
-		time_t lastHookResponse;                   		  // Last time we got a valid Webhook response
-		uint16_t lastConnectionDuration;                  // How long - in seconds - did it take to last connect to the Particle cloud
-		uint8_t sensorType;                               // What is the sensor type - 0-Pressure Sensor, 1-PIR Sensor
-		bool verizonSIM;                                  // Are we using a Verizon SIM?
-	};
+	// This structure always begins with the header (16 bytes), named sysHeader.
+	// Your fields go here. Once you've added a field you cannot add fields
+	// (except at the end), insert fields, remove fields, change size of a field.
+	// Doing so will cause the data to be corrupted!
+#define SYS_DATA_FIELDS(FIELD, STRING) \
+	FIELD(uint8_t, structuresVersion)                 /* Version of the data structures (system and data) */ \
+	FIELD(bool, verboseMode)                          /* Turns on extra messaging */ \
+	FIELD(bool, solarPowerMode)                       /* Powered by a solar panel or utility power */ \
+	FIELD(bool, lowPowerMode)                         /* Does the device need to run disconnected to save battery */ \
+	FIELD(bool, lowBatteryMode)                       /* Is the battery level so low that we can no longer connect */ \
+	FIELD(uint8_t, resetCount)                        /* reset count of device (0-256) */ \
+	STRING(timeZoneStr, 39)                           /* String for the timezone - https://developer.ibm.com/technologies/systems/articles/au-aix-posix/ */ \
+	FIELD(uint8_t, openTime)                          /* Hour the park opens (0-23) */ \
+	FIELD(uint8_t, closeTime)                         /* Hour the park closes (0-23) */ \
+	FIELD(time_t, lastReport)                         /* The last time we sent a webhook to the queue */ \
+	FIELD(time_t, lastConnection)                     /* Last time we successfully connected to Particle */ \
+	FIELD(time_t, lastHookResponse)                   /* Last time we got a valid Webhook response */ \
+	FIELD(uint16_t, lastConnectionDuration)           /* How long - in seconds - did it take to last connect to the Particle cloud */ \
+	FIELD(uint8_t, sensorType)                        /* What is the sensor type - 0-Pressure Sensor, 1-PIR Sensor */ \
+	FIELD(bool, verizonSIM)                           /* Are we using a Verizon SIM? */
+
+	STORAGEHELPER_STRUCT(SysData, sysHeader, SYS_DATA_FIELDS)
 
 	SysData sysData;
 
 	// 	******************* Get and Set Functions for each variable in the storage object ***********
-    
-	/**
-	 * @brief For the Get functions, used to retrieve the value of the variable
-	 * 
-	 * @details Specific to the location in the object and the type of the variable
-	 * 
-	 * @param Nothing needed
-	 * 
-	 * @returns The value of the variable in the corret type
-	 * 
-	 */
 
 	/**
-	 * @brief For the Set functions, used to set the value of the variable
-	 * 
-	 * @details Specific to the location in the object and the type of the variable
-	 * 
-	 * @param Value to set the variable - correct type - for Strings they are truncated if too long
-	 * 
-	 * @returns None needed
-	 * 
+	 * @brief Declares get_ and set_ functions for each field in SYS_DATA_FIELDS, for example
+	 * uint8_t get_openTime() const and void set_openTime(uint8_t value). For strings, the get function
+	 * returns a String and the set function returns false if the string is too long.
 	 */
-
-	uint8_t get_structuresVersion() const ;
-	void set_structuresVersion(uint8_t value);
-
-	bool get_verboseMode() const;
-	void set_verboseMode(bool value);
-
-	bool get_solarPowerMode() const;
-	void set_solarPowerMode(bool value);
-
-	bool get_lowPowerMode() const;
-	void set_lowPowerMode(bool value);
-
-	bool get_lowBatteryMode() const;
-	void set_lowBatteryMode(bool value);
-
-	uint8_t get_resetCount() const;
-	void set_resetCount(uint8_t value);
-
-	String get_timeZoneStr() const;
-	bool set_timeZoneStr(const char *str);
-
-	uint8_t get_openTime() const;
-	void set_openTime(uint8_t value);
-
-	uint8_t get_closeTime() const;
-	void set_closeTime(uint8_t value);
-
-	time_t get_lastReport() const;
-	void set_lastReport(time_t value);
-
-	time_t get_lastConnection() const;
-	void set_lastConnection(time_t value);
-
-	uint16_t get_lastConnectionDuration() const;
-	void set_lastConnectionDuration(uint16_t value);
-
-	time_t get_lastHookResponse() const;
-	void set_lastHookResponse(time_t value);
-
-	uint8_t get_alertCodeNode() const;
-	void set_alertCodeNode(uint8_t value);
-
-	time_t get_alertTimestampNode() const;
-	void set_alertTimestampNode(time_t value);
-
-	uint8_t get_sensorType() const;
-	void set_sensorType(uint8_t value);
-
-	bool get_verizonSIM() const;
-	void set_verizonSIM(bool value);
+	STORAGEHELPER_ACCESSORS(SysData, SYS_DATA_FIELDS)
 
 
 	//Members here are internal only and therefore protected
@@ -265,72 +198,32 @@ public:
 	 */
 	void initialize();  
 
-	class CurrentData {
-	public:
-		// This structure must always begin with the header (16 bytes)
-		StorageHelperRK::PersistentDataBase::SavedDataHeader currentHeader;
-		// Your fields go here. Once you've added a field you cannot add fields
-		// (except at the end), insert fields, remove fields, change size of a field.
-		// Doing so will cause the data to be corrupted!
-		// You may want to keep a version number in your data.
-		uint16_t distance;                             // distance in cm
-		time_t lastCountTime;
-		float internalTempC;                            // Enclosure temperature in degrees C
-		float externalTempC;							// Temp Sensor at the ultrasonic device
-		uint8_t alertCode;								// Current Alert Code
-		time_t lastAlertTime;
-		float stateOfCharge;                                // Battery charge level
-		uint8_t batteryState;                             // Stores the current battery state
-	};
+	// This structure always begins with the header (16 bytes), named currentHeader.
+	// Your fields go here. Once you've added a field you cannot add fields
+	// (except at the end), insert fields, remove fields, change size of a field.
+	// Doing so will cause the data to be corrupted!
+	// You may want to keep a version number in your data.
+#define CURRENT_DATA_FIELDS(FIELD, STRING) \
+	FIELD(uint16_t, distance)                         /* distance in cm */ \
+	FIELD(time_t, lastCountTime) \
+	FIELD(float, internalTempC)                       /* Enclosure temperature in degrees C */ \
+	FIELD(float, externalTempC)                       /* Temp Sensor at the ultrasonic device */ \
+	FIELD(int8_t, alertCode)                          /* Current Alert Code */ \
+	FIELD(time_t, lastAlertTime) \
+	FIELD(float, stateOfCharge)                       /* Battery charge level */ \
+	FIELD(uint8_t, batteryState)                      /* Stores the current battery state */
+
+	STORAGEHELPER_STRUCT(CurrentData, currentHeader, CURRENT_DATA_FIELDS)
+
 	CurrentData currentData;
 
 	// 	******************* Get and Set Functions for each variable in the storage object ***********
-    
-	/**
-	 * @brief For the Get functions, used to retrieve the value of the variable
-	 * 
-	 * @details Specific to the location in the object and the type of the variable
-	 * 
-	 * @param Nothing needed
-	 * 
-	 * @returns The value of the variable in the corret type
-	 * 
-	 */
 
 	/**
-	 * @brief For the Set functions, used to set the value of the variable
-	 * 
-	 * @details Specific to the location in the object and the type of the variable
-	 * 
-	 * @param Value to set the variable - correct type - for Strings they are truncated if too long
-	 * 
-	 * @returns None needed
-	 * 
+	 * @brief Declares get_ and set_ functions for each field in CURRENT_DATA_FIELDS, for example
+	 * uint16_t get_distance() const and void set_distance(uint16_t value).
 	 */
-
-	uint16_t get_distance() const;
-	void set_distance(uint16_t value);
-
-	time_t get_lastCountTime() const;
-	void set_lastCountTime(time_t value);
-
-	float get_internalTempC() const ;
-	void set_internalTempC(float value);
-
-	float get_externalTempC() const ;
-	void set_externalTempC(float value);
-
-	int8_t get_alertCode() const;
-	void set_alertCode(int8_t value);
-
-	time_t get_lastAlertTime() const;
-	void set_lastAlertTime(time_t value);
-
-	float get_stateOfCharge() const;
-	void set_stateOfCharge(float value);
-
-	uint8_t get_batteryState() const;
-	void set_batteryState(uint8_t value);
+	STORAGEHELPER_ACCESSORS(CurrentData, CURRENT_DATA_FIELDS)
 
 
 		//Members here are internal only and therefore protected
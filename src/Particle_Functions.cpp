@@ -210,7 +210,10 @@ void Particle_Functions::sendEvent() {
   timeStampValue = Time.now();                                        // Set the timestamp (may need to adjust for midnight)
 
   snprintf(data, sizeof(data), "{\"distance\":%i, \"battery\":%4.2f,\"key1\":\"%s\", \"temp\":%4.2f, \"resets\":%i, \"alerts\":%i,\"connecttime\":%i,\"timestamp\":%lu000}",current.get_distance(), current.get_stateOfCharge(), batteryContext[current.get_batteryState()],current.get_internalTempC(), sysStatus.get_resetCount(), current.get_alertCode(), sysStatus.get_lastConnectionDuration(), timeStampValue);
-  PublishQueuePosix::instance().publish("Ubidots_Level_Hook_v1", data, PRIVATE | WITH_ACK);
+  if (current.get_alertCode() != 0) {                                  // Alerts jump ahead of routine readings and are the last to be discarded
+    PublishQueuePosix::instance().publishWithPriority(2, "Ubidots_Level_Hook_v1", data, PRIVATE | WITH_ACK);
+  }
+  else PublishQueuePosix::instance().publish("Ubidots_Level_Hook_v1", data, PRIVATE | WITH_ACK);
   Log.info("Ubidots Webhook: %s", data);                              // For monitoring via serial
   current.set_alertCode(0);                                                 // Reset the alert after publish
 }